@@ -0,0 +1,2 @@
+@echo off
+bbuild\bench.exe %*
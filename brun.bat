@@ -0,0 +1 @@
+bbuild && bplay %*
@@ -0,0 +1 @@
+ibuild && iplay
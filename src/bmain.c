@@ -0,0 +1,260 @@
+#include "SDL.h"
+#include "es_warehouse.h"
+
+// Microbenchmarks for the math and rng in es_warehouse. Each benchmark runs over the same
+// arrays BENCH_RUNS times and keeps its fastest run. Benchmarks that are the SIMD or batch
+// version of the one before them are also reported as a speedup over it. Nothing here needs
+// video or vulkan, so SDL is never initialised.
+#define BENCH_DEFAULT_COUNT (1 << 20)
+#define BENCH_RUNS 8
+// Matrices are cycled through a small set, since they are too big to have one per element.
+#define BENCH_MATRICES 1024
+
+typedef struct {
+    Uint32 count;
+    vec3* points;
+    vec3* axes;
+    float* angles;
+    vec3* out;
+    mat4* matrices;
+    EsRng rng;
+    // Every benchmark adds some of its results in here, so that none of the work can be
+    // optimised away.
+    float sink;
+} BenchData;
+
+typedef void (*BenchFunction)(BenchData* data);
+
+typedef struct {
+    const char* name;
+    BenchFunction function;
+    // Set when this is a faster version of the benchmark before it.
+    SDL_bool compare_with_previous;
+} Benchmark;
+
+void _bench_sink_points(BenchData* data) {
+    float sum = 0.0f;
+    for (Uint32 i=0; i<data->count; i+=64)
+        sum += data->out[i].x + data->out[i].y + data->out[i].z;
+    data->sink += sum;
+}
+
+void _bench_vec3_normalize(BenchData* data) {
+    for (Uint32 i=0; i<data->count; i++)
+        data->out[i] = vec3_normalize(data->points[i]);
+    _bench_sink_points(data);
+}
+
+void _bench_vec3_normalize_array_scalar(BenchData* data) {
+    SDL_memcpy(data->out, data->points, data->count * sizeof(vec3));
+    vec3_normalize_array_scalar(data->out, data->count);
+    _bench_sink_points(data);
+}
+
+void _bench_vec3_normalize_array(BenchData* data) {
+    SDL_memcpy(data->out, data->points, data->count * sizeof(vec3));
+    vec3_normalize_array(data->out, data->count);
+    _bench_sink_points(data);
+}
+
+void _bench_vec3_offset_array_scalar(BenchData* data) {
+    SDL_memcpy(data->out, data->points, data->count * sizeof(vec3));
+    vec3_offset_array_scalar(data->out, data->axes[0], data->count);
+    _bench_sink_points(data);
+}
+
+void _bench_vec3_offset_array(BenchData* data) {
+    SDL_memcpy(data->out, data->points, data->count * sizeof(vec3));
+    vec3_offset_array(data->out, data->axes[0], data->count);
+    _bench_sink_points(data);
+}
+
+void _bench_rotation_matrix_axis(BenchData* data) {
+    // The way rotate_about_origin_axis used to work, for comparison.
+    for (Uint32 i=0; i<data->count; i++) {
+        vec3 p = data->points[i];
+        vec4 rotated = mat4_vec4_multiply(rotation_matrix_axis(data->angles[i], data->axes[i]), build_vec4(p.x, p.y, p.z, 0.0f));
+        data->out[i] = vec3_from_vec4(rotated);
+    }
+    _bench_sink_points(data);
+}
+
+void _bench_rotate_about_origin_axis(BenchData* data) {
+    for (Uint32 i=0; i<data->count; i++)
+        data->out[i] = rotate_about_origin_axis(data->points[i], data->angles[i], data->axes[i]);
+    _bench_sink_points(data);
+}
+
+void _bench_rotate_same_axis(BenchData* data) {
+    for (Uint32 i=0; i<data->count; i++)
+        data->out[i] = rotate_about_origin_axis(data->points[i], data->angles[0], data->axes[0]);
+    _bench_sink_points(data);
+}
+
+void _bench_rotate_points_about_origin_axis(BenchData* data) {
+    SDL_memcpy(data->out, data->points, data->count * sizeof(vec3));
+    rotate_points_about_origin_axis(data->out, data->count, data->angles[0], data->axes[0]);
+    _bench_sink_points(data);
+}
+
+void _bench_mat4_transform_points_scalar(BenchData* data) {
+    mat4_transform_points_scalar(data->matrices[0], data->points, data->count, data->out, sizeof(vec3));
+    _bench_sink_points(data);
+}
+
+void _bench_mat4_transform_points(BenchData* data) {
+    mat4_transform_points(data->matrices[0], data->points, data->count, data->out, sizeof(vec3));
+    _bench_sink_points(data);
+}
+
+void _bench_mat4_vec4_multiply_scalar(BenchData* data) {
+    float sum = 0.0f;
+    for (Uint32 i=0; i<data->count; i++) {
+        vec3 p = data->points[i];
+        vec4 result = mat4_vec4_multiply_scalar(data->matrices[i % BENCH_MATRICES], build_vec4(p.x, p.y, p.z, 1.0f));
+        sum += result.x + result.w;
+    }
+    data->sink += sum;
+}
+
+void _bench_mat4_vec4_multiply(BenchData* data) {
+    float sum = 0.0f;
+    for (Uint32 i=0; i<data->count; i++) {
+        vec3 p = data->points[i];
+        vec4 result = mat4_vec4_multiply(data->matrices[i % BENCH_MATRICES], build_vec4(p.x, p.y, p.z, 1.0f));
+        sum += result.x + result.w;
+    }
+    data->sink += sum;
+}
+
+void _bench_mat4_mat4_multiply(BenchData* data) {
+    float sum = 0.0f;
+    for (Uint32 i=0; i<data->count; i++) {
+        mat4 result = mat4_mat4_multiply(data->matrices[i % BENCH_MATRICES], data->matrices[(i+1) % BENCH_MATRICES]);
+        sum += result.a.x + result.d.w;
+    }
+    data->sink += sum;
+}
+
+void _bench_look_at(BenchData* data) {
+    float sum = 0.0f;
+    vec3 up = build_vec3(0.0f, 1.0f, 0.0f);
+    for (Uint32 i=0; i<data->count; i++) {
+        mat4 result = look_at(data->points[i], data->axes[i], up);
+        sum += result.a.x + result.d.z;
+    }
+    data->sink += sum;
+}
+
+void _bench_rand_vec3(BenchData* data) {
+    for (Uint32 i=0; i<data->count; i++)
+        data->out[i] = rand_vec3();
+    _bench_sink_points(data);
+}
+
+void _bench_rng_vec3(BenchData* data) {
+    for (Uint32 i=0; i<data->count; i++)
+        data->out[i] = rng_vec3(&data->rng);
+    _bench_sink_points(data);
+}
+
+void _bench_rng_fill_vec3(BenchData* data) {
+    rng_fill_vec3(&data->rng, data->out, data->count);
+    _bench_sink_points(data);
+}
+
+static const Benchmark BENCHMARKS[] = {
+    { "vec3_normalize", _bench_vec3_normalize, SDL_FALSE },
+    { "vec3_normalize_array_scalar", _bench_vec3_normalize_array_scalar, SDL_FALSE },
+    { "vec3_normalize_array", _bench_vec3_normalize_array, SDL_TRUE },
+    { "vec3_offset_array_scalar", _bench_vec3_offset_array_scalar, SDL_FALSE },
+    { "vec3_offset_array", _bench_vec3_offset_array, SDL_TRUE },
+    { "rotation_matrix_axis", _bench_rotation_matrix_axis, SDL_FALSE },
+    { "rotate_about_origin_axis", _bench_rotate_about_origin_axis, SDL_TRUE },
+    { "rotate_about_origin_axis same axis", _bench_rotate_same_axis, SDL_FALSE },
+    { "rotate_points_about_origin_axis", _bench_rotate_points_about_origin_axis, SDL_TRUE },
+    { "mat4_transform_points_scalar", _bench_mat4_transform_points_scalar, SDL_FALSE },
+    { "mat4_transform_points", _bench_mat4_transform_points, SDL_TRUE },
+    { "mat4_vec4_multiply_scalar", _bench_mat4_vec4_multiply_scalar, SDL_FALSE },
+    { "mat4_vec4_multiply", _bench_mat4_vec4_multiply, SDL_TRUE },
+    { "mat4_mat4_multiply", _bench_mat4_mat4_multiply, SDL_FALSE },
+    { "look_at", _bench_look_at, SDL_FALSE },
+    { "rand_vec3", _bench_rand_vec3, SDL_FALSE },
+    { "rng_vec3", _bench_rng_vec3, SDL_TRUE },
+    { "rng_fill_vec3", _bench_rng_fill_vec3, SDL_TRUE },
+};
+#define BENCH_COUNT (sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]))
+
+SDL_bool _bench_init_data(BenchData* data, Uint32 count) {
+    data->count = count;
+    data->sink = 0.0f;
+    rng_seed(&data->rng, 1);
+    data->points = (vec3*) SDL_malloc(count * sizeof(vec3));
+    data->axes = (vec3*) SDL_malloc(count * sizeof(vec3));
+    data->angles = (float*) SDL_malloc(count * sizeof(float));
+    data->out = (vec3*) SDL_malloc(count * sizeof(vec3));
+    data->matrices = (mat4*) SDL_malloc(BENCH_MATRICES * sizeof(mat4));
+    if (data->points == NULL || data->axes == NULL || data->angles == NULL || data->out == NULL || data->matrices == NULL) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory for benchmarks\n");
+        return SDL_FALSE;
+    }
+    for (Uint32 i=0; i<count; i++) {
+        data->points[i] = vec3_scale(rng_vec3(&data->rng), 1.0f + 10.0f*rng_pos(&data->rng));
+        data->axes[i] = rng_vec3(&data->rng);
+        data->angles[i] = rng_negpos(&data->rng) * (float) M_PI;
+    }
+    for (Uint32 i=0; i<BENCH_MATRICES; i++) {
+        mat4 rotation = rotation_matrix_axis(data->angles[i], data->axes[i]);
+        rotation.a.w = data->points[i].x;
+        rotation.b.w = data->points[i].y;
+        rotation.c.w = data->points[i].z;
+        data->matrices[i] = rotation;
+    }
+    return SDL_TRUE;
+}
+
+void _bench_free_data(BenchData* data) {
+    SDL_free(data->points);
+    SDL_free(data->axes);
+    SDL_free(data->angles);
+    SDL_free(data->out);
+    SDL_free(data->matrices);
+}
+
+int main(int argc, char** argv) {
+    SDL_LogSetAllPriority(SDL_LOG_PRIORITY_VERBOSE);
+    Uint32 count = BENCH_DEFAULT_COUNT;
+    if (argc > 1 && SDL_atoi(argv[1]) > 0)
+        count = (Uint32) SDL_atoi(argv[1]);
+    BenchData data;
+    if (!_bench_init_data(&data, count))
+        return 1;
+#ifdef ES_SSE2
+    SDL_Log("%u elements, best of %u runs, SSE2 on\n", count, BENCH_RUNS);
+#else
+    SDL_Log("%u elements, best of %u runs, SSE2 off\n", count, BENCH_RUNS);
+#endif
+    double frequency = (double) SDL_GetPerformanceFrequency();
+    double previous_ns = 0.0;
+    for (Uint32 i=0; i<BENCH_COUNT; i++) {
+        const Benchmark* bench = &BENCHMARKS[i];
+        double best = 0.0;
+        for (Uint32 run=0; run<BENCH_RUNS; run++) {
+            Uint64 start = SDL_GetPerformanceCounter();
+            bench->function(&data);
+            double seconds = (SDL_GetPerformanceCounter() - start) / frequency;
+            if (run == 0 || seconds < best)
+                best = seconds;
+        }
+        double ns = best * 1e9 / count;
+        double mops = count / best / 1e6;
+        if (bench->compare_with_previous)
+            SDL_Log("%-36s %9.2f ns/op %9.1f Mop/s %6.2fx vs %s\n", bench->name, ns, mops, previous_ns / ns, BENCHMARKS[i-1].name);
+        else
+            SDL_Log("%-36s %9.2f ns/op %9.1f Mop/s\n", bench->name, ns, mops);
+        previous_ns = ns;
+    }
+    SDL_Log("sink %f\n", data.sink);
+    _bench_free_data(&data);
+    return 0;
+}
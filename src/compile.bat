@@ -13,6 +13,6 @@
 @echo off
 pushd data\spirv\
 del *.spv
-"C:\VulkanSDK\1.2.154.1\Bin32\glslc.exe" -c ..\..\shaders\tree_vertex.glsl ..\..\shaders\tree_sm_vertex.glsl ..\..\shaders\tree_fragment.glsl ..\..\shaders\tree_sm_fragment.glsl ..\..\shaders\skybox_vertex.glsl ..\..\shaders\skybox_fragment.glsl ..\..\shaders\grass_vertex.glsl ..\..\shaders\grass_sm_vertex.glsl ..\..\shaders\grass_fragment.glsl ..\..\shaders\grass_sm_fragment.glsl ..\..\shaders\ui_vertex.glsl ..\..\shaders\ui_fragment.glsl ..\..\shaders\base_vertex.glsl ..\..\shaders\base_sm_vertex.glsl ..\..\shaders\base_fragment.glsl ..\..\shaders\base_sm_fragment.glsl ..\..\shaders\plane_vertex.glsl ..\..\shaders\plane_sm_vertex.glsl ..\..\shaders\plane_fragment.glsl ..\..\shaders\plane_sm_fragment.glsl
+"C:\VulkanSDK\1.2.154.1\Bin32\glslc.exe" -c ..\..\shaders\tree_vertex.glsl ..\..\shaders\tree_sm_vertex.glsl ..\..\shaders\tree_fragment.glsl ..\..\shaders\tree_sm_fragment.glsl ..\..\shaders\skybox_vertex.glsl ..\..\shaders\skybox_fragment.glsl ..\..\shaders\grass_vertex.glsl ..\..\shaders\grass_sm_vertex.glsl ..\..\shaders\grass_fragment.glsl ..\..\shaders\grass_sm_fragment.glsl ..\..\shaders\ui_vertex.glsl ..\..\shaders\ui_fragment.glsl ..\..\shaders\base_vertex.glsl ..\..\shaders\base_sm_vertex.glsl ..\..\shaders\base_fragment.glsl ..\..\shaders\base_sm_fragment.glsl ..\..\shaders\plane_vertex.glsl ..\..\shaders\plane_sm_vertex.glsl ..\..\shaders\plane_fragment.glsl ..\..\shaders\plane_sm_fragment.glsl ..\..\shaders\impostor_vertex.glsl ..\..\shaders\impostor_sm_vertex.glsl ..\..\shaders\impostor_fragment.glsl ..\..\shaders\impostor_sm_fragment.glsl ..\..\shaders\impostor_bake_vertex.glsl ..\..\shaders\impostor_bake_fragment.glsl
 popd
 echo "Complete"
@@ -1,152 +1,501 @@
 #include "SDL.h"
 #include "es_geometrygen.h"
 
-#define STB_DS_IMPLEMENTATION
-#include "stb_ds.h"
+// Mesh files are mapped where there is mmap. windows.h can't be built with /Za, so on windows
+// they are read into memory in one go instead.
+#if defined(__unix__) || defined(__APPLE__)
+#define GEOM_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-
-float _geom_error_from_lod(Uint32 lod);
-Uint32 _geom_get_vertices_from_radius(float radius, Uint32 lod);
+Uint32 _geom_get_vertices_from_radius(float radius, float error);
+const vec2* _geom_get_ring(Uint32 num_vertices);
+Uint32 _geom_stitch_rings(EsFace* faces, Uint32 base_first, Uint32 base_count, Uint32 tip_first, Uint32 tip_count, Uint32 first_vertex, Uint32 first_texture, Uint32 first_normal, Uint32 first_color);
+void _geom_place_points(vec3* points, Uint32 count, float angle, vec3 axis, vec3 position);
 Uint32 _geom_remaining_vertices(EsGeometry* geom);
 Uint32 _geom_remaining_faces(EsGeometry* geom);
 Uint32 _geom_remaining_textures(EsGeometry* geom);
 Uint32 _geom_remaining_colors(EsGeometry* geom);
 Uint32 _geom_remaining_normals(EsGeometry* geom);
 
+// Welding merges the elements of an array that share a key, keeping the first of each in the
+// order they came in. Without an epsilon the key is the bits of each float, so only exact
+// duplicates are merged. With one, each float is divided by epsilon and rounded, and elements
+// that land in the same cell are merged. Elements are split into partitions by hash, and each
+// partition is deduplicated with its own open addressing table, on its own worker.
+#define GEOM_WELD_PARTITIONS 64
+#define GEOM_WELD_MIN_PARALLEL 4096
+
 typedef struct {
-    vec3 key;
-    int value;
-} Vec3Map;
+    const float* elements;
+    Uint32 count;
+    Uint32 dims;
+    float epsilon;
+    Uint32 num_partitions;
+    Uint32* keys;
+    Uint64* hashes;
+    // The elements of each partition, in the order they came in.
+    Uint32* partition_starts;
+    Uint32* partition_elements;
+    // The first element with the same key as each element.
+    Uint32* firsts;
+    SDL_bool failed;
+} _EsWeldJob;
 
 typedef struct {
-    vec2 key;
-    int value;
-} Vec2Map;
+    EsFace* faces;
+    Uint32 num_faces;
+    Uint32 num_chunks;
+    Uint32* remaps[4];
+    Uint32 counts[4];
+} _EsWeldFacesJob;
 
-SDL_bool geom_simplify_geometry(EsGeometry* geom) {
-    // We want to remove all the duplicate vertices, textures and normals.
-    // The way we do this is by using hashmaps.
-    // So we create a hashmap for vertices, textures and normals, with key as vert
-    // and value as index. (where while inserting, we only increment index if the
-    // element doesn't already exist in the hashmap)
-    // Once all the hashmaps have been filled, we fill simplified with all the vertices
-    // as per their indexvalue in the hashmap. For each face, we query the hashmap for
-    // the simplified index, and load that in.
-    int vertex_index = 0;
-    int texture_index = 0;
-    int normal_index = 0;
-    int color_index = 0;
-    Vec3Map* vertices = NULL;
-    Vec2Map* textures = NULL;
-    Vec3Map* normals = NULL;
-    Vec3Map* colors = NULL;
-    hmdefault(vertices, -1);
-    hmdefault(textures, -1);
-    hmdefault(normals, -1);
-    hmdefault(colors, -1);
-    for (Uint32 i=0; i<geom->num_vertices; i++) {
-        vec3 vert = geom->vertices[i];
-        if (hmget(vertices, vert) < 0) {
-            hmput(vertices, vert, vertex_index);
-            vertex_index++;
+Uint64 _geom_weld_hash(const Uint32* key, Uint32 dims) {
+    Uint64 hash = 0x9E3779B97F4A7C15ull;
+    for (Uint32 i=0; i<dims; i++) {
+        hash ^= key[i];
+        hash *= 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+Uint32 _geom_weld_partition(Uint64 hash, Uint32 num_partitions) {
+    // The table slots use the low bits of the hash, so the partitions use the high ones.
+    return (Uint32) (hash >> 40) % num_partitions;
+}
+
+void _geom_weld_key_job(void* data, Uint32 index, Uint32 worker) {
+    worker;
+    _EsWeldJob* job = (_EsWeldJob*) data;
+    Uint32 chunk = (job->count + job->num_partitions - 1) / job->num_partitions;
+    Uint32 end = SDL_min(job->count, (index+1) * chunk);
+    for (Uint32 i=index*chunk; i<end; i++) {
+        Uint32* key = &job->keys[i*job->dims];
+        for (Uint32 d=0; d<job->dims; d++) {
+            float value = job->elements[i*job->dims + d];
+            if (job->epsilon > 0.0f) {
+                float cell = SDL_floorf(value/job->epsilon + 0.5f);
+                cell = SDL_max(-2147483648.0f, SDL_min(2147483520.0f, cell));
+                key[d] = (Uint32) (Sint32) cell;
+            } else {
+                SDL_memcpy(&key[d], &value, sizeof(Uint32));
+            }
         }
+        job->hashes[i] = _geom_weld_hash(key, job->dims);
+    }
+}
+
+void _geom_weld_partition_job(void* data, Uint32 index, Uint32 worker) {
+    worker;
+    _EsWeldJob* job = (_EsWeldJob*) data;
+    Uint32 start = job->partition_starts[index];
+    Uint32 count = job->partition_starts[index+1] - start;
+    if (count == 0)
+        return;
+    Uint32 table_size = 1;
+    while (table_size < count*2)
+        table_size *= 2;
+    Uint32* table = (Uint32*) SDL_malloc(table_size * sizeof(Uint32));
+    if (table == NULL) {
+        job->failed = SDL_TRUE;
+        return;
+    }
+    SDL_memset(table, 0xFF, table_size * sizeof(Uint32));
+    size_t key_size = job->dims * sizeof(Uint32);
+    for (Uint32 i=start; i<start+count; i++) {
+        Uint32 element = job->partition_elements[i];
+        Uint32 slot = (Uint32) job->hashes[element] & (table_size-1);
+        while (SDL_TRUE) {
+            Uint32 other = table[slot];
+            if (other == UINT32_MAX) {
+                table[slot] = element;
+                job->firsts[element] = element;
+                break;
+            }
+            if (job->hashes[other] == job->hashes[element] && SDL_memcmp(&job->keys[other*job->dims], &job->keys[element*job->dims], key_size) == 0) {
+                job->firsts[element] = other;
+                break;
+            }
+            slot = (slot+1) & (table_size-1);
+        }
+    }
+    SDL_free(table);
+}
+
+Sint64 _geom_weld(const float* elements, Uint32 count, Uint32 dims, float epsilon, Uint32* remap) {
+    // Fills remap with the new index of every element, and returns the number of unique
+    // elements, or -1 if we ran out of memory.
+    if (count == 0)
+        return 0;
+    _EsWeldJob job;
+    job.elements = elements;
+    job.count = count;
+    job.dims = dims;
+    job.epsilon = epsilon;
+    // Small arrays aren't worth the threads, so they go in a single partition.
+    job.num_partitions = count < GEOM_WELD_MIN_PARALLEL ? 1 : GEOM_WELD_PARTITIONS;
+    job.failed = SDL_FALSE;
+    job.keys = (Uint32*) SDL_malloc((size_t) count * dims * sizeof(Uint32));
+    job.hashes = (Uint64*) SDL_malloc(count * sizeof(Uint64));
+    job.partition_starts = (Uint32*) SDL_calloc(job.num_partitions+1, sizeof(Uint32));
+    job.partition_elements = (Uint32*) SDL_malloc(count * sizeof(Uint32));
+    job.firsts = (Uint32*) SDL_malloc(count * sizeof(Uint32));
+    SDL_bool result = job.keys != NULL && job.hashes != NULL && job.partition_starts != NULL && job.partition_elements != NULL && job.firsts != NULL;
+    result = result && warehouse_parallel_for(job.num_partitions, _geom_weld_key_job, &job);
+    if (result) {
+        // A counting sort keeps every partition in the order the elements came in, so the first
+        // element that a partition sees with a key is the first one overall.
+        Uint32 cursors[GEOM_WELD_PARTITIONS];
+        for (Uint32 i=0; i<count; i++)
+            job.partition_starts[_geom_weld_partition(job.hashes[i], job.num_partitions) + 1]++;
+        for (Uint32 i=0; i<job.num_partitions; i++) {
+            job.partition_starts[i+1] += job.partition_starts[i];
+            cursors[i] = job.partition_starts[i];
+        }
+        for (Uint32 i=0; i<count; i++) {
+            Uint32 partition = _geom_weld_partition(job.hashes[i], job.num_partitions);
+            job.partition_elements[cursors[partition]] = i;
+            cursors[partition]++;
+        }
+    }
+    result = result && warehouse_parallel_for(job.num_partitions, _geom_weld_partition_job, &job) && !job.failed;
+    Sint64 num_unique = -1;
+    if (result) {
+        // The first element of a key always comes before the rest, so it already has its index.
+        Uint32 next = 0;
+        for (Uint32 i=0; i<count; i++) {
+            if (job.firsts[i] == i) {
+                remap[i] = next;
+                next++;
+            } else {
+                remap[i] = remap[job.firsts[i]];
+            }
+        }
+        num_unique = next;
+    }
+    SDL_free(job.keys);
+    SDL_free(job.hashes);
+    SDL_free(job.partition_starts);
+    SDL_free(job.partition_elements);
+    SDL_free(job.firsts);
+    return num_unique;
+}
+
+void* _geom_weld_elements(const void* elements, Uint32 count, size_t element_size, Uint32* remap, Uint32 num_unique) {
+    // Keeps the first element of each key, which are also the ones in increasing remap order.
+    Uint8* welded = (Uint8*) SDL_malloc(SDL_max(num_unique, 1) * element_size);
+    if (welded == NULL)
+        return NULL;
+    const Uint8* bytes = (const Uint8*) elements;
+    Uint32 written = 0;
+    for (Uint32 i=0; i<count && written<num_unique; i++) {
+        if (remap[i] == written) {
+            SDL_memcpy(&welded[written * element_size], &bytes[i * element_size], element_size);
+            written++;
+        }
+    }
+    return welded;
+}
+
+Uint32 _geom_weld_index(Uint32 index, Uint32* remap, Uint32 count) {
+    // Faces of some primitives leave the indices they don't use unset, so leave those alone.
+    if (index >= count)
+        return index;
+    return remap[index];
+}
+
+void _geom_weld_faces_job(void* data, Uint32 index, Uint32 worker) {
+    worker;
+    _EsWeldFacesJob* job = (_EsWeldFacesJob*) data;
+    Uint32 chunk = (job->num_faces + job->num_chunks - 1) / job->num_chunks;
+    Uint32 end = SDL_min(job->num_faces, (index+1) * chunk);
+    for (Uint32 i=index*chunk; i<end; i++) {
+        EsFace* face = &job->faces[i];
+        vec3ui* corners[4] = { &face->verts, &face->texs, &face->norms, &face->cols };
+        for (Uint32 j=0; j<4; j++) {
+            corners[j]->x = _geom_weld_index(corners[j]->x, job->remaps[j], job->counts[j]);
+            corners[j]->y = _geom_weld_index(corners[j]->y, job->remaps[j], job->counts[j]);
+            corners[j]->z = _geom_weld_index(corners[j]->z, job->remaps[j], job->counts[j]);
+        }
+    }
+}
+
+SDL_bool geom_weld_geometry(EsGeometry* geom, float epsilon) {
+    // Merges the duplicate vertices, textures, normals and colors, and points the faces at the
+    // merged ones. With an epsilon of 0, only exact duplicates are merged.
+    Uint64 timer_start = SDL_GetPerformanceCounter();
+    SDL_bool result = SDL_TRUE;
+    float* arrays[4] = { (float*) geom->vertices, (float*) geom->textures, (float*) geom->normals, (float*) geom->colors };
+    Uint32 counts[4] = { geom->num_vertices, geom->num_textures, geom->num_normals, geom->num_colors };
+    Uint32 dims[4] = { 3, 2, 3, 3 };
+    const char* names[4] = { "vertices", "textures", "normals", "colors" };
+    Uint32* remaps[4] = { NULL, NULL, NULL, NULL };
+    Sint64 uniques[4];
+    void* welded[4] = { NULL, NULL, NULL, NULL };
+    for (Uint32 i=0; i<4 && result; i++) {
+        remaps[i] = (Uint32*) SDL_malloc(SDL_max(counts[i], 1) * sizeof(Uint32));
+        uniques[i] = remaps[i] ? _geom_weld(arrays[i], counts[i], dims[i], epsilon, remaps[i]) : -1;
+        if (uniques[i] >= 0)
+            welded[i] = _geom_weld_elements(arrays[i], counts[i], dims[i] * sizeof(float), remaps[i], (Uint32) uniques[i]);
+        result = uniques[i] >= 0 && welded[i] != NULL;
+        if (result)
+            SDL_Log("total %s = %i, unique %s = %i\n", names[i], counts[i], names[i], (Uint32) uniques[i]);
+    }
+    if (result) {
+        _EsWeldFacesJob faces_job;
+        faces_job.faces = geom->faces;
+        faces_job.num_faces = geom->num_faces;
+        faces_job.num_chunks = geom->num_faces < GEOM_WELD_MIN_PARALLEL ? 1 : GEOM_WELD_PARTITIONS;
+        for (Uint32 i=0; i<4; i++) {
+            faces_job.remaps[i] = remaps[i];
+            faces_job.counts[i] = counts[i];
+        }
+        result = warehouse_parallel_for(faces_job.num_chunks, _geom_weld_faces_job, &faces_job);
+    }
+    for (Uint32 i=0; i<4; i++)
+        SDL_free(remaps[i]);
+    if (!result) {
+        for (Uint32 i=0; i<4; i++)
+            SDL_free(welded[i]);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to weld geometry\n");
+        return SDL_FALSE;
     }
-    SDL_Log("total vertices = %i, unique vertices = %i\n", geom->num_vertices, vertex_index);
-    for (Uint32 i=0; i<geom->num_textures; i++) {
-        vec2 tex = geom->textures[i];
-        if (hmget(textures, tex) < 0) {
-            hmput(textures, tex, texture_index);
-            texture_index++;
-        }
-    }
-    SDL_Log("total textures = %i, unique textures = %i\n", geom->num_textures, texture_index);
-    for (Uint32 i=0; i<geom->num_normals; i++) {
-        vec3 norm = geom->normals[i];
-        if (hmget(normals, norm) < 0) {
-            hmput(normals, norm, normal_index);
-            normal_index++;
-        }
-    }
-    SDL_Log("total normals = %i, unique normals = %i\n", geom->num_normals, normal_index);
-    for (Uint32 i=0; i<geom->num_colors; i++) {
-        vec3 col = geom->colors[i];
-        if (hmget(colors, col) < 0) {
-            hmput(colors, col, color_index);
-            color_index++;
-        }
-    }
-    SDL_Log("total colors = %i, unique colors = %i\n", geom->num_colors, color_index);
-    EsGeometry simple = geom_init_geometry_size(vertex_index, geom->num_faces, texture_index, normal_index, color_index);
-    for (Uint32 i=0; i<geom->num_vertices; i++)
-        simple.vertices[hmget(vertices, geom->vertices[i])] = geom->vertices[i];
-    for (Uint32 i=0; i<geom->num_textures; i++)
-        simple.textures[hmget(textures, geom->textures[i])] = geom->textures[i];
-    for (Uint32 i=0; i<geom->num_normals; i++)
-        simple.normals[hmget(normals, geom->normals[i])] = geom->normals[i];
-    for (Uint32 i=0; i<geom->num_colors; i++)
-        simple.colors[hmget(colors, geom->colors[i])] = geom->colors[i];
-    for (Uint32 i=0; i<geom->num_faces; i++) {
-        vec3ui verts_old = geom->faces[i].verts;
-        vec3ui texs_old = geom->faces[i].texs;
-        vec3ui norms_old = geom->faces[i].norms;
-        vec3ui cols_old = geom->faces[i].cols;
-        geom->faces[i].verts.x = hmget(vertices, geom->vertices[verts_old.x]);
-        geom->faces[i].verts.y = hmget(vertices, geom->vertices[verts_old.y]);
-        geom->faces[i].verts.z = hmget(vertices, geom->vertices[verts_old.z]);
-        geom->faces[i].texs.x = hmget(textures, geom->textures[texs_old.x]);
-        geom->faces[i].texs.y = hmget(textures, geom->textures[texs_old.y]);
-        geom->faces[i].texs.z = hmget(textures, geom->textures[texs_old.z]);
-        geom->faces[i].norms.x = hmget(normals, geom->normals[norms_old.x]);
-        geom->faces[i].norms.y = hmget(normals, geom->normals[norms_old.y]);
-        geom->faces[i].norms.z = hmget(normals, geom->normals[norms_old.z]);
-        geom->faces[i].cols.x = hmget(colors, geom->colors[cols_old.x]);
-        geom->faces[i].cols.y = hmget(colors, geom->colors[cols_old.y]);
-        geom->faces[i].cols.z = hmget(colors, geom->colors[cols_old.z]);
-    }
-    hmfree(vertices);
-    hmfree(textures);
-    hmfree(normals);
-    hmfree(colors);
     SDL_free(geom->vertices);
     SDL_free(geom->textures);
     SDL_free(geom->normals);
     SDL_free(geom->colors);
-    geom->vertices = simple.vertices;
-    geom->textures = simple.textures;
-    geom->normals = simple.normals;
-    geom->colors = simple.colors;
-    geom->num_vertices = vertex_index;
-    geom->num_textures = texture_index;
-    geom->num_normals = normal_index;
-    geom->num_colors = color_index;
-    geom->vertices_size = vertex_index;
-    geom->textures_size = texture_index;
-    geom->normals_size = normal_index;
-    geom->colors_size = color_index;
+    geom->vertices = (vec3*) welded[0];
+    geom->textures = (vec2*) welded[1];
+    geom->normals = (vec3*) welded[2];
+    geom->colors = (vec3*) welded[3];
+    geom->num_vertices = (Uint32) uniques[0];
+    geom->num_textures = (Uint32) uniques[1];
+    geom->num_normals = (Uint32) uniques[2];
+    geom->num_colors = (Uint32) uniques[3];
+    geom->vertices_size = SDL_max(geom->num_vertices, 1);
+    geom->textures_size = SDL_max(geom->num_textures, 1);
+    geom->normals_size = SDL_max(geom->num_normals, 1);
+    geom->colors_size = SDL_max(geom->num_colors, 1);
+    SDL_Log("weld geometry took %f ms\n", (SDL_GetPerformanceCounter()-timer_start) * 1000.0 / SDL_GetPerformanceFrequency());
     return SDL_TRUE;
 }
 
-float _geom_error_from_lod(Uint32 lod) {
-    // Gives the pixel error
-    if (lod == 0)
-        return 0.01f;
-    else if (lod == 1)
-        return 5.0f;
-    else if (lod == 2)
-        return 10.0f;
-    else
-        return 15.0f;
+SDL_bool geom_simplify_geometry(EsGeometry* geom) {
+    return geom_weld_geometry(geom, 0.0f);
 }
 
-Uint32 _geom_get_vertices_from_radius(float radius, Uint32 lod) {
+// Each lod is drawn until the object is about GEOM_LOD_PIXELS[lod] pixels tall on screen (see
+// _painter_get_instance_lod), and we allow GEOM_LOD_PIXEL_ERROR pixels of error at that size.
+// The first lod has no upper bound, so it uses a full screen.
+static const float GEOM_LOD_PIXELS[] = { 1080.0f, 300.0f, 120.0f, 40.0f };
+#define GEOM_LOD_PIXEL_ERROR 0.5f
+#define GEOM_LOD_COUNT (sizeof(GEOM_LOD_PIXELS) / sizeof(GEOM_LOD_PIXELS[0]))
+
+float geom_error_from_lod(Uint32 lod) {
+    // Gives the error allowed at lod, as a fraction of the size of the object.
+    lod = SDL_min(lod, GEOM_LOD_COUNT-1);
+    return GEOM_LOD_PIXEL_ERROR / GEOM_LOD_PIXELS[lod];
+}
+
+Uint32 _geom_get_vertices_from_radius(float radius, float error) {
     // https://stackoverflow.com/questions/11774038/how-to-render-a-circle-with-as-few-vertices-as-possible
-    // float error = _geom_error_from_lod(lod);
-    // float th = SDL_acosf(2 * SDL_powf((1 - error / radius), 2) - 1);
-    // Uint32 num_vertices = (Uint32) SDL_ceilf(2* (float)M_PI/th);
-    // return num_vertices;
-    lod += 1;
-    radius += 1.0f;
-    return 3;
+    // A ring of n vertices is at most radius * (1 - cos(pi/n)) away from the circle, so we
+    // take the smallest n that keeps that within error.
+    if (radius <= error)
+        return GEOM_RING_MIN_VERTICES;
+    float th = SDL_acosf(1.0f - error / radius);
+    float num_vertices = SDL_ceilf((float) M_PI / th);
+    if (num_vertices >= GEOM_RING_MAX_VERTICES)
+        return GEOM_RING_MAX_VERTICES;
+    return SDL_max(GEOM_RING_MIN_VERTICES, (Uint32) num_vertices);
+}
+
+// The unit rings for every vertex count we use, one after the other, with x = sin and
+// y = cos of each angle. The table is generated from the angle 2*pi*i/n in single precision, so
+// it is the same on every platform and the mesh workers only ever read it.
+#define GEOM_RING_TABLE_SIZE ((GEOM_RING_MAX_VERTICES*(GEOM_RING_MAX_VERTICES+1))/2 - (GEOM_RING_MIN_VERTICES*(GEOM_RING_MIN_VERTICES-1))/2)
+static const vec2 _geom_ring_table[GEOM_RING_TABLE_SIZE] = {
+    // 3
+    {0.0f, 1.0f}, {0.866025388f, -0.50000006f}, {-0.866025448f, -0.499999911f},
+    // 4
+    {0.0f, 1.0f}, {1.0f, -4.37113883e-08f}, {-8.74227766e-08f, -1.0f}, {-1.0f, 1.19248806e-08f},
+    // 5
+    {0.0f, 1.0f}, {0.95105654f, 0.309016973f}, {0.587785184f, -0.809017062f}, {-0.587785542f, -0.809016764f},
+    {-0.95105648f, 0.309017122f},
+    // 6
+    {0.0f, 1.0f}, {0.866025448f, 0.49999997f}, {0.866025388f, -0.50000006f}, {-8.74227766e-08f, -1.0f},
+    {-0.866025448f, -0.499999911f}, {-0.866025448f, 0.499999911f},
+    // 7
+    {0.0f, 1.0f}, {0.781831503f, 0.623489738f}, {0.974927902f, -0.222521067f}, {0.433883607f, -0.900968909f},
+    {-0.433883995f, -0.90096873f}, {-0.974928021f, -0.222520545f}, {-0.781831324f, 0.623490036f},
+    // 8
+    {0.0f, 1.0f}, {0.707106769f, 0.707106769f}, {1.0f, -4.37113883e-08f}, {0.707106769f, -0.707106769f},
+    {-8.74227766e-08f, -1.0f}, {-0.707106888f, -0.70710665f}, {-1.0f, 1.19248806e-08f}, {-0.707106531f, 0.707107008f},
+    // 9
+    {0.0f, 1.0f}, {0.642787635f, 0.766044438f}, {0.984807789f, 0.173648104f}, {0.866025388f, -0.50000006f},
+    {0.342020005f, -0.939692676f}, {-0.342020392f, -0.939692557f}, {-0.866025448f, -0.499999911f}, {-0.98480767f, 0.173648626f},
+    {-0.642787397f, 0.766044617f},
+    // 10
+    {0.0f, 1.0f}, {0.587785244f, 0.809017003f}, {0.95105654f, 0.309016973f}, {0.95105648f, -0.309017152f},
+    {0.587785184f, -0.809017062f}, {-8.74227766e-08f, -1.0f}, {-0.587785542f, -0.809016764f}, {-0.95105648f, -0.309017092f},
+    {-0.95105648f, 0.309017122f}, {-0.587785304f, 0.809016943f},
+    // 11
+    {0.0f, 1.0f}, {0.540640831f, 0.841253519f}, {0.909632027f, 0.415414959f}, {0.989821434f, -0.142314956f},
+    {0.755749464f, -0.654860854f}, {0.28173238f, -0.959493041f}, {-0.281732768f, -0.959492922f}, {-0.755749583f, -0.654860735f},
+    {-0.989821494f, -0.142314538f}, {-0.909631968f, 0.415415108f}, {-0.540640473f, 0.841253757f},
+    // 12
+    {0.0f, 1.0f}, {0.5f, 0.866025388f}, {0.866025448f, 0.49999997f}, {1.0f, -4.37113883e-08f},
+    {0.866025388f, -0.50000006f}, {0.50000006f, -0.866025388f}, {-8.74227766e-08f, -1.0f}, {-0.49999997f, -0.866025388f},
+    {-0.866025448f, -0.499999911f}, {-1.0f, 1.19248806e-08f}, {-0.866025448f, 0.499999911f}, {-0.499999762f, 0.866025567f},
+    // 13
+    {0.0f, 1.0f}, {0.4647232f, 0.885456026f}, {0.822983861f, 0.56806469f}, {0.992708862f, 0.120536685f},
+    {0.935016215f, -0.354604959f}, {0.663122654f, -0.748510778f}, {0.239315674f, -0.970941842f}, {-0.239315853f, -0.970941782f},
+    {-0.663122773f, -0.748510659f}, {-0.935016334f, -0.354604572f}, {-0.992708862f, 0.120536745f}, {-0.822983742f, 0.568064928f},
+    {-0.4647232f, 0.885456026f},
+    // 14
+    {0.0f, 1.0f}, {0.433883756f, 0.90096885f}, {0.781831503f, 0.623489738f}, {0.974927902f, 0.222520858f},
+    {0.974927902f, -0.222521067f}, {0.781831384f, -0.623489976f}, {0.433883607f, -0.900968909f}, {-8.74227766e-08f, -1.0f},
+    {-0.433883995f, -0.90096873f}, {-0.781831622f, -0.623489618f}, {-0.974928021f, -0.222520545f}, {-0.974927902f, 0.222521037f},
+    {-0.781831324f, 0.623490036f}, {-0.433883756f, 0.90096885f},
+    // 15
+    {0.0f, 1.0f}, {0.406736672f, 0.91354543f}, {0.74314487f, 0.669130564f}, {0.95105654f, 0.309016973f},
+    {0.994521856f, -0.104528628f}, {0.866025388f, -0.50000006f}, {0.587785184f, -0.809017062f}, {0.207911611f, -0.978147626f},
+    {-0.207912013f, -0.978147507f}, {-0.587785542f, -0.809016764f}, {-0.866025448f, -0.499999911f}, {-0.994521916f, -0.104528338f},
+    {-0.95105648f, 0.309017122f}, {-0.743144751f, 0.669130743f}, {-0.406736493f, 0.913545549f},
+    // 16
+    {0.0f, 1.0f}, {0.382683456f, 0.923879504f}, {0.707106769f, 0.707106769f}, {0.923879504f, 0.382683426f},
+    {1.0f, -4.37113883e-08f}, {0.923879504f, -0.382683516f}, {0.707106769f, -0.707106769f}, {0.382683277f, -0.923879623f},
+    {-8.74227766e-08f, -1.0f}, {-0.382683426f, -0.923879504f}, {-0.707106888f, -0.70710665f}, {-0.923879683f, -0.382683128f},
+    {-1.0f, 1.19248806e-08f}, {-0.923879445f, 0.382683605f}, {-0.707106531f, 0.707107008f}, {-0.382683426f, 0.923879564f},
+    // 17
+    {0.0f, 1.0f}, {0.361241668f, 0.932472229f}, {0.673695624f, 0.739008904f}, {0.895163298f, 0.445738345f},
+    {0.995734155f, 0.0922683701f}, {0.961825609f, -0.273663074f}, {0.798017204f, -0.602634668f}, {0.526432157f, -0.850217164f},
+    {0.183749527f, -0.982973099f}, {-0.183749706f, -0.982973039f}, {-0.526432276f, -0.850217044f}, {-0.798017442f, -0.60263437f},
+    {-0.961825669f, -0.273662895f}, {-0.995734155f, 0.0922686607f}, {-0.895163298f, 0.445738375f}, {-0.673695445f, 0.739009082f},
+    {-0.361241698f, 0.932472229f},
+    // 18
+    {0.0f, 1.0f}, {0.342020154f, 0.939692616f}, {0.642787635f, 0.766044438f}, {0.866025448f, 0.49999997f},
+    {0.984807789f, 0.173648104f}, {0.98480773f, -0.173648298f}, {0.866025388f, -0.50000006f}, {0.642787457f, -0.766044617f},
+    {0.342020005f, -0.939692676f}, {-8.74227766e-08f, -1.0f}, {-0.342020392f, -0.939692557f}, {-0.642787576f, -0.766044497f},
+    {-0.866025448f, -0.499999911f}, {-0.984807789f, -0.173648134f}, {-0.98480767f, 0.173648626f}, {-0.866025448f, 0.499999911f},
+    {-0.642787397f, 0.766044617f}, {-0.342020363f, 0.939692557f},
+    // 19
+    {0.0f, 1.0f}, {0.324699491f, 0.945817232f}, {0.614212751f, 0.789140463f}, {0.837166488f, 0.546948135f},
+    {0.969400287f, 0.24548538f}, {0.996584475f, -0.0825794488f}, {0.915773332f, -0.4016954f}, {0.735723913f, -0.677281559f},
+    {0.475947201f, -0.879473865f}, {0.164594382f, -0.986361325f}, {-0.164594799f, -0.986361265f}, {-0.47594735f, -0.879473746f},
+    {-0.735723913f, -0.677281618f}, {-0.915773392f, -0.401695251f}, {-0.996584475f, -0.0825793892f}, {-0.969400227f, 0.245485663f},
+    {-0.83716625f, 0.546948493f}, {-0.614212573f, 0.789140642f}, {-0.324699074f, 0.945817351f},
+    // 20
+    {0.0f, 1.0f}, {0.309017003f, 0.95105654f}, {0.587785244f, 0.809017003f}, {0.809017062f, 0.587785184f},
+    {0.95105654f, 0.309016973f}, {1.0f, -4.37113883e-08f}, {0.95105648f, -0.309017152f}, {0.809017003f, -0.587785184f},
+    {0.587785184f, -0.809017062f}, {0.309017032f, -0.95105648f}, {-8.74227766e-08f, -1.0f}, {-0.309017211f, -0.951056421f},
+    {-0.587785542f, -0.809016764f}, {-0.809016824f, -0.587785423f}, {-0.95105648f, -0.309017092f}, {-1.0f, 1.19248806e-08f},
+    {-0.95105648f, 0.309017122f}, {-0.809016824f, 0.587785482f}, {-0.587785304f, 0.809016943f}, {-0.309016943f, 0.95105654f},
+    // 21
+    {0.0f, 1.0f}, {0.294755191f, 0.955572784f}, {0.5633201f, 0.826238751f}, {0.781831503f, 0.623489738f},
+    {0.930873752f, 0.365340978f}, {0.997203827f, 0.0747300014f}, {0.974927902f, -0.222521067f}, {0.866025388f, -0.50000006f},
+    {0.680172682f, -0.733051956f}, {0.433883607f, -0.900968909f}, {0.149042085f, -0.988830864f}, {-0.149042487f, -0.988830805f},
+    {-0.433883995f, -0.90096873f}, {-0.68017298f, -0.733051658f}, {-0.866025448f, -0.499999911f}, {-0.974928021f, -0.222520545f},
+    {-0.997203767f, 0.074730292f}, {-0.930873752f, 0.365341038f}, {-0.781831324f, 0.623490036f}, {-0.563319981f, 0.826238811f},
+    {-0.294754833f, 0.955572903f},
+    // 22
+    {0.0f, 1.0f}, {0.281732589f, 0.959492981f}, {0.540640831f, 0.841253519f}, {0.755749583f, 0.654860675f},
+    {0.909632027f, 0.415414959f}, {0.989821434f, 0.142314747f}, {0.989821434f, -0.142314956f}, {0.909631968f, -0.415415019f},
+    {0.755749464f, -0.654860854f}, {0.540640771f, -0.841253579f}, {0.28173238f, -0.959493041f}, {-8.74227766e-08f, -1.0f},
+    {-0.281732768f, -0.959492922f}, {-0.540640712f, -0.841253579f}, {-0.755749583f, -0.654860735f}, {-0.909631968f, -0.415415078f},
+    {-0.989821494f, -0.142314538f}, {-0.989821434f, 0.14231503f}, {-0.909631968f, 0.415415108f}, {-0.755749583f, 0.654860735f},
+    {-0.540640473f, 0.841253757f}, {-0.281732291f, 0.959493041f},
+    // 23
+    {0.0f, 1.0f}, {0.269796789f, 0.962917268f}, {0.519583941f, 0.85441941f}, {0.730835974f, 0.682553113f},
+    {0.887885213f, 0.460065007f}, {0.979084074f, 0.203456044f}, {0.997668743f, -0.0682424456f}, {0.942260921f, -0.334879577f},
+    {0.816969872f, -0.576680362f}, {0.631087959f, -0.775711298f}, {0.398401141f, -0.917211294f}, {0.136166543f, -0.99068594f},
+    {-0.136166707f, -0.99068594f}, {-0.398401082f, -0.917211294f}, {-0.631087899f, -0.775711298f}, {-0.816969991f, -0.576680183f},
+    {-0.942260921f, -0.334879547f}, {-0.997668743f, -0.068242386f}, {-0.979084074f, 0.203455985f}, {-0.887885273f, 0.460064948f},
+    {-0.730836034f, 0.682553053f}, {-0.519583702f, 0.854419529f}, {-0.26979655f, 0.962917328f},
+    // 24
+    {0.0f, 1.0f}, {0.258819044f, 0.965925813f}, {0.5f, 0.866025388f}, {0.707106769f, 0.707106769f},
+    {0.866025448f, 0.49999997f}, {0.965925813f, 0.258819073f}, {1.0f, -4.37113883e-08f}, {0.965925813f, -0.258819044f},
+    {0.866025388f, -0.50000006f}, {0.707106769f, -0.707106769f}, {0.50000006f, -0.866025388f}, {0.258818924f, -0.965925872f},
+    {-8.74227766e-08f, -1.0f}, {-0.258819312f, -0.965925753f}, {-0.49999997f, -0.866025388f}, {-0.707106888f, -0.70710665f},
+    {-0.866025448f, -0.499999911f}, {-0.965925872f, -0.258818984f}, {-1.0f, 1.19248806e-08f}, {-0.965925694f, 0.258819461f},
+    {-0.866025448f, 0.499999911f}, {-0.707106531f, 0.707107008f}, {-0.499999762f, 0.866025567f}, {-0.258818835f, 0.965925872f},
+    // 25
+    {0.0f, 1.0f}, {0.248689905f, 0.968583167f}, {0.481753707f, 0.876306653f}, {0.684547126f, 0.72896862f},
+    {0.844327927f, 0.535826743f}, {0.95105654f, 0.309016973f}, {0.998026729f, 0.0627904981f}, {0.982287228f, -0.187381312f},
+    {0.904826999f, -0.425779372f}, {0.770513117f, -0.637424171f}, {0.587785184f, -0.809017062f}, {0.368124396f, -0.929776549f},
+    {0.125333205f, -0.992114723f}, {-0.12533313f, -0.992114723f}, {-0.368124545f, -0.92977649f}, {-0.587785542f, -0.809016764f},
+    {-0.770513356f, -0.637423813f}, {-0.904827178f, -0.425779015f}, {-0.982287347f, -0.18738091f}, {-0.998026729f, 0.0627905577f},
+    {-0.95105648f, 0.309017122f}, {-0.844328046f, 0.535826623f}, {-0.684546828f, 0.728968859f}, {-0.48175329f, 0.876306891f},
+    {-0.248689815f, 0.968583167f},
+    // 26
+    {0.0f, 1.0f}, {0.239315674f, 0.970941842f}, {0.4647232f, 0.885456026f}, {0.663122654f, 0.748510778f},
+    {0.822983861f, 0.56806469f}, {0.935016274f, 0.35460487f}, {0.992708862f, 0.120536685f}, {0.992708862f, -0.120536774f},
+    {0.935016215f, -0.354604959f}, {0.822983742f, -0.568064868f}, {0.663122654f, -0.748510778f}, {0.464723051f, -0.885456085f},
+    {0.239315674f, -0.970941842f}, {-8.74227766e-08f, -1.0f}, {-0.239315853f, -0.970941782f}, {-0.4647232f, -0.885456026f},
+    {-0.663122773f, -0.748510659f}, {-0.82298398f, -0.56806457f}, {-0.935016334f, -0.354604572f}, {-0.992708862f, -0.120536715f},
+    {-0.992708862f, 0.120536745f}, {-0.935016215f, 0.354605049f}, {-0.822983742f, 0.568064928f}, {-0.663122773f, 0.748510659f},
+    {-0.4647232f, 0.885456026f}, {-0.239315584f, 0.970941842f},
+    // 27
+    {0.0f, 1.0f}, {0.230615869f, 0.973044872f}, {0.448799193f, 0.89363265f}, {0.642787635f, 0.766044438f},
+    {0.802123189f, 0.597158611f}, {0.918216109f, 0.396079719f}, {0.984807789f, 0.173648104f}, {0.998308182f, -0.0581448227f},
+    {0.957989514f, -0.286803246f}, {0.866025388f, -0.50000006f}, {0.7273736f, -0.686241686f}, {0.54950887f, -0.835487902f},
+    {0.342020005f, -0.939692676f}, {0.116092727f, -0.993238389f}, {-0.116092898f, -0.99323833f}, {-0.342020392f, -0.939692557f},
+    {-0.549508989f, -0.835487783f}, {-0.727373719f, -0.686241567f}, {-0.866025448f, -0.499999911f}, {-0.957989514f, -0.286803305f},
+    {-0.998308182f, -0.0581446476f}, {-0.98480767f, 0.173648626f}, {-0.91821599f, 0.396079987f}, {-0.802122891f, 0.597159028f},
+    {-0.642787397f, 0.766044617f}, {-0.448799074f, 0.89363271f}, {-0.230615497f, 0.973044932f},
+    // 28
+    {0.0f, 1.0f}, {0.222520947f, 0.974927902f}, {0.433883756f, 0.90096885f}, {0.623489857f, 0.781831443f},
+    {0.781831503f, 0.623489738f}, {0.900968909f, 0.433883637f}, {0.974927902f, 0.222520858f}, {1.0f, -4.37113883e-08f},
+    {0.974927902f, -0.222521067f}, {0.90096885f, -0.433883846f}, {0.781831384f, -0.623489976f}, {0.623489738f, -0.781831503f},
+    {0.433883607f, -0.900968909f}, {0.222520933f, -0.974927902f}, {-8.74227766e-08f, -1.0f}, {-0.222520873f, -0.974927902f},
+    {-0.433883995f, -0.90096873f}, {-0.623489916f, -0.781831384f}, {-0.781831622f, -0.623489618f}, {-0.90096879f, -0.433883905f},
+    {-0.974928021f, -0.222520545f}, {-1.0f, 1.19248806e-08f}, {-0.974927902f, 0.222521037f}, {-0.90096879f, 0.433883905f},
+    {-0.781831324f, 0.623490036f}, {-0.623489857f, 0.781831443f}, {-0.433883756f, 0.90096885f}, {-0.222520858f, 0.974927902f},
+    // 29
+    {0.0f, 1.0f}, {0.214970455f, 0.976620555f}, {0.419889122f, 0.907575428f}, {0.605174243f, 0.796093047f},
+    {0.762162089f, 0.647386253f}, {0.88351208f, 0.468408406f}, {0.963550031f, 0.267528296f}, {0.998533428f, 0.0541388392f},
+    {0.986826539f, -0.161782071f}, {0.928976715f, -0.370138139f}, {0.827688932f, -0.561187148f}, {0.687699437f, -0.725995481f},
+    {0.515553772f, -0.85685724f}, {0.319301516f, -0.947653174f}, {0.108118877f, -0.994137943f}, {-0.108119048f, -0.994137943f},
+    {-0.319301695f, -0.947653115f}, {-0.51555413f, -0.856857002f}, {-0.687699437f, -0.725995541f}, {-0.827689171f, -0.56118679f},
+    {-0.928976774f, -0.37013796f}, {-0.986826539f, -0.161781907f}, {-0.998533428f, 0.0541388951f}, {-0.963549912f, 0.267528683f},
+    {-0.883511901f, 0.468408644f}, {-0.76216197f, 0.647386372f}, {-0.605174184f, 0.796093106f}, {-0.419888735f, 0.907575607f},
+    {-0.214970157f, 0.976620615f},
+    // 30
+    {0.0f, 1.0f}, {0.207911715f, 0.978147626f}, {0.406736672f, 0.91354543f}, {0.587785244f, 0.809017003f},
+    {0.74314487f, 0.669130564f}, {0.866025448f, 0.49999997f}, {0.95105654f, 0.309016973f}, {0.994521916f, 0.10452842f},
+    {0.994521856f, -0.104528628f}, {0.95105648f, -0.309017152f}, {0.866025388f, -0.50000006f}, {0.74314481f, -0.669130683f},
+    {0.587785184f, -0.809017062f}, {0.406736583f, -0.913545489f}, {0.207911611f, -0.978147626f}, {-8.74227766e-08f, -1.0f},
+    {-0.207912013f, -0.978147507f}, {-0.406736732f, -0.91354543f}, {-0.587785542f, -0.809016764f}, {-0.74314487f, -0.669130504f},
+    {-0.866025448f, -0.499999911f}, {-0.95105648f, -0.309017092f}, {-0.994521916f, -0.104528338f}, {-0.994521916f, 0.10452836f},
+    {-0.95105648f, 0.309017122f}, {-0.866025448f, 0.499999911f}, {-0.743144751f, 0.669130743f}, {-0.587785304f, 0.809016943f},
+    {-0.406736493f, 0.913545549f}, {-0.20791176f, 0.978147566f},
+    // 31
+    {0.0f, 1.0f}, {0.20129852f, 0.979529917f}, {0.394355834f, 0.918957829f}, {0.571268201f, 0.820763469f},
+    {0.724792778f, 0.68896693f}, {0.848644257f, 0.528963983f}, {0.937752128f, 0.347305298f}, {0.988468349f, 0.151427776f},
+    {0.998716533f, -0.0506491065f}, {0.968077123f, -0.250652522f}, {0.897804499f, -0.440394193f}, {0.790775657f, -0.612106085f},
+    {0.651372552f, -0.758758068f}, {0.485302001f, -0.874346614f}, {0.299363106f, -0.954139233f}, {0.10116826f, -0.994869351f},
+    {-0.1011682f, -0.994869351f}, {-0.299363285f, -0.954139233f}, {-0.485301942f, -0.874346614f}, {-0.651372671f, -0.758757949f},
+    {-0.790775776f, -0.612105906f}, {-0.897804618f, -0.440394044f}, {-0.968077183f, -0.250652343f}, {-0.998716533f, -0.0506489314f},
+    {-0.988468349f, 0.151427597f}, {-0.937752008f, 0.347305566f}, {-0.848644316f, 0.528963923f}, {-0.724792838f, 0.68896687f},
+    {-0.571268201f, 0.820763469f}, {-0.394355804f, 0.918957829f}, {-0.201298401f, 0.979529977f},
+    // 32
+    {0.0f, 1.0f}, {0.195090324f, 0.980785251f}, {0.382683456f, 0.923879504f}, {0.555570245f, 0.831469595f},
+    {0.707106769f, 0.707106769f}, {0.831469655f, 0.555570185f}, {0.923879504f, 0.382683426f}, {0.98078531f, 0.195090234f},
+    {1.0f, -4.37113883e-08f}, {0.980785251f, -0.195090324f}, {0.923879504f, -0.382683516f}, {0.831469536f, -0.555570364f},
+    {0.707106769f, -0.707106769f}, {0.555570185f, -0.831469655f}, {0.382683277f, -0.923879623f}, {0.195090309f, -0.98078531f},
+    {-8.74227766e-08f, -1.0f}, {-0.195090488f, -0.980785251f}, {-0.382683426f, -0.923879504f}, {-0.555570304f, -0.831469536f},
+    {-0.707106888f, -0.70710665f}, {-0.831469774f, -0.555570006f}, {-0.923879683f, -0.382683128f}, {-0.980785251f, -0.195090383f},
+    {-1.0f, 1.19248806e-08f}, {-0.980785251f, 0.195090413f}, {-0.923879445f, 0.382683605f}, {-0.831469476f, 0.555570424f},
+    {-0.707106531f, 0.707107008f}, {-0.555570304f, 0.831469595f}, {-0.382683426f, 0.923879564f}, {-0.195090234f, 0.98078531f},
+};
+
+const vec2* _geom_get_ring(Uint32 num_vertices) {
+    Uint32 first = (num_vertices*(num_vertices-1))/2 - (GEOM_RING_MIN_VERTICES*(GEOM_RING_MIN_VERTICES-1))/2;
+    return &_geom_ring_table[first];
 }
 
 Uint32 _geom_remaining_vertices(EsGeometry* geom) {
@@ -186,53 +535,74 @@ EsGeometry geom_init_geometry_size(Uint32 vertices_size, Uint32 faces_size, Uint
     geom.textures = (vec2*) SDL_malloc(geom.textures_size * sizeof(vec2));
     geom.normals = (vec3*) SDL_malloc(geom.normals_size * sizeof(vec3));
     geom.colors = (vec3*) SDL_malloc(geom.colors_size * sizeof(vec3));
+    geom.emit = NULL;
     return geom;
 }
 
-SDL_bool geom_add_vertices_memory(EsGeometry* geom, Uint32 vertices_size) {
-    // TODO (07 Dec 2020 sam): Grow memory exponentially. Otherwise will need too many reallocs.
-    vec3* new_vertices = (vec3*) SDL_realloc(geom->vertices, (geom->vertices_size+vertices_size) * sizeof(vec3));
-    if (new_vertices == NULL)
+Uint32 _geom_grown_size(Uint32 size, Uint32 extra, size_t element_size) {
+    // Arrays at least double, so that meshing a whole forest into one geometry only reallocates
+    // O(log n) times. Large arrays are rounded up to whole blocks, which keeps them friendly to
+    // huge pages, and lets the allocator grow them in place.
+    Uint32 grown = size + extra;
+    if (size <= UINT32_MAX/2)
+        grown = SDL_max(grown, size*2);
+    size_t bytes = (size_t) grown * element_size;
+    if (bytes >= GEOM_LARGE_BLOCK_SIZE) {
+        bytes = (bytes + GEOM_LARGE_BLOCK_SIZE - 1) / GEOM_LARGE_BLOCK_SIZE * GEOM_LARGE_BLOCK_SIZE;
+        if (bytes / element_size <= UINT32_MAX)
+            grown = (Uint32) (bytes / element_size);
+    }
+    return grown;
+}
+
+SDL_bool _geom_grow_array(void** array, Uint32* size, Uint32 extra, size_t element_size) {
+    Uint32 new_size = _geom_grown_size(*size, extra, element_size);
+    void* new_array = SDL_realloc(*array, new_size * element_size);
+    if (new_array == NULL)
         return SDL_FALSE;
-    geom->vertices = new_vertices;
-    geom->vertices_size += vertices_size;
+    *array = new_array;
+    *size = new_size;
     return SDL_TRUE;
 }
 
+SDL_bool geom_add_vertices_memory(EsGeometry* geom, Uint32 vertices_size) {
+    return _geom_grow_array((void**) &geom->vertices, &geom->vertices_size, vertices_size, sizeof(vec3));
+}
+
 SDL_bool geom_add_normals_memory(EsGeometry* geom, Uint32 normals_size) {
-    vec3* new_normals = (vec3*) SDL_realloc(geom->normals, (geom->normals_size+normals_size) * sizeof(vec3));
-    if (new_normals == NULL)
-        return SDL_FALSE;
-    geom->normals = new_normals;
-    geom->normals_size += normals_size;
-    return SDL_TRUE;
+    return _geom_grow_array((void**) &geom->normals, &geom->normals_size, normals_size, sizeof(vec3));
 }
 
 SDL_bool geom_add_colors_memory(EsGeometry* geom, Uint32 colors_size) {
-    vec3* new_colors = (vec3*) SDL_realloc(geom->colors, (geom->colors_size+colors_size) * sizeof(vec3));
-    if (new_colors == NULL)
-        return SDL_FALSE;
-    geom->colors = new_colors;
-    geom->colors_size += colors_size;
-    return SDL_TRUE;
+    return _geom_grow_array((void**) &geom->colors, &geom->colors_size, colors_size, sizeof(vec3));
 }
 
 SDL_bool geom_add_faces_memory(EsGeometry* geom, Uint32 faces_size) {
-    EsFace* new_faces = (EsFace*) SDL_realloc(geom->faces, (geom->faces_size+faces_size) * sizeof(EsFace));
-    if (new_faces == NULL)
-        return SDL_FALSE;
-    geom->faces = new_faces;
-    geom->faces_size += faces_size;
-    return SDL_TRUE;
+    return _geom_grow_array((void**) &geom->faces, &geom->faces_size, faces_size, sizeof(EsFace));
 }
 
 SDL_bool geom_add_textures_memory(EsGeometry* geom, Uint32 textures_size) {
-    vec2* new_textures = (vec2*) SDL_realloc(geom->textures, (geom->textures_size+textures_size) * sizeof(vec2));
-    if (new_textures == NULL)
-        return SDL_FALSE;
-    geom->textures = new_textures;
-    geom->textures_size += textures_size;
-    return SDL_TRUE;
+    return _geom_grow_array((void**) &geom->textures, &geom->textures_size, textures_size, sizeof(vec2));
+}
+
+void _geom_compact_array(void** array, Uint32 num, Uint32* size, size_t element_size) {
+    if (*size == num)
+        return;
+    // Keep one element, so that the array is never freed out from under the geometry.
+    void* new_array = SDL_realloc(*array, SDL_max(num, 1) * element_size);
+    if (new_array == NULL)
+        return;
+    *array = new_array;
+    *size = SDL_max(num, 1);
+}
+
+void geom_compact_geometry(EsGeometry* geom) {
+    // Gives back the memory that growing left unused, once a geometry is done being built.
+    _geom_compact_array((void**) &geom->vertices, geom->num_vertices, &geom->vertices_size, sizeof(vec3));
+    _geom_compact_array((void**) &geom->faces, geom->num_faces, &geom->faces_size, sizeof(EsFace));
+    _geom_compact_array((void**) &geom->textures, geom->num_textures, &geom->textures_size, sizeof(vec2));
+    _geom_compact_array((void**) &geom->normals, geom->num_normals, &geom->normals_size, sizeof(vec3));
+    _geom_compact_array((void**) &geom->colors, geom->num_colors, &geom->colors_size, sizeof(vec3));
 }
 
 EsGeometry geom_init_geometry() {
@@ -258,8 +628,756 @@ void geom_destroy_geometry(EsGeometry* geom) {
     return;
 }
 
+void geom_clear_geometry(EsGeometry* geom) {
+    // Keeps the memory, so that the geometry can be filled again without reallocating.
+    geom->num_vertices = 0;
+    geom->num_faces = 0;
+    geom->num_textures = 0;
+    geom->num_normals = 0;
+    geom->num_colors = 0;
+}
+
+EsGeometryMark geom_get_mark(EsGeometry* geom) {
+    EsGeometryMark mark;
+    mark.num_vertices = geom->num_vertices;
+    mark.num_faces = geom->num_faces;
+    mark.num_textures = geom->num_textures;
+    mark.num_normals = geom->num_normals;
+    mark.num_colors = geom->num_colors;
+    return mark;
+}
+
+SDL_bool _geom_splice(void** array, Uint32* num, Uint32* size, size_t element_size, Uint32 start, Uint32 end, void* other, Uint32 other_num) {
+    // Puts other_num elements of other in place of the elements start to end, moving the ones
+    // after end along.
+    Uint32 new_num = *num - (end-start) + other_num;
+    if (new_num > *size) {
+        if (!_geom_grow_array(array, size, new_num - *size, element_size))
+            return SDL_FALSE;
+    }
+    Uint8* bytes = (Uint8*) *array;
+    SDL_memmove(&bytes[(start+other_num) * element_size], &bytes[end * element_size], (*num-end) * element_size);
+    SDL_memcpy(&bytes[start * element_size], other, other_num * element_size);
+    *num = new_num;
+    return SDL_TRUE;
+}
+
+Uint32 _geom_move_index(Uint32 index, Uint32 start, Uint32 end, Uint32 other_num) {
+    if (index < end)
+        return index;
+    return index - end + start + other_num;
+}
+
+SDL_bool geom_replace_range(EsGeometry* geom, EsGeometryMark* start, EsGeometryMark* end, EsGeometry* other) {
+    // Replaces the elements between the two marks with all of other. The faces of the range are
+    // expected to only use elements of the range, like anything added with geom_append_geometry.
+    // If the sizes differ, the faces after the range are updated to point to the moved elements.
+    SDL_bool result = SDL_TRUE;
+    result = result && _geom_splice((void**) &geom->vertices, &geom->num_vertices, &geom->vertices_size, sizeof(vec3), start->num_vertices, end->num_vertices, other->vertices, other->num_vertices);
+    result = result && _geom_splice((void**) &geom->textures, &geom->num_textures, &geom->textures_size, sizeof(vec2), start->num_textures, end->num_textures, other->textures, other->num_textures);
+    result = result && _geom_splice((void**) &geom->normals, &geom->num_normals, &geom->normals_size, sizeof(vec3), start->num_normals, end->num_normals, other->normals, other->num_normals);
+    result = result && _geom_splice((void**) &geom->colors, &geom->num_colors, &geom->colors_size, sizeof(vec3), start->num_colors, end->num_colors, other->colors, other->num_colors);
+    result = result && _geom_splice((void**) &geom->faces, &geom->num_faces, &geom->faces_size, sizeof(EsFace), start->num_faces, end->num_faces, other->faces, other->num_faces);
+    if (!result) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not allocate memory to replace geometry\n");
+        return SDL_FALSE;
+    }
+    for (Uint32 i=start->num_faces; i<start->num_faces+other->num_faces; i++) {
+        EsFace* face = &geom->faces[i];
+        face->verts = build_vec3ui(face->verts.x+start->num_vertices, face->verts.y+start->num_vertices, face->verts.z+start->num_vertices);
+        face->texs = build_vec3ui(face->texs.x+start->num_textures, face->texs.y+start->num_textures, face->texs.z+start->num_textures);
+        face->norms = build_vec3ui(face->norms.x+start->num_normals, face->norms.y+start->num_normals, face->norms.z+start->num_normals);
+        face->cols = build_vec3ui(face->cols.x+start->num_colors, face->cols.y+start->num_colors, face->cols.z+start->num_colors);
+    }
+    for (Uint32 i=start->num_faces+other->num_faces; i<geom->num_faces; i++) {
+        EsFace* face = &geom->faces[i];
+        face->verts.x = _geom_move_index(face->verts.x, start->num_vertices, end->num_vertices, other->num_vertices);
+        face->verts.y = _geom_move_index(face->verts.y, start->num_vertices, end->num_vertices, other->num_vertices);
+        face->verts.z = _geom_move_index(face->verts.z, start->num_vertices, end->num_vertices, other->num_vertices);
+        face->texs.x = _geom_move_index(face->texs.x, start->num_textures, end->num_textures, other->num_textures);
+        face->texs.y = _geom_move_index(face->texs.y, start->num_textures, end->num_textures, other->num_textures);
+        face->texs.z = _geom_move_index(face->texs.z, start->num_textures, end->num_textures, other->num_textures);
+        face->norms.x = _geom_move_index(face->norms.x, start->num_normals, end->num_normals, other->num_normals);
+        face->norms.y = _geom_move_index(face->norms.y, start->num_normals, end->num_normals, other->num_normals);
+        face->norms.z = _geom_move_index(face->norms.z, start->num_normals, end->num_normals, other->num_normals);
+        face->cols.x = _geom_move_index(face->cols.x, start->num_colors, end->num_colors, other->num_colors);
+        face->cols.y = _geom_move_index(face->cols.y, start->num_colors, end->num_colors, other->num_colors);
+        face->cols.z = _geom_move_index(face->cols.z, start->num_colors, end->num_colors, other->num_colors);
+    }
+    return SDL_TRUE;
+}
+
+void geom_fill_vertices(EsGeometry* geom, EsVertex* vertices, Uint32* indices) {
+    // vertices needs num_vertices entries and indices num_faces*3. The texture, normal and
+    // color of a vertex are taken from the last face that uses it.
+    for (Uint32 i=0; i<geom->num_vertices; i++) {
+        EsVertex vert;
+        vert.pos = geom->vertices[i];
+        vert.color.x = 0.0;
+        vert.color.y = 0.0;
+        vert.color.z = 0.0;
+        vertices[i] = vert;
+    }
+    for (Uint32 i=0; i<geom->num_faces; i++) {
+        EsFace face = geom->faces[i];
+        EsVertex vert_x = vertices[face.verts.x];
+        EsVertex vert_y = vertices[face.verts.y];
+        EsVertex vert_z = vertices[face.verts.z];
+        vert_x.tex = geom->textures[face.texs.x];
+        vert_y.tex = geom->textures[face.texs.y];
+        vert_z.tex = geom->textures[face.texs.z];
+        vert_x.normal = geom->normals[face.norms.x];
+        vert_y.normal = geom->normals[face.norms.y];
+        vert_z.normal = geom->normals[face.norms.z];
+        vert_x.color = geom->colors[face.cols.x];
+        vert_y.color = geom->colors[face.cols.y];
+        vert_z.color = geom->colors[face.cols.z];
+        vertices[face.verts.x] = vert_x;
+        vertices[face.verts.y] = vert_y;
+        vertices[face.verts.z] = vert_z;
+        indices[i*3 + 0] = face.verts.x;
+        indices[i*3 + 1] = face.verts.y;
+        indices[i*3 + 2] = face.verts.z;
+    }
+    return;
+}
+
+// The position, color, texture and normal of an EsVertex, which are what welding compares.
+#define GEOM_MESH_KEY_WORDS 11
+#define GEOM_MESH_MIN_TABLE_SIZE 1024
+#define GEOM_EMIT_CACHE_SIZE 256
+
+typedef struct {
+    vec4ui key;
+    Uint32 index;
+} EsEmitCacheEntry;
+
+Uint32 geom_num_triangles(EsGeometry* geom) {
+    // Counts the ones that went into the mesh in emission mode.
+    if (geom->emit)
+        return geom->emit->num_indices / 3;
+    return geom->num_faces;
+}
+
+EsIndexedMesh geom_init_indexed_mesh() {
+    EsIndexedMesh mesh;
+    mesh.num_vertices = 0;
+    mesh.num_indices = 0;
+    mesh.vertices_size = DEFAULT_NUM_VERTICES;
+    mesh.indices_size = DEFAULT_NUM_INDICES * 3;
+    mesh.vertices = (EsVertex*) SDL_malloc(mesh.vertices_size * sizeof(EsVertex));
+    mesh.indices = (Uint32*) SDL_malloc(mesh.indices_size * sizeof(Uint32));
+    mesh.table_size = 0;
+    mesh.table = NULL;
+    return mesh;
+}
+
+void geom_destroy_indexed_mesh(EsIndexedMesh* mesh) {
+    mesh->num_vertices = 0;
+    mesh->num_indices = 0;
+    mesh->vertices_size = 0;
+    mesh->indices_size = 0;
+    mesh->table_size = 0;
+    SDL_free(mesh->vertices);
+    SDL_free(mesh->indices);
+    SDL_free(mesh->table);
+    mesh->vertices = NULL;
+    mesh->indices = NULL;
+    mesh->table = NULL;
+    return;
+}
+
+void geom_clear_indexed_mesh(EsIndexedMesh* mesh) {
+    // Keeps the memory, so that the mesh can be filled again without reallocating.
+    mesh->num_vertices = 0;
+    mesh->num_indices = 0;
+    if (mesh->table)
+        SDL_memset(mesh->table, 0xFF, mesh->table_size * sizeof(Uint32));
+}
+
+void geom_compact_indexed_mesh(EsIndexedMesh* mesh) {
+    // The table is only needed while the mesh is being built, and is made again if anything
+    // else is emitted into it.
+    _geom_compact_array((void**) &mesh->vertices, mesh->num_vertices, &mesh->vertices_size, sizeof(EsVertex));
+    _geom_compact_array((void**) &mesh->indices, mesh->num_indices, &mesh->indices_size, sizeof(Uint32));
+    SDL_free(mesh->table);
+    mesh->table = NULL;
+    mesh->table_size = 0;
+}
+
+Uint32* _geom_mesh_find_slot(EsIndexedMesh* mesh, EsVertex* vert) {
+    // The slot with the vertex that vert welds to, or the empty one where it would go.
+    Uint32 key[GEOM_MESH_KEY_WORDS];
+    SDL_memcpy(key, vert, sizeof(key));
+    Uint32 slot = (Uint32) _geom_weld_hash(key, GEOM_MESH_KEY_WORDS) & (mesh->table_size-1);
+    while (mesh->table[slot] != UINT32_MAX && SDL_memcmp(&mesh->vertices[mesh->table[slot]], key, sizeof(key)) != 0)
+        slot = (slot+1) & (mesh->table_size-1);
+    return &mesh->table[slot];
+}
+
+SDL_bool _geom_reserve_indexed_mesh(EsIndexedMesh* mesh, Uint32 num_corners) {
+    // Room for num_corners more indices, and for each of them to be a new vertex. The table is
+    // kept at most half full.
+    if (mesh->vertices_size - mesh->num_vertices < num_corners) {
+        if (!_geom_grow_array((void**) &mesh->vertices, &mesh->vertices_size, num_corners, sizeof(EsVertex)))
+            return SDL_FALSE;
+    }
+    if (mesh->indices_size - mesh->num_indices < num_corners) {
+        if (!_geom_grow_array((void**) &mesh->indices, &mesh->indices_size, num_corners, sizeof(Uint32)))
+            return SDL_FALSE;
+    }
+    Uint32 max_vertices = mesh->num_vertices + num_corners;
+    if (mesh->table_size >= max_vertices*2)
+        return SDL_TRUE;
+    Uint32 table_size = GEOM_MESH_MIN_TABLE_SIZE;
+    while (table_size < max_vertices*2)
+        table_size *= 2;
+    Uint32* table = (Uint32*) SDL_malloc(table_size * sizeof(Uint32));
+    if (table == NULL)
+        return SDL_FALSE;
+    SDL_memset(table, 0xFF, table_size * sizeof(Uint32));
+    SDL_free(mesh->table);
+    mesh->table = table;
+    mesh->table_size = table_size;
+    // Appended meshes aren't welded to each other, so a vertex can already be in the table.
+    for (Uint32 i=0; i<mesh->num_vertices; i++) {
+        Uint32* slot = _geom_mesh_find_slot(mesh, &mesh->vertices[i]);
+        if (*slot == UINT32_MAX)
+            *slot = i;
+    }
+    return SDL_TRUE;
+}
+
+Uint32 _geom_corner(vec3ui indices, Uint32 corner) {
+    if (corner == 0)
+        return indices.x;
+    if (corner == 1)
+        return indices.y;
+    return indices.z;
+}
+
+SDL_bool geom_emit_faces(EsGeometry* geom, Uint32 first_face, EsIndexedMesh* mesh) {
+    // Adds the faces from first_face on to mesh. A corner welds to a vertex already in the mesh
+    // only if all of its attributes are the same, so unlike geom_fill_vertices, corners that
+    // only share a position keep their own texture, normal and color.
+    // Neighbouring faces mostly share their corners, so the last few corners are cached by
+    // their indices, and only new ones have to be looked up by value.
+    EsEmitCacheEntry cache[GEOM_EMIT_CACHE_SIZE];
+    SDL_memset(cache, 0xFF, sizeof(cache));
+    Uint32 num_corners = (geom->num_faces - first_face) * 3;
+    if (!_geom_reserve_indexed_mesh(mesh, num_corners)) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to emit faces\n");
+        return SDL_FALSE;
+    }
+    for (Uint32 i=first_face; i<geom->num_faces; i++) {
+        EsFace face = geom->faces[i];
+        for (Uint32 corner=0; corner<3; corner++) {
+            vec4ui key = build_vec4ui(_geom_corner(face.verts, corner), _geom_corner(face.texs, corner), _geom_corner(face.norms, corner), _geom_corner(face.cols, corner));
+            EsEmitCacheEntry* entry = &cache[key.x % GEOM_EMIT_CACHE_SIZE];
+            if (SDL_memcmp(&entry->key, &key, sizeof(vec4ui)) != 0) {
+                // Some primitives leave the attributes they don't have unset.
+                EsVertex vert;
+                SDL_memset(&vert, 0, sizeof(EsVertex));
+                vert.pos = geom->vertices[key.x];
+                if (key.y < geom->num_textures)
+                    vert.tex = geom->textures[key.y];
+                if (key.z < geom->num_normals)
+                    vert.normal = geom->normals[key.z];
+                if (key.w < geom->num_colors)
+                    vert.color = geom->colors[key.w];
+                Uint32* slot = _geom_mesh_find_slot(mesh, &vert);
+                if (*slot == UINT32_MAX) {
+                    *slot = mesh->num_vertices;
+                    mesh->vertices[mesh->num_vertices] = vert;
+                    mesh->num_vertices++;
+                }
+                entry->key = key;
+                entry->index = *slot;
+            }
+            mesh->indices[mesh->num_indices] = entry->index;
+            mesh->num_indices++;
+        }
+    }
+    return SDL_TRUE;
+}
+
+SDL_bool _geom_emit_primitive(EsGeometry* geom, EsGeometryMark* start) {
+    // In emission mode, a primitive goes into the mesh as soon as it is added, so the geometry
+    // never holds more than one of them.
+    if (geom->emit == NULL)
+        return SDL_TRUE;
+    SDL_bool result = geom_emit_faces(geom, start->num_faces, geom->emit);
+    geom->num_vertices = start->num_vertices;
+    geom->num_faces = start->num_faces;
+    geom->num_textures = start->num_textures;
+    geom->num_normals = start->num_normals;
+    geom->num_colors = start->num_colors;
+    return result;
+}
+
+SDL_bool geom_append_indexed_mesh(EsIndexedMesh* mesh, EsIndexedMesh* other) {
+    // Copies all of other into mesh, offsetting the indices. The vertices of other are not
+    // welded to the ones already in mesh.
+    if (mesh->vertices_size - mesh->num_vertices < other->num_vertices) {
+        if (!_geom_grow_array((void**) &mesh->vertices, &mesh->vertices_size, other->num_vertices, sizeof(EsVertex)))
+            return SDL_FALSE;
+    }
+    if (mesh->indices_size - mesh->num_indices < other->num_indices) {
+        if (!_geom_grow_array((void**) &mesh->indices, &mesh->indices_size, other->num_indices, sizeof(Uint32)))
+            return SDL_FALSE;
+    }
+    Uint32 first_vertex = mesh->num_vertices;
+    SDL_memcpy(&mesh->vertices[first_vertex], other->vertices, other->num_vertices * sizeof(EsVertex));
+    for (Uint32 i=0; i<other->num_indices; i++)
+        mesh->indices[mesh->num_indices+i] = other->indices[i] + first_vertex;
+    mesh->num_vertices += other->num_vertices;
+    mesh->num_indices += other->num_indices;
+    // The table no longer has every vertex, so it is made again if anything is emitted.
+    SDL_free(mesh->table);
+    mesh->table = NULL;
+    mesh->table_size = 0;
+    return SDL_TRUE;
+}
+
+// Forsyth's linear speed vertex cache optimisation, with his scoring constants. The cache
+// scores are for an LRU cache of GEOM_VERTEX_CACHE_SIZE, and the valence scores boost
+// vertices with few triangles left, so that they get finished off instead of left behind.
+#define GEOM_FORSYTH_MAX_VALENCE 64
+#define GEOM_FORSYTH_LAST_TRI_SCORE 0.75f
+#define GEOM_FORSYTH_CACHE_DECAY_POWER 1.5f
+#define GEOM_FORSYTH_VALENCE_BOOST_SCALE 2.0f
+#define GEOM_FORSYTH_VALENCE_BOOST_POWER 0.5f
+
+typedef struct {
+    float cache_scores[GEOM_VERTEX_CACHE_SIZE];
+    float valence_scores[GEOM_FORSYTH_MAX_VALENCE];
+    // Per vertex, from the lowest vertex index used to the highest.
+    Uint32 base;
+    Uint32 span;
+    Uint32* live_triangles;
+    Uint32* adjacency_starts;
+    Sint32* cache_positions;
+    float* scores;
+    Uint32* adjacency;
+    float* triangle_scores;
+    SDL_bool* emitted;
+} _EsForsyth;
+
+float _geom_forsyth_vertex_score(_EsForsyth* forsyth, Uint32 vertex) {
+    Uint32 live = forsyth->live_triangles[vertex];
+    if (live == 0)
+        return -1.0f;
+    float score = 0.0f;
+    Sint32 cache_position = forsyth->cache_positions[vertex];
+    if (cache_position >= 0)
+        score = forsyth->cache_scores[cache_position];
+    if (live < GEOM_FORSYTH_MAX_VALENCE)
+        return score + forsyth->valence_scores[live];
+    return score + GEOM_FORSYTH_VALENCE_BOOST_SCALE * SDL_powf((float) live, -GEOM_FORSYTH_VALENCE_BOOST_POWER);
+}
+
+void _geom_forsyth_free(_EsForsyth* forsyth) {
+    SDL_free(forsyth->live_triangles);
+    SDL_free(forsyth->adjacency_starts);
+    SDL_free(forsyth->cache_positions);
+    SDL_free(forsyth->scores);
+    SDL_free(forsyth->adjacency);
+    SDL_free(forsyth->triangle_scores);
+    SDL_free(forsyth->emitted);
+}
+
+SDL_bool geom_optimize_vertex_cache(Uint32* indices, Uint32 num_indices) {
+    // Reorders the triangles of indices in place, so that each one reuses as many of the
+    // vertices of the ones just before it as it can. The vertices themselves aren't touched.
+    Uint32 num_triangles = num_indices / 3;
+    if (num_triangles < 2)
+        return SDL_TRUE;
+    _EsForsyth forsyth;
+    for (Uint32 i=0; i<GEOM_VERTEX_CACHE_SIZE; i++) {
+        if (i < 3)
+            forsyth.cache_scores[i] = GEOM_FORSYTH_LAST_TRI_SCORE;
+        else
+            forsyth.cache_scores[i] = SDL_powf(1.0f - (i-3) / (float) (GEOM_VERTEX_CACHE_SIZE-3), GEOM_FORSYTH_CACHE_DECAY_POWER);
+    }
+    forsyth.valence_scores[0] = 0.0f;
+    for (Uint32 i=1; i<GEOM_FORSYTH_MAX_VALENCE; i++)
+        forsyth.valence_scores[i] = GEOM_FORSYTH_VALENCE_BOOST_SCALE * SDL_powf((float) i, -GEOM_FORSYTH_VALENCE_BOOST_POWER);
+    // Meshes are usually emitted a range at a time, so only the vertices of this range get space.
+    Uint32 min_vertex = indices[0];
+    Uint32 max_vertex = indices[0];
+    for (Uint32 i=0; i<num_triangles*3; i++) {
+        min_vertex = SDL_min(min_vertex, indices[i]);
+        max_vertex = SDL_max(max_vertex, indices[i]);
+    }
+    forsyth.base = min_vertex;
+    forsyth.span = max_vertex - min_vertex + 1;
+    forsyth.live_triangles = (Uint32*) SDL_calloc(forsyth.span, sizeof(Uint32));
+    forsyth.adjacency_starts = (Uint32*) SDL_malloc((forsyth.span+1) * sizeof(Uint32));
+    forsyth.cache_positions = (Sint32*) SDL_malloc(forsyth.span * sizeof(Sint32));
+    forsyth.scores = (float*) SDL_malloc(forsyth.span * sizeof(float));
+    forsyth.adjacency = (Uint32*) SDL_malloc(num_triangles * 3 * sizeof(Uint32));
+    forsyth.triangle_scores = (float*) SDL_malloc(num_triangles * sizeof(float));
+    forsyth.emitted = (SDL_bool*) SDL_calloc(num_triangles, sizeof(SDL_bool));
+    Uint32* output = (Uint32*) SDL_malloc(num_triangles * 3 * sizeof(Uint32));
+    if (forsyth.live_triangles == NULL || forsyth.adjacency_starts == NULL || forsyth.cache_positions == NULL || forsyth.scores == NULL || forsyth.adjacency == NULL || forsyth.triangle_scores == NULL || forsyth.emitted == NULL || output == NULL) {
+        _geom_forsyth_free(&forsyth);
+        SDL_free(output);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to optimize vertex cache\n");
+        return SDL_FALSE;
+    }
+    for (Uint32 i=0; i<num_triangles*3; i++)
+        forsyth.live_triangles[indices[i]-forsyth.base]++;
+    // The triangles of each vertex, with the live ones kept at the front.
+    forsyth.adjacency_starts[0] = 0;
+    for (Uint32 v=0; v<forsyth.span; v++)
+        forsyth.adjacency_starts[v+1] = forsyth.adjacency_starts[v] + forsyth.live_triangles[v];
+    for (Uint32 v=0; v<forsyth.span; v++)
+        forsyth.live_triangles[v] = 0;
+    for (Uint32 i=0; i<num_triangles*3; i++) {
+        Uint32 v = indices[i]-forsyth.base;
+        forsyth.adjacency[forsyth.adjacency_starts[v] + forsyth.live_triangles[v]] = i/3;
+        forsyth.live_triangles[v]++;
+    }
+    for (Uint32 v=0; v<forsyth.span; v++) {
+        forsyth.cache_positions[v] = -1;
+        forsyth.scores[v] = _geom_forsyth_vertex_score(&forsyth, v);
+    }
+    Sint32 best_triangle = -1;
+    float best_score = -1.0f;
+    for (Uint32 t=0; t<num_triangles; t++) {
+        forsyth.triangle_scores[t] = forsyth.scores[indices[t*3+0]-forsyth.base] + forsyth.scores[indices[t*3+1]-forsyth.base] + forsyth.scores[indices[t*3+2]-forsyth.base];
+        if (forsyth.triangle_scores[t] > best_score) {
+            best_score = forsyth.triangle_scores[t];
+            best_triangle = t;
+        }
+    }
+    // The cache is three longer, for the vertices that a new triangle pushes out.
+    Uint32 cache[GEOM_VERTEX_CACHE_SIZE+3];
+    Uint32 new_cache[GEOM_VERTEX_CACHE_SIZE+3];
+    Uint32 cache_count = 0;
+    Uint32 next_unemitted = 0;
+    for (Uint32 out=0; out<num_triangles; out++) {
+        if (best_triangle < 0) {
+            // Nothing in the cache has triangles left, so carry on from the first one left over.
+            while (forsyth.emitted[next_unemitted])
+                next_unemitted++;
+            best_triangle = next_unemitted;
+        }
+        Uint32 t = (Uint32) best_triangle;
+        forsyth.emitted[t] = SDL_TRUE;
+        Uint32 new_count = 0;
+        for (Uint32 c=0; c<3; c++) {
+            Uint32 v = indices[t*3+c]-forsyth.base;
+            output[out*3+c] = indices[t*3+c];
+            // Swap the triangle to the end of the live ones.
+            Uint32* adjacent = &forsyth.adjacency[forsyth.adjacency_starts[v]];
+            Uint32 live = forsyth.live_triangles[v];
+            for (Uint32 a=0; a<live; a++) {
+                if (adjacent[a] == t) {
+                    adjacent[a] = adjacent[live-1];
+                    adjacent[live-1] = t;
+                    break;
+                }
+            }
+            forsyth.live_triangles[v]--;
+            if (new_count == 0 || (new_cache[0] != v && (new_count < 2 || new_cache[1] != v)))
+                new_cache[new_count++] = v;
+        }
+        for (Uint32 i=0; i<cache_count; i++) {
+            Uint32 v = cache[i];
+            if (v != new_cache[0] && (new_count < 2 || v != new_cache[1]) && (new_count < 3 || v != new_cache[2]))
+                new_cache[new_count++] = v;
+        }
+        best_triangle = -1;
+        best_score = -1.0f;
+        for (Uint32 i=0; i<new_count; i++) {
+            Uint32 v = new_cache[i];
+            forsyth.cache_positions[v] = i < GEOM_VERTEX_CACHE_SIZE ? (Sint32) i : -1;
+            float score = _geom_forsyth_vertex_score(&forsyth, v);
+            float delta = score - forsyth.scores[v];
+            forsyth.scores[v] = score;
+            Uint32* adjacent = &forsyth.adjacency[forsyth.adjacency_starts[v]];
+            for (Uint32 a=0; a<forsyth.live_triangles[v]; a++) {
+                Uint32 other = adjacent[a];
+                forsyth.triangle_scores[other] += delta;
+                if (forsyth.triangle_scores[other] > best_score) {
+                    best_score = forsyth.triangle_scores[other];
+                    best_triangle = other;
+                }
+            }
+        }
+        cache_count = SDL_min(new_count, GEOM_VERTEX_CACHE_SIZE);
+        SDL_memcpy(cache, new_cache, cache_count * sizeof(Uint32));
+    }
+    SDL_memcpy(indices, output, num_triangles * 3 * sizeof(Uint32));
+    _geom_forsyth_free(&forsyth);
+    SDL_free(output);
+    return SDL_TRUE;
+}
+
+SDL_bool geom_optimize_vertex_fetch(EsVertex* vertices, Uint32 num_vertices, Uint32* indices, Uint32 num_indices) {
+    // Renumbers the vertices in the order the indices first use them, so that drawing walks
+    // through the vertex buffer instead of jumping around it. Unused vertices go at the end.
+    Uint32* remap = (Uint32*) SDL_malloc(SDL_max(num_vertices, 1) * sizeof(Uint32));
+    EsVertex* reordered = (EsVertex*) SDL_malloc(SDL_max(num_vertices, 1) * sizeof(EsVertex));
+    if (remap == NULL || reordered == NULL) {
+        SDL_free(remap);
+        SDL_free(reordered);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to optimize vertex fetch\n");
+        return SDL_FALSE;
+    }
+    SDL_memset(remap, 0xFF, num_vertices * sizeof(Uint32));
+    Uint32 next = 0;
+    for (Uint32 i=0; i<num_indices; i++) {
+        Uint32 v = indices[i];
+        if (remap[v] == UINT32_MAX) {
+            remap[v] = next;
+            reordered[next] = vertices[v];
+            next++;
+        }
+        indices[i] = remap[v];
+    }
+    for (Uint32 v=0; v<num_vertices; v++) {
+        if (remap[v] == UINT32_MAX) {
+            reordered[next] = vertices[v];
+            next++;
+        }
+    }
+    SDL_memcpy(vertices, reordered, num_vertices * sizeof(EsVertex));
+    SDL_free(remap);
+    SDL_free(reordered);
+    return SDL_TRUE;
+}
+
+EsVertexCacheStats geom_get_vertex_cache_stats(Uint32* indices, Uint32 num_indices, Uint32 num_vertices, Uint32 cache_size) {
+    // Simulates a FIFO post transform cache of cache_size vertices, which is close to what the
+    // hardware does. ACMR is the misses per triangle, which is 0.5 at best for a big regular
+    // grid and 3 at worst. ATVR is the misses per vertex used, and 1 at best.
+    EsVertexCacheStats stats;
+    stats.acmr = 0.0f;
+    stats.atvr = 0.0f;
+    Uint32* inserted = (Uint32*) SDL_malloc(SDL_max(num_vertices, 1) * sizeof(Uint32));
+    if (inserted == NULL || num_indices < 3) {
+        SDL_free(inserted);
+        return stats;
+    }
+    SDL_memset(inserted, 0xFF, num_vertices * sizeof(Uint32));
+    Uint32 misses = 0;
+    Uint32 used = 0;
+    for (Uint32 i=0; i<num_indices; i++) {
+        Uint32 v = indices[i];
+        if (inserted[v] == UINT32_MAX)
+            used++;
+        if (inserted[v] == UINT32_MAX || misses - inserted[v] >= cache_size) {
+            inserted[v] = misses;
+            misses++;
+        }
+    }
+    stats.acmr = misses / (float) (num_indices/3);
+    stats.atvr = misses / (float) used;
+    SDL_free(inserted);
+    return stats;
+}
+
+SDL_bool geom_optimize_indexed_mesh(EsIndexedMesh* mesh, Uint32* face_ranges, Uint32 num_ranges) {
+    // Reorders the triangles for the vertex cache and then the vertices for fetching. Triangles
+    // only move inside their range, where the faces of range i are face_ranges[i] to
+    // face_ranges[i+1], so that draws of the ranges stay valid. With no ranges, the whole mesh
+    // is one range.
+    Uint64 timer_start = SDL_GetPerformanceCounter();
+    EsVertexCacheStats before = geom_get_vertex_cache_stats(mesh->indices, mesh->num_indices, mesh->num_vertices, GEOM_VERTEX_CACHE_SIZE);
+    SDL_bool result = SDL_TRUE;
+    if (face_ranges == NULL || num_ranges == 0) {
+        result = geom_optimize_vertex_cache(mesh->indices, mesh->num_indices);
+    } else {
+        for (Uint32 i=0; i<num_ranges && result; i++)
+            result = geom_optimize_vertex_cache(&mesh->indices[face_ranges[i]*3], (face_ranges[i+1]-face_ranges[i])*3);
+    }
+    if (result)
+        result = geom_optimize_vertex_fetch(mesh->vertices, mesh->num_vertices, mesh->indices, mesh->num_indices);
+    if (!result)
+        return SDL_FALSE;
+    EsVertexCacheStats after = geom_get_vertex_cache_stats(mesh->indices, mesh->num_indices, mesh->num_vertices, GEOM_VERTEX_CACHE_SIZE);
+    SDL_Log("optimize mesh took %f ms, acmr %f -> %f, atvr %f -> %f\n", (SDL_GetPerformanceCounter()-timer_start) * 1000.0 / SDL_GetPerformanceFrequency(), before.acmr, after.acmr, before.atvr, after.atvr);
+    return SDL_TRUE;
+}
+
+Uint16 _geom_float_to_half(float value) {
+    // Rounds to nearest even. Values too small for a half flush to zero, and values too big
+    // become infinity.
+    union { float f; Uint32 u; } bits;
+    bits.f = value;
+    Uint32 sign = (bits.u >> 16) & 0x8000;
+    Uint32 magnitude = bits.u & 0x7fffffff;
+    if (magnitude >= 0x7f800000)
+        return (Uint16) (sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0));
+    if (magnitude >= 0x477ff000)
+        return (Uint16) (sign | 0x7c00);
+    if (magnitude < 0x38800000) {
+        // Subnormal half. Below half the smallest one, this is zero.
+        if (magnitude < 0x33000000)
+            return (Uint16) sign;
+        Uint32 shift = 126 - (magnitude >> 23);
+        Uint32 mantissa = (magnitude & 0x007fffff) | 0x00800000;
+        Uint32 half = mantissa >> shift;
+        Uint32 rest = mantissa & ((1u << shift) - 1);
+        Uint32 midway = 1u << (shift - 1);
+        if (rest > midway || (rest == midway && (half & 1)))
+            half++;
+        return (Uint16) (sign | half);
+    }
+    magnitude -= 0x38000000;
+    magnitude += 0x0fff + ((magnitude >> 13) & 1);
+    return (Uint16) (sign | (magnitude >> 13));
+}
+
+Sint16 _geom_float_to_snorm16(float value) {
+    value = SDL_max(-1.0f, SDL_min(1.0f, value));
+    return (Sint16) SDL_floorf(value*32767.0f + 0.5f);
+}
+
+Uint8 _geom_float_to_unorm8(float value) {
+    value = SDL_max(0.0f, SDL_min(1.0f, value));
+    return (Uint8) SDL_floorf(value*255.0f + 0.5f);
+}
+
+void geom_pack_vertices(EsVertex* vertices, Uint32 num_vertices, EsPackedVertex* packed) {
+    // Has to match the decode in tree_vertex.glsl.
+    for (Uint32 i=0; i<num_vertices; i++) {
+        EsVertex* v = &vertices[i];
+        EsPackedVertex* p = &packed[i];
+        p->pos[0] = _geom_float_to_half(v->pos.x);
+        p->pos[1] = _geom_float_to_half(v->pos.y);
+        p->pos[2] = _geom_float_to_half(v->pos.z);
+        p->pos[3] = _geom_float_to_half(1.0f);
+        p->color[0] = _geom_float_to_unorm8(v->color.x / PACKED_VERTEX_COLOR_RANGE);
+        p->color[1] = _geom_float_to_unorm8(v->color.y / PACKED_VERTEX_COLOR_RANGE);
+        p->color[2] = _geom_float_to_unorm8(v->color.z / PACKED_VERTEX_COLOR_RANGE);
+        p->color[3] = 255;
+        p->tex[0] = _geom_float_to_half(v->tex.x);
+        p->tex[1] = _geom_float_to_half(v->tex.y);
+        // Octahedral encoding. The normal is projected onto the octahedron |x|+|y|+|z| = 1,
+        // and the lower half is folded over the diagonals onto the upper half.
+        vec3 n = v->normal;
+        float length = SDL_fabsf(n.x) + SDL_fabsf(n.y) + SDL_fabsf(n.z);
+        vec2 e = build_vec2(0.0f, 0.0f);
+        if (length > 0.0f) {
+            e = build_vec2(n.x/length, n.y/length);
+            if (n.z < 0.0f) {
+                float x = e.x;
+                e.x = (1.0f - SDL_fabsf(e.y)) * (x >= 0.0f ? 1.0f : -1.0f);
+                e.y = (1.0f - SDL_fabsf(x)) * (e.y >= 0.0f ? 1.0f : -1.0f);
+            }
+        }
+        p->normal[0] = _geom_float_to_snorm16(e.x);
+        p->normal[1] = _geom_float_to_snorm16(e.y);
+    }
+}
+
+void _geom_grow_box(vec3* box_min, vec3* box_max, vec3 v) {
+    *box_min = build_vec3(SDL_min(box_min->x, v.x), SDL_min(box_min->y, v.y), SDL_min(box_min->z, v.z));
+    *box_max = build_vec3(SDL_max(box_max->x, v.x), SDL_max(box_max->y, v.y), SDL_max(box_max->z, v.z));
+}
+
+float geom_get_bounding_sphere(EsGeometry* geom, Uint32 first_face, Uint32 last_face, vec3* centre) {
+    // Sphere around the centre of the bounding box of the faces first_face to last_face.
+    *centre = build_vec3(0.0f, 0.0f, 0.0f);
+    if (first_face >= last_face)
+        return 0.0f;
+    vec3 box_min = geom->vertices[geom->faces[first_face].verts.x];
+    vec3 box_max = box_min;
+    for (Uint32 i=first_face; i<last_face; i++) {
+        _geom_grow_box(&box_min, &box_max, geom->vertices[geom->faces[i].verts.x]);
+        _geom_grow_box(&box_min, &box_max, geom->vertices[geom->faces[i].verts.y]);
+        _geom_grow_box(&box_min, &box_max, geom->vertices[geom->faces[i].verts.z]);
+    }
+    *centre = vec3_scale(vec3_add(box_min, box_max), 0.5f);
+    float radius = 0.0f;
+    for (Uint32 i=first_face; i<last_face; i++) {
+        radius = SDL_max(radius, vec3_distance(*centre, geom->vertices[geom->faces[i].verts.x]));
+        radius = SDL_max(radius, vec3_distance(*centre, geom->vertices[geom->faces[i].verts.y]));
+        radius = SDL_max(radius, vec3_distance(*centre, geom->vertices[geom->faces[i].verts.z]));
+    }
+    return radius;
+}
+
+float geom_get_indexed_mesh_bounding_sphere(EsIndexedMesh* mesh, Uint32 first_face, Uint32 last_face, vec3* centre) {
+    // Same as geom_get_bounding_sphere, for the triangles first_face to last_face of a mesh.
+    *centre = build_vec3(0.0f, 0.0f, 0.0f);
+    if (first_face >= last_face)
+        return 0.0f;
+    vec3 box_min = mesh->vertices[mesh->indices[first_face*3]].pos;
+    vec3 box_max = box_min;
+    for (Uint32 i=first_face*3; i<last_face*3; i++)
+        _geom_grow_box(&box_min, &box_max, mesh->vertices[mesh->indices[i]].pos);
+    *centre = vec3_scale(vec3_add(box_min, box_max), 0.5f);
+    float radius = 0.0f;
+    for (Uint32 i=first_face*3; i<last_face*3; i++)
+        radius = SDL_max(radius, vec3_distance(*centre, mesh->vertices[mesh->indices[i]].pos));
+    return radius;
+}
+
+SDL_bool geom_append_geometry(EsGeometry* geom, EsGeometry* other) {
+    // Copies all of other into geom, offsetting the face indices so that they point to the
+    // copied elements.
+    if (_geom_remaining_vertices(geom) < other->num_vertices) {
+        if (!geom_add_vertices_memory(geom, other->num_vertices))
+            return SDL_FALSE;
+    }
+    if (_geom_remaining_faces(geom) < other->num_faces) {
+        if (!geom_add_faces_memory(geom, other->num_faces))
+            return SDL_FALSE;
+    }
+    if (_geom_remaining_textures(geom) < other->num_textures) {
+        if (!geom_add_textures_memory(geom, other->num_textures))
+            return SDL_FALSE;
+    }
+    if (_geom_remaining_normals(geom) < other->num_normals) {
+        if (!geom_add_normals_memory(geom, other->num_normals))
+            return SDL_FALSE;
+    }
+    if (_geom_remaining_colors(geom) < other->num_colors) {
+        if (!geom_add_colors_memory(geom, other->num_colors))
+            return SDL_FALSE;
+    }
+    Uint32 first_vertex = geom->num_vertices;
+    Uint32 first_texture = geom->num_textures;
+    Uint32 first_normal = geom->num_normals;
+    Uint32 first_color = geom->num_colors;
+    SDL_memcpy(&geom->vertices[first_vertex], other->vertices, sizeof(vec3)*other->num_vertices);
+    SDL_memcpy(&geom->textures[first_texture], other->textures, sizeof(vec2)*other->num_textures);
+    SDL_memcpy(&geom->normals[first_normal], other->normals, sizeof(vec3)*other->num_normals);
+    SDL_memcpy(&geom->colors[first_color], other->colors, sizeof(vec3)*other->num_colors);
+    for (Uint32 i=0; i<other->num_faces; i++) {
+        EsFace face = other->faces[i];
+        face.verts = build_vec3ui(face.verts.x+first_vertex, face.verts.y+first_vertex, face.verts.z+first_vertex);
+        face.texs = build_vec3ui(face.texs.x+first_texture, face.texs.y+first_texture, face.texs.z+first_texture);
+        face.norms = build_vec3ui(face.norms.x+first_normal, face.norms.y+first_normal, face.norms.z+first_normal);
+        face.cols = build_vec3ui(face.cols.x+first_color, face.cols.y+first_color, face.cols.z+first_color);
+        geom->faces[geom->num_faces+i] = face;
+    }
+    geom->num_vertices += other->num_vertices;
+    geom->num_faces += other->num_faces;
+    geom->num_textures += other->num_textures;
+    geom->num_normals += other->num_normals;
+    geom->num_colors += other->num_colors;
+    return SDL_TRUE;
+}
+
+void _geom_place_points(vec3* points, Uint32 count, float angle, vec3 axis, vec3 position) {
+    // Rotates the points about axis and then moves them by position, with one matrix for the
+    // whole batch.
+    mat4 transform = (vec3_is_zero(axis) || angle == 0.0f) ? identity_mat4() : rotation_matrix_axis(angle, axis);
+    transform.a.w = position.x;
+    transform.b.w = position.y;
+    transform.c.w = position.z;
+    mat4_transform_points(transform, points, count, points, sizeof(vec3));
+}
+
 SDL_bool geom_add_cone(EsGeometry* geom, vec3 root, vec3 axis, float base_radius, float height, SDL_bool close, Uint32 lod) {
-    Uint32 base_num_vertices = _geom_get_vertices_from_radius(base_radius, lod);
+    EsGeometryMark start = geom_get_mark(geom);
+    float error = geom_error_from_lod(lod) * SDL_max(2.0f*base_radius, height);
+    Uint32 base_num_vertices = _geom_get_vertices_from_radius(base_radius, error);
     Uint32 total_vertices = base_num_vertices + 1;
     if (close)
         total_vertices++;
@@ -285,15 +1403,12 @@ SDL_bool geom_add_cone(EsGeometry* geom, vec3 root, vec3 axis, float base_radius
     Uint32 first_face = geom->num_faces;
     geom->num_vertices += total_vertices;
     geom->num_faces += total_faces;
-    vec3* vertices = (vec3*) SDL_malloc(total_vertices * sizeof(vec3));
-    EsFace* faces = (EsFace*) SDL_malloc(total_faces * sizeof(EsFace));
+    vec3* vertices = &geom->vertices[first_vertex];
+    EsFace* faces = &geom->faces[first_face];
+    const vec2* ring = _geom_get_ring(base_num_vertices);
     vertices[0] = build_vec3(0.0f, height, 0.0f);
-    for (Uint32 i=1; i<base_num_vertices+1; i++) {
-        float angle = (i-1.0f) / (base_num_vertices*1.0f) * (2.0f* (float)M_PI);
-        float x = SDL_sinf(angle) * base_radius;
-        float y = SDL_cosf(angle) * base_radius;
-        vertices[i] = build_vec3(x, 0.0f, y);
-    }
+    for (Uint32 i=1; i<base_num_vertices+1; i++)
+        vertices[i] = build_vec3(ring[i-1].x * base_radius, 0.0f, ring[i-1].y * base_radius);
     if (close)
         vertices[base_num_vertices+1] = build_vec3(0.0f, 0.0f, 0.0f);
     // TODO (22 Nov 2020 sam): Align to root and axis
@@ -301,9 +1416,7 @@ SDL_bool geom_add_cone(EsGeometry* geom, vec3 root, vec3 axis, float base_radius
     axis = vec3_normalize(axis);
     vec3 perp_axis = vec3_cross(y_axis, axis);
     float angle = SDL_acosf(vec3_dot(y_axis, axis));
-    for (Uint32 i=0; i<total_vertices; i++) {
-        vertices[i] = vec3_add(root, rotate_about_origin_axis(vertices[i], angle, perp_axis));
-    }
+    _geom_place_points(vertices, total_vertices, angle, perp_axis, root);
     for (Uint32 i=0; i<base_num_vertices-1; i++) {
         faces[i].verts = build_vec3ui(first_vertex+i+1, first_vertex+0, first_vertex+i+2);
     }
@@ -315,17 +1428,45 @@ SDL_bool geom_add_cone(EsGeometry* geom, vec3 root, vec3 axis, float base_radius
         Uint32 last_face = (base_num_vertices*2) - 1;
         faces[last_face].verts = build_vec3ui(first_vertex+1, first_vertex+base_num_vertices+1, first_vertex+(base_num_vertices-1)+1);
     }
-    SDL_memcpy(&geom->vertices[first_vertex], vertices, sizeof(vec3)*total_vertices);
-    SDL_memcpy(&geom->faces[first_face], faces, sizeof(EsFace)*total_faces);
-    SDL_free(vertices);
-    SDL_free(faces);
-    return SDL_TRUE;
+    return _geom_emit_primitive(geom, &start);
+}
+
+Uint32 _geom_stitch_rings(EsFace* faces, Uint32 base_first, Uint32 base_count, Uint32 tip_first, Uint32 tip_count, Uint32 first_vertex, Uint32 first_texture, Uint32 first_normal, Uint32 first_color) {
+    // Joins two rings with base_count + tip_count faces, advancing along whichever ring is
+    // behind. Ring corners are offsets from first_vertex, first_normal and first_color, which
+    // all line up. Gives the number of faces.
+    Uint32 b = 0;
+    Uint32 t = 0;
+    Uint32 total_faces = base_count + tip_count;
+    for (Uint32 i=0; i<total_faces; i++) {
+        Uint32 base = base_first + (b % base_count);
+        Uint32 tip = tip_first + (t % tip_count);
+        Uint32 next;
+        if (t == tip_count || (b < base_count && (b+1)*tip_count <= (t+1)*base_count)) {
+            b++;
+            next = base_first + (b % base_count);
+        } else {
+            t++;
+            next = tip_first + (t % tip_count);
+        }
+        faces[i].verts = build_vec3ui(first_vertex+base, first_vertex+next, first_vertex+tip);
+        faces[i].texs = build_vec3ui(first_texture, first_texture, first_texture);
+        faces[i].norms = build_vec3ui(first_normal+base, first_normal+next, first_normal+tip);
+        faces[i].cols = build_vec3ui(first_color+base, first_color+next, first_color+tip);
+    }
+    return total_faces;
 }
 
 SDL_bool geom_add_cs_surface(EsGeometry* geom, float base_radius, vec3 base_pos, vec3 base_axis, float tip_radius, vec3 tip_pos, vec3 tip_axis, vec2 tex, Uint32 lod, float tree_height, float branch_offset_start, float branch_offset_end) {
-    Uint32 base_num_vertices = _geom_get_vertices_from_radius(base_radius, lod);
-    Uint32 total_vertices = base_num_vertices * 2;
-    Uint32 total_faces = base_num_vertices * 2;
+    // Each ring gets as many vertices as its own radius needs, so the same cross section always
+    // gets the same ring, and consecutive surfaces meet without cracks. When the rings have
+    // different counts, the faces between them advance along whichever ring is behind.
+    EsGeometryMark start = geom_get_mark(geom);
+    float error = geom_error_from_lod(lod) * tree_height;
+    Uint32 base_num_vertices = _geom_get_vertices_from_radius(base_radius, error);
+    Uint32 tip_num_vertices = _geom_get_vertices_from_radius(tip_radius, error);
+    Uint32 total_vertices = base_num_vertices + tip_num_vertices;
+    Uint32 total_faces = base_num_vertices + tip_num_vertices;
     Uint32 total_textures = 1;
     Uint32 total_normals = total_vertices;
     Uint32 total_colors = total_vertices;
@@ -375,79 +1516,145 @@ SDL_bool geom_add_cs_surface(EsGeometry* geom, float base_radius, vec3 base_pos,
     geom->num_textures += total_textures;
     geom->num_normals += total_normals;
     geom->num_colors += total_colors;
-    vec3* vertices = (vec3*) SDL_malloc(total_vertices * sizeof(vec3));
-    EsFace* faces = (EsFace*) SDL_malloc(total_faces * sizeof(EsFace));
-    vec2* textures = (vec2*) SDL_malloc(total_textures * sizeof(vec2));
-    vec3* normals = (vec3*) SDL_malloc(total_normals * sizeof(vec3));
-    vec3* colors = (vec3*) SDL_malloc(total_colors * sizeof(vec3));
-    if (vertices == NULL || faces == NULL || textures == NULL || normals == NULL || colors == NULL)
-        SDL_Log("\n\n\nCOULD NOT ALLOC MEMORY\n\n\n");
-    for (Uint32 i=0; i<base_num_vertices; i++) {
-        float angle = (i-1.0f) / (base_num_vertices*1.0f) * (2.0f* (float)M_PI);
-        float x = SDL_sinf(angle) * base_radius;
-        float y = SDL_cosf(angle) * base_radius;
-        vertices[i] = build_vec3(x, 0.0f, y);
-        x = SDL_sinf(angle) * tip_radius;
-        y = SDL_cosf(angle) * tip_radius;
-        vertices[base_num_vertices+i] = build_vec3(x, 0.0f, y);
-    }
+    vec3* vertices = &geom->vertices[first_vertex];
+    EsFace* faces = &geom->faces[first_face];
+    vec2* textures = &geom->textures[first_texture];
+    vec3* normals = &geom->normals[first_normal];
+    vec3* colors = &geom->colors[first_color];
+    const vec2* base_ring = _geom_get_ring(base_num_vertices);
+    const vec2* tip_ring = _geom_get_ring(tip_num_vertices);
     vec3 y_axis = build_vec3(0.0f, 1.0f, 0.0f);
     base_axis = vec3_normalize(base_axis);
     vec3 base_perp_axis = vec3_cross(y_axis, base_axis);
     float base_angle = SDL_acosf(vec3_dot(y_axis, base_axis));
-    for (Uint32 i=0; i<base_num_vertices; i++) {
-        vertices[i] = vec3_add(base_pos, rotate_about_origin_axis(vertices[i], base_angle, base_perp_axis));
-        normals[i] = vec3_normalize(vec3_sub(vertices[i], base_pos));
+    for (Uint32 i=0; i<base_num_vertices; i++)
+        vertices[i] = build_vec3(base_ring[i].x * base_radius, 0.0f, base_ring[i].y * base_radius);
+    _geom_place_points(vertices, base_num_vertices, base_angle, base_perp_axis, base_pos);
+    SDL_memcpy(normals, vertices, base_num_vertices * sizeof(vec3));
+    vec3_offset_array(normals, vec3_scale(base_pos, -1.0f), base_num_vertices);
+    for (Uint32 i=0; i<base_num_vertices; i++)
         colors[i] = build_vec3(vertices[i].y/tree_height, branch_offset_start, 0.0f);
-    }
     tip_axis = vec3_normalize(tip_axis);
     vec3 tip_perp_axis = vec3_cross(y_axis, tip_axis);
     float tip_angle = SDL_acosf(vec3_dot(y_axis, tip_axis));
-    for (Uint32 i=0; i<base_num_vertices; i++) {
-        vertices[i+base_num_vertices] = vec3_add(tip_pos, rotate_about_origin_axis(vertices[i+base_num_vertices], tip_angle, tip_perp_axis));
-        normals[i+base_num_vertices] = vec3_normalize(vec3_sub(vertices[i+base_num_vertices], tip_pos));
-        colors[i+base_num_vertices] = build_vec3(vertices[i+base_num_vertices].y/tree_height, branch_offset_end, 0.0f);
-    }
+    vec3* tip_vertices = &vertices[base_num_vertices];
+    for (Uint32 i=0; i<tip_num_vertices; i++)
+        tip_vertices[i] = build_vec3(tip_ring[i].x * tip_radius, 0.0f, tip_ring[i].y * tip_radius);
+    _geom_place_points(tip_vertices, tip_num_vertices, tip_angle, tip_perp_axis, tip_pos);
+    SDL_memcpy(&normals[base_num_vertices], tip_vertices, tip_num_vertices * sizeof(vec3));
+    vec3_offset_array(&normals[base_num_vertices], vec3_scale(tip_pos, -1.0f), tip_num_vertices);
+    vec3_normalize_array(normals, total_normals);
+    for (Uint32 i=0; i<tip_num_vertices; i++)
+        colors[base_num_vertices+i] = build_vec3(tip_vertices[i].y/tree_height, branch_offset_end, 0.0f);
     textures[0] = tex;
-    for (Uint32 i=0; i<base_num_vertices-1; i++) {
-        faces[2*i + 0].verts = build_vec3ui(first_vertex+i, first_vertex+i+1, first_vertex+base_num_vertices+i);
-        faces[2*i + 1].verts = build_vec3ui(first_vertex+i+1, first_vertex+base_num_vertices+i+1, first_vertex+base_num_vertices+i);
-        faces[2*i + 0].texs = build_vec3ui(first_texture, first_texture, first_texture);
-        faces[2*i + 1].texs = build_vec3ui(first_texture, first_texture, first_texture);
-        faces[2*i + 0].norms = build_vec3ui(first_normal+i, first_normal+i+1, first_normal+base_num_vertices+i);
-        faces[2*i + 1].norms = build_vec3ui(first_normal+i+1, first_normal+base_num_vertices+i+1, first_normal+base_num_vertices+i);
-        faces[2*i + 0].cols = build_vec3ui(first_color+i, first_color+i+1, first_color+base_num_vertices+i);
-        faces[2*i + 1].cols = build_vec3ui(first_color+i+1, first_color+base_num_vertices+i+1, first_color+base_num_vertices+i);
-    }
-    Uint32 last_index = 2*(base_num_vertices-1);
-    Uint32 last_vertex = base_num_vertices-1;
-    Uint32 last_normal = base_num_vertices-1;
-    Uint32 last_color = base_num_vertices-1;
-    faces[last_index + 0].verts = build_vec3ui(first_vertex+last_vertex, first_vertex+0, first_vertex+base_num_vertices+last_vertex);
-    faces[last_index + 1].verts = build_vec3ui(first_vertex+0, first_vertex+base_num_vertices+0, first_vertex+base_num_vertices+last_vertex);
-    faces[last_index + 0].texs = build_vec3ui(first_texture, first_texture, first_texture);
-    faces[last_index + 1].texs = build_vec3ui(first_texture, first_texture, first_texture);
-    faces[last_index + 0].norms = build_vec3ui(first_normal+last_normal, first_normal+0, first_normal+base_num_vertices+last_normal);
-    faces[last_index + 1].norms = build_vec3ui(first_normal+0, first_normal+base_num_vertices+0, first_normal+base_num_vertices+last_normal);
-    faces[last_index + 0].cols = build_vec3ui(first_color+last_color, first_color+0, first_color+base_num_vertices+last_color);
-    faces[last_index + 1].cols = build_vec3ui(first_color+0, first_color+base_num_vertices+0, first_color+base_num_vertices+last_color);
-    SDL_memcpy(&geom->vertices[first_vertex], vertices, sizeof(vec3)*total_vertices);
-    SDL_memcpy(&geom->faces[first_face], faces, sizeof(EsFace)*total_faces);
-    SDL_memcpy(&geom->textures[first_texture], textures, sizeof(vec2)*total_textures);
-    SDL_memcpy(&geom->normals[first_normal], normals, sizeof(vec3)*total_normals);
-    SDL_memcpy(&geom->colors[first_color], colors, sizeof(vec3)*total_colors);
-    SDL_free(vertices);
-    SDL_free(faces);
-    SDL_free(textures);
-    SDL_free(normals);
-    SDL_free(colors);
-    return SDL_TRUE;
+    _geom_stitch_rings(faces, 0, base_num_vertices, base_num_vertices, tip_num_vertices, first_vertex, first_texture, first_normal, first_color);
+    return _geom_emit_primitive(geom, &start);
+}
+
+SDL_bool geom_add_sweep(EsGeometry* geom, EsSweepSection* sections, Uint32 num_sections, vec3* frame, vec2 tex, Uint32 lod, float tree_height) {
+    // Sweeps a ring along the sections, with one ring for each section that the surfaces on
+    // either side of it share. The rings are sized like in geom_add_cs_surface. Their frame is
+    // carried from one section to the next by the smallest rotation between their axes, so
+    // the surface doesn't twist along the chain. frame is the direction of the first vertex of
+    // the first ring, or zero to start it the way the other primitives orient their rings, and
+    // comes back as that of the last ring, so that a chain can be swept in parts.
+    if (num_sections < 2)
+        return SDL_TRUE;
+    EsGeometryMark start = geom_get_mark(geom);
+    float error = geom_error_from_lod(lod) * tree_height;
+    Uint32 total_vertices = 0;
+    Uint32 total_faces = 0;
+    for (Uint32 i=0; i<num_sections; i++) {
+        Uint32 num_vertices = _geom_get_vertices_from_radius(sections[i].radius, error);
+        total_vertices += num_vertices;
+        if (i > 0)
+            total_faces += num_vertices + _geom_get_vertices_from_radius(sections[i-1].radius, error);
+    }
+    Uint32 total_textures = 1;
+    Uint32 total_normals = total_vertices;
+    Uint32 total_colors = total_vertices;
+    if (_geom_remaining_vertices(geom) < total_vertices && !geom_add_vertices_memory(geom, total_vertices)) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Add sweep : Could not alloc vertices\n");
+        return SDL_FALSE;
+    }
+    if (_geom_remaining_faces(geom) < total_faces && !geom_add_faces_memory(geom, total_faces)) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Add sweep : Could not alloc faces\n");
+        return SDL_FALSE;
+    }
+    if (_geom_remaining_textures(geom) < total_textures && !geom_add_textures_memory(geom, total_textures)) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Add sweep : Could not alloc textures\n");
+        return SDL_FALSE;
+    }
+    if (_geom_remaining_normals(geom) < total_normals && !geom_add_normals_memory(geom, total_normals)) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Add sweep : Could not alloc normals\n");
+        return SDL_FALSE;
+    }
+    if (_geom_remaining_colors(geom) < total_colors && !geom_add_colors_memory(geom, total_colors)) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Add sweep : Could not alloc colors\n");
+        return SDL_FALSE;
+    }
+    Uint32 first_vertex = geom->num_vertices;
+    Uint32 first_face = geom->num_faces;
+    Uint32 first_texture = geom->num_textures;
+    Uint32 first_normal = geom->num_normals;
+    Uint32 first_color = geom->num_colors;
+    geom->num_vertices += total_vertices;
+    geom->num_faces += total_faces;
+    geom->num_textures += total_textures;
+    geom->num_normals += total_normals;
+    geom->num_colors += total_colors;
+    vec3* vertices = &geom->vertices[first_vertex];
+    EsFace* faces = &geom->faces[first_face];
+    vec3* normals = &geom->normals[first_normal];
+    vec3* colors = &geom->colors[first_color];
+    geom->textures[first_texture] = tex;
+
+    vec3 y_axis = build_vec3(0.0f, 1.0f, 0.0f);
+    vec3 axis = vec3_normalize(sections[0].axis);
+    vec3 u;
+    if (vec3_is_zero(*frame)) {
+        vec3 perp_axis = vec3_cross(y_axis, axis);
+        u = rotate_about_origin_axis(build_vec3(1.0f, 0.0f, 0.0f), SDL_acosf(vec3_dot(y_axis, axis)), perp_axis);
+    } else {
+        u = *frame;
+    }
+    Uint32 ring_first = 0;
+    Uint32 prev_first = 0;
+    Uint32 prev_count = 0;
+    for (Uint32 i=0; i<num_sections; i++) {
+        EsSweepSection section = sections[i];
+        if (i > 0) {
+            vec3 next_axis = vec3_normalize(section.axis);
+            float cos_angle = SDL_max(-1.0f, SDL_min(1.0f, vec3_dot(axis, next_axis)));
+            u = rotate_about_origin_axis(u, SDL_acosf(cos_angle), vec3_cross(axis, next_axis));
+            axis = next_axis;
+        }
+        // Keep the frame square to the axis, so that rounding doesn't build up along the chain.
+        u = vec3_normalize(vec3_sub(u, vec3_scale(axis, vec3_dot(u, axis))));
+        vec3 w = vec3_cross(u, axis);
+        Uint32 count = _geom_get_vertices_from_radius(section.radius, error);
+        const vec2* ring = _geom_get_ring(count);
+        for (Uint32 j=0; j<count; j++) {
+            vec3 direction = vec3_add(vec3_scale(u, ring[j].x), vec3_scale(w, ring[j].y));
+            vertices[ring_first+j] = vec3_add(section.position, vec3_scale(direction, section.radius));
+            normals[ring_first+j] = direction;
+            colors[ring_first+j] = build_vec3(vertices[ring_first+j].y/tree_height, section.offset, 0.0f);
+        }
+        if (i > 0)
+            faces += _geom_stitch_rings(faces, prev_first, prev_count, ring_first, count, first_vertex, first_texture, first_normal, first_color);
+        prev_first = ring_first;
+        prev_count = count;
+        ring_first += count;
+    }
+    *frame = u;
+    return _geom_emit_primitive(geom, &start);
 }
 
 SDL_bool geom_add_oval(EsGeometry* geom, vec3 position, vec3 axis, vec3 normal, float length, float width, vec2 tex, Uint32 lod) {
-    lod += 1;
+    EsGeometryMark start = geom_get_mark(geom);
     axis;
-    Uint32 base_num_vertices = _geom_get_vertices_from_radius(width, lod);
+    float radius = SDL_max(width, length);
+    Uint32 base_num_vertices = _geom_get_vertices_from_radius(radius, geom_error_from_lod(lod) * 2.0f*radius);
     Uint32 total_vertices = base_num_vertices + 1;
     Uint32 total_faces = base_num_vertices;
     Uint32 total_textures = 1;
@@ -489,26 +1696,19 @@ SDL_bool geom_add_oval(EsGeometry* geom, vec3 position, vec3 axis, vec3 normal,
     geom->num_faces += total_faces;
     geom->num_textures += total_textures;
     geom->num_normals += total_normals;
-    vec3* vertices = (vec3*) SDL_malloc(total_vertices * sizeof(vec3));
-    EsFace* faces = (EsFace*) SDL_malloc(total_faces * sizeof(EsFace));
-    vec2* textures = (vec2*) SDL_malloc(total_textures * sizeof(vec2));
-    vec3* normals = (vec3*) SDL_malloc(total_normals * sizeof(vec3));
-    if (vertices == NULL || faces == NULL || textures == NULL || normals == NULL)
-        SDL_Log("\n\n\nCOULD NOT ALLOC MEMORY\n\n\n");
-    for (Uint32 i=0; i<base_num_vertices; i++) {
-        float angle = (i*1.0f) / (base_num_vertices*1.0f) * (2.0f* (float)M_PI);
-        float x = SDL_sinf(angle) * width;
-        float y = SDL_cosf(angle) * length;
-        vertices[i] = build_vec3(x, 0.0f, y);
-    }
+    vec3* vertices = &geom->vertices[first_vertex];
+    EsFace* faces = &geom->faces[first_face];
+    vec2* textures = &geom->textures[first_texture];
+    vec3* normals = &geom->normals[first_normal];
+    const vec2* ring = _geom_get_ring(base_num_vertices);
+    for (Uint32 i=0; i<base_num_vertices; i++)
+        vertices[i] = build_vec3(ring[i].x * width, 0.0f, ring[i].y * length);
     vertices[base_num_vertices] = build_vec3(0.0f, 0.0f, 0.0f);
     vec3 y_axis = build_vec3(0.0f, 1.0f, 0.0f);
     normal = vec3_normalize(normal);
     vec3 perp_axis = vec3_cross(y_axis, normal);
     float angle = SDL_acosf(vec3_dot(y_axis, normal));
-    for (Uint32 i=0; i<total_vertices; i++) {
-        vertices[i] = vec3_add(position, rotate_about_origin_axis(vertices[i], angle, perp_axis));
-    }
+    _geom_place_points(vertices, total_vertices, angle, perp_axis, position);
     // TODO (26 Nov 2020 sam): align with axis as well.
     textures[0] = tex;
     normals[0] = perp_axis;
@@ -520,18 +1720,11 @@ SDL_bool geom_add_oval(EsGeometry* geom, vec3 position, vec3 axis, vec3 normal,
     faces[base_num_vertices-1].verts = build_vec3ui(first_vertex+base_num_vertices-1, first_vertex, first_vertex+base_num_vertices);
     faces[base_num_vertices-1].texs = build_vec3ui(first_texture, first_texture, first_texture);
     faces[base_num_vertices-1].norms = build_vec3ui(first_normal, first_normal, first_normal);
-    SDL_memcpy(&geom->vertices[first_vertex], vertices, sizeof(vec3)*total_vertices);
-    SDL_memcpy(&geom->faces[first_face], faces, sizeof(EsFace)*total_faces);
-    SDL_memcpy(&geom->textures[first_texture], textures, sizeof(vec2)*total_textures);
-    SDL_memcpy(&geom->normals[first_normal], normals, sizeof(vec3)*total_normals);
-    SDL_free(vertices);
-    SDL_free(faces);
-    SDL_free(textures);
-    SDL_free(normals);
-    return SDL_TRUE;
+    return _geom_emit_primitive(geom, &start);
 }
 
 SDL_bool geom_add_triple_quad_mesh(EsGeometry* geom, vec3 position, vec3 axis, float height, float width, vec2 tex1, vec2 tex2, Uint32 lod, float tree_height, float branch_length, vec3 branch_root_pos) {
+    EsGeometryMark start = geom_get_mark(geom);
     lod += 1;
     Uint32 total_vertices = 12;
     Uint32 total_faces = 6;  // TODO (04 Dec 2020 sam): Figure out whether we need to make this double faced
@@ -584,25 +1777,25 @@ SDL_bool geom_add_triple_quad_mesh(EsGeometry* geom, vec3 position, vec3 axis, f
     geom->num_textures += total_textures;
     geom->num_normals += total_normals;
     geom->num_colors += total_colors;
-    vec3* vertices = (vec3*) SDL_malloc(total_vertices * sizeof(vec3));
-    EsFace* faces = (EsFace*) SDL_malloc(total_faces * sizeof(EsFace));
-    vec2* textures = (vec2*) SDL_malloc(total_textures * sizeof(vec2));
-    vec3* normals = (vec3*) SDL_malloc(total_normals * sizeof(vec3));
-    vec3* colors = (vec3*) SDL_malloc(total_colors * sizeof(vec3));
-    if (vertices == NULL || faces == NULL || textures == NULL || normals == NULL || colors == NULL)
-        SDL_Log("\n\n\nCOULD NOT ALLOC MEMORY\n\n\n");
+    vec3* vertices = &geom->vertices[first_vertex];
+    EsFace* faces = &geom->faces[first_face];
+    vec2* textures = &geom->textures[first_texture];
+    vec3* normals = &geom->normals[first_normal];
+    vec3* colors = &geom->colors[first_color];
+    // The corners are a hexagon turned about the y axis, at the bottom and at the top.
+    const vec2* ring = _geom_get_ring(6);
     for (Uint32 i=0; i<6; i++) {
-        vertices[i] = rotate_about_origin_yaxis(build_vec3(width/2.0f, 0.0f, 0.0f), i/6.0f * 2.0f * (float) M_PI);
+        vertices[i] = build_vec3(ring[i].y * width/2.0f, 0.0f, -ring[i].x * width/2.0f);
         colors[i].z = 0.0f;
-        vertices[i+6] = rotate_about_origin_yaxis(build_vec3(width/2.0f, height, 0.0f), i/6.0f * 2.0f * (float) M_PI);
+        vertices[i+6] = build_vec3(ring[i].y * width/2.0f, height, -ring[i].x * width/2.0f);
         colors[i+6].z = 1.0f;
     }
     vec3 y_axis = build_vec3(0.0f, 1.0f, 0.0f);
     axis = vec3_normalize(axis);
     vec3 perp_axis = vec3_cross(y_axis, axis);
     float angle = SDL_acosf(vec3_dot(y_axis, axis));
+    _geom_place_points(vertices, total_vertices, angle, perp_axis, position);
     for (Uint32 i=0; i<total_vertices; i++) {
-        vertices[i] = vec3_add(position, rotate_about_origin_axis(vertices[i], angle, perp_axis));
         colors[i].x = vertices[i].y / tree_height;
         colors[i].y = vec3_distance(vertices[i], branch_root_pos) / branch_length;
     }
@@ -612,11 +1805,13 @@ SDL_bool geom_add_triple_quad_mesh(EsGeometry* geom, vec3 position, vec3 axis, f
     textures[3] = build_vec2(tex2.x, tex1.y);
     // TODO (04 Dec 2020 sam): Use proper normals here.
     normals[0] = vec3_normalize(axis);
-    vec4ui* quads = (vec4ui*) SDL_malloc(3 * sizeof(vec4ui));
+    normals[1] = normals[0];
+    normals[2] = normals[0];
+    vec4ui quads[3];
     quads[0] = build_vec4ui(first_vertex+0, first_vertex+3, first_vertex+9, first_vertex+6);
     quads[1] = build_vec4ui(first_vertex+1, first_vertex+4, first_vertex+10, first_vertex+7);
     quads[2] = build_vec4ui(first_vertex+2, first_vertex+5, first_vertex+11, first_vertex+8);
-    vec4ui* cquads = (vec4ui*) SDL_malloc(3 * sizeof(vec4ui));
+    vec4ui cquads[3];
     cquads[0] = build_vec4ui(first_color+0, first_color+3, first_color+9, first_color+6);
     cquads[1] = build_vec4ui(first_color+1, first_color+4, first_color+10, first_color+7);
     cquads[2] = build_vec4ui(first_color+2, first_color+5, first_color+11, first_color+8);
@@ -631,19 +1826,7 @@ SDL_bool geom_add_triple_quad_mesh(EsGeometry* geom, vec3 position, vec3 axis, f
     for (Uint32 i=0; i<total_faces; i++) {
         faces[i].norms = build_vec3ui(first_normal, first_normal, first_normal);
     }
-    SDL_memcpy(&geom->vertices[first_vertex], vertices, sizeof(vec3)*total_vertices);
-    SDL_memcpy(&geom->faces[first_face], faces, sizeof(EsFace)*total_faces);
-    SDL_memcpy(&geom->textures[first_texture], textures, sizeof(vec2)*total_textures);
-    SDL_memcpy(&geom->normals[first_normal], normals, sizeof(vec3)*total_normals);
-    SDL_memcpy(&geom->colors[first_color], colors, sizeof(vec3)*total_colors);
-    SDL_free(vertices);
-    SDL_free(faces);
-    SDL_free(textures);
-    SDL_free(normals);
-    SDL_free(colors);
-    SDL_free(quads);
-    SDL_free(cquads);
-    return SDL_TRUE;
+    return _geom_emit_primitive(geom, &start);
 }
 
 SDL_bool geom_add_cone_origin_zaxis(EsGeometry* geom, float base_radius, float height, SDL_bool close, Uint32 lod) {
@@ -652,45 +1835,822 @@ SDL_bool geom_add_cone_origin_zaxis(EsGeometry* geom, float base_radius, float h
     return geom_add_cone(geom, ORIGIN, ZAXIS, base_radius, height, close, lod);
 }
 
-SDL_bool geom_save_obj(EsGeometry* geom, const char* filename) {
-    SDL_RWops* obj_file;
-    geom_simplify_geometry(geom);
-    char* buffer = (char*) SDL_malloc(256 * sizeof(char));
-    obj_file = SDL_RWFromFile(filename, "w");
-    char* header = "o es_geom\n";
-    SDL_RWwrite(obj_file, header, 1, SDL_strlen(header));
-    for (Uint32 i=0; i<geom->num_vertices; i++) {
-        vec3 vert = geom->vertices[i];
-        SDL_snprintf(buffer, 256, "v %f %f %f\n", vert.x, vert.y, vert.z);
-        SDL_RWwrite(obj_file, buffer, 1, SDL_strlen(buffer));
-    }
-    if (geom->num_textures == 0) {
-        SDL_snprintf(buffer, 256, "vt 0.0 0.0\n");
-        SDL_RWwrite(obj_file, buffer, 1, SDL_strlen(buffer));
+// OBJ files are formatted in chunks of lines, one chunk per job, and a batch of chunks is
+// written in order before the next batch is formatted. No line is longer than
+// GEOM_OBJ_MAX_LINE, so each chunk gets a buffer that is big enough for its worst case.
+#define GEOM_OBJ_CHUNK_LINES 16384
+#define GEOM_OBJ_MAX_LINE 256
+#define GEOM_OBJ_CHUNKS_PER_WORKER 2
+
+typedef enum {
+    GEOM_OBJ_VERTICES,
+    GEOM_OBJ_TEXTURES,
+    GEOM_OBJ_NORMALS,
+    GEOM_OBJ_FACES,
+} _EsObjSection;
+
+typedef struct {
+    EsGeometry* geom;
+    _EsObjSection section;
+    Uint32 num_lines;
+    Uint32 first_chunk;
+    char* buffers;
+    size_t* lengths;
+} _EsObjJob;
+
+char* _geom_write_uint(char* out, Uint64 value) {
+    char digits[20];
+    Uint32 num_digits = 0;
+    do {
+        digits[num_digits++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (num_digits)
+        *out++ = digits[--num_digits];
+    return out;
+}
+
+char* _geom_write_float(char* out, float value) {
+    // The same text as %f. A float times 1e6 fits exactly in a double, so rounding it to the
+    // nearest, ties to even, gives the six decimals that printf would.
+    double magnitude = SDL_fabs((double) value);
+    if (!(magnitude < 1e12)) {
+        char buffer[GEOM_OBJ_MAX_LINE];
+        int length = SDL_snprintf(buffer, GEOM_OBJ_MAX_LINE, "%f", value);
+        SDL_memcpy(out, buffer, length);
+        return out + length;
     }
-    for (Uint32 i=0; i<geom->num_textures; i++) {
+    union { float f; Uint32 u; } bits;
+    bits.f = value;
+    if (bits.u >> 31)
+        *out++ = '-';
+    double scaled = magnitude * 1e6;
+    double whole = SDL_floor(scaled);
+    Uint64 fixed = (Uint64) whole;
+    if (scaled - whole > 0.5 || (scaled - whole == 0.5 && (fixed & 1)))
+        fixed++;
+    out = _geom_write_uint(out, fixed / 1000000);
+    *out++ = '.';
+    Uint32 fraction = (Uint32) (fixed % 1000000);
+    for (Uint32 divisor=100000; divisor>0; divisor/=10)
+        *out++ = (char) ('0' + (fraction / divisor) % 10);
+    return out;
+}
+
+char* _geom_write_obj_line(char* out, EsGeometry* geom, _EsObjSection section, Uint32 i) {
+    // Face indices are written for every corner, even ones without textures or normals, which
+    // point at the default ones.
+    if (section == GEOM_OBJ_VERTICES || section == GEOM_OBJ_NORMALS) {
+        vec3 v = section == GEOM_OBJ_VERTICES ? geom->vertices[i] : geom->normals[i];
+        *out++ = 'v';
+        if (section == GEOM_OBJ_NORMALS)
+            *out++ = 'n';
+        *out++ = ' ';
+        out = _geom_write_float(out, v.x);
+        *out++ = ' ';
+        out = _geom_write_float(out, v.y);
+        *out++ = ' ';
+        out = _geom_write_float(out, v.z);
+    } else if (section == GEOM_OBJ_TEXTURES) {
         vec2 tex = geom->textures[i];
-        SDL_snprintf(buffer, 256, "vt %f %f\n", tex.x, tex.y);
-        SDL_RWwrite(obj_file, buffer, 1, SDL_strlen(buffer));
+        *out++ = 'v';
+        *out++ = 't';
+        *out++ = ' ';
+        out = _geom_write_float(out, tex.x);
+        *out++ = ' ';
+        out = _geom_write_float(out, tex.y);
+    } else {
+        EsFace face = geom->faces[i];
+        *out++ = 'f';
+        for (Uint32 corner=0; corner<3; corner++) {
+            *out++ = ' ';
+            out = _geom_write_uint(out, (Uint64) _geom_corner(face.verts, corner) + 1);
+            *out++ = '/';
+            out = _geom_write_uint(out, (Uint64) _geom_corner(face.texs, corner) + 1);
+            *out++ = '/';
+            out = _geom_write_uint(out, (Uint64) _geom_corner(face.norms, corner) + 1);
+        }
     }
-    if (geom->num_normals == 0) {
-        SDL_snprintf(buffer, 256, "vn 0.0 0.0 1.0\n");
-        SDL_RWwrite(obj_file, buffer, 1, SDL_strlen(buffer));
+    *out++ = '\n';
+    return out;
+}
+
+void _geom_obj_chunk_job(void* data, Uint32 index, Uint32 worker) {
+    worker;
+    _EsObjJob* job = (_EsObjJob*) data;
+    char* start = &job->buffers[(size_t) index * GEOM_OBJ_CHUNK_LINES * GEOM_OBJ_MAX_LINE];
+    char* out = start;
+    Uint32 first = (job->first_chunk + index) * GEOM_OBJ_CHUNK_LINES;
+    Uint32 last = SDL_min(first + GEOM_OBJ_CHUNK_LINES, job->num_lines);
+    for (Uint32 i=first; i<last; i++)
+        out = _geom_write_obj_line(out, job->geom, job->section, i);
+    job->lengths[index] = (size_t) (out - start);
+}
+
+SDL_bool _geom_write_obj_section(SDL_RWops* obj_file, _EsObjJob* job, Uint32 batch_chunks) {
+    Uint32 num_chunks = (job->num_lines + GEOM_OBJ_CHUNK_LINES-1) / GEOM_OBJ_CHUNK_LINES;
+    for (job->first_chunk=0; job->first_chunk<num_chunks; job->first_chunk+=batch_chunks) {
+        Uint32 count = SDL_min(batch_chunks, num_chunks - job->first_chunk);
+        if (!warehouse_parallel_for(count, _geom_obj_chunk_job, job))
+            return SDL_FALSE;
+        for (Uint32 i=0; i<count; i++) {
+            char* buffer = &job->buffers[(size_t) i * GEOM_OBJ_CHUNK_LINES * GEOM_OBJ_MAX_LINE];
+            if (SDL_RWwrite(obj_file, buffer, 1, job->lengths[i]) != job->lengths[i])
+                return SDL_FALSE;
+        }
     }
-    for (Uint32 i=0; i<geom->num_normals; i++) {
-        vec3 norm = geom->normals[i];
-        SDL_snprintf(buffer, 256, "vn %f %f %f\n", norm.x, norm.y, norm.z);
-        SDL_RWwrite(obj_file, buffer, 1, SDL_strlen(buffer));
+    return SDL_TRUE;
+}
+
+SDL_bool geom_export_obj(EsGeometry* geom, const char* filename, SDL_bool simplify) {
+    // Without simplify, the geometry is written as it is, duplicates and all.
+    if (simplify && !geom_simplify_geometry(geom))
+        return SDL_FALSE;
+    Uint32 batch_chunks = warehouse_num_workers() * GEOM_OBJ_CHUNKS_PER_WORKER;
+    Uint32 max_lines = SDL_max(SDL_max(geom->num_vertices, geom->num_textures), SDL_max(geom->num_normals, geom->num_faces));
+    batch_chunks = SDL_max(1, SDL_min(batch_chunks, (max_lines + GEOM_OBJ_CHUNK_LINES-1) / GEOM_OBJ_CHUNK_LINES));
+    _EsObjJob job;
+    job.geom = geom;
+    job.buffers = (char*) SDL_malloc((size_t) batch_chunks * GEOM_OBJ_CHUNK_LINES * GEOM_OBJ_MAX_LINE);
+    job.lengths = (size_t*) SDL_malloc(batch_chunks * sizeof(size_t));
+    if (job.buffers == NULL || job.lengths == NULL) {
+        SDL_free(job.buffers);
+        SDL_free(job.lengths);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to export obj\n");
+        return SDL_FALSE;
     }
-    for (Uint32 i=0; i<geom->num_faces; i++) {
-        EsFace face = geom->faces[i];
-        SDL_snprintf(buffer, 256, "f %i/%i/%i %i/%i/%i %i/%i/%i\n",
-                face.verts.x+1, face.texs.x+1, face.norms.x+1,
-                face.verts.y+1, face.texs.y+1, face.norms.y+1,
-                face.verts.z+1, face.texs.z+1, face.norms.z+1);
-        SDL_RWwrite(obj_file, buffer, 1, SDL_strlen(buffer));
+    SDL_RWops* obj_file = SDL_RWFromFile(filename, "wb");
+    if (obj_file == NULL) {
+        SDL_free(job.buffers);
+        SDL_free(job.lengths);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not open %s to export obj\n", filename);
+        return SDL_FALSE;
     }
+    const char* header = "o es_geom\n";
+    const char* default_texture = "vt 0.0 0.0\n";
+    const char* default_normal = "vn 0.0 0.0 1.0\n";
+    SDL_bool result = SDL_RWwrite(obj_file, header, 1, SDL_strlen(header)) == SDL_strlen(header);
+    job.section = GEOM_OBJ_VERTICES;
+    job.num_lines = geom->num_vertices;
+    result = result && _geom_write_obj_section(obj_file, &job, batch_chunks);
+    if (geom->num_textures == 0)
+        result = result && SDL_RWwrite(obj_file, default_texture, 1, SDL_strlen(default_texture)) == SDL_strlen(default_texture);
+    job.section = GEOM_OBJ_TEXTURES;
+    job.num_lines = geom->num_textures;
+    result = result && _geom_write_obj_section(obj_file, &job, batch_chunks);
+    if (geom->num_normals == 0)
+        result = result && SDL_RWwrite(obj_file, default_normal, 1, SDL_strlen(default_normal)) == SDL_strlen(default_normal);
+    job.section = GEOM_OBJ_NORMALS;
+    job.num_lines = geom->num_normals;
+    result = result && _geom_write_obj_section(obj_file, &job, batch_chunks);
+    job.section = GEOM_OBJ_FACES;
+    job.num_lines = geom->num_faces;
+    result = result && _geom_write_obj_section(obj_file, &job, batch_chunks);
     SDL_RWclose(obj_file);
-    SDL_free(buffer);
+    SDL_free(job.buffers);
+    SDL_free(job.lengths);
+    if (!result)
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not write obj to %s\n", filename);
+    return result;
+}
+
+SDL_bool geom_save_obj(EsGeometry* geom, const char* filename) {
+    return geom_export_obj(geom, filename, SDL_TRUE);
+}
+
+Uint64 _geom_mesh_file_align(Uint64 offset) {
+    return (offset + GEOM_MESH_FILE_ALIGNMENT-1) & ~((Uint64) GEOM_MESH_FILE_ALIGNMENT-1);
+}
+
+size_t _geom_mesh_section_element_size(Uint32 type) {
+    // Zero for types that this version doesn't know about.
+    switch (type) {
+        case GEOM_SECTION_MESH_VERTICES: return sizeof(EsVertex);
+        case GEOM_SECTION_MESH_INDICES: return sizeof(Uint32);
+        case GEOM_SECTION_FACE_RANGES: return sizeof(Uint32);
+        case GEOM_SECTION_POSITIONS: return sizeof(vec3);
+        case GEOM_SECTION_FACES: return sizeof(EsFace);
+        case GEOM_SECTION_TEXTURES: return sizeof(vec2);
+        case GEOM_SECTION_NORMALS: return sizeof(vec3);
+        case GEOM_SECTION_COLORS: return sizeof(vec3);
+    }
+    return 0;
+}
+
+SDL_bool _geom_write_padded(SDL_RWops* rw, const void* data, Uint64 size) {
+    // Writes data, and then zeros up to the next multiple of the alignment.
+    static const Uint8 zeros[GEOM_MESH_FILE_ALIGNMENT] = { 0 };
+    if (size > 0 && SDL_RWwrite(rw, data, 1, (size_t) size) != (size_t) size)
+        return SDL_FALSE;
+    size_t padding = (size_t) (_geom_mesh_file_align(size) - size);
+    if (padding > 0 && SDL_RWwrite(rw, zeros, 1, padding) != padding)
+        return SDL_FALSE;
+    return SDL_TRUE;
+}
+
+SDL_bool _geom_write_mesh_file(const char* filename, Uint64 key, EsMeshSection* sections, const void** data, Uint32 num_sections) {
+    // Only type, count and element_size of the sections have to be filled in.
+    EsMeshFileHeader header;
+    SDL_memset(&header, 0, sizeof(EsMeshFileHeader));
+    header.magic = GEOM_MESH_FILE_MAGIC;
+    header.version = GEOM_MESH_FILE_VERSION;
+    header.header_size = sizeof(EsMeshFileHeader);
+    header.num_sections = num_sections;
+    header.key = key;
+    Uint64 offset = _geom_mesh_file_align(sizeof(EsMeshFileHeader));
+    for (Uint32 i=0; i<num_sections; i++) {
+        EsMeshSection* section = &header.sections[i];
+        *section = sections[i];
+        section->padding = 0;
+        section->size = (Uint64) section->count * section->element_size;
+        section->offset = offset;
+        offset = _geom_mesh_file_align(offset + section->size);
+    }
+    header.file_size = offset;
+    SDL_RWops* rw = SDL_RWFromFile(filename, "wb");
+    if (rw == NULL) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not open %s to write mesh\n", filename);
+        return SDL_FALSE;
+    }
+    SDL_bool result = _geom_write_padded(rw, &header, sizeof(EsMeshFileHeader));
+    for (Uint32 i=0; i<num_sections && result; i++)
+        result = _geom_write_padded(rw, data[i], header.sections[i].size);
+    SDL_RWclose(rw);
+    if (!result)
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not write mesh to %s\n", filename);
+    return result;
+}
+
+SDL_bool geom_save_indexed_mesh(EsIndexedMesh* mesh, Uint32* face_ranges, Uint32 num_face_ranges, Uint64 key, const char* filename) {
+    // face_ranges can be NULL.
+    EsMeshSection sections[3];
+    const void* data[3];
+    SDL_memset(sections, 0, sizeof(sections));
+    sections[0].type = GEOM_SECTION_MESH_VERTICES;
+    sections[0].count = mesh->num_vertices;
+    sections[0].element_size = sizeof(EsVertex);
+    data[0] = mesh->vertices;
+    sections[1].type = GEOM_SECTION_MESH_INDICES;
+    sections[1].count = mesh->num_indices;
+    sections[1].element_size = sizeof(Uint32);
+    data[1] = mesh->indices;
+    sections[2].type = GEOM_SECTION_FACE_RANGES;
+    sections[2].count = face_ranges ? num_face_ranges : 0;
+    sections[2].element_size = sizeof(Uint32);
+    data[2] = face_ranges;
+    return _geom_write_mesh_file(filename, key, sections, data, 3);
+}
+
+SDL_bool geom_save_geometry(EsGeometry* geom, Uint64 key, const char* filename) {
+    EsMeshSection sections[5];
+    const void* data[5];
+    SDL_memset(sections, 0, sizeof(sections));
+    sections[0].type = GEOM_SECTION_POSITIONS;
+    sections[0].count = geom->num_vertices;
+    data[0] = geom->vertices;
+    sections[1].type = GEOM_SECTION_FACES;
+    sections[1].count = geom->num_faces;
+    data[1] = geom->faces;
+    sections[2].type = GEOM_SECTION_TEXTURES;
+    sections[2].count = geom->num_textures;
+    data[2] = geom->textures;
+    sections[3].type = GEOM_SECTION_NORMALS;
+    sections[3].count = geom->num_normals;
+    data[3] = geom->normals;
+    sections[4].type = GEOM_SECTION_COLORS;
+    sections[4].count = geom->num_colors;
+    data[4] = geom->colors;
+    for (Uint32 i=0; i<5; i++)
+        sections[i].element_size = (Uint32) _geom_mesh_section_element_size(sections[i].type);
+    return _geom_write_mesh_file(filename, key, sections, data, 5);
+}
+
+SDL_bool _geom_check_mesh_file(EsMeshFile* file, const char* filename) {
+    EsMeshFileHeader* header = (EsMeshFileHeader*) file->data;
+    if (file->size < sizeof(EsMeshFileHeader) || header->magic != GEOM_MESH_FILE_MAGIC) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "%s is not a mesh file\n", filename);
+        return SDL_FALSE;
+    }
+    if (header->version != GEOM_MESH_FILE_VERSION || header->header_size != sizeof(EsMeshFileHeader)) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "%s is mesh file version %i, expected %i\n", filename, header->version, GEOM_MESH_FILE_VERSION);
+        return SDL_FALSE;
+    }
+    if (header->file_size != file->size || header->num_sections > GEOM_MESH_FILE_MAX_SECTIONS) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "%s is truncated or corrupt\n", filename);
+        return SDL_FALSE;
+    }
+    for (Uint32 i=0; i<header->num_sections; i++) {
+        EsMeshSection* section = &header->sections[i];
+        size_t element_size = _geom_mesh_section_element_size(section->type);
+        SDL_bool valid = section->offset % GEOM_MESH_FILE_ALIGNMENT == 0;
+        valid = valid && section->offset >= sizeof(EsMeshFileHeader);
+        valid = valid && section->size == (Uint64) section->count * section->element_size;
+        valid = valid && section->offset <= file->size && section->size <= file->size - section->offset;
+        valid = valid && (element_size == 0 || element_size == section->element_size);
+        if (!valid) {
+            SDL_LogError(SDL_LOG_CATEGORY_ERROR, "%s has a bad section %i\n", filename, i);
+            return SDL_FALSE;
+        }
+    }
+    file->header = header;
+    return SDL_TRUE;
+}
+
+SDL_bool _geom_map_file(const char* filename, void** data, Uint64* size, SDL_bool* mapped) {
+    // The whole file, mapped where there is mmap and read otherwise, and read only either way.
+    // A missing file isn't logged, since callers use this to look for cached meshes.
+    *data = NULL;
+    *size = 0;
+    *mapped = SDL_FALSE;
+#ifdef GEOM_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return SDL_FALSE;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0) {
+        close(fd);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not get the size of %s\n", filename);
+        return SDL_FALSE;
+    }
+    void* mapping = mmap(NULL, (size_t) file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not map %s\n", filename);
+        return SDL_FALSE;
+    }
+    *data = mapping;
+    *size = (Uint64) file_stat.st_size;
+    *mapped = SDL_TRUE;
+#else
+    SDL_RWops* rw = SDL_RWFromFile(filename, "rb");
+    if (rw == NULL)
+        return SDL_FALSE;
+    Sint64 file_size = SDL_RWsize(rw);
+    if (file_size <= 0) {
+        SDL_RWclose(rw);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not get the size of %s\n", filename);
+        return SDL_FALSE;
+    }
+    void* buffer = SDL_malloc((size_t) file_size);
+    if (buffer == NULL || SDL_RWread(rw, buffer, 1, (size_t) file_size) != (size_t) file_size) {
+        SDL_RWclose(rw);
+        SDL_free(buffer);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not read %s\n", filename);
+        return SDL_FALSE;
+    }
+    SDL_RWclose(rw);
+    *data = buffer;
+    *size = (Uint64) file_size;
+#endif
+    return SDL_TRUE;
+}
+
+void _geom_unmap_file(void* data, Uint64 size, SDL_bool mapped) {
+#ifdef GEOM_MMAP
+    if (mapped) {
+        munmap(data, (size_t) size);
+        return;
+    }
+#endif
+    size;
+    mapped;
+    SDL_free(data);
+}
+
+SDL_bool geom_open_mesh_file(const char* filename, EsMeshFile* file) {
+    SDL_memset(file, 0, sizeof(EsMeshFile));
+    if (!_geom_map_file(filename, &file->data, &file->size, &file->mapped))
+        return SDL_FALSE;
+    if (!_geom_check_mesh_file(file, filename)) {
+        geom_close_mesh_file(file);
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+void geom_close_mesh_file(EsMeshFile* file) {
+    if (file->data)
+        _geom_unmap_file(file->data, file->size, file->mapped);
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = SDL_FALSE;
+    file->header = NULL;
+}
+
+void* geom_get_mesh_file_section(EsMeshFile* file, EsMeshSectionType type, Uint32* count) {
+    // The first section of the type, or NULL if the file doesn't have one. It points into the
+    // file, so it is only valid until the file is closed.
+    *count = 0;
+    for (Uint32 i=0; i<file->header->num_sections; i++) {
+        EsMeshSection* section = &file->header->sections[i];
+        if (section->type != (Uint32) type)
+            continue;
+        *count = section->count;
+        return (Uint8*) file->data + section->offset;
+    }
+    return NULL;
+}
+
+SDL_bool geom_load_indexed_mesh(EsMeshFile* file, EsIndexedMesh* mesh) {
+    // Replaces what was in mesh. The indices are checked, since they go straight to the gpu.
+    EsIndexedMesh view;
+    SDL_memset(&view, 0, sizeof(EsIndexedMesh));
+    view.vertices = (EsVertex*) geom_get_mesh_file_section(file, GEOM_SECTION_MESH_VERTICES, &view.num_vertices);
+    view.indices = (Uint32*) geom_get_mesh_file_section(file, GEOM_SECTION_MESH_INDICES, &view.num_indices);
+    if (view.vertices == NULL || view.indices == NULL || view.num_indices % 3 != 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Mesh file has no indexed mesh\n");
+        return SDL_FALSE;
+    }
+    for (Uint32 i=0; i<view.num_indices; i++) {
+        if (view.indices[i] >= view.num_vertices) {
+            SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Mesh file index %i is out of range\n", i);
+            return SDL_FALSE;
+        }
+    }
+    geom_clear_indexed_mesh(mesh);
+    if (!geom_append_indexed_mesh(mesh, &view)) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to load mesh\n");
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+SDL_bool _geom_load_mesh_file_section(EsMeshFile* file, EsMeshSectionType type, void** array, Uint32* size, Uint32* num, size_t element_size) {
+    Uint32 count;
+    void* data = geom_get_mesh_file_section(file, type, &count);
+    *num = 0;
+    if (data == NULL || count == 0)
+        return SDL_TRUE;
+    if (*size < count && !_geom_grow_array(array, size, count - *size, element_size))
+        return SDL_FALSE;
+    SDL_memcpy(*array, data, count * element_size);
+    *num = count;
+    return SDL_TRUE;
+}
+
+SDL_bool geom_load_geometry(EsMeshFile* file, EsGeometry* geom) {
+    // Replaces what was in geom. The faces aren't checked against the other arrays, so only
+    // load files that were written by geom_save_geometry.
+    Uint32 count;
+    if (geom_get_mesh_file_section(file, GEOM_SECTION_POSITIONS, &count) == NULL || geom_get_mesh_file_section(file, GEOM_SECTION_FACES, &count) == NULL) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Mesh file has no geometry\n");
+        return SDL_FALSE;
+    }
+    geom_clear_geometry(geom);
+    SDL_bool result = _geom_load_mesh_file_section(file, GEOM_SECTION_POSITIONS, (void**) &geom->vertices, &geom->vertices_size, &geom->num_vertices, sizeof(vec3));
+    result = result && _geom_load_mesh_file_section(file, GEOM_SECTION_FACES, (void**) &geom->faces, &geom->faces_size, &geom->num_faces, sizeof(EsFace));
+    result = result && _geom_load_mesh_file_section(file, GEOM_SECTION_TEXTURES, (void**) &geom->textures, &geom->textures_size, &geom->num_textures, sizeof(vec2));
+    result = result && _geom_load_mesh_file_section(file, GEOM_SECTION_NORMALS, (void**) &geom->normals, &geom->normals_size, &geom->num_normals, sizeof(vec3));
+    result = result && _geom_load_mesh_file_section(file, GEOM_SECTION_COLORS, (void**) &geom->colors, &geom->colors_size, &geom->num_colors, sizeof(vec3));
+    if (!result) {
+        geom_clear_geometry(geom);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to load geometry\n");
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+// OBJ files are split into chunks at line breaks, and each chunk is parsed on its own worker.
+// The first pass only counts the elements in each chunk, so that the second pass can parse
+// them straight into their place in the arrays. Faces with more than three corners are
+// triangulated as fans.
+#define GEOM_OBJ_MIN_CHUNK_SIZE (256*1024)
+#define GEOM_OBJ_PARSE_CHUNKS_PER_WORKER 4
+#define GEOM_OBJ_NO_INDEX UINT32_MAX
+
+typedef struct {
+    const char* start;
+    const char* end;
+    Uint32 num_positions;
+    Uint32 num_textures;
+    Uint32 num_normals;
+    Uint32 num_corners;
+    Uint32 first_position;
+    Uint32 first_texture;
+    Uint32 first_normal;
+    Uint32 first_corner;
+} _EsObjChunk;
+
+typedef struct {
+    _EsObjChunk* chunks;
+    SDL_bool fill;
+    vec3* positions;
+    vec2* textures;
+    vec3* normals;
+    // Position, texture and normal of each corner, already made zero based.
+    vec3ui* corners;
+} _EsObjParseJob;
+
+static const double _geom_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+SDL_bool _geom_obj_is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+const char* _geom_obj_skip_space(const char* p, const char* end) {
+    while (p < end && _geom_obj_is_space(*p))
+        p++;
+    return p;
+}
+
+const char* _geom_parse_float(const char* p, const char* end, float* value) {
+    // Up to 19 significant digits are kept, which is more than a float can tell apart. Powers
+    // of ten up to 22 are exact in a double, so most numbers only round once.
+    p = _geom_obj_skip_space(p, end);
+    SDL_bool negative = SDL_FALSE;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    Uint64 mantissa = 0;
+    Sint32 exponent = 0;
+    Uint32 num_digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (num_digits < 19) {
+            mantissa = mantissa*10 + (Uint64) (*p - '0');
+            num_digits += mantissa > 0;
+        } else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (num_digits < 19) {
+                mantissa = mantissa*10 + (Uint64) (*p - '0');
+                num_digits += mantissa > 0;
+                exponent--;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        SDL_bool negative_exponent = SDL_FALSE;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative_exponent = *p == '-';
+            p++;
+        }
+        Sint32 written = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++)
+            written = SDL_min(written*10 + (*p - '0'), 10000);
+        exponent += negative_exponent ? -written : written;
+    }
+    double result = (double) mantissa;
+    if (mantissa == 0)
+        result = 0.0;
+    else if (exponent >= 0 && exponent <= 22)
+        result *= _geom_powers_of_ten[exponent];
+    else if (exponent < 0 && exponent >= -22)
+        result /= _geom_powers_of_ten[-exponent];
+    else
+        result *= SDL_pow(10.0, (double) exponent);
+    *value = (float) (negative ? -result : result);
+    return p;
+}
+
+const char* _geom_parse_obj_index(const char* p, const char* end, Uint32 count, Uint32* index) {
+    // OBJ indices start at one, and negative ones count back from the last element so far. A
+    // missing index or a zero is GEOM_OBJ_NO_INDEX, and so is one that points before the first
+    // element. Ones past the end are caught once every element is known.
+    SDL_bool negative = SDL_FALSE;
+    if (p < end && *p == '-') {
+        negative = SDL_TRUE;
+        p++;
+    }
+    Sint64 value = 0;
+    SDL_bool found = SDL_FALSE;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        value = SDL_min(value*10 + (*p - '0'), (Sint64) UINT32_MAX);
+        found = SDL_TRUE;
+    }
+    *index = GEOM_OBJ_NO_INDEX;
+    if (found && value > 0) {
+        if (!negative)
+            *index = (Uint32) (value - 1);
+        else if (value <= count)
+            *index = (Uint32) (count - value);
+    }
+    return p;
+}
+
+const char* _geom_parse_obj_corner(const char* p, const char* end, _EsObjChunk* chunk, vec3ui* corner) {
+    // Positions, textures and normals are counted up to this line, for negative indices.
+    Uint32 num_positions = chunk->first_position + chunk->num_positions;
+    Uint32 num_textures = chunk->first_texture + chunk->num_textures;
+    Uint32 num_normals = chunk->first_normal + chunk->num_normals;
+    p = _geom_parse_obj_index(p, end, num_positions, &corner->x);
+    corner->y = GEOM_OBJ_NO_INDEX;
+    corner->z = GEOM_OBJ_NO_INDEX;
+    if (p < end && *p == '/') {
+        p++;
+        if (p < end && *p != '/')
+            p = _geom_parse_obj_index(p, end, num_textures, &corner->y);
+        if (p < end && *p == '/')
+            p = _geom_parse_obj_index(p+1, end, num_normals, &corner->z);
+    }
+    while (p < end && !_geom_obj_is_space(*p) && *p != '\n')
+        p++;
+    return p;
+}
+
+void _geom_parse_obj_job(void* data, Uint32 index, Uint32 worker) {
+    // Counts the elements of the chunk, or with fill, parses them into the arrays. Lines that
+    // aren't positions, textures, normals or faces are skipped.
+    worker;
+    _EsObjParseJob* job = (_EsObjParseJob*) data;
+    _EsObjChunk* chunk = &job->chunks[index];
+    chunk->num_positions = 0;
+    chunk->num_textures = 0;
+    chunk->num_normals = 0;
+    chunk->num_corners = 0;
+    const char* end = chunk->end;
+    const char* p = chunk->start;
+    while (p < end) {
+        p = _geom_obj_skip_space(p, end);
+        if (p+1 < end && p[0] == 'v' && _geom_obj_is_space(p[1])) {
+            if (job->fill) {
+                vec3* position = &job->positions[chunk->first_position + chunk->num_positions];
+                p = _geom_parse_float(p+2, end, &position->x);
+                p = _geom_parse_float(p, end, &position->y);
+                p = _geom_parse_float(p, end, &position->z);
+            }
+            chunk->num_positions++;
+        } else if (p+2 < end && p[0] == 'v' && p[1] == 't' && _geom_obj_is_space(p[2])) {
+            if (job->fill) {
+                vec2* texture = &job->textures[chunk->first_texture + chunk->num_textures];
+                p = _geom_parse_float(p+3, end, &texture->x);
+                p = _geom_parse_float(p, end, &texture->y);
+            }
+            chunk->num_textures++;
+        } else if (p+2 < end && p[0] == 'v' && p[1] == 'n' && _geom_obj_is_space(p[2])) {
+            if (job->fill) {
+                vec3* normal = &job->normals[chunk->first_normal + chunk->num_normals];
+                p = _geom_parse_float(p+3, end, &normal->x);
+                p = _geom_parse_float(p, end, &normal->y);
+                p = _geom_parse_float(p, end, &normal->z);
+            }
+            chunk->num_normals++;
+        } else if (p+1 < end && p[0] == 'f' && _geom_obj_is_space(p[1])) {
+            vec3ui first;
+            vec3ui previous;
+            vec3ui corner;
+            Uint32 num_corners = 0;
+            p = _geom_obj_skip_space(p+2, end);
+            while (p < end && *p != '\n' && *p != '#') {
+                p = _geom_parse_obj_corner(p, end, chunk, &corner);
+                if (num_corners >= 2) {
+                    if (job->fill) {
+                        vec3ui* out = &job->corners[chunk->first_corner + chunk->num_corners];
+                        out[0] = first;
+                        out[1] = previous;
+                        out[2] = corner;
+                    }
+                    chunk->num_corners += 3;
+                }
+                if (num_corners == 0)
+                    first = corner;
+                previous = corner;
+                num_corners++;
+                p = _geom_obj_skip_space(p, end);
+            }
+        }
+        while (p < end && *p != '\n')
+            p++;
+        p++;
+    }
+}
+
+SDL_bool _geom_build_obj_mesh(_EsObjParseJob* job, _EsObjChunk* totals, EsIndexedMesh* mesh, SDL_bool per_position) {
+    for (Uint32 i=0; i<totals->num_corners; i++) {
+        vec3ui corner = job->corners[i];
+        SDL_bool valid = corner.x < totals->num_positions;
+        valid = valid && (corner.y == GEOM_OBJ_NO_INDEX || corner.y < totals->num_textures);
+        valid = valid && (corner.z == GEOM_OBJ_NO_INDEX || corner.z < totals->num_normals);
+        if (!valid) {
+            SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Obj face corner %i has an index out of range\n", i);
+            return SDL_FALSE;
+        }
+    }
+    geom_clear_indexed_mesh(mesh);
+    Uint32 num_vertices = per_position ? totals->num_positions : totals->num_corners;
+    if (!_geom_reserve_indexed_mesh(mesh, SDL_max(num_vertices, totals->num_corners))) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to load obj\n");
+        return SDL_FALSE;
+    }
+    if (per_position) {
+        SDL_memset(mesh->vertices, 0, totals->num_positions * sizeof(EsVertex));
+        for (Uint32 i=0; i<totals->num_positions; i++)
+            mesh->vertices[i].pos = job->positions[i];
+        mesh->num_vertices = totals->num_positions;
+    }
+    for (Uint32 i=0; i<totals->num_corners; i++) {
+        vec3ui corner = job->corners[i];
+        EsVertex vert;
+        if (per_position)
+            vert = mesh->vertices[corner.x];
+        else
+            SDL_memset(&vert, 0, sizeof(EsVertex));
+        vert.pos = job->positions[corner.x];
+        if (corner.y != GEOM_OBJ_NO_INDEX)
+            vert.tex = job->textures[corner.y];
+        if (corner.z != GEOM_OBJ_NO_INDEX)
+            vert.normal = job->normals[corner.z];
+        if (per_position) {
+            mesh->vertices[corner.x] = vert;
+            mesh->indices[i] = corner.x;
+            continue;
+        }
+        Uint32* slot = _geom_mesh_find_slot(mesh, &vert);
+        if (*slot == UINT32_MAX) {
+            *slot = mesh->num_vertices;
+            mesh->vertices[mesh->num_vertices] = vert;
+            mesh->num_vertices++;
+        }
+        mesh->indices[i] = *slot;
+    }
+    mesh->num_indices = totals->num_corners;
+    if (per_position) {
+        // The table was made for an empty mesh, and the vertices went in without it.
+        SDL_free(mesh->table);
+        mesh->table = NULL;
+        mesh->table_size = 0;
+    }
     return SDL_TRUE;
 }
+
+SDL_bool geom_load_obj(const char* filename, EsIndexedMesh* mesh, SDL_bool per_position) {
+    // Replaces what was in mesh. With per_position, there is one vertex for each position in
+    // the file, and it takes the texture and normal of the last corner that uses it. Otherwise
+    // corners only weld if all of their attributes are the same. Materials, groups and
+    // colors are ignored.
+    void* data;
+    Uint64 size;
+    SDL_bool mapped;
+    if (!_geom_map_file(filename, &data, &size, &mapped)) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not open obj %s\n", filename);
+        return SDL_FALSE;
+    }
+    const char* text = (const char*) data;
+    Uint64 chunk_size = SDL_max(GEOM_OBJ_MIN_CHUNK_SIZE, size / (warehouse_num_workers() * GEOM_OBJ_PARSE_CHUNKS_PER_WORKER) + 1);
+    Uint32 max_chunks = (Uint32) (size / chunk_size) + 1;
+    _EsObjParseJob job;
+    SDL_memset(&job, 0, sizeof(_EsObjParseJob));
+    job.chunks = (_EsObjChunk*) SDL_calloc(max_chunks, sizeof(_EsObjChunk));
+    if (job.chunks == NULL) {
+        _geom_unmap_file(data, size, mapped);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to load obj\n");
+        return SDL_FALSE;
+    }
+    Uint32 num_chunks = 0;
+    Uint64 offset = 0;
+    while (offset < size) {
+        Uint64 chunk_end = SDL_min(offset + chunk_size, size);
+        while (chunk_end < size && text[chunk_end-1] != '\n')
+            chunk_end++;
+        job.chunks[num_chunks].start = text + offset;
+        job.chunks[num_chunks].end = text + chunk_end;
+        num_chunks++;
+        offset = chunk_end;
+    }
+
+    SDL_bool result = warehouse_parallel_for(num_chunks, _geom_parse_obj_job, &job);
+    _EsObjChunk totals;
+    SDL_memset(&totals, 0, sizeof(_EsObjChunk));
+    for (Uint32 i=0; i<num_chunks && result; i++) {
+        _EsObjChunk* chunk = &job.chunks[i];
+        chunk->first_position = totals.num_positions;
+        chunk->first_texture = totals.num_textures;
+        chunk->first_normal = totals.num_normals;
+        chunk->first_corner = totals.num_corners;
+        totals.num_positions += chunk->num_positions;
+        totals.num_textures += chunk->num_textures;
+        totals.num_normals += chunk->num_normals;
+        totals.num_corners += chunk->num_corners;
+    }
+    if (result) {
+        job.positions = (vec3*) SDL_malloc(SDL_max(1, totals.num_positions) * sizeof(vec3));
+        job.textures = (vec2*) SDL_malloc(SDL_max(1, totals.num_textures) * sizeof(vec2));
+        job.normals = (vec3*) SDL_malloc(SDL_max(1, totals.num_normals) * sizeof(vec3));
+        job.corners = (vec3ui*) SDL_malloc(SDL_max(1, totals.num_corners) * sizeof(vec3ui));
+        result = job.positions && job.textures && job.normals && job.corners;
+        if (!result)
+            SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc memory to load obj\n");
+    }
+    if (result) {
+        job.fill = SDL_TRUE;
+        result = warehouse_parallel_for(num_chunks, _geom_parse_obj_job, &job);
+    }
+    _geom_unmap_file(data, size, mapped);
+    if (result)
+        result = _geom_build_obj_mesh(&job, &totals, mesh, per_position);
+    if (!result)
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not load obj %s\n", filename);
+    SDL_free(job.chunks);
+    SDL_free(job.positions);
+    SDL_free(job.textures);
+    SDL_free(job.normals);
+    SDL_free(job.corners);
+    return result;
+}
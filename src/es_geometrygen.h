@@ -13,6 +13,13 @@
 #define DEFAULT_NUM_TEXTURES 128
 #define DEFAULT_NUM_NORMALS 128
 #define DEFAULT_NUM_COLORS 128
+// Size of the post transform vertex cache that meshes are optimized for.
+#define GEOM_VERTEX_CACHE_SIZE 32
+// Arrays bigger than this grow in whole blocks of it. 2MB is the size of a huge page.
+#define GEOM_LARGE_BLOCK_SIZE (2*1024*1024)
+// Rings around branches, cones and ovals get as many vertices as their radius needs, within these.
+#define GEOM_RING_MIN_VERTICES 3
+#define GEOM_RING_MAX_VERTICES 32
 
 typedef struct {
     vec3ui verts;
@@ -21,6 +28,77 @@ typedef struct {
     vec3ui cols;
 } EsFace;
 
+// Vertices ready to be drawn, with three indices per triangle. Every vertex is a unique
+// combination of position, color, texture and normal, and the table finds the vertex that a
+// new corner welds to.
+typedef struct {
+    Uint32 num_vertices;
+    Uint32 num_indices;
+    Uint32 vertices_size;
+    Uint32 indices_size;
+    EsVertex* vertices;
+    Uint32* indices;
+    Uint32 table_size;
+    Uint32* table;
+} EsIndexedMesh;
+
+// Binary mesh files. A header with a table of sections, and then the data of each section, each
+// starting at a multiple of GEOM_MESH_FILE_ALIGNMENT. The data is stored exactly as it is in
+// memory, so a file can be mapped and its sections used in place. The key is whatever the
+// writer wants it to be, and lets the reader tell a stale file from a good one.
+#define GEOM_MESH_FILE_MAGIC 0x424D5345
+#define GEOM_MESH_FILE_VERSION 1
+#define GEOM_MESH_FILE_ALIGNMENT 64
+#define GEOM_MESH_FILE_MAX_SECTIONS 8
+
+typedef enum {
+    // EsIndexedMesh
+    GEOM_SECTION_MESH_VERTICES,
+    GEOM_SECTION_MESH_INDICES,
+    // Uint32 face offsets, like the ones trees_generate_forest fills in.
+    GEOM_SECTION_FACE_RANGES,
+    // EsGeometry
+    GEOM_SECTION_POSITIONS,
+    GEOM_SECTION_FACES,
+    GEOM_SECTION_TEXTURES,
+    GEOM_SECTION_NORMALS,
+    GEOM_SECTION_COLORS,
+} EsMeshSectionType;
+
+typedef struct {
+    Uint32 type;
+    Uint32 count;
+    Uint32 element_size;
+    Uint32 padding;
+    Uint64 offset;
+    Uint64 size;
+} EsMeshSection;
+
+typedef struct {
+    Uint32 magic;
+    Uint32 version;
+    Uint32 header_size;
+    Uint32 num_sections;
+    Uint64 file_size;
+    Uint64 key;
+    EsMeshSection sections[GEOM_MESH_FILE_MAX_SECTIONS];
+} EsMeshFileHeader;
+
+// An open mesh file. The data is mapped where the platform allows, and read in one go where it
+// doesn't.
+typedef struct {
+    void* data;
+    Uint64 size;
+    SDL_bool mapped;
+    EsMeshFileHeader* header;
+} EsMeshFile;
+
+// Vertex cache misses per triangle and per vertex, for a simulated FIFO cache.
+typedef struct {
+    float acmr;
+    float atvr;
+} EsVertexCacheStats;
+
 typedef struct {
     Uint32 num_vertices;
     Uint32 num_faces;
@@ -37,8 +115,30 @@ typedef struct {
     vec2* textures;
     vec3* normals;
     vec3* colors;
+    // If set, every primitive that is added goes straight into this mesh, and is then dropped
+    // from the geometry. Marks and ranges of the geometry mean nothing while it is set.
+    EsIndexedMesh* emit;
 } EsGeometry;
 
+// How many of each element a geometry had at some point, so that the elements added after it
+// can be found again.
+typedef struct {
+    Uint32 num_vertices;
+    Uint32 num_faces;
+    Uint32 num_textures;
+    Uint32 num_normals;
+    Uint32 num_colors;
+} EsGeometryMark;
+
+// A cross section of a swept surface. offset goes into the second channel of the color, like
+// the branch offsets of geom_add_cs_surface.
+typedef struct {
+    vec3 position;
+    vec3 axis;
+    float radius;
+    float offset;
+} EsSweepSection;
+
 extern EsGeometry geom_init_geometry();
 extern EsGeometry geom_init_geometry_size(Uint32 vertices_size, Uint32 faces_size, Uint32 textures_size, Uint32 normals_size, Uint32 colors_size);
 extern SDL_bool geom_add_vertices_memory(EsGeometry* geom, Uint32 vertices_size);
@@ -47,14 +147,46 @@ extern SDL_bool geom_add_textures_memory(EsGeometry* geom, Uint32 textures_size)
 extern SDL_bool geom_add_normals_memory(EsGeometry* geom, Uint32 normals_size);
 extern SDL_bool geom_add_colors_memory(EsGeometry* geom, Uint32 colors_size);
 extern void geom_destroy_geometry(EsGeometry* geom);
+extern void geom_clear_geometry(EsGeometry* geom);
+extern void geom_compact_geometry(EsGeometry* geom);
+extern SDL_bool geom_append_geometry(EsGeometry* geom, EsGeometry* other);
+extern EsGeometryMark geom_get_mark(EsGeometry* geom);
+extern SDL_bool geom_replace_range(EsGeometry* geom, EsGeometryMark* start, EsGeometryMark* end, EsGeometry* other);
+extern void geom_fill_vertices(EsGeometry* geom, EsVertex* vertices, Uint32* indices);
+extern float geom_get_bounding_sphere(EsGeometry* geom, Uint32 first_face, Uint32 last_face, vec3* centre);
+extern Uint32 geom_num_triangles(EsGeometry* geom);
+extern EsIndexedMesh geom_init_indexed_mesh();
+extern void geom_destroy_indexed_mesh(EsIndexedMesh* mesh);
+extern void geom_clear_indexed_mesh(EsIndexedMesh* mesh);
+extern void geom_compact_indexed_mesh(EsIndexedMesh* mesh);
+extern SDL_bool geom_emit_faces(EsGeometry* geom, Uint32 first_face, EsIndexedMesh* mesh);
+extern SDL_bool geom_append_indexed_mesh(EsIndexedMesh* mesh, EsIndexedMesh* other);
+extern float geom_get_indexed_mesh_bounding_sphere(EsIndexedMesh* mesh, Uint32 first_face, Uint32 last_face, vec3* centre);
+extern SDL_bool geom_optimize_vertex_cache(Uint32* indices, Uint32 num_indices);
+extern SDL_bool geom_optimize_vertex_fetch(EsVertex* vertices, Uint32 num_vertices, Uint32* indices, Uint32 num_indices);
+extern EsVertexCacheStats geom_get_vertex_cache_stats(Uint32* indices, Uint32 num_indices, Uint32 num_vertices, Uint32 cache_size);
+extern SDL_bool geom_optimize_indexed_mesh(EsIndexedMesh* mesh, Uint32* face_ranges, Uint32 num_ranges);
+extern void geom_pack_vertices(EsVertex* vertices, Uint32 num_vertices, EsPackedVertex* packed);
 
+extern float geom_error_from_lod(Uint32 lod);
 extern SDL_bool geom_add_cone(EsGeometry* geom, vec3 root, vec3 axis, float base_radius, float height, SDL_bool close, Uint32 lod);
 extern SDL_bool geom_add_cone_origin_zaxis(EsGeometry* geom, float base_radius, float height, SDL_bool close, Uint32 lod);
 extern SDL_bool geom_add_cs_surface(EsGeometry* geom, float base_radius, vec3 base_pos, vec3 base_axis, float tip_radius, vec3 tip_pos, vec3 tip_axis, vec2 tex, Uint32 lod, float tree_height, float branch_offset_start, float branch_offset_end);
+extern SDL_bool geom_add_sweep(EsGeometry* geom, EsSweepSection* sections, Uint32 num_sections, vec3* frame, vec2 tex, Uint32 lod, float tree_height);
 extern SDL_bool geom_add_oval(EsGeometry* geom, vec3 position, vec3 axis, vec3 normal, float length, float width, vec2 tex, Uint32 lod);
 extern SDL_bool geom_add_triple_quad_mesh(EsGeometry* geom, vec3 position, vec3 axis, float height, float width, vec2 tex1, vec2 tex2, Uint32 lod, float tree_height, float branch_length, vec3 branch_root_pos);
 
 extern SDL_bool geom_simplify_geometry(EsGeometry* geom);
+extern SDL_bool geom_weld_geometry(EsGeometry* geom, float epsilon);
 extern SDL_bool geom_save_obj(EsGeometry* geom, const char* filename);
+extern SDL_bool geom_export_obj(EsGeometry* geom, const char* filename, SDL_bool simplify);
+extern SDL_bool geom_load_obj(const char* filename, EsIndexedMesh* mesh, SDL_bool per_position);
+extern SDL_bool geom_save_indexed_mesh(EsIndexedMesh* mesh, Uint32* face_ranges, Uint32 num_face_ranges, Uint64 key, const char* filename);
+extern SDL_bool geom_save_geometry(EsGeometry* geom, Uint64 key, const char* filename);
+extern SDL_bool geom_open_mesh_file(const char* filename, EsMeshFile* file);
+extern void geom_close_mesh_file(EsMeshFile* file);
+extern void* geom_get_mesh_file_section(EsMeshFile* file, EsMeshSectionType type, Uint32* count);
+extern SDL_bool geom_load_indexed_mesh(EsMeshFile* file, EsIndexedMesh* mesh);
+extern SDL_bool geom_load_geometry(EsMeshFile* file, EsGeometry* geom);
 
 #endif
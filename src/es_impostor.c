@@ -0,0 +1,609 @@
+#include "SDL.h"
+#include "es_impostor.h"
+#include "es_world.h"
+
+#include <stddef.h>
+
+typedef struct {
+    mat4 view;
+    mat4 proj;
+} ImpostorBakeConstants;
+
+void impostor_cleanup_baker(EsPainter* painter, EsImpostorBaker* baker) {
+    // Every step of the bake waits for the queue, so nothing is in use by now.
+    if (baker->framebuffer)
+        vkDestroyFramebuffer(painter->device, baker->framebuffer, NULL);
+    if (baker->render_pass)
+        vkDestroyRenderPass(painter->device, baker->render_pass, NULL);
+    if (baker->readback_buffer)
+        vkDestroyBuffer(painter->device, baker->readback_buffer, NULL);
+    if (baker->readback_buffer_memory)
+        vkFreeMemory(painter->device, baker->readback_buffer_memory, NULL);
+    if (baker->depth_image_view)
+        vkDestroyImageView(painter->device, baker->depth_image_view, NULL);
+    if (baker->depth_image)
+        vkDestroyImage(painter->device, baker->depth_image, NULL);
+    if (baker->depth_image_memory)
+        vkFreeMemory(painter->device, baker->depth_image_memory, NULL);
+    if (baker->normal_image_view)
+        vkDestroyImageView(painter->device, baker->normal_image_view, NULL);
+    if (baker->normal_image)
+        vkDestroyImage(painter->device, baker->normal_image, NULL);
+    if (baker->normal_image_memory)
+        vkFreeMemory(painter->device, baker->normal_image_memory, NULL);
+    if (baker->color_image_view)
+        vkDestroyImageView(painter->device, baker->color_image_view, NULL);
+    if (baker->color_image)
+        vkDestroyImage(painter->device, baker->color_image, NULL);
+    if (baker->color_image_memory)
+        vkFreeMemory(painter->device, baker->color_image_memory, NULL);
+    _painter_shader_cleanup(painter, &baker->shader);
+    SDL_memset(baker, 0, sizeof(EsImpostorBaker));
+    if (painter->impostor_baker == baker)
+        painter->impostor_baker = NULL;
+}
+
+SDL_bool _impostor_error(EsPainter* painter, EsImpostorBaker* baker, const char* message) {
+    // The painter helpers clean up the painter when they fail, so the baker does the same.
+    impostor_cleanup_baker(painter, baker);
+    return _painter_cleanup_error(painter, "Error in Impostor Bake.", message);
+}
+
+mat4 _impostor_projection(float half_size, float near, float far) {
+    // Orthographic projection to vulkan clip space, with y down and depth from 0 to 1.
+    return build_mat4(
+        1.0f/half_size, 0.0f,            0.0f,               0.0f,
+        0.0f,          -1.0f/half_size,  0.0f,               0.0f,
+        0.0f,           0.0f,           -1.0f/(far-near),    0.0f,
+        0.0f,           0.0f,           -near/(far-near),    1.0f
+    );
+}
+
+SDL_bool _impostor_load_geometry(EsPainter* painter, EsImpostorBaker* baker, EsIndexedMesh* mesh) {
+    // Uploaded the same way as the painter uploads its shaders, but unpacked, since the bake
+    // pipeline reads EsVertex.
+    SDL_bool sdl_result;
+    ShaderData* shader = &baker->shader;
+    VkMemoryPropertyFlags staging_property_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    shader->num_vertices = mesh->num_vertices;
+    shader->num_indices = mesh->num_indices;
+    shader->vertex_buffer_size = mesh->num_vertices * sizeof(EsVertex);
+    shader->vertex_staging_buffer_size = shader->vertex_buffer_size;
+    shader->index_buffer_size = mesh->num_indices * sizeof(Uint32);
+    shader->index_staging_buffer_size = shader->index_buffer_size;
+    sdl_result = _painter_create_buffer(painter, shader->vertex_staging_buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, staging_property_flags, &shader->vertex_staging_buffer, &shader->vertex_staging_buffer_memory);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _painter_create_buffer(painter, shader->vertex_buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &shader->vertex_buffer, &shader->vertex_buffer_memory);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _painter_create_buffer(painter, shader->index_staging_buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, staging_property_flags, &shader->index_staging_buffer, &shader->index_staging_buffer_memory);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _painter_create_buffer(painter, shader->index_buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &shader->index_buffer, &shader->index_buffer_memory);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _painter_load_buffer_via_staging(painter, mesh->vertices, &shader->vertex_staging_buffer_memory, &shader->vertex_staging_buffer, &shader->vertex_buffer, shader->vertex_staging_buffer_size);
+    if (!sdl_result) return SDL_FALSE;
+    return _painter_load_buffer_via_staging(painter, mesh->indices, &shader->index_staging_buffer_memory, &shader->index_staging_buffer, &shader->index_buffer, shader->index_staging_buffer_size);
+}
+
+SDL_bool _impostor_load_shader_module(EsPainter* painter, const char* filename, VkShaderModule* module) {
+    Uint32* spirv;
+    Sint64 spirv_length = painter_read_shader_file(filename, &spirv);
+    if (spirv_length < 0)
+        return SDL_FALSE;
+    VkShaderModuleCreateInfo shader_module_create_info;
+    shader_module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shader_module_create_info.pNext = NULL;
+    shader_module_create_info.flags = 0;
+    shader_module_create_info.codeSize = (size_t) spirv_length;
+    shader_module_create_info.pCode = spirv;
+    VkResult result = vkCreateShaderModule(painter->device, &shader_module_create_info, NULL, module);
+    SDL_free(spirv);
+    if (result != VK_SUCCESS) {
+        *module = VK_NULL_HANDLE;
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+SDL_bool _impostor_create_target(EsPainter* painter, EsImpostorBaker* baker, VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect, VkImage* image, VkDeviceMemory* image_memory, VkImageView* image_view) {
+    SDL_bool sdl_result = _painter_create_image(painter, baker->width, baker->height, 1, VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, image_memory, 1, SDL_FALSE);
+    if (!sdl_result) return SDL_FALSE;
+    return _painter_create_image_view(painter, format, aspect, VK_IMAGE_VIEW_TYPE_2D, 1, image, image_view);
+}
+
+SDL_bool _impostor_create_targets(EsPainter* painter, EsImpostorBaker* baker) {
+    // The color target is srgb, like every texture the painter loads. The normal target is
+    // unorm, so that the normals and depth are stored linearly, and the impostor shader loads
+    // the atlas as unorm and decodes the color half itself.
+    SDL_bool sdl_result;
+    sdl_result = _impostor_create_target(painter, baker, IMPOSTOR_COLOR_FORMAT, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_IMAGE_ASPECT_COLOR_BIT, &baker->color_image, &baker->color_image_memory, &baker->color_image_view);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _impostor_create_target(painter, baker, IMPOSTOR_NORMAL_FORMAT, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_IMAGE_ASPECT_COLOR_BIT, &baker->normal_image, &baker->normal_image_memory, &baker->normal_image_view);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _impostor_create_target(painter, baker, VK_FORMAT_D32_SFLOAT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_IMAGE_ASPECT_DEPTH_BIT, &baker->depth_image, &baker->depth_image_memory, &baker->depth_image_view);
+    if (!sdl_result) return SDL_FALSE;
+
+    VkAttachmentDescription attachments[3];
+    for (Uint32 i=0; i<2; i++) {
+        attachments[i].flags = 0;
+        attachments[i].format = i == 0 ? IMPOSTOR_COLOR_FORMAT : IMPOSTOR_NORMAL_FORMAT;
+        attachments[i].samples = VK_SAMPLE_COUNT_1_BIT;
+        attachments[i].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        attachments[i].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        attachments[i].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        attachments[i].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[i].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        attachments[i].finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    }
+    attachments[2].flags = 0;
+    attachments[2].format = VK_FORMAT_D32_SFLOAT;
+    attachments[2].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[2].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[2].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[2].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[2].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[2].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    attachments[2].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    VkAttachmentReference color_references[2];
+    color_references[0].attachment = 0;
+    color_references[0].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_references[1].attachment = 1;
+    color_references[1].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkAttachmentReference depth_reference;
+    depth_reference.attachment = 2;
+    depth_reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    VkSubpassDescription subpass;
+    subpass.flags = 0;
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.inputAttachmentCount = 0;
+    subpass.pInputAttachments = NULL;
+    subpass.colorAttachmentCount = 2;
+    subpass.pColorAttachments = color_references;
+    subpass.pResolveAttachments = NULL;
+    subpass.pDepthStencilAttachment = &depth_reference;
+    subpass.preserveAttachmentCount = 0;
+    subpass.pPreserveAttachments = NULL;
+    // The targets get copied out once the pass is done.
+    VkSubpassDependency dependency;
+    dependency.srcSubpass = 0;
+    dependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    dependency.dependencyFlags = 0;
+    VkRenderPassCreateInfo render_pass_create_info;
+    render_pass_create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_create_info.pNext = NULL;
+    render_pass_create_info.flags = 0;
+    render_pass_create_info.attachmentCount = 3;
+    render_pass_create_info.pAttachments = attachments;
+    render_pass_create_info.subpassCount = 1;
+    render_pass_create_info.pSubpasses = &subpass;
+    render_pass_create_info.dependencyCount = 1;
+    render_pass_create_info.pDependencies = &dependency;
+    if (vkCreateRenderPass(painter->device, &render_pass_create_info, NULL, &baker->render_pass) != VK_SUCCESS)
+        return _impostor_error(painter, baker, "Could not create render pass");
+
+    VkImageView framebuffer_attachments[3];
+    framebuffer_attachments[0] = baker->color_image_view;
+    framebuffer_attachments[1] = baker->normal_image_view;
+    framebuffer_attachments[2] = baker->depth_image_view;
+    VkFramebufferCreateInfo framebuffer_create_info;
+    framebuffer_create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_create_info.pNext = NULL;
+    framebuffer_create_info.flags = 0;
+    framebuffer_create_info.renderPass = baker->render_pass;
+    framebuffer_create_info.attachmentCount = 3;
+    framebuffer_create_info.pAttachments = framebuffer_attachments;
+    framebuffer_create_info.width = baker->width;
+    framebuffer_create_info.height = baker->height;
+    framebuffer_create_info.layers = 1;
+    if (vkCreateFramebuffer(painter->device, &framebuffer_create_info, NULL, &baker->framebuffer) != VK_SUCCESS)
+        return _impostor_error(painter, baker, "Could not create framebuffer");
+
+    // Both targets are read back into one buffer, color first.
+    return _painter_create_buffer(painter, 2 * baker->width * baker->height * 4, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &baker->readback_buffer, &baker->readback_buffer_memory);
+}
+
+SDL_bool _impostor_create_pipeline(EsPainter* painter, EsImpostorBaker* baker) {
+    VkResult result;
+    VkDescriptorSetLayoutBinding sampler_layout_binding;
+    sampler_layout_binding.binding = 0;
+    sampler_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    sampler_layout_binding.descriptorCount = 1;
+    sampler_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    sampler_layout_binding.pImmutableSamplers = NULL;
+    VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info;
+    descriptor_set_layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptor_set_layout_create_info.pNext = NULL;
+    descriptor_set_layout_create_info.flags = 0;
+    descriptor_set_layout_create_info.bindingCount = 1;
+    descriptor_set_layout_create_info.pBindings = &sampler_layout_binding;
+    result = vkCreateDescriptorSetLayout(painter->device, &descriptor_set_layout_create_info, NULL, &baker->shader.descriptor_set_layout);
+    if (result != VK_SUCCESS) return _impostor_error(painter, baker, "Could not create descriptor set layout");
+    VkDescriptorPoolSize pool_size;
+    pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    pool_size.descriptorCount = 1;
+    VkDescriptorPoolCreateInfo descriptor_pool_create_info;
+    descriptor_pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptor_pool_create_info.pNext = NULL;
+    descriptor_pool_create_info.flags = 0;
+    descriptor_pool_create_info.maxSets = 1;
+    descriptor_pool_create_info.poolSizeCount = 1;
+    descriptor_pool_create_info.pPoolSizes = &pool_size;
+    result = vkCreateDescriptorPool(painter->device, &descriptor_pool_create_info, NULL, &baker->shader.descriptor_pool);
+    if (result != VK_SUCCESS) return _impostor_error(painter, baker, "Could not create descriptor pool");
+    VkDescriptorSetAllocateInfo descriptor_set_allocate_info;
+    descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_allocate_info.pNext = NULL;
+    descriptor_set_allocate_info.descriptorPool = baker->shader.descriptor_pool;
+    descriptor_set_allocate_info.descriptorSetCount = 1;
+    descriptor_set_allocate_info.pSetLayouts = &baker->shader.descriptor_set_layout;
+    result = vkAllocateDescriptorSets(painter->device, &descriptor_set_allocate_info, &baker->descriptor_set);
+    if (result != VK_SUCCESS) return _impostor_error(painter, baker, "Could not allocate descriptor set");
+    VkDescriptorImageInfo image_info;
+    image_info.sampler = baker->shader.texture_sampler;
+    image_info.imageView = baker->shader.texture_image_view;
+    image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    VkWriteDescriptorSet descriptor_write;
+    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_write.pNext = NULL;
+    descriptor_write.dstSet = baker->descriptor_set;
+    descriptor_write.dstBinding = 0;
+    descriptor_write.dstArrayElement = 0;
+    descriptor_write.descriptorCount = 1;
+    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptor_write.pImageInfo = &image_info;
+    descriptor_write.pBufferInfo = NULL;
+    descriptor_write.pTexelBufferView = NULL;
+    vkUpdateDescriptorSets(painter->device, 1, &descriptor_write, 0, NULL);
+
+    // Each view gets its own camera, so the matrices are pushed per draw.
+    VkPushConstantRange push_constant_range;
+    push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(ImpostorBakeConstants);
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info;
+    pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_create_info.pNext = NULL;
+    pipeline_layout_create_info.flags = 0;
+    pipeline_layout_create_info.setLayoutCount = 1;
+    pipeline_layout_create_info.pSetLayouts = &baker->shader.descriptor_set_layout;
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+    result = vkCreatePipelineLayout(painter->device, &pipeline_layout_create_info, NULL, &baker->shader.pipeline_layout);
+    if (result != VK_SUCCESS) return _impostor_error(painter, baker, "Could not create pipeline layout");
+
+    if (!_impostor_load_shader_module(painter, IMPOSTOR_BAKE_VERTEX_SHADER, &baker->shader.vertex_shader_module))
+        return _impostor_error(painter, baker, "Could not load the bake vertex shader");
+    if (!_impostor_load_shader_module(painter, IMPOSTOR_BAKE_FRAGMENT_SHADER, &baker->shader.fragment_shader_module))
+        return _impostor_error(painter, baker, "Could not load the bake fragment shader");
+    VkPipelineShaderStageCreateInfo shader_stages[2];
+    shader_stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shader_stages[0].pNext = NULL;
+    shader_stages[0].flags = 0;
+    shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shader_stages[0].module = baker->shader.vertex_shader_module;
+    shader_stages[0].pName = "main";
+    shader_stages[0].pSpecializationInfo = NULL;
+    shader_stages[1] = shader_stages[0];
+    shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shader_stages[1].module = baker->shader.fragment_shader_module;
+    VkVertexInputBindingDescription vertex_binding_description;
+    vertex_binding_description.binding = 0;
+    vertex_binding_description.stride = sizeof(EsVertex);
+    vertex_binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    VkVertexInputAttributeDescription vertex_input_attributes[4];
+    vertex_input_attributes[0].location = 0;
+    vertex_input_attributes[0].binding = 0;
+    vertex_input_attributes[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+    vertex_input_attributes[0].offset = offsetof(EsVertex, pos);
+    vertex_input_attributes[1].location = 1;
+    vertex_input_attributes[1].binding = 0;
+    vertex_input_attributes[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+    vertex_input_attributes[1].offset = offsetof(EsVertex, color);
+    vertex_input_attributes[2].location = 2;
+    vertex_input_attributes[2].binding = 0;
+    vertex_input_attributes[2].format = VK_FORMAT_R32G32_SFLOAT;
+    vertex_input_attributes[2].offset = offsetof(EsVertex, tex);
+    vertex_input_attributes[3].location = 3;
+    vertex_input_attributes[3].binding = 0;
+    vertex_input_attributes[3].format = VK_FORMAT_R32G32B32_SFLOAT;
+    vertex_input_attributes[3].offset = offsetof(EsVertex, normal);
+    VkPipelineVertexInputStateCreateInfo vertex_input_state_create_info;
+    vertex_input_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertex_input_state_create_info.pNext = NULL;
+    vertex_input_state_create_info.flags = 0;
+    vertex_input_state_create_info.vertexBindingDescriptionCount = 1;
+    vertex_input_state_create_info.pVertexBindingDescriptions = &vertex_binding_description;
+    vertex_input_state_create_info.vertexAttributeDescriptionCount = 4;
+    vertex_input_state_create_info.pVertexAttributeDescriptions = vertex_input_attributes;
+    VkPipelineInputAssemblyStateCreateInfo input_assembly_state_create_info;
+    input_assembly_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly_state_create_info.pNext = NULL;
+    input_assembly_state_create_info.flags = 0;
+    input_assembly_state_create_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    input_assembly_state_create_info.primitiveRestartEnable = VK_FALSE;
+    // The viewport moves to a different atlas cell for every view.
+    VkPipelineViewportStateCreateInfo viewport_state_create_info;
+    viewport_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state_create_info.pNext = NULL;
+    viewport_state_create_info.flags = 0;
+    viewport_state_create_info.viewportCount = 1;
+    viewport_state_create_info.pViewports = NULL;
+    viewport_state_create_info.scissorCount = 1;
+    viewport_state_create_info.pScissors = NULL;
+    VkDynamicState dynamic_states[2];
+    dynamic_states[0] = VK_DYNAMIC_STATE_VIEWPORT;
+    dynamic_states[1] = VK_DYNAMIC_STATE_SCISSOR;
+    VkPipelineDynamicStateCreateInfo dynamic_state_create_info;
+    dynamic_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state_create_info.pNext = NULL;
+    dynamic_state_create_info.flags = 0;
+    dynamic_state_create_info.dynamicStateCount = 2;
+    dynamic_state_create_info.pDynamicStates = dynamic_states;
+    VkPipelineRasterizationStateCreateInfo rasterization_state_create_info;
+    rasterization_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterization_state_create_info.pNext = NULL;
+    rasterization_state_create_info.flags = 0;
+    rasterization_state_create_info.depthClampEnable = VK_FALSE;
+    rasterization_state_create_info.rasterizerDiscardEnable = VK_FALSE;
+    rasterization_state_create_info.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterization_state_create_info.cullMode = VK_CULL_MODE_NONE;
+    rasterization_state_create_info.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    rasterization_state_create_info.depthBiasEnable = VK_FALSE;
+    rasterization_state_create_info.depthBiasConstantFactor = 0.0f;
+    rasterization_state_create_info.depthBiasClamp = 0.0f;
+    rasterization_state_create_info.depthBiasSlopeFactor = 0.0f;
+    rasterization_state_create_info.lineWidth = 1.0f;
+    VkPipelineMultisampleStateCreateInfo multisample_state_create_info;
+    multisample_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisample_state_create_info.pNext = NULL;
+    multisample_state_create_info.flags = 0;
+    multisample_state_create_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    multisample_state_create_info.sampleShadingEnable = VK_FALSE;
+    multisample_state_create_info.minSampleShading = 0.0f;
+    multisample_state_create_info.pSampleMask = NULL;
+    multisample_state_create_info.alphaToCoverageEnable = VK_FALSE;
+    multisample_state_create_info.alphaToOneEnable = VK_FALSE;
+    VkPipelineColorBlendAttachmentState color_blend_attachment_states[2];
+    for (Uint32 i=0; i<2; i++) {
+        color_blend_attachment_states[i].blendEnable = VK_FALSE;
+        color_blend_attachment_states[i].srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+        color_blend_attachment_states[i].dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+        color_blend_attachment_states[i].colorBlendOp = VK_BLEND_OP_ADD;
+        color_blend_attachment_states[i].srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        color_blend_attachment_states[i].dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+        color_blend_attachment_states[i].alphaBlendOp = VK_BLEND_OP_ADD;
+        color_blend_attachment_states[i].colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    }
+    VkPipelineColorBlendStateCreateInfo color_blend_state_create_info;
+    color_blend_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    color_blend_state_create_info.pNext = NULL;
+    color_blend_state_create_info.flags = 0;
+    color_blend_state_create_info.logicOpEnable = VK_FALSE;
+    color_blend_state_create_info.logicOp = VK_LOGIC_OP_COPY;
+    color_blend_state_create_info.attachmentCount = 2;
+    color_blend_state_create_info.pAttachments = color_blend_attachment_states;
+    color_blend_state_create_info.blendConstants[0] = 0.0f;
+    color_blend_state_create_info.blendConstants[1] = 0.0f;
+    color_blend_state_create_info.blendConstants[2] = 0.0f;
+    color_blend_state_create_info.blendConstants[3] = 0.0f;
+    VkStencilOpState no_op;
+    no_op.failOp = VK_STENCIL_OP_KEEP;
+    no_op.passOp = VK_STENCIL_OP_KEEP;
+    no_op.depthFailOp = VK_STENCIL_OP_KEEP;
+    no_op.compareOp = VK_COMPARE_OP_ALWAYS;
+    no_op.compareMask = 0;
+    no_op.writeMask = 0;
+    no_op.reference = 0;
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_state_create_info;
+    depth_stencil_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil_state_create_info.pNext = NULL;
+    depth_stencil_state_create_info.flags = 0;
+    depth_stencil_state_create_info.depthTestEnable = VK_TRUE;
+    depth_stencil_state_create_info.depthWriteEnable = VK_TRUE;
+    depth_stencil_state_create_info.depthCompareOp = VK_COMPARE_OP_LESS;
+    depth_stencil_state_create_info.depthBoundsTestEnable = VK_FALSE;
+    depth_stencil_state_create_info.stencilTestEnable = VK_FALSE;
+    depth_stencil_state_create_info.front = no_op;
+    depth_stencil_state_create_info.back = no_op;
+    depth_stencil_state_create_info.minDepthBounds = 0.0f;
+    depth_stencil_state_create_info.maxDepthBounds = 1.0f;
+    VkGraphicsPipelineCreateInfo graphics_pipeline_create_info;
+    graphics_pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    graphics_pipeline_create_info.pNext = NULL;
+    graphics_pipeline_create_info.flags = 0;
+    graphics_pipeline_create_info.stageCount = 2;
+    graphics_pipeline_create_info.pStages = shader_stages;
+    graphics_pipeline_create_info.pVertexInputState = &vertex_input_state_create_info;
+    graphics_pipeline_create_info.pInputAssemblyState = &input_assembly_state_create_info;
+    graphics_pipeline_create_info.pTessellationState = NULL;
+    graphics_pipeline_create_info.pViewportState = &viewport_state_create_info;
+    graphics_pipeline_create_info.pRasterizationState = &rasterization_state_create_info;
+    graphics_pipeline_create_info.pMultisampleState = &multisample_state_create_info;
+    graphics_pipeline_create_info.pDepthStencilState = &depth_stencil_state_create_info;
+    graphics_pipeline_create_info.pColorBlendState = &color_blend_state_create_info;
+    graphics_pipeline_create_info.pDynamicState = &dynamic_state_create_info;
+    graphics_pipeline_create_info.layout = baker->shader.pipeline_layout;
+    graphics_pipeline_create_info.renderPass = baker->render_pass;
+    graphics_pipeline_create_info.subpass = 0;
+    graphics_pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
+    graphics_pipeline_create_info.basePipelineIndex = -1;
+    result = vkCreateGraphicsPipelines(painter->device, VK_NULL_HANDLE, 1, &graphics_pipeline_create_info, NULL, &baker->shader.pipeline);
+    if (result != VK_SUCCESS) return _impostor_error(painter, baker, "Could not create graphics pipeline");
+    return SDL_TRUE;
+}
+
+SDL_bool _impostor_render(EsPainter* painter, EsImpostorBaker* baker, EsIndexedMesh* mesh, InstanceDraw* draws, Uint32 num_draws) {
+    VkCommandBuffer command_buffer = _painter_begin_single_use_command_buffer(painter);
+    if (command_buffer == NULL) return SDL_FALSE;
+    // Empty texels have zero alpha, with a normal facing the camera at the far plane.
+    VkClearValue clear_values[3];
+    clear_values[0].color.float32[0] = 0.0f;
+    clear_values[0].color.float32[1] = 0.0f;
+    clear_values[0].color.float32[2] = 0.0f;
+    clear_values[0].color.float32[3] = 0.0f;
+    clear_values[1].color.float32[0] = 0.5f;
+    clear_values[1].color.float32[1] = 0.5f;
+    clear_values[1].color.float32[2] = 1.0f;
+    clear_values[1].color.float32[3] = 1.0f;
+    clear_values[2].depthStencil.depth = 1.0f;
+    clear_values[2].depthStencil.stencil = 0;
+    VkRenderPassBeginInfo render_pass_begin_info;
+    render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_begin_info.pNext = NULL;
+    render_pass_begin_info.renderPass = baker->render_pass;
+    render_pass_begin_info.framebuffer = baker->framebuffer;
+    render_pass_begin_info.renderArea.offset.x = 0;
+    render_pass_begin_info.renderArea.offset.y = 0;
+    render_pass_begin_info.renderArea.extent.width = baker->width;
+    render_pass_begin_info.renderArea.extent.height = baker->height;
+    render_pass_begin_info.clearValueCount = 3;
+    render_pass_begin_info.pClearValues = clear_values;
+    vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+    VkDeviceSize offset = 0;
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, baker->shader.pipeline);
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &baker->shader.vertex_buffer, &offset);
+    vkCmdBindIndexBuffer(command_buffer, baker->shader.index_buffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, baker->shader.pipeline_layout, 0, 1, &baker->descriptor_set, 0, NULL);
+    for (Uint32 i=0; i<num_draws; i++) {
+        // Each view is an orthographic camera looking at the centre of the bounding sphere from
+        // outside it, at an angle of 2*pi*view/IMPOSTOR_VIEWS around the y axis. The painter
+        // picks the view with the same angle.
+        Uint32 first_face = draws[i].first_index[0] / 3;
+        vec3 centre;
+        float radius = geom_get_indexed_mesh_bounding_sphere(mesh, first_face, first_face + draws[i].num_indices[0] / 3, &centre);
+        if (radius <= 0.0f)
+            continue;
+        for (Uint32 view=0; view<IMPOSTOR_VIEWS; view++) {
+            float angle = 2.0f * (float) M_PI * view / IMPOSTOR_VIEWS;
+            vec3 direction = build_vec3(SDL_sinf(angle), 0.0f, SDL_cosf(angle));
+            vec3 eye = vec3_add(centre, vec3_scale(direction, 2.0f*radius));
+            ImpostorBakeConstants constants;
+            constants.view = look_at(eye, centre, build_vec3(0.0f, 1.0f, 0.0f));
+            constants.proj = _impostor_projection(radius, 0.5f*radius, 3.5f*radius);
+            VkViewport viewport;
+            viewport.x = (float) (view * IMPOSTOR_CELL_SIZE);
+            viewport.y = (float) (i * IMPOSTOR_CELL_SIZE);
+            viewport.width = (float) IMPOSTOR_CELL_SIZE;
+            viewport.height = (float) IMPOSTOR_CELL_SIZE;
+            viewport.minDepth = 0.0f;
+            viewport.maxDepth = 1.0f;
+            VkRect2D scissor;
+            scissor.offset.x = view * IMPOSTOR_CELL_SIZE;
+            scissor.offset.y = i * IMPOSTOR_CELL_SIZE;
+            scissor.extent.width = IMPOSTOR_CELL_SIZE;
+            scissor.extent.height = IMPOSTOR_CELL_SIZE;
+            vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+            vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+            vkCmdPushConstants(command_buffer, baker->shader.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ImpostorBakeConstants), &constants);
+            vkCmdDrawIndexed(command_buffer, draws[i].num_indices[0], 1, draws[i].first_index[0], 0, 0);
+        }
+    }
+    vkCmdEndRenderPass(command_buffer);
+    VkBufferImageCopy region;
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset.x = 0;
+    region.imageOffset.y = 0;
+    region.imageOffset.z = 0;
+    region.imageExtent.width = baker->width;
+    region.imageExtent.height = baker->height;
+    region.imageExtent.depth = 1;
+    vkCmdCopyImageToBuffer(command_buffer, baker->color_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, baker->readback_buffer, 1, &region);
+    region.bufferOffset = baker->width * baker->height * 4;
+    vkCmdCopyImageToBuffer(command_buffer, baker->normal_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, baker->readback_buffer, 1, &region);
+    return _painter_end_single_use_command_buffer(painter, &command_buffer);
+}
+
+SDL_bool _impostor_write_atlas(EsPainter* painter, EsImpostorBaker* baker, const char* atlas_path) {
+    // Uncompressed top-left origin tga, which stb_image can load. The color target is on the
+    // left half and the normal target on the right.
+    Uint32 atlas_width = 2 * baker->width;
+    Uint32 atlas_height = baker->height;
+    Uint8 header[18];
+    SDL_memset(header, 0, sizeof(header));
+    header[2] = 2;
+    header[12] = (Uint8) (atlas_width & 0xff);
+    header[13] = (Uint8) (atlas_width >> 8);
+    header[14] = (Uint8) (atlas_height & 0xff);
+    header[15] = (Uint8) (atlas_height >> 8);
+    header[16] = 32;
+    header[17] = 0x28;
+    Uint8* pixels;
+    if (vkMapMemory(painter->device, baker->readback_buffer_memory, 0, VK_WHOLE_SIZE, 0, (void**) &pixels) != VK_SUCCESS)
+        return _impostor_error(painter, baker, "Could not map readback memory");
+    Uint8* row = (Uint8*) SDL_malloc(atlas_width * 4);
+    SDL_RWops* atlas_file = SDL_RWFromFile(atlas_path, "wb");
+    if (row == NULL || atlas_file == NULL) {
+        SDL_free(row);
+        if (atlas_file)
+            SDL_RWclose(atlas_file);
+        vkUnmapMemory(painter->device, baker->readback_buffer_memory);
+        return _impostor_error(painter, baker, "Could not open atlas for writing");
+    }
+    SDL_bool sdl_result = SDL_RWwrite(atlas_file, header, sizeof(header), 1) == 1;
+    for (Uint32 y=0; y<atlas_height && sdl_result; y++) {
+        for (Uint32 x=0; x<atlas_width; x++) {
+            Uint32 target = x / baker->width;
+            Uint8* texel = &pixels[target*baker->width*baker->height*4 + (y*baker->width + x%baker->width)*4];
+            row[x*4 + 0] = texel[2];
+            row[x*4 + 1] = texel[1];
+            row[x*4 + 2] = texel[0];
+            row[x*4 + 3] = texel[3];
+        }
+        sdl_result = SDL_RWwrite(atlas_file, row, atlas_width * 4, 1) == 1;
+    }
+    SDL_RWclose(atlas_file);
+    SDL_free(row);
+    vkUnmapMemory(painter->device, baker->readback_buffer_memory);
+    if (!sdl_result) return _impostor_error(painter, baker, "Could not write atlas");
+    return SDL_TRUE;
+}
+
+void impostor_get_atlas_path(char* atlas_path, Uint32 seed) {
+    SDL_snprintf(atlas_path, IMPOSTOR_ATLAS_PATH_LENGTH, IMPOSTOR_ATLAS_PATH, IMPOSTOR_ATLAS_VERSION, TREE_CACHE_VERSION, seed);
+}
+
+SDL_bool impostor_atlas_exists(const char* atlas_path) {
+    SDL_RWops* atlas_file = SDL_RWFromFile(atlas_path, "rb");
+    if (atlas_file == NULL)
+        return SDL_FALSE;
+    SDL_RWclose(atlas_file);
+    return SDL_TRUE;
+}
+
+SDL_bool impostor_bake_atlas(EsPainter* painter, EsIndexedMesh* mesh, InstanceDraw* draws, Uint32 num_draws, const char* atlas_path) {
+    SDL_bool sdl_result;
+    EsImpostorBaker baker;
+    SDL_memset(&baker, 0, sizeof(EsImpostorBaker));
+    // The painter helpers call painter_cleanup when they fail, which releases the baker too, so
+    // every failure below ends up cleaning up both.
+    painter->impostor_baker = &baker;
+    if (num_draws == 0 || mesh->num_indices == 0) return _impostor_error(painter, &baker, "Nothing to bake");
+    baker.width = IMPOSTOR_VIEWS * IMPOSTOR_CELL_SIZE;
+    baker.height = num_draws * IMPOSTOR_CELL_SIZE;
+    baker.shader.shader_name = "Impostor Bake Shader";
+    baker.shader.texture_filepath = IMPOSTOR_TREE_TEXTURE_PATH;
+    // Loaded and sampled like the tree shader does, so the leaves come out the same color.
+    sdl_result = _painter_load_image_and_sampler(painter, baker.shader.texture_filepath, &baker.shader, NULL, 0, 0, 0, SDL_FALSE, MODEL_SHADER);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _impostor_load_geometry(painter, &baker, mesh);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _impostor_create_targets(painter, &baker);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _impostor_create_pipeline(painter, &baker);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _impostor_render(painter, &baker, mesh, draws, num_draws);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _impostor_write_atlas(painter, &baker, atlas_path);
+    if (!sdl_result) return SDL_FALSE;
+    impostor_cleanup_baker(painter, &baker);
+    return SDL_TRUE;
+}
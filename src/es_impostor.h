@@ -0,0 +1,66 @@
+/*
+ * es_impostor bakes the tree archetypes into an impostor atlas, that the painter uses to draw
+ * distant trees as a single camera facing quad. The baker runs on a painter's device. The
+ * painter bakes the atlas on startup if there isn't one for its trees yet, and imain.c bakes
+ * it on a headless painter, so that it can run on build machines against a software vulkan
+ * device.
+ */
+
+#ifndef ES_IMPOSTOR_DEFINED
+#define ES_IMPOSTOR_DEFINED
+
+#include "SDL.h"
+#include <vulkan/vulkan.h>
+#include "es_warehouse.h"
+#include "es_geometrygen.h"
+#include "es_painter.h"
+
+// Each archetype is one row of the atlas. The row has IMPOSTOR_VIEWS color cells, rendered from
+// evenly spaced angles around the y axis, followed by the same views with the view space normal
+// in rgb and the depth in a. The depth is the 8 bit unorm of the bake's depth range, which is
+// three times the archetype's radius, so it is only good to about a hundredth of the radius.
+#define IMPOSTOR_VIEWS 8
+#define IMPOSTOR_CELL_SIZE 256
+#define IMPOSTOR_COLOR_FORMAT VK_FORMAT_R8G8B8A8_SRGB
+#define IMPOSTOR_NORMAL_FORMAT VK_FORMAT_R8G8B8A8_UNORM
+// An atlas is only good for the trees it was baked from and the layout it was baked with, so it
+// is named after the atlas version, the tree cache version and the tree seed.
+#define IMPOSTOR_ATLAS_VERSION 2
+#define IMPOSTOR_ATLAS_PATH "data/img/impostor_atlas_%u_%u_%u.tga"
+#define IMPOSTOR_ATLAS_PATH_LENGTH 128
+#define IMPOSTOR_TREE_TEXTURE_PATH "data/img/tree.png"
+#define IMPOSTOR_BAKE_VERTEX_SHADER "data/spirv/impostor_bake_vertex.spv"
+#define IMPOSTOR_BAKE_FRAGMENT_SHADER "data/spirv/impostor_bake_fragment.spv"
+
+typedef struct EsImpostorBaker {
+    // The tree texture, the archetype mesh and the bake pipeline live in here, so that they
+    // are cleaned up like any other shader.
+    ShaderData shader;
+    VkDescriptorSet descriptor_set;
+    Uint32 width;
+    Uint32 height;
+    VkImage color_image;
+    VkDeviceMemory color_image_memory;
+    VkImageView color_image_view;
+    VkImage normal_image;
+    VkDeviceMemory normal_image_memory;
+    VkImageView normal_image_view;
+    VkImage depth_image;
+    VkDeviceMemory depth_image_memory;
+    VkImageView depth_image_view;
+    VkRenderPass render_pass;
+    VkFramebuffer framebuffer;
+    VkBuffer readback_buffer;
+    VkDeviceMemory readback_buffer_memory;
+} EsImpostorBaker;
+
+extern void impostor_get_atlas_path(char* atlas_path, Uint32 seed);
+extern SDL_bool impostor_atlas_exists(const char* atlas_path);
+// Bakes the first lod of each of the draws in mesh as one row of the atlas. Archetypes are
+// expected to be at the origin. Like the painter helpers, the painter is cleaned up if this
+// fails.
+extern SDL_bool impostor_bake_atlas(EsPainter* painter, EsIndexedMesh* mesh, InstanceDraw* draws, Uint32 num_draws, const char* atlas_path);
+// Releases everything the baker holds, and unregisters it from the painter.
+extern void impostor_cleanup_baker(EsPainter* painter, EsImpostorBaker* baker);
+
+#endif
@@ -2,15 +2,15 @@
 #include "SDL_vulkan.h"
 #include "es_geometrygen.h"
 #include "es_trees.h"
+#include "es_impostor.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_PERLIN_IMPLEMENTATION
 #include "stb_perlin.h"
-#define TINYOBJ_LOADER_C_IMPLEMENTATION
-#include "tinyobj_loader_c.h"
 
 #include <stdlib.h>
+#include <stddef.h>
 
 #define GRASS_INSTANCES 20005
 #define GRASS_NUM_VERTICES 4
@@ -25,7 +25,9 @@
 #define SKYBOX_MODEL_TEXTURE_PATH1 "data/img/skybox/left0.jpg"
 #define SKYBOX_MODEL_TEXTURE_PATH0 "data/img/skybox/right0.jpg"
 #define TREE_INSTANCES 30
+#define GRASS_SEED 2
 #define TREE_MODEL_TEXTURE_PATH "data/img/tree.png"
+#define TREE_CACHE_PATH "data/obj/trees_%u.esm"
 #define PLANE_MODEL_PATH "data/obj/plane.obj"
 #define PLANE_MODEL_TEXUTRE_PATH "data/img/tree.png"
 #define GROUND_MODEL_TEXTURE_PATH "data/img/ground.png"
@@ -35,17 +37,90 @@
 SDL_bool _painter_create_swapchain(EsPainter* painter);
 SDL_bool _painter_load_data(EsPainter* painter);
 SDL_bool _painter_fill_command_buffers(EsPainter* painter);
+SDL_bool _painter_fill_command_buffer(EsPainter* painter, Uint32 i);
+SDL_bool _painter_update_instances(EsPainter* painter, ShaderData* shader, ShaderData* impostor_shader, Uint32 image_index);
+void _painter_draw_shader(VkCommandBuffer command_buffer, ShaderData* shader, Uint32 image_index);
+SDL_bool _painter_build_tree_archetypes(EsIndexedMesh* mesh, Uint32 seed, InstanceDraw* draws, Uint32* archetype_faces);
 
 #include "es_painter_helpers.h"
 
+SDL_bool _painter_load_cached_trees(EsIndexedMesh* mesh, const char* cache_path, Uint64 cache_key, Uint32* archetype_faces) {
+    // Any problem with the cache just means that the trees are generated again.
+    EsMeshFile file;
+    if (!geom_open_mesh_file(cache_path, &file))
+        return SDL_FALSE;
+    Uint32 num_faces;
+    Uint32* faces = (Uint32*) geom_get_mesh_file_section(&file, GEOM_SECTION_FACE_RANGES, &num_faces);
+    SDL_bool sdl_result = file.header->key == cache_key && faces != NULL && num_faces == TREE_ARCHETYPES*TREE_LODS+1;
+    if (sdl_result)
+        sdl_result = geom_load_indexed_mesh(&file, mesh);
+    if (sdl_result)
+        SDL_memcpy(archetype_faces, faces, num_faces * sizeof(Uint32));
+    else
+        SDL_Log("tree cache %s is stale, generating the trees again", cache_path);
+    geom_close_mesh_file(&file);
+    return sdl_result;
+}
+
+SDL_bool _painter_build_tree_archetypes(EsIndexedMesh* mesh, Uint32 seed, InstanceDraw* draws, Uint32* archetype_faces) {
+    // We only mesh a few archetypes, all at the origin, and then draw them instanced with
+    // per instance transforms. So the tree geometry doesn't grow with the number of trees.
+    // Each archetype is meshed at every lod, one after the other. Only the index ranges and
+    // the radius of the draws are filled in here.
+    // The trees are emitted straight into the mesh, already welded and ready to upload. The
+    // optimized mesh is cached on disk for each seed.
+    SDL_bool sdl_result;
+    Uint32 timer_start = SDL_GetTicks();
+    char cache_path[128];
+    SDL_snprintf(cache_path, 128, TREE_CACHE_PATH, seed);
+    Uint64 cache_key = ((Uint64) TREE_CACHE_VERSION << 32) | seed;
+    if (_painter_load_cached_trees(mesh, cache_path, cache_key, archetype_faces)) {
+        SDL_Log("load tree archetypes %i ticks, %i vertices", SDL_GetTicks()-timer_start, mesh->num_vertices);
+    } else {
+        vec3 archetype_positions[TREE_ARCHETYPES];
+        for (Uint32 i=0; i<TREE_ARCHETYPES; i++)
+            archetype_positions[i] = build_vec3(0.0f, 0.0f, 0.0f);
+        geom_clear_indexed_mesh(mesh);
+        EsGeometry geom = geom_init_geometry();
+        geom.emit = mesh;
+        sdl_result = trees_generate_forest(&geom, archetype_positions, TREE_ARCHETYPES, TREE_LODS, seed, archetype_faces);
+        geom_destroy_geometry(&geom);
+        if (!sdl_result) return SDL_FALSE;
+        SDL_Log("generate tree archetypes %i ticks, %i vertices", SDL_GetTicks()-timer_start, mesh->num_vertices);
+        sdl_result = geom_optimize_indexed_mesh(mesh, archetype_faces, TREE_ARCHETYPES*TREE_LODS);
+        if (!sdl_result) return SDL_FALSE;
+        // Not being able to write the cache only costs the next launch some time.
+        geom_save_indexed_mesh(mesh, archetype_faces, TREE_ARCHETYPES*TREE_LODS+1, cache_key, cache_path);
+    }
+    for (Uint32 i=0; i<TREE_ARCHETYPES; i++) {
+        InstanceDraw* draw = &draws[i];
+        draw->num_lods = TREE_LODS;
+        for (Uint32 lod=0; lod<TREE_LODS; lod++) {
+            draw->first_index[lod] = archetype_faces[i*TREE_LODS + lod] * 3;
+            draw->num_indices[lod] = (archetype_faces[i*TREE_LODS + lod + 1] - archetype_faces[i*TREE_LODS + lod]) * 3;
+        }
+        // The archetypes are at the origin, so the bounding sphere of the full mesh is centred there.
+        draw->radius = 0.0f;
+        for (Uint32 j=archetype_faces[i*TREE_LODS]*3; j<archetype_faces[i*TREE_LODS + 1]*3; j++)
+            draw->radius = SDL_max(draw->radius, vec3_magnitude(mesh->vertices[mesh->indices[j]].pos));
+    }
+    return SDL_TRUE;
+}
+
+SDL_bool _painter_load_model(EsPainter* painter, const char* filename, EsIndexedMesh* model) {
+    // One vertex for each position in the file, which is what the shaders that use models
+    // expect.
+    *model = geom_init_indexed_mesh();
+    if (geom_load_obj(filename, model, SDL_TRUE))
+        return SDL_TRUE;
+    geom_destroy_indexed_mesh(model);
+    warehouse_error_popup("Error in Setup.", "Could not load model");
+    painter_cleanup(painter);
+    return SDL_FALSE;
+}
+
 SDL_bool _painter_load_data(EsPainter* painter) {
-    tinyobj_attrib_t attrib;
-    tinyobj_shape_t* shapes = NULL;
-    size_t num_shapes;
-    tinyobj_material_t* materials = NULL;
-    size_t num_materials;
-    Uint32 flags = TINYOBJ_FLAG_TRIANGULATE;
-    int ret;
+    SDL_bool sdl_result;
     // SameSizeShadowMapCheck
     painter->shadow_map_size.x = SHADOW_PASS_SIZE;
     painter->shadow_map_size.y = SHADOW_PASS_SIZE;
@@ -56,6 +131,8 @@ SDL_bool _painter_load_data(EsPainter* painter) {
     ShaderData ground_shader = painter->shaders[1];
     ShaderData grass_shader = painter->shaders[2];
     ShaderData plane_shader = painter->shaders[3];
+    ShaderData impostor_shader;
+    SDL_memset(&impostor_shader, 0, sizeof(ShaderData));
 
     grass_shader.shader_name = "Grass Shader";
     grass_shader.vertex_shader = "data/spirv/grass_vertex.spv";
@@ -92,46 +169,26 @@ SDL_bool _painter_load_data(EsPainter* painter) {
     painter->ui_shader->fragment_shader = "data/spirv/ui_fragment.spv";
     painter->ui_shader->shadow_map_fragment_shader = "data/spirv/ui_fragment.spv";
 
-    ret = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials,
-                            &num_materials, GRASS_MODEL_PATH, _painter_read_obj_file, flags);
-    if (ret != TINYOBJ_SUCCESS) {
-        warehouse_error_popup("Error in Setup.", "Could not load model");
-        painter_cleanup(painter);
-        return SDL_FALSE;
-    }
-    grass_shader.num_vertices = attrib.num_vertices * GRASS_INSTANCES;
+    EsIndexedMesh model;
+    sdl_result = _painter_load_model(painter, GRASS_MODEL_PATH, &model);
+    if (!sdl_result) return SDL_FALSE;
+    grass_shader.num_vertices = model.num_vertices * GRASS_INSTANCES;
     grass_shader.vertices = (EsVertex*) SDL_malloc(grass_shader.num_vertices * sizeof(EsVertex));
-    grass_shader.num_indices = attrib.num_faces * GRASS_INSTANCES;
+    grass_shader.num_indices = model.num_indices * GRASS_INSTANCES;
     grass_shader.indices = (Uint32*) SDL_malloc(grass_shader.num_indices * sizeof(Uint32));
-    if (num_shapes != 1) {
-        warehouse_error_popup("Error in Setup.", "Currently only support obj with 1 shape");
-        painter_cleanup(painter);
-        return SDL_FALSE;
-    }
-    for (Uint32 i=0; i<attrib.num_vertices; i++) {
-        EsVertex vert;
-        vert.pos.x = attrib.vertices[i*3 + 0];
-        vert.pos.y = attrib.vertices[i*3 + 1];
-        vert.pos.z = attrib.vertices[i*3 + 2];
+    for (Uint32 i=0; i<model.num_vertices; i++) {
+        EsVertex vert = model.vertices[i];
         // We're loading color field with same data for ease of billboarding
-        vert.color.x = attrib.vertices[i*3 + 0];
-        vert.color.y = attrib.vertices[i*3 + 1];
-        vert.color.z = attrib.vertices[i*3 + 2];
-        // TODO (28 Nov 2020 sam): Load this from the tinyobj parse
-        vert.normal.x = 0.0f;
-        vert.normal.y = 0.0f;
-        vert.normal.z = 1.0f;
+        vert.color = vert.pos;
+        vert.normal = build_vec3(0.0f, 0.0f, 1.0f);
         grass_shader.vertices[i] = vert;
     }
-    for (Uint32 i=0; i<attrib.num_faces; i++) {
-        tinyobj_vertex_index_t face = attrib.faces[i];
-        grass_shader.indices[i] = face.v_idx;
-        grass_shader.vertices[face.v_idx].tex.x = attrib.texcoords[face.vt_idx*2 + 0];
-        grass_shader.vertices[face.v_idx].tex.y = attrib.texcoords[face.vt_idx*2 + 1];
-    }
+    SDL_memcpy(grass_shader.indices, model.indices, model.num_indices * sizeof(Uint32));
+    EsRng rng;
+    rng_seed(&rng, GRASS_SEED);
     for (Uint32 i=1; i<GRASS_INSTANCES; i++) {
-        float x = rand_negpos() * GRASS_RADIUS;
-        float z = rand_negpos() * GRASS_RADIUS;
+        float x = rng_negpos(&rng) * GRASS_RADIUS;
+        float z = rng_negpos(&rng) * GRASS_RADIUS;
         if (vec3_magnitude(build_vec3(x,0,z)) > GRASS_RADIUS) {
             i--;
             continue;
@@ -144,49 +201,21 @@ SDL_bool _painter_load_data(EsPainter* painter) {
             vert.pos.z += z;        
             grass_shader.vertices[i*GRASS_NUM_VERTICES + j] = vert;
         }
-        for (Uint32 j=0; j<attrib.num_faces; j++) {
-            grass_shader.indices[i*attrib.num_faces + j] = i*GRASS_NUM_VERTICES + grass_shader.indices[j];
+        for (Uint32 j=0; j<model.num_indices; j++) {
+            grass_shader.indices[i*model.num_indices + j] = i*GRASS_NUM_VERTICES + grass_shader.indices[j];
         }
     }
-    tinyobj_attrib_free(&attrib);
-    tinyobj_shapes_free(shapes, num_shapes);
-    tinyobj_materials_free(materials, num_materials);
+    geom_destroy_indexed_mesh(&model);
 
-    ret = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials,
-                            &num_materials, SKYBOX_MODEL_PATH, _painter_read_obj_file, flags);
-    if (ret != TINYOBJ_SUCCESS) {
-        warehouse_error_popup("Error in Setup.", "Could not load model");
-        painter_cleanup(painter);
-        return SDL_FALSE;
-    }
-    painter->skybox_shader->num_vertices = attrib.num_vertices;
+    sdl_result = _painter_load_model(painter, SKYBOX_MODEL_PATH, &model);
+    if (!sdl_result) return SDL_FALSE;
+    painter->skybox_shader->num_vertices = model.num_vertices;
     painter->skybox_shader->vertices = (EsVertex*) SDL_malloc(painter->skybox_shader->num_vertices * sizeof(EsVertex));
-    painter->skybox_shader->num_indices = attrib.num_faces;
+    painter->skybox_shader->num_indices = model.num_indices;
     painter->skybox_shader->indices = (Uint32*) SDL_malloc(painter->skybox_shader->num_indices * sizeof(Uint32));
-    if (num_shapes != 1) {
-        warehouse_error_popup("Error in Setup.", "Currently only support obj with 1 shape");
-        painter_cleanup(painter);
-        return SDL_FALSE;
-    }
-    for (Uint32 i=0; i<attrib.num_vertices; i++) {
-        EsVertex vert;
-        vert.pos.x = attrib.vertices[i*3 + 0];
-        vert.pos.y = attrib.vertices[i*3 + 1];
-        vert.pos.z = attrib.vertices[i*3 + 2];
-        vert.color.x = 0.0f;
-        vert.color.y = 0.0f;
-        vert.color.z = 0.0f;
-        painter->skybox_shader->vertices[i] = vert;
-    }
-    for (Uint32 i=0; i<attrib.num_faces; i++) {
-        tinyobj_vertex_index_t face = attrib.faces[i];
-        painter->skybox_shader->indices[i] = face.v_idx;
-        // painter->skybox_shader->vertices[face.v_idx].tex.x = attrib.texcoords[face.vt_idx*2 + 0];
-        // painter->skybox_shader->vertices[face.v_idx].tex.y = 1.0f - attrib.texcoords[face.vt_idx*2 + 1];
-    }
-    tinyobj_attrib_free(&attrib);
-    tinyobj_shapes_free(shapes, num_shapes);
-    tinyobj_materials_free(materials, num_materials);
+    SDL_memcpy(painter->skybox_shader->vertices, model.vertices, model.num_vertices * sizeof(EsVertex));
+    SDL_memcpy(painter->skybox_shader->indices, model.indices, model.num_indices * sizeof(Uint32));
+    geom_destroy_indexed_mesh(&model);
 
     painter->ui_shader->num_vertices = painter->ui->vertices_size;
     painter->ui_shader->vertices = painter->ui->vertices;
@@ -195,32 +224,117 @@ SDL_bool _painter_load_data(EsPainter* painter) {
     SDL_Log("UI shader num vertices = %i", painter->ui_shader->num_vertices);
 
 
-    Uint32 timer_start = SDL_GetTicks();
-    // TODO (20 Jan 2021 sam): This process is really slow. See how it can be speeded up
-    // Specifically, it seems like the add_to_geom is the slow function. tree gen is faster.
-    // Total takes ~1.7 seconds. Tree gen takes ~0.2 seconds.
-    for (Uint32 i=0; i<TREE_INSTANCES; i++) {
-        float x = rand_negpos() * GRASS_RADIUS;
-        float z = rand_negpos() * GRASS_RADIUS;
-        float y = 1.0f * stb_perlin_noise3(x/10.0f, 0, z/10.0f, 0, 0, 0);
-        vec3 pos = build_vec3(x, y, z);
-        EsTree tree = trees_gen_test();
-        trees_add_to_geom_at_pos(&tree, &painter->world->tree_geom, pos);
-    }
-    SDL_Log("add to geom %i ticks", SDL_GetTicks()-timer_start);
-    timer_start = SDL_GetTicks();
-    geom_simplify_geometry(&painter->world->tree_geom);
-    painter->world->refresh_tree = SDL_TRUE;
-    SDL_Log("simplify geom took %i ticks", SDL_GetTicks()-timer_start);
-
-    tree_shader.num_vertices = painter->world->tree_geom.num_vertices;
-    tree_shader.vertices = (EsVertex*) SDL_malloc(tree_shader.num_vertices * sizeof(EsVertex));
-    tree_shader.num_indices = painter->world->tree_geom.num_faces * 3;
+    InstanceDraw archetype_draws[TREE_ARCHETYPES];
+    Uint32 archetype_faces[TREE_ARCHETYPES*TREE_LODS+1];
+    sdl_result = _painter_build_tree_archetypes(&painter->world->tree_mesh, painter->world->tree_seed, archetype_draws, archetype_faces);
+    if (!sdl_result) {
+        warehouse_error_popup("Error in Setup.", "Could not generate trees");
+        painter_cleanup(painter);
+        return SDL_FALSE;
+    }
+
+    tree_shader.num_instances = TREE_INSTANCES;
+    tree_shader.instances = (EsInstance*) SDL_malloc(tree_shader.num_instances * sizeof(EsInstance));
+    tree_shader.num_draws = TREE_ARCHETYPES;
+    tree_shader.draws = (InstanceDraw*) SDL_malloc(tree_shader.num_draws * sizeof(InstanceDraw));
+    tree_shader.frame_instances = (EsInstance*) SDL_malloc(tree_shader.num_instances * sizeof(EsInstance));
+    tree_shader.instance_lods = (Uint32*) SDL_malloc(tree_shader.num_instances * sizeof(Uint32));
+    tree_shader.num_indirect_draws = TREE_ARCHETYPES * TREE_LODS;
+    tree_shader.indirect_draws = (VkDrawIndexedIndirectCommand*) SDL_calloc(tree_shader.num_indirect_draws, sizeof(VkDrawIndexedIndirectCommand));
+    if (tree_shader.instances == NULL || tree_shader.draws == NULL || tree_shader.frame_instances == NULL || tree_shader.instance_lods == NULL || tree_shader.indirect_draws == NULL) {
+        warehouse_error_popup("Error in Setup.", "Could not allocate tree instances");
+        painter_cleanup(painter);
+        return SDL_FALSE;
+    }
+    // Instances are grouped by archetype, so that each archetype is a single draw.
+    rng_seed(&rng, TREE_SEED);
+    Uint32 instance_index = 0;
+    for (Uint32 i=0; i<TREE_ARCHETYPES; i++) {
+        InstanceDraw draw = archetype_draws[i];
+        draw.first_instance = instance_index;
+        draw.num_instances = TREE_INSTANCES / TREE_ARCHETYPES;
+        if (i < TREE_INSTANCES % TREE_ARCHETYPES)
+            draw.num_instances++;
+        for (Uint32 j=0; j<draw.num_instances; j++) {
+            EsInstance instance;
+            float x = rng_negpos(&rng) * GRASS_RADIUS;
+            float z = rng_negpos(&rng) * GRASS_RADIUS;
+            float y = 1.0f * stb_perlin_noise3(x/10.0f, 0, z/10.0f, 0, 0, 0);
+            instance.position = build_vec3(x, y, z);
+            instance.rotation = rng_pos(&rng) * 2.0f * (float) M_PI;
+            instance.scale = 0.8f + 0.4f * rng_pos(&rng);
+            instance.wind_phase = rng_pos(&rng) * 2.0f * (float) M_PI;
+            tree_shader.instances[instance_index] = instance;
+            instance_index++;
+        }
+        tree_shader.draws[i] = draw;
+    }
+
+    painter->tree_buffers_seed = painter->world->tree_seed;
+    painter->impostor_seed = painter->world->tree_seed;
+    impostor_get_atlas_path(painter->impostor_atlas_path, painter->impostor_seed);
+    if (painter->num_shaders > 4) {
+        // The impostor shader draws the same instances, each archetype as a single quad with
+        // its row of the baked atlas. Each frame an instance goes to one of the two shaders.
+        impostor_shader.shader_name = "Impostor Shader";
+        impostor_shader.vertex_shader = "data/spirv/impostor_vertex.spv";
+        impostor_shader.shadow_map_vertex_shader = "data/spirv/impostor_sm_vertex.spv";
+        impostor_shader.fragment_shader = "data/spirv/impostor_fragment.spv";
+        impostor_shader.shadow_map_fragment_shader = "data/spirv/impostor_sm_fragment.spv";
+        impostor_shader.texture_filepath = painter->impostor_atlas_path;
+        impostor_shader.num_vertices = TREE_ARCHETYPES * 4;
+        impostor_shader.vertices = (EsVertex*) SDL_calloc(impostor_shader.num_vertices, sizeof(EsVertex));
+        impostor_shader.num_indices = TREE_ARCHETYPES * 6;
+        impostor_shader.indices = (Uint32*) SDL_malloc(impostor_shader.num_indices * sizeof(Uint32));
+        impostor_shader.num_instances = TREE_INSTANCES;
+        impostor_shader.instances = (EsInstance*) SDL_malloc(impostor_shader.num_instances * sizeof(EsInstance));
+        impostor_shader.num_draws = TREE_ARCHETYPES;
+        impostor_shader.draws = (InstanceDraw*) SDL_malloc(impostor_shader.num_draws * sizeof(InstanceDraw));
+        impostor_shader.frame_instances = (EsInstance*) SDL_malloc(impostor_shader.num_instances * sizeof(EsInstance));
+        impostor_shader.num_indirect_draws = TREE_ARCHETYPES;
+        impostor_shader.indirect_draws = (VkDrawIndexedIndirectCommand*) SDL_calloc(impostor_shader.num_indirect_draws, sizeof(VkDrawIndexedIndirectCommand));
+        if (impostor_shader.vertices == NULL || impostor_shader.indices == NULL || impostor_shader.instances == NULL || impostor_shader.draws == NULL || impostor_shader.frame_instances == NULL || impostor_shader.indirect_draws == NULL) {
+            warehouse_error_popup("Error in Setup.", "Could not allocate tree impostors");
+            painter_cleanup(painter);
+            return SDL_FALSE;
+        }
+        SDL_memcpy(impostor_shader.instances, tree_shader.instances, impostor_shader.num_instances * sizeof(EsInstance));
+        const vec2 corners[4] = { {-1.0f, 1.0f}, {1.0f, 1.0f}, {1.0f, -1.0f}, {-1.0f, -1.0f} };
+        const Uint32 corner_indices[6] = { 0, 3, 1, 1, 3, 2 };
+        for (Uint32 i=0; i<TREE_ARCHETYPES; i++) {
+            // Same bounding sphere that the baker framed the archetype with.
+            vec3 centre;
+            float radius = geom_get_indexed_mesh_bounding_sphere(&painter->world->tree_mesh, archetype_faces[i*TREE_LODS], archetype_faces[i*TREE_LODS + 1], &centre);
+            for (Uint32 j=0; j<4; j++) {
+                EsVertex* vertex = &impostor_shader.vertices[i*4 + j];
+                vertex->pos = centre;
+                vertex->color = build_vec3(corners[j].x * radius, corners[j].y * radius, 0.0f);
+                vertex->tex = build_vec2(0.5f + 0.5f*corners[j].x, 0.5f - 0.5f*corners[j].y);
+                vertex->normal = build_vec3(0.0f, 0.0f, 1.0f);
+                vertex->assorted = build_vec4((float) i, (float) TREE_ARCHETYPES, (float) IMPOSTOR_VIEWS, 0.0f);
+            }
+            for (Uint32 j=0; j<6; j++)
+                impostor_shader.indices[i*6 + j] = i*4 + corner_indices[j];
+            InstanceDraw draw = tree_shader.draws[i];
+            draw.num_lods = 1;
+            draw.first_index[0] = i * 6;
+            draw.num_indices[0] = 6;
+            impostor_shader.draws[i] = draw;
+        }
+    }
+
+    EsIndexedMesh* tree_mesh = &painter->world->tree_mesh;
+    tree_shader.num_vertices = tree_mesh->num_vertices;
+    tree_shader.packed = SDL_TRUE;
+    tree_shader.packed_vertices = (EsPackedVertex*) SDL_malloc(tree_shader.num_vertices * sizeof(EsPackedVertex));
+    tree_shader.num_indices = tree_mesh->num_indices;
     tree_shader.indices = (Uint32*) SDL_malloc(tree_shader.num_indices * sizeof(Uint32));
+    geom_pack_vertices(tree_mesh->vertices, tree_shader.num_vertices, tree_shader.packed_vertices);
+    SDL_memcpy(tree_shader.indices, tree_mesh->indices, tree_shader.num_indices * sizeof(Uint32));
 
     ground_shader.num_vertices = (GROUND_NUM_VERTICES_SIDE+1) * (GROUND_NUM_VERTICES_SIDE+1);
     ground_shader.vertices = (EsVertex*) SDL_malloc(ground_shader.num_vertices * sizeof(EsVertex));
-    ground_shader.num_indices = ground_shader.num_vertices * 6;
+    ground_shader.num_indices = GROUND_NUM_VERTICES_SIDE * GROUND_NUM_VERTICES_SIDE * 6;
     ground_shader.indices = (Uint32*) SDL_calloc(ground_shader.num_indices, sizeof(Uint32));
     float tex_x = 0.0;
     float tex_y = 0.0;
@@ -248,7 +362,7 @@ SDL_bool _painter_load_data(EsPainter* painter) {
     }
     for (Uint32 i=0; i<GROUND_NUM_VERTICES_SIDE; i++) {
         for (Uint32 j=0; j<GROUND_NUM_VERTICES_SIDE; j++) {
-            Uint32 index = 6 * (i*(GROUND_NUM_VERTICES_SIDE+1) + j);
+            Uint32 index = 6 * (i*GROUND_NUM_VERTICES_SIDE + j);
             Uint32 v1 = (i+0)*(GROUND_NUM_VERTICES_SIDE+1) + (j+0);
             Uint32 v2 = (i+0)*(GROUND_NUM_VERTICES_SIDE+1) + (j+1);
             Uint32 v3 = (i+1)*(GROUND_NUM_VERTICES_SIDE+1) + (j+1);
@@ -261,44 +375,36 @@ SDL_bool _painter_load_data(EsPainter* painter) {
             ground_shader.indices[index+5] = v4;
         }
     }
-
-    ret = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials,
-                            &num_materials, PLANE_MODEL_PATH, _painter_read_obj_file, flags);
-    if (ret != TINYOBJ_SUCCESS) {
-        warehouse_error_popup("Error in Setup.", "Could not load model");
+    // Row by row, the grid misses the vertex cache for about every triangle.
+    EsIndexedMesh ground_mesh;
+    SDL_memset(&ground_mesh, 0, sizeof(EsIndexedMesh));
+    ground_mesh.num_vertices = ground_shader.num_vertices;
+    ground_mesh.num_indices = ground_shader.num_indices;
+    ground_mesh.vertices = ground_shader.vertices;
+    ground_mesh.indices = ground_shader.indices;
+    sdl_result = geom_optimize_indexed_mesh(&ground_mesh, NULL, 0);
+    if (!sdl_result) {
+        warehouse_error_popup("Error in Setup.", "Could not optimize ground");
         painter_cleanup(painter);
         return SDL_FALSE;
     }
-    plane_shader.num_vertices = attrib.num_vertices;
+
+    sdl_result = _painter_load_model(painter, PLANE_MODEL_PATH, &model);
+    if (!sdl_result) return SDL_FALSE;
+    plane_shader.num_vertices = model.num_vertices;
     plane_shader.vertices = (EsVertex*) SDL_malloc(plane_shader.num_vertices * sizeof(EsVertex));
     plane_shader.original_positions = (vec3*) SDL_malloc(plane_shader.num_vertices * sizeof(vec3));
-    plane_shader.num_indices = attrib.num_faces;
+    plane_shader.num_indices = model.num_indices;
     plane_shader.indices = (Uint32*) SDL_malloc(plane_shader.num_indices * sizeof(Uint32));
-    if (num_shapes != 1) {
-        warehouse_error_popup("Error in Setup.", "Currently only support obj with 1 shape");
-        painter_cleanup(painter);
-        return SDL_FALSE;
-    }
-    for (Uint32 i=0; i<attrib.num_vertices; i++) {
-        EsVertex vert;
-        vert.pos.x = attrib.vertices[i*3 + 0];
-        vert.pos.z = attrib.vertices[i*3 + 1];
-        vert.pos.y = -attrib.vertices[i*3 + 2];
-        vert.color.x = 0.0f;
-        vert.color.y = 0.0f;
-        vert.color.z = 0.0f;
+    for (Uint32 i=0; i<model.num_vertices; i++) {
+        EsVertex vert = model.vertices[i];
+        vert.pos = build_vec3(model.vertices[i].pos.x, -model.vertices[i].pos.z, model.vertices[i].pos.y);
+        vert.tex = build_vec2(0.0f, 0.0f);
         plane_shader.vertices[i] = vert;
         plane_shader.original_positions[i] = vert.pos;
     }
-    for (Uint32 i=0; i<attrib.num_faces; i++) {
-        tinyobj_vertex_index_t face = attrib.faces[i];
-        plane_shader.indices[i] = face.v_idx;
-        plane_shader.vertices[face.v_idx].tex.x = 0.0f;
-        plane_shader.vertices[face.v_idx].tex.y = 0.0f;
-    }
-    tinyobj_attrib_free(&attrib);
-    tinyobj_shapes_free(shapes, num_shapes);
-    tinyobj_materials_free(materials, num_materials);
+    SDL_memcpy(plane_shader.indices, model.indices, model.num_indices * sizeof(Uint32));
+    geom_destroy_indexed_mesh(&model);
 
     painter->shadow_map_shader->num_vertices = 4;
     painter->shadow_map_shader->num_indices = 6;
@@ -323,6 +429,8 @@ SDL_bool _painter_load_data(EsPainter* painter) {
     painter->shaders[1] = ground_shader;
     painter->shaders[2] = grass_shader;
     painter->shaders[3] = plane_shader;
+    if (painter->num_shaders > 4)
+        painter->shaders[4] = impostor_shader;
 
     painter->uniform_buffer_object.model = identity_mat4();
     painter->uniform_buffer_object.window_size = build_vec2(1024.0f, 768.0f);
@@ -335,9 +443,16 @@ SDL_bool _painter_load_data(EsPainter* painter) {
 SDL_bool painter_initialise(EsPainter* painter) {
     SDL_bool sdl_result;
 
+    SDL_memset(&painter->tree_rebuild, 0, sizeof(TreeRebuild));
+    painter->tree_rebuild.mesh = geom_init_indexed_mesh();
+    painter->stale_command_buffers = NULL;
+    painter->num_stale_command_buffers = 0;
+    painter->impostor_baker = NULL;
     sdl_result = _painter_initialise_sdl_window(painter, "Easel");
     if (!sdl_result) return SDL_FALSE;
-    painter->num_shaders = 4;
+    // Distant trees are drawn as impostors. The atlas for the starting trees is baked when the
+    // device is up, if it isn't on disk yet.
+    painter->num_shaders = 5;
     painter->skybox_shader = (ShaderData*) SDL_calloc(1, sizeof(ShaderData));
     painter->ui_shader = (ShaderData*) SDL_calloc(1, sizeof(ShaderData));
     painter->shadow_map_shader = (ShaderData*) SDL_calloc(1, sizeof(ShaderData));
@@ -359,12 +474,43 @@ SDL_bool painter_initialise(EsPainter* painter) {
     for (Uint32 i=0; i<painter->num_shaders; i++) {
         if (i==3)  continue;  // we don't want to free the plane_vertex vertices
         SDL_free(painter->shaders[i].vertices);
+        SDL_free(painter->shaders[i].packed_vertices);
         SDL_free(painter->shaders[i].indices);
     }
 
     return SDL_TRUE;
 }
 
+SDL_bool painter_initialise_headless(EsPainter* painter, SDL_bool prefer_cpu) {
+    SDL_bool sdl_result;
+
+    SDL_memset(painter, 0, sizeof(EsPainter));
+    painter->tree_rebuild.mesh = geom_init_indexed_mesh();
+    sdl_result = _painter_init_instance(painter);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _painter_create_headless_device(painter, prefer_cpu);
+    if (!sdl_result) return SDL_FALSE;
+    return SDL_TRUE;
+}
+
+SDL_bool painter_bake_impostors(EsPainter* painter, Uint32 seed) {
+    // Bakes the archetypes of seed on their own, without a world around them. Like the other
+    // painter functions, the painter is cleaned up if this fails.
+    SDL_bool sdl_result;
+    EsIndexedMesh mesh = geom_init_indexed_mesh();
+    InstanceDraw draws[TREE_ARCHETYPES];
+    Uint32 archetype_faces[TREE_ARCHETYPES*TREE_LODS+1];
+    sdl_result = _painter_build_tree_archetypes(&mesh, seed, draws, archetype_faces);
+    if (!sdl_result) {
+        geom_destroy_indexed_mesh(&mesh);
+        return _painter_cleanup_error(painter, "Error in Setup.", "Could not generate trees");
+    }
+    impostor_get_atlas_path(painter->impostor_atlas_path, seed);
+    sdl_result = impostor_bake_atlas(painter, &mesh, draws, TREE_ARCHETYPES, painter->impostor_atlas_path);
+    geom_destroy_indexed_mesh(&mesh);
+    return sdl_result;
+}
+
 SDL_bool _painter_create_swapchain(EsPainter* painter) {
     SDL_bool sdl_result;
 
@@ -376,9 +522,17 @@ SDL_bool _painter_create_swapchain(EsPainter* painter) {
     sdl_result = _painter_shadow_map_init(painter);
     if (!sdl_result) return SDL_FALSE;
 
+    // The impostor shader loads the atlas with the other textures below, so it has to be baked
+    // first. The atlas is only for impostor_seed, and those trees may have been swapped out.
+    if (painter->num_shaders > 4 && painter->tree_buffers_seed == painter->impostor_seed && !impostor_atlas_exists(painter->impostor_atlas_path)) {
+        SDL_Log("baking %s", painter->impostor_atlas_path);
+        sdl_result = impostor_bake_atlas(painter, &painter->world->tree_mesh, painter->shaders[0].draws, TREE_ARCHETYPES, painter->impostor_atlas_path);
+        if (!sdl_result) return SDL_FALSE;
+    }
+
     SDL_Log("initting shader_data");
     for (Uint32 i=0; i<painter->num_shaders; i++) {
-        sdl_result = _painter_init_shader_data(painter, &painter->shaders[i], MODEL_SHADER);
+        sdl_result = _painter_init_shader_data(painter, &painter->shaders[i], i == 4 ? IMPOSTOR_SHADER : MODEL_SHADER);
         if (!sdl_result) return _painter_custom_error("Setup Error", "Could not init shader data");
     }
     sdl_result = _painter_init_shader_data(painter, painter->ui_shader, UI_SHADER);
@@ -417,9 +571,118 @@ SDL_bool _painter_create_swapchain(EsPainter* painter) {
     return SDL_TRUE;
 }
 
+void _painter_draw_shader(VkCommandBuffer command_buffer, ShaderData* shader, Uint32 image_index) {
+    if (shader->num_indirect_draws == 0) {
+        vkCmdDrawIndexed(command_buffer, shader->num_indices, 1, 0, 0, 0);
+        return;
+    }
+    // The instance counts change every frame, so the draws read them from the indirect buffer.
+    // We don't enable multiDrawIndirect, so it is one indirect draw per command.
+    for (Uint32 i=0; i<shader->num_indirect_draws; i++)
+        vkCmdDrawIndexedIndirect(command_buffer, shader->indirect_buffers[image_index], i * sizeof(VkDrawIndexedIndirectCommand), 1, sizeof(VkDrawIndexedIndirectCommand));
+    return;
+}
+
+Uint32 _painter_get_instance_lod(EsPainter* painter, InstanceDraw* draw, EsInstance* instance, float pixels_per_unit, SDL_bool has_impostor) {
+    // Pick the lod by how many pixels tall the bounding sphere is on screen. Past the last lod,
+    // the instance is drawn as an impostor if there is one, and gets draw->num_lods.
+    const float lod_pixels[TREE_LODS] = { 300.0f, 120.0f, 40.0f, 12.0f };
+    float distance = SDL_max(vec3_distance(painter->camera_position, instance->position), 0.001f);
+    float pixels = 2.0f * draw->radius * instance->scale * pixels_per_unit / distance;
+    Uint32 max_lod = has_impostor ? draw->num_lods : draw->num_lods-1;
+    Uint32 lod = 0;
+    while (lod < max_lod && pixels < lod_pixels[lod])
+        lod++;
+    return lod;
+}
+
+VkDrawIndexedIndirectCommand* _painter_get_indirect_draw(ShaderData* shader, ShaderData* impostor_shader, Uint32 draw, Uint32 lod) {
+    if (lod == shader->draws[draw].num_lods)
+        return &impostor_shader->indirect_draws[draw];
+    return &shader->indirect_draws[draw*TREE_LODS + lod];
+}
+
+SDL_bool _painter_update_instances(EsPainter* painter, ShaderData* shader, ShaderData* impostor_shader, Uint32 image_index) {
+    // Sort the instances by draw and lod, so that each (draw, lod) pair is one indirect draw
+    // over a contiguous range of instances, and write both into the buffers of this image. The
+    // instances that are too small on screen go to the impostor shader instead, which has one
+    // indirect draw per draw.
+    if (shader->num_indirect_draws == 0)
+        return SDL_TRUE;
+    float pixels_per_unit = painter->swapchain_extent.height / (2.0f * SDL_tanf(deg_to_rad(painter->camera_fov) / 2.0f));
+    for (Uint32 i=0; i<shader->num_indirect_draws; i++)
+        shader->indirect_draws[i].instanceCount = 0;
+    if (impostor_shader) {
+        for (Uint32 i=0; i<impostor_shader->num_indirect_draws; i++)
+            impostor_shader->indirect_draws[i].instanceCount = 0;
+    }
+    for (Uint32 i=0; i<shader->num_draws; i++) {
+        InstanceDraw* draw = &shader->draws[i];
+        for (Uint32 j=draw->first_instance; j<draw->first_instance+draw->num_instances; j++) {
+            shader->instance_lods[j] = _painter_get_instance_lod(painter, draw, &shader->instances[j], pixels_per_unit, impostor_shader != NULL);
+            _painter_get_indirect_draw(shader, impostor_shader, i, shader->instance_lods[j])->instanceCount++;
+        }
+    }
+    Uint32 first_instance = 0;
+    for (Uint32 i=0; i<shader->num_draws; i++) {
+        for (Uint32 lod=0; lod<TREE_LODS; lod++) {
+            VkDrawIndexedIndirectCommand* command = &shader->indirect_draws[i*TREE_LODS + lod];
+            command->indexCount = lod < shader->draws[i].num_lods ? shader->draws[i].num_indices[lod] : 0;
+            command->firstIndex = lod < shader->draws[i].num_lods ? shader->draws[i].first_index[lod] : 0;
+            command->vertexOffset = 0;
+            command->firstInstance = first_instance;
+            first_instance += command->instanceCount;
+            command->instanceCount = 0;
+        }
+    }
+    if (impostor_shader) {
+        first_instance = 0;
+        for (Uint32 i=0; i<impostor_shader->num_draws; i++) {
+            VkDrawIndexedIndirectCommand* command = &impostor_shader->indirect_draws[i];
+            command->indexCount = impostor_shader->draws[i].num_indices[0];
+            command->firstIndex = impostor_shader->draws[i].first_index[0];
+            command->vertexOffset = 0;
+            command->firstInstance = first_instance;
+            first_instance += command->instanceCount;
+            command->instanceCount = 0;
+        }
+    }
+    for (Uint32 i=0; i<shader->num_draws; i++) {
+        InstanceDraw* draw = &shader->draws[i];
+        for (Uint32 j=draw->first_instance; j<draw->first_instance+draw->num_instances; j++) {
+            Uint32 lod = shader->instance_lods[j];
+            VkDrawIndexedIndirectCommand* command = _painter_get_indirect_draw(shader, impostor_shader, i, lod);
+            if (lod == draw->num_lods)
+                impostor_shader->frame_instances[command->firstInstance + command->instanceCount] = shader->instances[j];
+            else
+                shader->frame_instances[command->firstInstance + command->instanceCount] = shader->instances[j];
+            command->instanceCount++;
+        }
+    }
+    // The last frame that drew this image is done with its buffers, so they can be written
+    // in place.
+    SDL_memcpy(shader->instance_buffers_mapped[image_index], shader->frame_instances, shader->instance_buffer_size);
+    SDL_memcpy(shader->indirect_buffers_mapped[image_index], shader->indirect_draws, shader->indirect_buffer_size);
+    if (impostor_shader) {
+        SDL_memcpy(impostor_shader->instance_buffers_mapped[image_index], impostor_shader->frame_instances, impostor_shader->instance_buffer_size);
+        SDL_memcpy(impostor_shader->indirect_buffers_mapped[image_index], impostor_shader->indirect_draws, impostor_shader->indirect_buffer_size);
+    }
+    return SDL_TRUE;
+}
+
 SDL_bool _painter_fill_command_buffers(EsPainter* painter) {
+    SDL_bool sdl_result;
+    for (Uint32 i=0; i<painter->swapchain_image_count; i++) {
+        sdl_result = _painter_fill_command_buffer(painter, i);
+        if (!sdl_result) return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+SDL_bool _painter_fill_command_buffer(EsPainter* painter, Uint32 i) {
+    // Records the shadow map and main command buffers of one swapchain image. Neither can be
+    // pending when this is called.
     VkResult result;
-    // SDL_bool sdl_result;
 
     VkClearColorValue color_value0 = { 1.0f, 0.0f, 0.0f, 1.0f };
     VkClearColorValue color_value1 = { 0.0f, 0.0f, 0.0f, 0.0f };
@@ -434,89 +697,90 @@ SDL_bool _painter_fill_command_buffers(EsPainter* painter) {
     clear_values[1].color = color_value1;
     clear_values[0].depthStencil = depth_value0;
     clear_values[1].depthStencil = depth_value1;
-    for (Uint32 i=0; i<painter->swapchain_image_count; i++) {
-        VkCommandBufferBeginInfo command_buffer_begin_info;
-        command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        command_buffer_begin_info.pNext = NULL;
-        command_buffer_begin_info.flags = 0;
-        command_buffer_begin_info.pInheritanceInfo = NULL;
-        VkRenderPassBeginInfo render_pass_begin_info;
-        render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        render_pass_begin_info.pNext = NULL;
-        render_pass_begin_info.renderArea.offset.x = 0;
-        render_pass_begin_info.renderArea.offset.y = 0;
-        VkBuffer vertex_buffers[1];
-        VkDeviceSize offsets[1];
-        offsets[0] = 0;
-
-        result = vkBeginCommandBuffer(painter->shadow_map_command_buffers[i], &command_buffer_begin_info);
-        if (result != VK_SUCCESS) return _painter_custom_error("Setup Error", "Could not begin sm command buffer");
-        render_pass_begin_info.renderPass = painter->shadow_map_render_pass;
-        render_pass_begin_info.framebuffer = painter->shadow_map_framebuffer;
-        // SameSizeShadowMapCheck
-        render_pass_begin_info.renderArea.extent.width = painter->shadow_map_size.x;
-        render_pass_begin_info.renderArea.extent.height = painter->shadow_map_size.y;
-        // render_pass_begin_info.renderArea.extent = painter->swapchain_extent;
-        render_pass_begin_info.clearValueCount = 1;
-        render_pass_begin_info.pClearValues = shadow_map_clear_values;
-        vkCmdBeginRenderPass(painter->shadow_map_command_buffers[i], &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
-        for (Uint32 j=0; j<painter->num_shaders; j++) {
-            vertex_buffers[0] = painter->shaders[j].vertex_buffer;
-            vkCmdBindPipeline(painter->shadow_map_command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shaders[j].shadow_map_pipeline);
-            vkCmdBindVertexBuffers(painter->shadow_map_command_buffers[i], 0, 1, vertex_buffers, offsets);
-            vkCmdBindIndexBuffer(painter->shadow_map_command_buffers[i], painter->shaders[j].index_buffer, 0, VK_INDEX_TYPE_UINT32);
-            vkCmdBindDescriptorSets(painter->shadow_map_command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shaders[j].pipeline_layout, 0, 1, &painter->shaders[j].shadow_map_descriptor_sets[i], 0, NULL);
-            vkCmdDrawIndexed(painter->shadow_map_command_buffers[i], painter->shaders[j].num_indices, 1, 0, 0, 0);
-        }
-        vkCmdEndRenderPass(painter->shadow_map_command_buffers[i]);
-        result = vkEndCommandBuffer(painter->shadow_map_command_buffers[i]);
-        if (result != VK_SUCCESS) return _painter_custom_error("Setup Error", "Could not end sm command buffer");
-
-        render_pass_begin_info.renderPass = painter->render_pass;
-        render_pass_begin_info.framebuffer = painter->swapchain_framebuffers[i];
-        render_pass_begin_info.renderArea.extent = painter->swapchain_extent;
-        render_pass_begin_info.clearValueCount = 2;
-        render_pass_begin_info.pClearValues = clear_values;
-        result = vkBeginCommandBuffer(painter->command_buffers[i], &command_buffer_begin_info);
-        if (result != VK_SUCCESS) return _painter_custom_error("Setup Error", "Could not begin command buffer");
-        vkCmdBeginRenderPass(painter->command_buffers[i], &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
-
-        /*
-        vertex_buffers[0] = painter->shadow_map_shader->vertex_buffer;
-        vkCmdBindPipeline(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shadow_map_shader->pipeline);
-        vkCmdBindVertexBuffers(painter->command_buffers[i], 0, 1, vertex_buffers, offsets);
-        vkCmdBindIndexBuffer(painter->command_buffers[i], painter->shadow_map_shader->index_buffer, 0, VK_INDEX_TYPE_UINT32);
-        vkCmdBindDescriptorSets(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shadow_map_shader->pipeline_layout, 0, 1, &painter->shadow_map_shader->descriptor_sets[i], 0, NULL);
-        vkCmdDrawIndexed(painter->command_buffers[i], painter->shadow_map_shader->num_indices, 1, 0, 0, 0);
-        */
-
-        vertex_buffers[0] = painter->skybox_shader->vertex_buffer;
-        vkCmdBindPipeline(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->skybox_shader->pipeline);
-        vkCmdBindVertexBuffers(painter->command_buffers[i], 0, 1, vertex_buffers, offsets);
-        vkCmdBindIndexBuffer(painter->command_buffers[i], painter->skybox_shader->index_buffer, 0, VK_INDEX_TYPE_UINT32);
-        vkCmdBindDescriptorSets(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->skybox_shader->pipeline_layout, 0, 1, &painter->skybox_shader->descriptor_sets[i], 0, NULL);
-        vkCmdDrawIndexed(painter->command_buffers[i], painter->skybox_shader->num_indices, 1, 0, 0, 0);
-
-        for (Uint32 j=0; j<painter->num_shaders; j++) {
-            vertex_buffers[0] = painter->shaders[j].vertex_buffer;
-            vkCmdBindPipeline(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shaders[j].pipeline);
-            vkCmdBindVertexBuffers(painter->command_buffers[i], 0, 1, vertex_buffers, offsets);
-            vkCmdBindIndexBuffer(painter->command_buffers[i], painter->shaders[j].index_buffer, 0, VK_INDEX_TYPE_UINT32);
-            vkCmdBindDescriptorSets(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shaders[j].pipeline_layout, 0, 1, &painter->shaders[j].descriptor_sets[i], 0, NULL);
-            vkCmdDrawIndexed(painter->command_buffers[i], painter->shaders[j].num_indices, 1, 0, 0, 0);
-        }
+    VkCommandBufferBeginInfo command_buffer_begin_info;
+    command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    command_buffer_begin_info.pNext = NULL;
+    command_buffer_begin_info.flags = 0;
+    command_buffer_begin_info.pInheritanceInfo = NULL;
+    VkRenderPassBeginInfo render_pass_begin_info;
+    render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_begin_info.pNext = NULL;
+    render_pass_begin_info.renderArea.offset.x = 0;
+    render_pass_begin_info.renderArea.offset.y = 0;
+    VkBuffer vertex_buffers[2];
+    VkDeviceSize offsets[2];
+    offsets[0] = 0;
+    offsets[1] = 0;
+
+    result = vkBeginCommandBuffer(painter->shadow_map_command_buffers[i], &command_buffer_begin_info);
+    if (result != VK_SUCCESS) return _painter_custom_error("Setup Error", "Could not begin sm command buffer");
+    render_pass_begin_info.renderPass = painter->shadow_map_render_pass;
+    render_pass_begin_info.framebuffer = painter->shadow_map_framebuffer;
+    // SameSizeShadowMapCheck
+    render_pass_begin_info.renderArea.extent.width = painter->shadow_map_size.x;
+    render_pass_begin_info.renderArea.extent.height = painter->shadow_map_size.y;
+    // render_pass_begin_info.renderArea.extent = painter->swapchain_extent;
+    render_pass_begin_info.clearValueCount = 1;
+    render_pass_begin_info.pClearValues = shadow_map_clear_values;
+    vkCmdBeginRenderPass(painter->shadow_map_command_buffers[i], &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+    for (Uint32 j=0; j<painter->num_shaders; j++) {
+        vertex_buffers[0] = painter->shaders[j].vertex_buffer;
+        vertex_buffers[1] = painter->shaders[j].num_instances ? painter->shaders[j].instance_buffers[i] : VK_NULL_HANDLE;
+        vkCmdBindPipeline(painter->shadow_map_command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shaders[j].shadow_map_pipeline);
+        vkCmdBindVertexBuffers(painter->shadow_map_command_buffers[i], 0, painter->shaders[j].num_instances ? 2 : 1, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(painter->shadow_map_command_buffers[i], painter->shaders[j].index_buffer, 0, VK_INDEX_TYPE_UINT32);
+        vkCmdBindDescriptorSets(painter->shadow_map_command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shaders[j].pipeline_layout, 0, 1, &painter->shaders[j].shadow_map_descriptor_sets[i], 0, NULL);
+        _painter_draw_shader(painter->shadow_map_command_buffers[i], &painter->shaders[j], i);
+    }
+    vkCmdEndRenderPass(painter->shadow_map_command_buffers[i]);
+    result = vkEndCommandBuffer(painter->shadow_map_command_buffers[i]);
+    if (result != VK_SUCCESS) return _painter_custom_error("Setup Error", "Could not end sm command buffer");
+
+    render_pass_begin_info.renderPass = painter->render_pass;
+    render_pass_begin_info.framebuffer = painter->swapchain_framebuffers[i];
+    render_pass_begin_info.renderArea.extent = painter->swapchain_extent;
+    render_pass_begin_info.clearValueCount = 2;
+    render_pass_begin_info.pClearValues = clear_values;
+    result = vkBeginCommandBuffer(painter->command_buffers[i], &command_buffer_begin_info);
+    if (result != VK_SUCCESS) return _painter_custom_error("Setup Error", "Could not begin command buffer");
+    vkCmdBeginRenderPass(painter->command_buffers[i], &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+
+    /*
+    vertex_buffers[0] = painter->shadow_map_shader->vertex_buffer;
+    vkCmdBindPipeline(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shadow_map_shader->pipeline);
+    vkCmdBindVertexBuffers(painter->command_buffers[i], 0, 1, vertex_buffers, offsets);
+    vkCmdBindIndexBuffer(painter->command_buffers[i], painter->shadow_map_shader->index_buffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdBindDescriptorSets(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shadow_map_shader->pipeline_layout, 0, 1, &painter->shadow_map_shader->descriptor_sets[i], 0, NULL);
+    vkCmdDrawIndexed(painter->command_buffers[i], painter->shadow_map_shader->num_indices, 1, 0, 0, 0);
+    */
+
+    vertex_buffers[0] = painter->skybox_shader->vertex_buffer;
+    vkCmdBindPipeline(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->skybox_shader->pipeline);
+    vkCmdBindVertexBuffers(painter->command_buffers[i], 0, 1, vertex_buffers, offsets);
+    vkCmdBindIndexBuffer(painter->command_buffers[i], painter->skybox_shader->index_buffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdBindDescriptorSets(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->skybox_shader->pipeline_layout, 0, 1, &painter->skybox_shader->descriptor_sets[i], 0, NULL);
+    vkCmdDrawIndexed(painter->command_buffers[i], painter->skybox_shader->num_indices, 1, 0, 0, 0);
+
+    for (Uint32 j=0; j<painter->num_shaders; j++) {
+        vertex_buffers[0] = painter->shaders[j].vertex_buffer;
+        vertex_buffers[1] = painter->shaders[j].num_instances ? painter->shaders[j].instance_buffers[i] : VK_NULL_HANDLE;
+        vkCmdBindPipeline(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shaders[j].pipeline);
+        vkCmdBindVertexBuffers(painter->command_buffers[i], 0, painter->shaders[j].num_instances ? 2 : 1, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(painter->command_buffers[i], painter->shaders[j].index_buffer, 0, VK_INDEX_TYPE_UINT32);
+        vkCmdBindDescriptorSets(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->shaders[j].pipeline_layout, 0, 1, &painter->shaders[j].descriptor_sets[i], 0, NULL);
+        _painter_draw_shader(painter->command_buffers[i], &painter->shaders[j], i);
+    }
 
-        vertex_buffers[0] = painter->ui_shader->vertex_buffer;
-        vkCmdBindPipeline(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->ui_shader->pipeline);
-        vkCmdBindVertexBuffers(painter->command_buffers[i], 0, 1, vertex_buffers, offsets);
-        vkCmdBindIndexBuffer(painter->command_buffers[i], painter->ui_shader->index_buffer, 0, VK_INDEX_TYPE_UINT32);
-        vkCmdBindDescriptorSets(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->ui_shader->pipeline_layout, 0, 1, &painter->ui_shader->descriptor_sets[i], 0, NULL);
-        vkCmdDrawIndexed(painter->command_buffers[i], painter->ui_shader->num_indices, 1, 0, 0, 0);
+    vertex_buffers[0] = painter->ui_shader->vertex_buffer;
+    vkCmdBindPipeline(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->ui_shader->pipeline);
+    vkCmdBindVertexBuffers(painter->command_buffers[i], 0, 1, vertex_buffers, offsets);
+    vkCmdBindIndexBuffer(painter->command_buffers[i], painter->ui_shader->index_buffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdBindDescriptorSets(painter->command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, painter->ui_shader->pipeline_layout, 0, 1, &painter->ui_shader->descriptor_sets[i], 0, NULL);
+    vkCmdDrawIndexed(painter->command_buffers[i], painter->ui_shader->num_indices, 1, 0, 0, 0);
 
-        vkCmdEndRenderPass(painter->command_buffers[i]);
-        result = vkEndCommandBuffer(painter->command_buffers[i]);
-        if (result != VK_SUCCESS) return _painter_custom_error("Setup Error", "Could not end command buffer");
-    }
+    vkCmdEndRenderPass(painter->command_buffers[i]);
+    result = vkEndCommandBuffer(painter->command_buffers[i]);
+    if (result != VK_SUCCESS) return _painter_custom_error("Setup Error", "Could not end command buffer");
     return SDL_TRUE;
 }
 
@@ -526,10 +790,11 @@ SDL_bool painter_paint_frame(EsPainter* painter) {
     VkResult result;
     SDL_bool sdl_result;
 
-    if (painter->world->refresh_tree) {
-        SDL_Log("reloading tree buffer\n");
-        sdl_result = _painter_load_buffer_from_geom(painter, &painter->world->tree_geom, &painter->shaders[0]);
-    }
+    // Trees are rebuilt in the background, and only swapped in here once they're ready.
+    if (painter->world->refresh_tree)
+        painter->tree_rebuild.pending = SDL_TRUE;
+    sdl_result = _painter_update_tree_rebuild(painter);
+    if (!sdl_result) return SDL_FALSE;
 
     if (painter->world->refresh_shaders) {
         SDL_Log("refreshing shaders");
@@ -550,6 +815,21 @@ SDL_bool painter_paint_frame(EsPainter* painter) {
         painter_cleanup(painter);
         return SDL_FALSE;
     }
+    // Everything that is per image is written below, so the last frame that used this image
+    // has to be done with it first.
+    if (painter->images_in_flight[image_index] != VK_NULL_HANDLE)
+        vkWaitForFences(painter->device, 1, &painter->images_in_flight[image_index], VK_TRUE, UINT64_MAX);
+    painter->images_in_flight[image_index] = painter->in_flight_fences[painter->frame_index];
+    // The tree buffers were swapped since this image was recorded. Its last frame is done by
+    // now, so only this image is recorded again, and the other images are left to finish.
+    if (painter->stale_command_buffers[image_index]) {
+        sdl_result = _painter_fill_command_buffer(painter, image_index);
+        if (!sdl_result) return _painter_custom_error("Rendering Error", "Could not fill commandbuffers");
+        painter->stale_command_buffers[image_index] = SDL_FALSE;
+        painter->num_stale_command_buffers--;
+        if (painter->num_stale_command_buffers == 0)
+            _painter_release_retired_tree_buffers(painter);
+    }
 
     painter->uniform_buffer_object.time = (float) (SDL_GetTicks()/1000.0f);
     vec3 target = painter->world->target;
@@ -563,6 +843,14 @@ SDL_bool painter_paint_frame(EsPainter* painter) {
     mat4 light_view = look_at(light_position, painter->camera_position, build_vec3(0.0f, 1.0f, 0.0f));
     painter->uniform_buffer_object.light_proj = mat4_mat4_multiply(light_view, light_projection);
 
+    // Once the trees are rebuilt from another seed the atlas doesn't match them anymore, so
+    // they are all drawn as meshes.
+    ShaderData* impostor_shader = NULL;
+    if (painter->num_shaders > 4 && painter->tree_buffers_seed == painter->impostor_seed)
+        impostor_shader = &painter->shaders[4];
+    sdl_result = _painter_update_instances(painter, &painter->shaders[0], impostor_shader, image_index);
+    if (!sdl_result) return _painter_custom_error("Rendering Error", "Could not update tree instances");
+
     void* uniform_data;
     result = vkMapMemory(painter->device, painter->uniform_buffers_memory[image_index], 0, painter->uniform_buffer_size, 0, &uniform_data);
     if (result != VK_SUCCESS) return _painter_custom_error("Rendering Error", "Could not map uniform memory");
@@ -575,16 +863,12 @@ SDL_bool painter_paint_frame(EsPainter* painter) {
     vec3 plane_xaxis = vec3_normalize(vec3_cross(painter->world->player_transform.up, plane_zaxis));
     vec3 plane_yaxis = vec3_normalize(vec3_cross(plane_zaxis, plane_xaxis));
     mat4 plane_transform = build_mat4(
-            plane_xaxis.x, plane_yaxis.x, plane_zaxis.x, 0.0f,
-            plane_xaxis.y, plane_yaxis.y, plane_zaxis.y, 0.0f,
-            plane_xaxis.z, plane_yaxis.z, plane_zaxis.z, 0.0f,
+            plane_xaxis.x, plane_yaxis.x, plane_zaxis.x, plane_position.x,
+            plane_xaxis.y, plane_yaxis.y, plane_zaxis.y, plane_position.y,
+            plane_xaxis.z, plane_yaxis.z, plane_zaxis.z, plane_position.z,
             0.0f,          0.0f,          0.0f,          1.0f
     );
-    for (Uint32 i=0; i<painter->shaders[3].num_vertices; i++) {
-        vec3 og_pos = painter->shaders[3].original_positions[i];
-        vec4 pos = build_vec4(og_pos.x, og_pos.y, og_pos.z, 1.0f);
-        painter->shaders[3].vertices[i].pos = vec3_add(plane_position, vec3_from_vec4(mat4_vec4_multiply(plane_transform, pos)));
-    }
+    mat4_transform_points(plane_transform, painter->shaders[3].original_positions, painter->shaders[3].num_vertices, &painter->shaders[3].vertices[0].pos, sizeof(EsVertex));
     void* plane_vertices;
     result = vkMapMemory(painter->device, painter->shaders[3].vertex_staging_buffer_memory, 0, painter->shaders[3].vertex_staging_buffer_size, 0, &plane_vertices);
     if (result != VK_SUCCESS) return _painter_custom_error("Rendering Error", "Could not map plane vertices");
@@ -626,9 +910,6 @@ SDL_bool painter_paint_frame(EsPainter* painter) {
     SDL_memcpy(uniform_data, &painter->uniform_buffer_object, (size_t) painter->uniform_buffer_size);
     vkUnmapMemory(painter->device, painter->uniform_buffers_memory[image_index]);
 
-    if (painter->images_in_flight[image_index] != VK_NULL_HANDLE)
-        vkWaitForFences(painter->device, 1, &painter->images_in_flight[image_index], VK_TRUE, UINT64_MAX);
-    painter->images_in_flight[image_index] = painter->in_flight_fences[painter->frame_index];
     VkSemaphore wait_semaphores[1];
     wait_semaphores[0] = painter->image_available_semaphores[painter->frame_index];
     VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
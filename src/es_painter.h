@@ -18,6 +18,7 @@ typedef enum {
     SKYBOX_SHADER,
     UI_SHADER,
     SHADOW_MAP_SHADER,
+    IMPOSTOR_SHADER,
     SHADERTYPE_COUNT,
 } ShaderType;
 
@@ -34,6 +35,18 @@ typedef struct {
     int state;
 } UniformBufferObject;
 
+// A range of instances that share a mesh. Each tree archetype is one of these. The mesh can
+// have up to TREES_NUM_LODS index ranges, and every frame each instance picks one of them
+// based on how big the bounding sphere is on screen.
+typedef struct {
+    Uint32 first_instance;
+    Uint32 num_instances;
+    float radius;
+    Uint32 num_lods;
+    Uint32 first_index[TREES_NUM_LODS];
+    Uint32 num_indices[TREES_NUM_LODS];
+} InstanceDraw;
+
 typedef struct {
     const char* shader_name;
     const char* vertex_shader;
@@ -42,15 +55,30 @@ typedef struct {
     const char* shadow_map_fragment_shader;
     const char* texture_filepath;
     EsVertex* vertices;
+    // Packed shaders upload packed_vertices instead of vertices, and their pipelines read the
+    // packed vertex format.
+    SDL_bool packed;
+    EsPackedVertex* packed_vertices;
     vec3* original_positions;
     Uint32* indices;
     Uint32 num_vertices;
     Uint32 num_indices;
+    EsInstance* instances;
+    Uint32 num_instances;
+    InstanceDraw* draws;
+    Uint32 num_draws;
+    // The instances sorted by draw and lod for this frame, and one indirect draw for each.
+    EsInstance* frame_instances;
+    Uint32* instance_lods;
+    VkDrawIndexedIndirectCommand* indirect_draws;
+    Uint32 num_indirect_draws;
+    Uint32 indirect_buffer_size;
     Uint32 mip_levels;
     Uint32 vertex_buffer_size;
     Uint32 vertex_staging_buffer_size;
     Uint32 index_buffer_size;
     Uint32 index_staging_buffer_size;
+    Uint32 instance_buffer_size;
     VkBuffer vertex_staging_buffer;
     VkDeviceMemory vertex_staging_buffer_memory;
     VkBuffer index_staging_buffer;
@@ -59,6 +87,14 @@ typedef struct {
     VkDeviceMemory vertex_buffer_memory;
     VkBuffer index_buffer;
     VkDeviceMemory index_buffer_memory;
+    // The instance and indirect buffers are written every frame, so there is one of each per
+    // swapchain image, host visible and mapped for as long as they exist.
+    VkBuffer* instance_buffers;
+    VkDeviceMemory* instance_buffers_memory;
+    void** instance_buffers_mapped;
+    VkBuffer* indirect_buffers;
+    VkDeviceMemory* indirect_buffers_memory;
+    void** indirect_buffers_mapped;
     VkImage texture_image;
     VkDeviceMemory texture_image_memory;
     VkImageView texture_image_view;
@@ -77,6 +113,40 @@ typedef struct {
     VkDescriptorSet* shadow_map_descriptor_sets;
 } ShaderData;
 
+typedef enum {
+    TREE_REBUILD_IDLE,
+    TREE_REBUILD_RUNNING,
+    TREE_REBUILD_READY,
+    TREE_REBUILD_FAILED,
+} TreeRebuildState;
+
+// The tree archetypes are rebuilt on a worker thread into a back mesh and back buffers,
+// and the painter swaps them in at the start of a frame once they are ready, so that a rebuild
+// never stalls rendering. While the state is TREE_REBUILD_RUNNING, everything else in here
+// but the retired buffers belongs to the worker.
+typedef struct {
+    SDL_Thread* thread;
+    SDL_atomic_t state;
+    // Another rebuild was asked for while one was running.
+    SDL_bool pending;
+    Uint32 seed;
+    EsIndexedMesh mesh;
+    // Only the index ranges and the radius of each draw are filled in.
+    InstanceDraw draws[TREE_ARCHETYPES];
+    Uint32 num_vertices;
+    Uint32 num_indices;
+    Uint32 vertex_buffer_size;
+    Uint32 index_buffer_size;
+    VkBuffer vertex_buffer;
+    VkDeviceMemory vertex_buffer_memory;
+    VkBuffer index_buffer;
+    VkDeviceMemory index_buffer_memory;
+    // The buffers that the last swap took out, with their staging buffers if they had any.
+    // They are destroyed once no image has command buffers that draw from them.
+    VkBuffer retired_buffers[4];
+    VkDeviceMemory retired_buffers_memory[4];
+} TreeRebuild;
+
 typedef struct {
     SDL_Window* window;
     VkInstance instance;
@@ -99,6 +169,10 @@ typedef struct {
     VkFence* in_flight_fences;
     VkFence* shadow_map_fences;
     VkFence* images_in_flight;
+    // Set for each image when the tree buffers are swapped, and cleared once the image's
+    // command buffers are recorded again.
+    SDL_bool* stale_command_buffers;
+    Uint32 num_stale_command_buffers;
     VkFence* shadows_in_flight;
     VkQueue presentation_queue;
     VkFormat swapchain_image_format;
@@ -128,11 +202,35 @@ typedef struct {
     ShaderData* shaders;
     EsWorld* world;
     EsUI* ui;
+    TreeRebuild tree_rebuild;
+    // The impostor atlas is baked from the trees of impostor_seed, so impostors are only drawn
+    // while the tree buffers are from the same seed.
+    char impostor_atlas_path[128];
+    Uint32 impostor_seed;
+    Uint32 tree_buffers_seed;
+    // Set while an impostor bake is running, so that painter_cleanup releases it if one of the
+    // painter helpers fails part way through the bake.
+    struct EsImpostorBaker* impostor_baker;
 } EsPainter;
 
 extern SDL_bool painter_initialise(EsPainter* painter);
+// Only sets up a device and a command pool, with no window, for offline work like baking the
+// impostor atlas. If prefer_cpu is set, a software device is picked if there is one.
+extern SDL_bool painter_initialise_headless(EsPainter* painter, SDL_bool prefer_cpu);
+extern SDL_bool painter_bake_impostors(EsPainter* painter, Uint32 seed);
 extern SDL_bool painter_paint_frame(EsPainter* painter);
 extern void painter_cleanup(EsPainter* painter);
 extern Sint64 painter_read_shader_file(const char* filename, Uint32** buffer);
 
+// The impostor baker builds on these. They are defined in es_painter_helpers.h.
+extern SDL_bool _painter_cleanup_error(EsPainter* painter, const char* header, const char* message);
+extern void _painter_shader_cleanup(EsPainter* painter, ShaderData* shader);
+extern SDL_bool _painter_create_buffer(EsPainter* painter, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer* buffer, VkDeviceMemory* bufferMemory);
+extern SDL_bool _painter_load_buffer_via_staging(EsPainter* painter, void* data, VkDeviceMemory* memory, VkBuffer* src, VkBuffer* dst, Uint32 size);
+extern SDL_bool _painter_create_image(EsPainter* painter, Uint32 width, Uint32 height, Uint32 mip_levels, VkSampleCountFlagBits num_samples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage* image, VkDeviceMemory* image_memory, Uint32 array_layers, SDL_bool is_cube);
+extern SDL_bool _painter_create_image_view(EsPainter* painter, VkFormat format, VkImageAspectFlags aspect_flags, VkImageViewType image_view_type, Uint32 mip_levels, VkImage* image, VkImageView* image_view);
+extern VkCommandBuffer _painter_begin_single_use_command_buffer(EsPainter* painter);
+extern SDL_bool _painter_end_single_use_command_buffer(EsPainter* painter, VkCommandBuffer* command_buffer);
+extern SDL_bool _painter_load_image_and_sampler(EsPainter* painter, const char* filepath, ShaderData* shader, Uint8* memory, int width, int height, int channels, SDL_bool from_memory, ShaderType shader_type);
+
 #endif
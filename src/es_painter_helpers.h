@@ -2,6 +2,9 @@ extern void _painter_cleanup_swapchain(EsPainter* painter);
 extern void _painter_shader_cleanup(EsPainter* painter, ShaderData* shader);
 extern SDL_bool _painter_recreate_swapchain(EsPainter* painter);
 extern SDL_bool _painter_create_buffer(EsPainter* painter, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer* buffer, VkDeviceMemory* bufferMemory);
+extern SDL_bool _painter_try_create_buffer(EsPainter* painter, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer* buffer, VkDeviceMemory* bufferMemory);
+extern SDL_bool _painter_create_mapped_buffers(EsPainter* painter, VkDeviceSize size, VkBufferUsageFlags usage, void* data, VkBuffer** buffers, VkDeviceMemory** buffers_memory, void*** buffers_mapped);
+extern void _painter_destroy_mapped_buffers(EsPainter* painter, VkBuffer** buffers, VkDeviceMemory** buffers_memory, void*** buffers_mapped);
 extern Uint32 _painter_find_memory_type(EsPainter* painter, VkMemoryPropertyFlags property_flags, VkMemoryRequirements* memory_requirements);
 extern SDL_bool _painter_transition_image_layout(EsPainter* painter, VkImage* image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout, Uint32 mip_levels, Uint32 layer_count);
 extern SDL_bool _painter_copy_buffer_to_image(EsPainter* painter, VkBuffer* buffer, VkImage* image, Uint32 width, Uint32 height);
@@ -14,13 +17,22 @@ extern SDL_bool _painter_generate_mipmaps(EsPainter* painter, VkImage* image, Vk
 extern SDL_bool _painter_initialise_sdl_window(EsPainter* painter, const char* window_name);
 extern SDL_bool _painter_init_instance(EsPainter* painter);
 extern SDL_bool _painter_select_physical_device(EsPainter* painter);
+extern SDL_bool _painter_create_headless_device(EsPainter* painter, SDL_bool prefer_cpu);
+extern SDL_bool _painter_create_synchronisation_elements(EsPainter* painter);
+extern SDL_bool _painter_create_device_and_queues(EsPainter* painter);
+extern SDL_bool _painter_load_shaders(EsPainter* painter, ShaderData* shader);
+extern SDL_bool _painter_create_descriptor_set_layout(EsPainter* painter, ShaderData* shader);
+extern SDL_bool _painter_create_pipeline(EsPainter* painter, ShaderData* shader);
+extern SDL_bool _painter_load_buffer_via_staging(EsPainter* painter, void* data, VkDeviceMemory* memory, VkBuffer* src, VkBuffer* dst, Uint32 size);
+extern SDL_bool _painter_initialise_sdl_window(EsPainter* painter, const char* window_name);
+extern SDL_bool _painter_init_instance(EsPainter* painter);
+extern SDL_bool _painter_select_physical_device(EsPainter* painter);
 extern SDL_bool _painter_create_synchronisation_elements(EsPainter* painter);
 extern SDL_bool _painter_create_device_and_queues(EsPainter* painter);
 extern SDL_bool _painter_load_shaders(EsPainter* painter, ShaderData* shader);
 extern SDL_bool _painter_create_descriptor_set_layout(EsPainter* painter, ShaderData* shader);
 extern SDL_bool _painter_create_pipeline(EsPainter* painter, ShaderData* shader);
 extern SDL_bool _painter_load_buffer_via_staging(EsPainter* painter, void* data, VkDeviceMemory* memory, VkBuffer* src, VkBuffer* dst, Uint32 size);
-extern void _painter_read_obj_file(const char* filename, const int is_mtl, const char *obj_filename, char** data, size_t* len);
 extern SDL_bool _painter_swapchain_renderpass_init(EsPainter* painter);
 extern SDL_bool _painter_custom_error(const char* header, const char* message);
 extern SDL_bool _painter_cleanup_error(EsPainter* painter, const char* header, const char* message);
@@ -29,65 +41,197 @@ extern SDL_bool _painter_load_cubemap_and_sampler(EsPainter* painter, const char
 extern SDL_bool _painter_create_commandbuffers(EsPainter* painter);
 extern SDL_bool _painter_create_descriptor_sets(EsPainter* painter, ShaderData* shader);
 extern SDL_bool _painter_init_shader_data(EsPainter* painter, ShaderData* shader, ShaderType type);
-extern SDL_bool _painter_load_buffer_from_geom(EsPainter* painter, EsGeometry* geom, ShaderData* shader);
+extern SDL_bool _painter_update_tree_rebuild(EsPainter* painter);
+extern void _painter_cleanup_tree_rebuild(EsPainter* painter);
+extern void _painter_release_retired_tree_buffers(EsPainter* painter);
+extern SDL_bool _painter_refill_command_buffers(EsPainter* painter);
 extern SDL_bool _painter_shadow_map_init(EsPainter* painter);
 extern SDL_bool _painter_refresh_shaders(EsPainter* painter);
 SDL_bool _painter_create_swapchain(EsPainter* painter);
 
-SDL_bool _painter_load_buffer_from_geom(EsPainter* painter, EsGeometry* geom, ShaderData* shader) {
+void _painter_destroy_tree_rebuild_buffers(EsPainter* painter, TreeRebuild* rebuild) {
+    if (rebuild->vertex_buffer)
+        vkDestroyBuffer(painter->device, rebuild->vertex_buffer, NULL);
+    if (rebuild->vertex_buffer_memory)
+        vkFreeMemory(painter->device, rebuild->vertex_buffer_memory, NULL);
+    if (rebuild->index_buffer)
+        vkDestroyBuffer(painter->device, rebuild->index_buffer, NULL);
+    if (rebuild->index_buffer_memory)
+        vkFreeMemory(painter->device, rebuild->index_buffer_memory, NULL);
+    rebuild->vertex_buffer = VK_NULL_HANDLE;
+    rebuild->vertex_buffer_memory = VK_NULL_HANDLE;
+    rebuild->index_buffer = VK_NULL_HANDLE;
+    rebuild->index_buffer_memory = VK_NULL_HANDLE;
+}
+
+void _painter_release_retired_tree_buffers(EsPainter* painter) {
+    // Only call this once nothing that is in flight draws from the retired buffers.
+    TreeRebuild* rebuild = &painter->tree_rebuild;
+    for (Uint32 i=0; i<4; i++) {
+        if (rebuild->retired_buffers[i])
+            vkDestroyBuffer(painter->device, rebuild->retired_buffers[i], NULL);
+        if (rebuild->retired_buffers_memory[i])
+            vkFreeMemory(painter->device, rebuild->retired_buffers_memory[i], NULL);
+        rebuild->retired_buffers[i] = VK_NULL_HANDLE;
+        rebuild->retired_buffers_memory[i] = VK_NULL_HANDLE;
+    }
+}
+
+SDL_bool _painter_prepare_tree_rebuild(EsPainter* painter, TreeRebuild* rebuild) {
+    // Runs on the rebuild thread. The buffers are host visible, so the mesh is packed straight
+    // into the buffers that will be drawn from, and the render thread has nothing to copy.
+    // The archetypes are small next to the rest of the scene, so they can do without device
+    // local memory.
     SDL_bool sdl_result;
-    // TODO (09 Dec 2020 sam): We should be reallocating memory and buffers if there is not enought
-    // memory available.
-    // if (geom->num_vertices > 100000 || geom->num_faces*3 > 1000000) {
-    //     SDL_Log("Not enough memory. Sorry");
-    //     return SDL_FALSE;
-    // }
-    shader->num_vertices = geom->num_vertices;
-    shader->vertices = (EsVertex*) SDL_malloc(shader->num_vertices * sizeof(EsVertex));
-    shader->num_indices = geom->num_faces * 3;
-    shader->indices = (Uint32*) SDL_malloc(shader->num_indices * sizeof(Uint32));
-    shader->vertex_staging_buffer_size = shader->num_vertices * sizeof(EsVertex);
-    shader->index_staging_buffer_size = shader->num_indices * sizeof(Uint32);
-    for (Uint32 i=0; i<geom->num_vertices; i++) {
-        EsVertex vert;
-        vert.pos = geom->vertices[i];
-        vert.color.x = 0.0;
-        vert.color.y = 0.0;
-        vert.color.z = 0.0;
-        shader->vertices[i] = vert;
-    }
-    for (Uint32 i=0; i<geom->num_faces; i++) {
-        EsFace face = geom->faces[i];
-        EsVertex vert_x = shader->vertices[face.verts.x];
-        EsVertex vert_y = shader->vertices[face.verts.y];
-        EsVertex vert_z = shader->vertices[face.verts.z];
-        vert_x.tex = geom->textures[face.texs.x];
-        vert_y.tex = geom->textures[face.texs.y];
-        vert_z.tex = geom->textures[face.texs.z];
-        vert_x.normal = geom->normals[face.norms.x];
-        vert_y.normal = geom->normals[face.norms.y];
-        vert_z.normal = geom->normals[face.norms.z];
-        vert_x.color = geom->colors[face.cols.x];
-        vert_y.color = geom->colors[face.cols.y];
-        vert_z.color = geom->colors[face.cols.z];
-        shader->vertices[face.verts.x] = vert_x;
-        shader->vertices[face.verts.y] = vert_y;
-        shader->vertices[face.verts.z] = vert_z;
-        shader->indices[i*3 + 0] = face.verts.x;
-        shader->indices[i*3 + 1] = face.verts.y;
-        shader->indices[i*3 + 2] = face.verts.z;
-    }
-
-    sdl_result = _painter_load_buffer_via_staging(painter, shader->vertices, &shader->vertex_staging_buffer_memory, &shader->vertex_staging_buffer, &shader->vertex_buffer, shader->vertex_staging_buffer_size);
-    if (!sdl_result) return _painter_cleanup_error(painter, "Could not copy vertices to buffer.", shader->shader_name);
-    sdl_result = _painter_load_buffer_via_staging(painter, shader->indices, &shader->index_staging_buffer_memory, &shader->index_staging_buffer, &shader->index_buffer, shader->index_staging_buffer_size);
-    if (!sdl_result) return _painter_cleanup_error(painter, "Could not copy indices to buffer.", shader->shader_name);
-    SDL_free(shader->vertices);
-    SDL_free(shader->indices);
+    VkResult result;
+    Uint32 archetype_faces[TREE_ARCHETYPES*TREE_LODS+1];
+    geom_clear_indexed_mesh(&rebuild->mesh);
+    sdl_result = _painter_build_tree_archetypes(&rebuild->mesh, rebuild->seed, rebuild->draws, archetype_faces);
+    if (!sdl_result) return SDL_FALSE;
+    rebuild->num_vertices = rebuild->mesh.num_vertices;
+    rebuild->num_indices = rebuild->mesh.num_indices;
+    rebuild->vertex_buffer_size = rebuild->num_vertices * sizeof(EsPackedVertex);
+    rebuild->index_buffer_size = rebuild->num_indices * sizeof(Uint32);
+
+    VkMemoryPropertyFlags property_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    sdl_result = _painter_try_create_buffer(painter, rebuild->vertex_buffer_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, property_flags, &rebuild->vertex_buffer, &rebuild->vertex_buffer_memory);
+    if (!sdl_result) return SDL_FALSE;
+    sdl_result = _painter_try_create_buffer(painter, rebuild->index_buffer_size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, property_flags, &rebuild->index_buffer, &rebuild->index_buffer_memory);
+    if (!sdl_result) return SDL_FALSE;
+
+    void* vertex_data;
+    void* index_data;
+    result = vkMapMemory(painter->device, rebuild->vertex_buffer_memory, 0, rebuild->vertex_buffer_size, 0, &vertex_data);
+    if (result != VK_SUCCESS) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not map tree vertices\n");
+        return SDL_FALSE;
+    }
+    result = vkMapMemory(painter->device, rebuild->index_buffer_memory, 0, rebuild->index_buffer_size, 0, &index_data);
+    if (result != VK_SUCCESS) {
+        vkUnmapMemory(painter->device, rebuild->vertex_buffer_memory);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not map tree indices\n");
+        return SDL_FALSE;
+    }
+    geom_pack_vertices(rebuild->mesh.vertices, rebuild->num_vertices, (EsPackedVertex*) vertex_data);
+    SDL_memcpy(index_data, rebuild->mesh.indices, rebuild->index_buffer_size);
+    vkUnmapMemory(painter->device, rebuild->vertex_buffer_memory);
+    vkUnmapMemory(painter->device, rebuild->index_buffer_memory);
+    return SDL_TRUE;
+}
+
+int _painter_tree_rebuild_thread(void* data) {
+    EsPainter* painter = (EsPainter*) data;
+    TreeRebuild* rebuild = &painter->tree_rebuild;
+    Uint32 timer_start = SDL_GetTicks();
+    SDL_bool sdl_result = _painter_prepare_tree_rebuild(painter, rebuild);
+    if (!sdl_result)
+        _painter_destroy_tree_rebuild_buffers(painter, rebuild);
+    SDL_Log("tree rebuild took %i ticks", SDL_GetTicks()-timer_start);
+    SDL_AtomicSet(&rebuild->state, sdl_result ? TREE_REBUILD_READY : TREE_REBUILD_FAILED);
+    return 0;
+}
+
+void _painter_swap_tree_buffers(EsPainter* painter) {
+    // The worker has already filled the back buffers, so only the bindings change here. The
+    // frames in flight keep drawing from the old buffers, and each image's command buffers are
+    // recorded again in painter_paint_frame, once its own fence says it is done with them.
+    TreeRebuild* rebuild = &painter->tree_rebuild;
+    ShaderData* shader = &painter->shaders[0];
+    rebuild->retired_buffers[0] = shader->vertex_buffer;
+    rebuild->retired_buffers_memory[0] = shader->vertex_buffer_memory;
+    rebuild->retired_buffers[1] = shader->index_buffer;
+    rebuild->retired_buffers_memory[1] = shader->index_buffer_memory;
+    rebuild->retired_buffers[2] = shader->vertex_staging_buffer;
+    rebuild->retired_buffers_memory[2] = shader->vertex_staging_buffer_memory;
+    rebuild->retired_buffers[3] = shader->index_staging_buffer;
+    rebuild->retired_buffers_memory[3] = shader->index_staging_buffer_memory;
+    shader->vertex_staging_buffer = VK_NULL_HANDLE;
+    shader->vertex_staging_buffer_memory = VK_NULL_HANDLE;
+    shader->index_staging_buffer = VK_NULL_HANDLE;
+    shader->index_staging_buffer_memory = VK_NULL_HANDLE;
+    shader->vertex_buffer = rebuild->vertex_buffer;
+    shader->vertex_buffer_memory = rebuild->vertex_buffer_memory;
+    shader->index_buffer = rebuild->index_buffer;
+    shader->index_buffer_memory = rebuild->index_buffer_memory;
+    shader->num_vertices = rebuild->num_vertices;
+    shader->num_indices = rebuild->num_indices;
+    shader->vertex_buffer_size = rebuild->vertex_buffer_size;
+    shader->vertex_staging_buffer_size = 0;
+    shader->index_buffer_size = rebuild->index_buffer_size;
+    shader->index_staging_buffer_size = 0;
+    rebuild->vertex_buffer = VK_NULL_HANDLE;
+    rebuild->vertex_buffer_memory = VK_NULL_HANDLE;
+    rebuild->index_buffer = VK_NULL_HANDLE;
+    rebuild->index_buffer_memory = VK_NULL_HANDLE;
+    for (Uint32 i=0; i<TREE_ARCHETYPES; i++) {
+        InstanceDraw* draw = &shader->draws[i];
+        draw->radius = rebuild->draws[i].radius;
+        draw->num_lods = rebuild->draws[i].num_lods;
+        for (Uint32 lod=0; lod<TREE_LODS; lod++) {
+            draw->first_index[lod] = rebuild->draws[i].first_index[lod];
+            draw->num_indices[lod] = rebuild->draws[i].num_indices[lod];
+        }
+    }
+    // The old mesh stays around to be filled by the next rebuild.
+    EsIndexedMesh front = painter->world->tree_mesh;
+    painter->world->tree_mesh = rebuild->mesh;
+    rebuild->mesh = front;
+    painter->tree_buffers_seed = rebuild->seed;
+    if (painter->num_shaders > 4 && painter->tree_buffers_seed != painter->impostor_seed)
+        SDL_Log("no impostor atlas for tree seed %u, drawing every tree as a mesh", painter->tree_buffers_seed);
 
+    for (Uint32 i=0; i<painter->swapchain_image_count; i++)
+        painter->stale_command_buffers[i] = SDL_TRUE;
+    painter->num_stale_command_buffers = painter->swapchain_image_count;
+}
+
+SDL_bool _painter_update_tree_rebuild(EsPainter* painter) {
+    // Called at the start of every frame. Swaps in a finished rebuild, and starts the next one
+    // if the trees were changed since the last one started.
+    TreeRebuild* rebuild = &painter->tree_rebuild;
+    int state = SDL_AtomicGet(&rebuild->state);
+    if (state == TREE_REBUILD_RUNNING)
+        return SDL_TRUE;
+    if (rebuild->thread) {
+        // The thread is done by now, so this doesn't block.
+        SDL_WaitThread(rebuild->thread, NULL);
+        rebuild->thread = NULL;
+    }
+    if (state == TREE_REBUILD_READY) {
+        // Some images still draw from the buffers of the last swap, so this one has to wait
+        // until they are all recorded again.
+        if (painter->num_stale_command_buffers > 0)
+            return SDL_TRUE;
+        _painter_swap_tree_buffers(painter);
+    } else if (state == TREE_REBUILD_FAILED) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not rebuild trees, keeping the old ones\n");
+    }
+    SDL_AtomicSet(&rebuild->state, TREE_REBUILD_IDLE);
+    if (rebuild->pending) {
+        rebuild->pending = SDL_FALSE;
+        rebuild->seed = painter->world->tree_seed;
+        SDL_AtomicSet(&rebuild->state, TREE_REBUILD_RUNNING);
+        rebuild->thread = SDL_CreateThread(_painter_tree_rebuild_thread, "tree rebuild", painter);
+        if (rebuild->thread == NULL) {
+            SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not create tree rebuild thread\n");
+            SDL_AtomicSet(&rebuild->state, TREE_REBUILD_IDLE);
+        }
+    }
     return SDL_TRUE;
 }
 
+void _painter_cleanup_tree_rebuild(EsPainter* painter) {
+    TreeRebuild* rebuild = &painter->tree_rebuild;
+    if (rebuild->thread) {
+        SDL_WaitThread(rebuild->thread, NULL);
+        rebuild->thread = NULL;
+    }
+    if (painter->device)
+        _painter_destroy_tree_rebuild_buffers(painter, rebuild);
+    geom_destroy_indexed_mesh(&rebuild->mesh);
+    SDL_AtomicSet(&rebuild->state, TREE_REBUILD_IDLE);
+}
+
 SDL_bool _painter_create_commandbuffers(EsPainter* painter) {
     VkResult result;
     painter->command_buffers = (VkCommandBuffer*) SDL_malloc(painter->swapchain_image_count * sizeof(VkCommandBuffer));
@@ -347,7 +491,11 @@ extern SDL_bool _painter_load_image_and_sampler(EsPainter* painter, const char*
         stbi_image_free(pixels);
 
     VkFormat image_format;
-    if (tex_channels == 4)
+    // The impostor atlas holds normals next to its colors, so it is read back as it was written
+    // and the impostor shader decodes the color half itself.
+    if (shader_type == IMPOSTOR_SHADER)
+        image_format = VK_FORMAT_R8G8B8A8_UNORM;
+    else if (tex_channels == 4)
         image_format = VK_FORMAT_R8G8B8A8_SRGB;
     // TODO (18 Dec 2020 sam): Use 1 channel here for UI stuff
     else if (tex_channels == 1)
@@ -915,7 +1063,9 @@ SDL_bool _painter_swapchain_renderpass_init(EsPainter* painter) {
     VkCommandPoolCreateInfo command_pool_create_info;
     command_pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     command_pool_create_info.pNext = NULL;
-    command_pool_create_info.flags = 0;
+    // Each image's command buffers are recorded again on their own when the tree buffers are
+    // swapped, so they have to be resettable one by one.
+    command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
     command_pool_create_info.queueFamilyIndex = graphics_queue_family;
     result = vkCreateCommandPool(painter->device, &command_pool_create_info, NULL, &painter->command_pool);
     if (result != VK_SUCCESS) {
@@ -1191,20 +1341,23 @@ SDL_bool _painter_init_instance(EsPainter* painter) {
     instance_create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
     instance_create_info.pNext = NULL;
     instance_create_info.pApplicationInfo = &app_info;
+    // A headless painter has no window, so it has no surface and needs no extensions for one.
     Uint32 required_extensions_count = 0;
-    const char** required_extensions;
-    sdl_result = SDL_Vulkan_GetInstanceExtensions(painter->window, &required_extensions_count, NULL);
-    if (!sdl_result) {
-        warehouse_error_popup("Error in getting Required Vulkan Extensions", SDL_GetError());
-        painter_cleanup(painter);
-        return SDL_FALSE;
-    }
-    required_extensions = (const char**) SDL_malloc(required_extensions_count * sizeof(char*));
-    sdl_result = SDL_Vulkan_GetInstanceExtensions(painter->window, &required_extensions_count, required_extensions);
-    if (!sdl_result) {
-        warehouse_error_popup("Error in getting Required Vulkan Extensions", SDL_GetError());
-        painter_cleanup(painter);
-        return SDL_FALSE;
+    const char** required_extensions = NULL;
+    if (painter->window) {
+        sdl_result = SDL_Vulkan_GetInstanceExtensions(painter->window, &required_extensions_count, NULL);
+        if (!sdl_result) {
+            warehouse_error_popup("Error in getting Required Vulkan Extensions", SDL_GetError());
+            painter_cleanup(painter);
+            return SDL_FALSE;
+        }
+        required_extensions = (const char**) SDL_malloc(required_extensions_count * sizeof(char*));
+        sdl_result = SDL_Vulkan_GetInstanceExtensions(painter->window, &required_extensions_count, required_extensions);
+        if (!sdl_result) {
+            warehouse_error_popup("Error in getting Required Vulkan Extensions", SDL_GetError());
+            painter_cleanup(painter);
+            return SDL_FALSE;
+        }
     }
     Uint32 available_extensions_count;
     result = vkEnumerateInstanceExtensionProperties(NULL, &available_extensions_count, NULL);
@@ -1250,11 +1403,13 @@ SDL_bool _painter_init_instance(EsPainter* painter) {
         return SDL_FALSE;
     }
 
-    sdl_result = SDL_Vulkan_CreateSurface(painter->window, painter->instance, &painter->surface);
-    if (!sdl_result) {
-        warehouse_error_popup("Error in getting Creating SDL Vulkan Surface", SDL_GetError());
-        painter_cleanup(painter);
-        return SDL_FALSE;
+    if (painter->window) {
+        sdl_result = SDL_Vulkan_CreateSurface(painter->window, painter->instance, &painter->surface);
+        if (!sdl_result) {
+            warehouse_error_popup("Error in getting Creating SDL Vulkan Surface", SDL_GetError());
+            painter_cleanup(painter);
+            return SDL_FALSE;
+        }
     }
 
 #if DEBUG_BUILD==SDL_TRUE
@@ -1317,6 +1472,97 @@ SDL_bool _painter_select_physical_device(EsPainter* painter) {
     return SDL_TRUE;
 }
 
+SDL_bool _painter_create_headless_device(EsPainter* painter, SDL_bool prefer_cpu) {
+    // Any device with a graphics queue will do, since nothing is presented. A software device
+    // is only picked first if asked for, so that this can run on machines without a gpu.
+    VkResult result;
+    Uint32 device_count = 0;
+    result = vkEnumeratePhysicalDevices(painter->instance, &device_count, NULL);
+    if (result != VK_SUCCESS || device_count == 0)
+        return _painter_cleanup_error(painter, "Error in Vulkan Setup.", "Could not find a device with Vulkan support.");
+    VkPhysicalDevice* devices = (VkPhysicalDevice*) SDL_malloc(device_count * sizeof(VkPhysicalDevice));
+    if (devices == NULL)
+        return _painter_cleanup_error(painter, "Error in Vulkan Setup.", "Could not alloc physical devices.");
+    result = vkEnumeratePhysicalDevices(painter->instance, &device_count, devices);
+    if (result != VK_SUCCESS) {
+        SDL_free(devices);
+        return _painter_cleanup_error(painter, "Error in Vulkan Setup.", "Could not get physical devices.");
+    }
+    VkPhysicalDeviceType preferred_type = prefer_cpu ? VK_PHYSICAL_DEVICE_TYPE_CPU : VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
+    int graphics_queue_family = -1;
+    painter->physical_device = VK_NULL_HANDLE;
+    for (Uint32 pass=0; pass<2 && painter->physical_device == VK_NULL_HANDLE; pass++) {
+        for (Uint32 i=0; i<device_count && painter->physical_device == VK_NULL_HANDLE; i++) {
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties(devices[i], &properties);
+            if (pass == 0 && properties.deviceType != preferred_type)
+                continue;
+            // The textures are sampled the same way as in the painter, which needs anisotropy.
+            VkPhysicalDeviceFeatures features;
+            vkGetPhysicalDeviceFeatures(devices[i], &features);
+            if (!features.samplerAnisotropy)
+                continue;
+            Uint32 queue_family_count = 0;
+            vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &queue_family_count, NULL);
+            VkQueueFamilyProperties* queue_families = (VkQueueFamilyProperties*) SDL_malloc(queue_family_count * sizeof(VkQueueFamilyProperties));
+            if (queue_families == NULL)
+                continue;
+            vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &queue_family_count, queue_families);
+            for (Uint32 j=0; j<queue_family_count; j++) {
+                if (queue_families[j].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+                    painter->physical_device = devices[i];
+                    graphics_queue_family = j;
+                    SDL_Log("Using %s", properties.deviceName);
+                    break;
+                }
+            }
+            SDL_free(queue_families);
+        }
+    }
+    SDL_free(devices);
+    if (painter->physical_device == VK_NULL_HANDLE)
+        return _painter_cleanup_error(painter, "Error in Vulkan Setup.", "Could not find a device with a graphics queue.");
+    painter->msaa_samples = VK_SAMPLE_COUNT_1_BIT;
+
+    float graphics_queue_priority = 1.0f;
+    VkDeviceQueueCreateInfo queue_create_info;
+    queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_create_info.pNext = NULL;
+    queue_create_info.flags = 0;
+    queue_create_info.queueFamilyIndex = graphics_queue_family;
+    queue_create_info.queueCount = 1;
+    queue_create_info.pQueuePriorities = &graphics_queue_priority;
+    VkPhysicalDeviceFeatures device_features;
+    vkGetPhysicalDeviceFeatures(painter->physical_device, &device_features);
+    VkDeviceCreateInfo device_create_info;
+    device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device_create_info.pNext = NULL;
+    device_create_info.flags = 0;
+    device_create_info.queueCreateInfoCount = 1;
+    device_create_info.pQueueCreateInfos = &queue_create_info;
+    device_create_info.enabledLayerCount = 0;
+    device_create_info.ppEnabledLayerNames = NULL;
+    device_create_info.enabledExtensionCount = 0;
+    device_create_info.ppEnabledExtensionNames = NULL;
+    device_create_info.pEnabledFeatures = &device_features;
+    result = vkCreateDevice(painter->physical_device, &device_create_info, NULL, &painter->device);
+    if (result != VK_SUCCESS)
+        return _painter_cleanup_error(painter, "Error in Vulkan Setup.", "Could not create device.");
+    // Everything waits on the presentation queue, so it is just the graphics queue here.
+    vkGetDeviceQueue(painter->device, graphics_queue_family, 0, &painter->graphics_queue);
+    painter->presentation_queue = painter->graphics_queue;
+
+    VkCommandPoolCreateInfo command_pool_create_info;
+    command_pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    command_pool_create_info.pNext = NULL;
+    command_pool_create_info.flags = 0;
+    command_pool_create_info.queueFamilyIndex = graphics_queue_family;
+    result = vkCreateCommandPool(painter->device, &command_pool_create_info, NULL, &painter->command_pool);
+    if (result != VK_SUCCESS)
+        return _painter_cleanup_error(painter, "Error in Vulkan Setup.", "Could not create command_pool");
+    return SDL_TRUE;
+}
+
 SDL_bool _painter_create_synchronisation_elements(EsPainter* painter) {
     VkResult result;
     // need to malloc here =P
@@ -1329,6 +1575,8 @@ SDL_bool _painter_create_synchronisation_elements(EsPainter* painter) {
     painter->in_flight_fences = (VkFence*) SDL_malloc(MAX_FRAMES_IN_FLIGHT * sizeof(VkFence));
     painter->shadow_map_fences = (VkFence*) SDL_malloc(MAX_FRAMES_IN_FLIGHT * sizeof(VkFence));
     painter->images_in_flight = (VkFence*) SDL_calloc(painter->swapchain_image_count, sizeof(VkFence));
+    painter->stale_command_buffers = (SDL_bool*) SDL_calloc(painter->swapchain_image_count, sizeof(SDL_bool));
+    painter->num_stale_command_buffers = 0;
     painter->shadows_in_flight = (VkFence*) SDL_calloc(painter->swapchain_image_count, sizeof(VkFence));
     VkFenceCreateInfo fence_create_info;
     fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
@@ -1369,8 +1617,16 @@ SDL_bool _painter_load_buffer_via_staging(EsPainter* painter, void* data, VkDevi
 }
 
 void _painter_cleanup_swapchain(EsPainter* painter) {
+    if (!painter->device)
+        return;
     vkQueueWaitIdle(painter->presentation_queue);
     vkDeviceWaitIdle(painter->device);
+    // Every command buffer is recorded again after this, so nothing draws from the retired
+    // tree buffers anymore.
+    _painter_release_retired_tree_buffers(painter);
+    if (painter->stale_command_buffers)
+        SDL_memset(painter->stale_command_buffers, 0, painter->swapchain_image_count * sizeof(SDL_bool));
+    painter->num_stale_command_buffers = 0;
     _painter_shader_cleanup(painter, painter->skybox_shader);
     _painter_shader_cleanup(painter, painter->ui_shader);
     _painter_shader_cleanup(painter, painter->shadow_map_shader);
@@ -1417,6 +1673,9 @@ void _painter_cleanup_swapchain(EsPainter* painter) {
 }
 
 void _painter_shader_cleanup(EsPainter* painter, ShaderData* shader) {
+    // A headless painter never allocates the skybox, ui and shadow map shaders.
+    if (shader == NULL)
+        return;
     if (shader->texture_sampler)
         vkDestroySampler(painter->device, shader->texture_sampler, NULL);
     if (shader->texture_image_view)
@@ -1437,6 +1696,8 @@ void _painter_shader_cleanup(EsPainter* painter, ShaderData* shader) {
         vkDestroyBuffer(painter->device, shader->index_staging_buffer, NULL);
     if (shader->index_staging_buffer_memory)
         vkFreeMemory(painter->device, shader->index_staging_buffer_memory, NULL);
+    _painter_destroy_mapped_buffers(painter, &shader->instance_buffers, &shader->instance_buffers_memory, &shader->instance_buffers_mapped);
+    _painter_destroy_mapped_buffers(painter, &shader->indirect_buffers, &shader->indirect_buffers_memory, &shader->indirect_buffers_mapped);
     if (shader->vertex_buffer)
         vkDestroyBuffer(painter->device, shader->vertex_buffer, NULL);
     if (shader->vertex_buffer_memory)
@@ -1464,6 +1725,9 @@ void _painter_shader_cleanup(EsPainter* painter, ShaderData* shader) {
 }
 
 void painter_cleanup(EsPainter* painter) {
+    _painter_cleanup_tree_rebuild(painter);
+    if (painter->impostor_baker)
+        impostor_cleanup_baker(painter, painter->impostor_baker);
     _painter_cleanup_swapchain(painter);
     if (painter->uniform_buffers)
         for (Uint32 i=0; i<painter->swapchain_image_count; i++)
@@ -1501,6 +1765,22 @@ void painter_cleanup(EsPainter* painter) {
     SDL_free(painter->swapchain_framebuffers);
     SDL_free(painter->uniform_buffers);
     SDL_free(painter->uniform_buffers_memory);
+    SDL_free(painter->stale_command_buffers);
+    painter->stale_command_buffers = NULL;
+    if (painter->shaders) {
+        for (Uint32 i=0; i<painter->num_shaders; i++) {
+            SDL_free(painter->shaders[i].instances);
+            SDL_free(painter->shaders[i].draws);
+            SDL_free(painter->shaders[i].frame_instances);
+            SDL_free(painter->shaders[i].instance_lods);
+            SDL_free(painter->shaders[i].indirect_draws);
+            painter->shaders[i].instances = NULL;
+            painter->shaders[i].draws = NULL;
+            painter->shaders[i].frame_instances = NULL;
+            painter->shaders[i].instance_lods = NULL;
+            painter->shaders[i].indirect_draws = NULL;
+        }
+    }
     SDL_Quit();
 }
 
@@ -1546,7 +1826,21 @@ SDL_bool _painter_recreate_swapchain(EsPainter* painter) {
 }
 
 SDL_bool _painter_create_buffer(EsPainter* painter, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags property_flags, VkBuffer* buffer, VkDeviceMemory* buffer_memory) {
+    SDL_bool sdl_result = _painter_try_create_buffer(painter, size, usage, property_flags, buffer, buffer_memory);
+    if (!sdl_result) {
+        warehouse_error_popup("Error in Vulkan Setup.", "Could not create buffer");
+        painter_cleanup(painter);
+        return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+SDL_bool _painter_try_create_buffer(EsPainter* painter, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags property_flags, VkBuffer* buffer, VkDeviceMemory* buffer_memory) {
+    // Only logs on failure, and leaves both handles null, so this can be called off the render
+    // thread. _painter_create_buffer is the version that gives up on the painter.
     VkResult result;
+    *buffer = VK_NULL_HANDLE;
+    *buffer_memory = VK_NULL_HANDLE;
     VkBufferCreateInfo buffer_create_info;
     buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     buffer_create_info.pNext = NULL;
@@ -1558,8 +1852,8 @@ SDL_bool _painter_create_buffer(EsPainter* painter, VkDeviceSize size, VkBufferU
     buffer_create_info.pQueueFamilyIndices = NULL;
     result = vkCreateBuffer(painter->device, &buffer_create_info, NULL, buffer);
     if (result != VK_SUCCESS) {
-        warehouse_error_popup("Error in Vulkan Setup.", "Could not create vertex buffer");
-        painter_cleanup(painter);
+        *buffer = VK_NULL_HANDLE;
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not create buffer\n");
         return SDL_FALSE;
     }
 
@@ -1567,8 +1861,9 @@ SDL_bool _painter_create_buffer(EsPainter* painter, VkDeviceSize size, VkBufferU
     vkGetBufferMemoryRequirements(painter->device, *buffer, &memory_requirements);
     Uint32 memory_type_index = _painter_find_memory_type(painter, property_flags, &memory_requirements);
     if (memory_type_index == UINT32_MAX) {
-        warehouse_error_popup("Error in Vulkan Setup.", "Could not find suitable memory");
-        painter_cleanup(painter);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not find suitable memory\n");
+        vkDestroyBuffer(painter->device, *buffer, NULL);
+        *buffer = VK_NULL_HANDLE;
         return SDL_FALSE;
     }
     VkMemoryAllocateInfo memory_allocation_info;
@@ -1578,19 +1873,65 @@ SDL_bool _painter_create_buffer(EsPainter* painter, VkDeviceSize size, VkBufferU
     memory_allocation_info.memoryTypeIndex = memory_type_index;
     result = vkAllocateMemory(painter->device, &memory_allocation_info, NULL, buffer_memory);
     if (result != VK_SUCCESS) {
-        warehouse_error_popup("Error in Vulkan Setup.", "Could not allocate vertex buffer memory");
-        painter_cleanup(painter);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not allocate buffer memory\n");
+        vkDestroyBuffer(painter->device, *buffer, NULL);
+        *buffer = VK_NULL_HANDLE;
+        *buffer_memory = VK_NULL_HANDLE;
         return SDL_FALSE;
     }
     result = vkBindBufferMemory(painter->device, *buffer, *buffer_memory, 0);
     if (result != VK_SUCCESS) {
-        warehouse_error_popup("Error in Vulkan Setup.", "Could not bind vertex buffer memory");
-        painter_cleanup(painter);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not bind buffer memory\n");
+        vkDestroyBuffer(painter->device, *buffer, NULL);
+        vkFreeMemory(painter->device, *buffer_memory, NULL);
+        *buffer = VK_NULL_HANDLE;
+        *buffer_memory = VK_NULL_HANDLE;
         return SDL_FALSE;
     }
     return SDL_TRUE;
 }
 
+SDL_bool _painter_create_mapped_buffers(EsPainter* painter, VkDeviceSize size, VkBufferUsageFlags usage, void* data, VkBuffer** buffers, VkDeviceMemory** buffers_memory, void*** buffers_mapped) {
+    // One host visible buffer for each swapchain image, each mapped until it is destroyed and
+    // filled with data to start with. For data that changes every frame, which can then be
+    // written straight into the buffer of the image being drawn, with no staging copy.
+    VkResult result;
+    SDL_bool sdl_result;
+    *buffers = (VkBuffer*) SDL_calloc(painter->swapchain_image_count, sizeof(VkBuffer));
+    *buffers_memory = (VkDeviceMemory*) SDL_calloc(painter->swapchain_image_count, sizeof(VkDeviceMemory));
+    *buffers_mapped = (void**) SDL_calloc(painter->swapchain_image_count, sizeof(void*));
+    if (*buffers == NULL || *buffers_memory == NULL || *buffers_mapped == NULL)
+        return _painter_cleanup_error(painter, "Error in Vulkan Setup.", "Could not allocate mapped buffers");
+    for (Uint32 i=0; i<painter->swapchain_image_count; i++) {
+        sdl_result = _painter_create_buffer(painter, size, usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &(*buffers)[i], &(*buffers_memory)[i]);
+        if (!sdl_result) return SDL_FALSE;
+        result = vkMapMemory(painter->device, (*buffers_memory)[i], 0, size, 0, &(*buffers_mapped)[i]);
+        if (result != VK_SUCCESS) {
+            (*buffers_mapped)[i] = NULL;
+            return _painter_cleanup_error(painter, "Error in Vulkan Setup.", "Could not map buffer memory");
+        }
+        SDL_memcpy((*buffers_mapped)[i], data, (size_t) size);
+    }
+    return SDL_TRUE;
+}
+
+void _painter_destroy_mapped_buffers(EsPainter* painter, VkBuffer** buffers, VkDeviceMemory** buffers_memory, void*** buffers_mapped) {
+    for (Uint32 i=0; *buffers_memory && i<painter->swapchain_image_count; i++) {
+        if (*buffers_mapped && (*buffers_mapped)[i])
+            vkUnmapMemory(painter->device, (*buffers_memory)[i]);
+        if (*buffers && (*buffers)[i])
+            vkDestroyBuffer(painter->device, (*buffers)[i], NULL);
+        if ((*buffers_memory)[i])
+            vkFreeMemory(painter->device, (*buffers_memory)[i], NULL);
+    }
+    SDL_free(*buffers);
+    SDL_free(*buffers_memory);
+    SDL_free(*buffers_mapped);
+    *buffers = NULL;
+    *buffers_memory = NULL;
+    *buffers_mapped = NULL;
+}
+
 Uint32 _painter_find_memory_type(EsPainter* painter, VkMemoryPropertyFlags property_flags, VkMemoryRequirements* memory_requirements) {
     Uint32 memory_type_index = UINT32_MAX;
     VkPhysicalDeviceMemoryProperties physical_device_memory_properties;
@@ -2093,31 +2434,61 @@ SDL_bool _painter_create_pipeline(EsPainter* painter, ShaderData* shader) {
 
     VkVertexInputBindingDescription vertex_input_binding_description;
     vertex_input_binding_description.binding = 0;
-    vertex_input_binding_description.stride = sizeof(EsVertex);
+    vertex_input_binding_description.stride = shader->packed ? sizeof(EsPackedVertex) : sizeof(EsVertex);
     vertex_input_binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-    VkVertexInputBindingDescription vertex_binding_descriptions[1];
+    VkVertexInputBindingDescription vertex_binding_descriptions[2];
     vertex_binding_descriptions[0] = vertex_input_binding_description;
-    VkVertexInputAttributeDescription vertex_input_attributes[5];
+    // Instanced shaders get a second binding that steps once per instance.
+    vertex_binding_descriptions[1].binding = 1;
+    vertex_binding_descriptions[1].stride = sizeof(EsInstance);
+    vertex_binding_descriptions[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+    Uint32 num_bindings = shader->num_instances ? 2 : 1;
+    Uint32 num_attributes = shader->num_instances ? 7 : 5;
+    VkVertexInputAttributeDescription vertex_input_attributes[7];
     vertex_input_attributes[0].location = 0;
     vertex_input_attributes[0].binding = 0;
     vertex_input_attributes[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-    vertex_input_attributes[0].offset = 0;
+    vertex_input_attributes[0].offset = offsetof(EsVertex, pos);
     vertex_input_attributes[1].location = 1;
     vertex_input_attributes[1].binding = 0;
     vertex_input_attributes[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-    vertex_input_attributes[1].offset = sizeof(vec3);
+    vertex_input_attributes[1].offset = offsetof(EsVertex, color);
     vertex_input_attributes[2].location = 2;
     vertex_input_attributes[2].binding = 0;
     vertex_input_attributes[2].format = VK_FORMAT_R32G32_SFLOAT;
-    vertex_input_attributes[2].offset = sizeof(vec3) + sizeof(vec3);
+    vertex_input_attributes[2].offset = offsetof(EsVertex, tex);
     vertex_input_attributes[3].location = 3;
     vertex_input_attributes[3].binding = 0;
     vertex_input_attributes[3].format = VK_FORMAT_R32G32B32_SFLOAT;
-    vertex_input_attributes[3].offset = sizeof(vec3) + sizeof(vec3) + sizeof(vec2);
+    vertex_input_attributes[3].offset = offsetof(EsVertex, normal);
     vertex_input_attributes[4].location = 4;
     vertex_input_attributes[4].binding = 0;
     vertex_input_attributes[4].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-    vertex_input_attributes[4].offset = sizeof(vec3) + sizeof(vec3) + sizeof(vec2) + sizeof(vec3);
+    vertex_input_attributes[4].offset = offsetof(EsVertex, assorted);
+    if (shader->packed) {
+        // See EsPackedVertex. The shader decodes the color and the normal. There is no
+        // assorted, so location 4 reads the color again rather than being left unbound.
+        vertex_input_attributes[0].format = VK_FORMAT_R16G16B16A16_SFLOAT;
+        vertex_input_attributes[0].offset = offsetof(EsPackedVertex, pos);
+        vertex_input_attributes[1].format = VK_FORMAT_R8G8B8A8_UNORM;
+        vertex_input_attributes[1].offset = offsetof(EsPackedVertex, color);
+        vertex_input_attributes[2].format = VK_FORMAT_R16G16_SFLOAT;
+        vertex_input_attributes[2].offset = offsetof(EsPackedVertex, tex);
+        vertex_input_attributes[3].format = VK_FORMAT_R16G16_SNORM;
+        vertex_input_attributes[3].offset = offsetof(EsPackedVertex, normal);
+        vertex_input_attributes[4].format = VK_FORMAT_R8G8B8A8_UNORM;
+        vertex_input_attributes[4].offset = offsetof(EsPackedVertex, color);
+    }
+    // position + rotation
+    vertex_input_attributes[5].location = 5;
+    vertex_input_attributes[5].binding = 1;
+    vertex_input_attributes[5].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    vertex_input_attributes[5].offset = 0;
+    // scale + wind phase
+    vertex_input_attributes[6].location = 6;
+    vertex_input_attributes[6].binding = 1;
+    vertex_input_attributes[6].format = VK_FORMAT_R32G32_SFLOAT;
+    vertex_input_attributes[6].offset = sizeof(vec3) + sizeof(float);
     VkPipelineShaderStageCreateInfo vertex_shader_stage_create_info;
     vertex_shader_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     vertex_shader_stage_create_info.pNext = NULL;
@@ -2138,9 +2509,9 @@ SDL_bool _painter_create_pipeline(EsPainter* painter, ShaderData* shader) {
     vertex_input_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
     vertex_input_state_create_info.pNext = NULL;
     vertex_input_state_create_info.flags = 0;
-    vertex_input_state_create_info.vertexBindingDescriptionCount = 1;
+    vertex_input_state_create_info.vertexBindingDescriptionCount = num_bindings;
     vertex_input_state_create_info.pVertexBindingDescriptions = vertex_binding_descriptions;
-    vertex_input_state_create_info.vertexAttributeDescriptionCount = 5;
+    vertex_input_state_create_info.vertexAttributeDescriptionCount = num_attributes;
     vertex_input_state_create_info.pVertexAttributeDescriptions = vertex_input_attributes;
     VkPipelineInputAssemblyStateCreateInfo input_assembly_state_create_info;
     input_assembly_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
@@ -2312,12 +2683,14 @@ SDL_bool _painter_init_shader_data(EsPainter* painter, ShaderData* shader, Shade
     VkMemoryPropertyFlags index_staging_property_flags =  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
     VkMemoryPropertyFlags index_property_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
 
-    shader->vertex_staging_buffer_size = shader->num_vertices * sizeof(EsVertex);
+    Uint32 vertex_size = shader->packed ? sizeof(EsPackedVertex) : sizeof(EsVertex);
+    void* vertex_data = shader->packed ? (void*) shader->packed_vertices : (void*) shader->vertices;
+    shader->vertex_staging_buffer_size = shader->num_vertices * vertex_size;
     // TODO (21 Oct 2020 sam): Use a single vkAllocateMemory for both buffers, and manage memory using
     // the offsets and things.
     sdl_result = _painter_create_buffer(painter, shader->vertex_staging_buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, vertex_staging_property_flags, &shader->vertex_staging_buffer, &shader->vertex_staging_buffer_memory);
     if (!sdl_result) return SDL_FALSE;
-    shader->vertex_buffer_size = shader->num_vertices * sizeof(EsVertex);
+    shader->vertex_buffer_size = shader->num_vertices * vertex_size;
     sdl_result = _painter_create_buffer(painter, shader->vertex_buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertex_property_flags, &shader->vertex_buffer, &shader->vertex_buffer_memory);
     if (!sdl_result) return SDL_FALSE;
 
@@ -2330,10 +2703,21 @@ SDL_bool _painter_init_shader_data(EsPainter* painter, ShaderData* shader, Shade
     sdl_result = _painter_create_buffer(painter, shader->index_buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, index_property_flags, &shader->index_buffer, &shader->index_buffer_memory);
     if (!sdl_result) return SDL_FALSE;
 
-    sdl_result = _painter_load_buffer_via_staging(painter, shader->vertices, &shader->vertex_staging_buffer_memory, &shader->vertex_staging_buffer, &shader->vertex_buffer, shader->vertex_staging_buffer_size);
+    sdl_result = _painter_load_buffer_via_staging(painter, vertex_data, &shader->vertex_staging_buffer_memory, &shader->vertex_staging_buffer, &shader->vertex_buffer, shader->vertex_staging_buffer_size);
     if (!sdl_result) return _painter_cleanup_error(painter, "Could not copy vertices to buffer.", shader->shader_name);
     sdl_result = _painter_load_buffer_via_staging(painter, shader->indices, &shader->index_staging_buffer_memory, &shader->index_staging_buffer, &shader->index_buffer, shader->index_staging_buffer_size);
     if (!sdl_result) return _painter_cleanup_error(painter, "Could not copy indices to buffer.", shader->shader_name);
+
+    if (shader->num_instances > 0) {
+        shader->instance_buffer_size = shader->num_instances * sizeof(EsInstance);
+        sdl_result = _painter_create_mapped_buffers(painter, shader->instance_buffer_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, shader->instances, &shader->instance_buffers, &shader->instance_buffers_memory, &shader->instance_buffers_mapped);
+        if (!sdl_result) return SDL_FALSE;
+    }
+    if (shader->num_indirect_draws > 0) {
+        shader->indirect_buffer_size = shader->num_indirect_draws * sizeof(VkDrawIndexedIndirectCommand);
+        sdl_result = _painter_create_mapped_buffers(painter, shader->indirect_buffer_size, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, shader->indirect_draws, &shader->indirect_buffers, &shader->indirect_buffers_memory, &shader->indirect_buffers_mapped);
+        if (!sdl_result) return SDL_FALSE;
+    }
     return SDL_TRUE;
 }
 
@@ -2373,10 +2757,19 @@ SDL_bool _painter_refresh_shaders(EsPainter* painter) {
         sdl_result = _painter_create_pipeline(painter, shader);
         if (!sdl_result) return SDL_FALSE;
     }
+    return _painter_refill_command_buffers(painter);
+}
+
+SDL_bool _painter_refill_command_buffers(EsPainter* painter) {
+    // The command buffers are recorded with the buffers and pipelines baked in, so they have
+    // to be recorded again whenever any of those change.
+    SDL_bool sdl_result;
     if (painter->shadow_map_command_buffers)
         vkFreeCommandBuffers(painter->device, painter->command_pool, painter->swapchain_image_count, painter->shadow_map_command_buffers);
     if (painter->command_buffers)
         vkFreeCommandBuffers(painter->device, painter->command_pool, painter->swapchain_image_count, painter->command_buffers);
+    SDL_free(painter->shadow_map_command_buffers);
+    SDL_free(painter->command_buffers);
     sdl_result = _painter_create_commandbuffers(painter);
     if (!sdl_result) return _painter_custom_error("Setup Error", "Could not create commandbuffers");
     sdl_result = _painter_fill_command_buffers(painter);
@@ -2,7 +2,7 @@
 
 #define SHADER_DIRECTORY "src/glsl"
 #define SHADER_TEMP_DIRECTORY "shaders"
-#define NUM_SHADERS 4
+#define NUM_SHADERS 5
 
 typedef struct {
     char* filepath;
@@ -174,6 +174,9 @@ int main(int argc, char** argv) {
     shaders[3].prefix = "plane";
     shaders[3].vertex.filepath = "plane_vertex.glsl";
     shaders[3].fragment.filepath = "fragment.glsl";
+    shaders[4].prefix = "impostor";
+    shaders[4].vertex.filepath = "impostor_vertex.glsl";
+    shaders[4].fragment.filepath = "impostor_fragment.glsl";
     for (Uint32 i=0; i<NUM_SHADERS; i++) {
         SDL_Log("Generating shader %i", i);
         result = _load_shader_code(&shaders[i]);
@@ -195,6 +198,13 @@ int main(int argc, char** argv) {
     SDL_Log("Generating ui shader");
     result = _copy_shaders(&ui);
     if (result != 0)  return _error_message_and_return(-1);
+    ShaderCode impostor_bake;
+    impostor_bake.prefix = "impostor_bake";
+    impostor_bake.vertex.filepath = "impostor_bake_vertex.glsl";
+    impostor_bake.fragment.filepath = "impostor_bake_fragment.glsl";
+    SDL_Log("Generating impostor bake shader");
+    result = _copy_shaders(&impostor_bake);
+    if (result != 0)  return _error_message_and_return(-1);
     SDL_Log("shader files generated. yay");
     return 0;
 }
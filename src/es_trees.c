@@ -1,27 +1,45 @@
 #include "es_trees.h"
 #include "es_geometrygen.h"
 
-// For rand and RAND_MAX
-#include <stdlib.h>
+#ifdef ES_SSE2
+#include <emmintrin.h>
+#endif
 
-#define TREES_DEFAULT_CS 2048
-#define TREES_DEFAULT_ROOTS 128
-#define TREES_DEFAULT_LEAVES 256
 #define MINIMUM_DIST_RAYMARCH 0.01
 #define MAXIMUM_DIST_RAYMARCH 100.0
+#define MAXIMUM_STEPS_RAYMARCH 100
+// Rays are marched 8 at a time, as two sets of 4 SSE lanes.
+#define TREES_RAY_BATCH 8
+#define TREES_TEST_SEED 1
+// Levels with fewer branches than this are built on the calling thread.
+#define TREES_MIN_PARALLEL_BRANCHES 16
 
-SDL_bool _trees_generate_branch(EsTree* tree, vec3 position, vec3 axis, vec3 rotation_axis, Uint32 depth, float parent_length, float parent_radius, float offset);
+void _trees_build_branch(EsTree* tree, Uint32 index, vec3* leaf_dirs);
+void _trees_build_leaves(EsTree* tree, Uint32 index, vec3* leaf_dirs);
 EsCrossSection _trees_build_cs(float radius, vec3 position, vec3 axis, Uint32 depth, Uint32 num_children, Uint32 child1);
-float _get_var(EsVarFloat var);
+float _get_var(EsRng* rng, EsVarFloat var);
 Uint32 _get_num_branches(Uint32 max_branches, float offset, float parent_length, float max_length, float child_length, Uint32 depth);
 float _shape_ratio(Uint32 shape, float ratio);
-float _get_branch_length(EsTree* tree, Uint32 depth, float parent_length, float offset);
+float _get_branch_length(EsTree* tree, EsRng* rng, Uint32 depth, float parent_length, float offset);
 float _get_branch_start_length(EsTree* tree, float length, Uint32 depth);
 vec3 _lerp_branch(EsTree* tree, Uint32 root, float length);
 Uint32 _get_segment_root(EsTree* tree, Uint32 root, float length);
+SDL_bool _get_segment_index(EsTree* tree, Uint32 root, float length, Uint32* segment);
 vec3 _get_current_branch_axis(EsTree* tree, EsCrossSection cs);
-float _get_down_angle(EsTree* tree, Uint32 depth, float parent_length, float offset);
-SDL_bool _add_leaf_on_branch(EsTree* tree, EsBranchSDF* branch, Uint32 leaf_id, float leaf_width, float leaf_length);
+float _get_down_angle(EsTree* tree, EsRng* rng, Uint32 depth, float parent_length, float offset);
+void _raymarch_batch(EsRaymarchStats* stats, EsBranchSDF* branch, vec3* starts, vec3* dirs, vec3* hits, Uint32 count);
+
+Uint32 _trees_hash_seed(Uint32 seed, Uint32 index) {
+    // Each tree in a forest, and each branch in a tree, gets its own stream, so we mix the
+    // index into the seed rather than just adding it, to avoid neighbours having similar streams.
+    Uint32 h = seed ^ (index * 0x9E3779B9u);
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
 
 float _get_time_in_seconds() {
     return (float) SDL_GetTicks()/1000.0f;
@@ -50,32 +68,137 @@ float _distance_field(vec3 pos, EsBranchSDF* branch) {
     return d;
 }
 
-vec3 _raymarch(vec3 start, vec3 dir, EsBranchSDF* branch) {
+vec3 _raymarch(EsRaymarchStats* stats, vec3 start, vec3 dir, EsBranchSDF* branch) {
     float d = 0.0f;
     vec3 p = start;
-    for (Uint32 i=0; i<100; i++) {
+    stats->rays++;
+    for (Uint32 i=0; i<MAXIMUM_STEPS_RAYMARCH; i++) {
         float dist = _distance_field(p, branch);
+        stats->iterations++;
         p = vec3_add(p, vec3_scale(dir, dist));
         d += dist;
         if (dist < MINIMUM_DIST_RAYMARCH)
             return p;
-        if (d > MAXIMUM_DIST_RAYMARCH) {
-            SDL_Log("failed to find sdf. branch= (%f, %f)", branch->main_radius, branch->sub_radius);
-            return build_vec3(0.0, 0.0, 0.0);
-        }
+        if (d > MAXIMUM_DIST_RAYMARCH)
+            break;
     }
-    SDL_Log("failed to find sdf. branch= (%f, %f)", branch->main_radius, branch->sub_radius);
+    stats->failures++;
     return build_vec3(0.0, 0.0, 0.0);
 }
 
-SDL_bool _add_leaf_on_branch(EsTree* tree, EsBranchSDF* branch, Uint32 leaf_id, float leaf_width, float leaf_length) {
-   vec3 start = vec3_add(branch->main_pos, vec3_scale(rand_vec3(), branch->main_radius*5.0f));
-   vec3 dir = vec3_normalize(vec3_sub(branch->main_pos, start));
-   tree->leaves[leaf_id].position = _raymarch(start, dir, branch);
-   tree->leaves[leaf_id].axis = rand_vec3();
-   tree->leaves[leaf_id].length = leaf_length;
-   tree->leaves[leaf_id].width = leaf_width;
-   return SDL_TRUE;
+#ifdef ES_SSE2
+__m128 _sdf_sphere4(__m128 x, __m128 y, __m128 z, vec3 center, float radius) {
+    __m128 dx = _mm_sub_ps(x, _mm_set1_ps(center.x));
+    __m128 dy = _mm_sub_ps(y, _mm_set1_ps(center.y));
+    __m128 dz = _mm_sub_ps(z, _mm_set1_ps(center.z));
+    __m128 sq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    return _mm_sub_ps(_mm_sqrt_ps(sq), _mm_set1_ps(radius));
+}
+
+__m128 _smooth_h4(__m128 d1, __m128 d2, float k) {
+    __m128 abs_diff = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(d1, d2));
+    __m128 h = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(k), abs_diff), _mm_setzero_ps());
+    return _mm_div_ps(_mm_mul_ps(_mm_mul_ps(h, h), _mm_set1_ps(0.25f)), _mm_set1_ps(k));
+}
+
+__m128 _distance_field4(__m128 x, __m128 y, __m128 z, EsBranchSDF* branch) {
+    // Same as _distance_field, for 4 points at a time.
+    __m128 d = _sdf_sphere4(x, y, z, branch->main_pos, branch->main_radius);
+    __m128 d1 = _sdf_sphere4(x, y, z, branch->add1_pos, branch->add1_radius);
+    d = _mm_sub_ps(_mm_min_ps(d, d1), _smooth_h4(d, d1, 1.0f));
+    d1 = _mm_sub_ps(_mm_setzero_ps(), _sdf_sphere4(x, y, z, branch->sub_pos, branch->sub_radius));
+    d = _mm_add_ps(_mm_max_ps(d, d1), _smooth_h4(d, d1, 0.3f));
+    return d;
+}
+
+Uint32 _count_bits(int mask) {
+    Uint32 count = 0;
+    for (; mask; mask &= mask-1)
+        count++;
+    return count;
+}
+
+void _raymarch_lanes(EsRaymarchStats* stats, EsBranchSDF* branch, vec3* starts, vec3* dirs, vec3* hits, Uint32 count) {
+    // Marches up to TREES_RAY_BATCH rays together. Each lane keeps marching until it hits or
+    // fails, and is then masked out. We stop as soon as all the lanes are done.
+    __m128 px[2], py[2], pz[2], dx[2], dy[2], dz[2], dist_total[2], active[2];
+    float lanes[3][TREES_RAY_BATCH];
+    float dir_lanes[3][TREES_RAY_BATCH];
+    for (Uint32 i=0; i<TREES_RAY_BATCH; i++) {
+        Uint32 j = SDL_min(i, count-1);
+        lanes[0][i] = starts[j].x;
+        lanes[1][i] = starts[j].y;
+        lanes[2][i] = starts[j].z;
+        dir_lanes[0][i] = dirs[j].x;
+        dir_lanes[1][i] = dirs[j].y;
+        dir_lanes[2][i] = dirs[j].z;
+    }
+    for (Uint32 h=0; h<2; h++) {
+        px[h] = _mm_loadu_ps(&lanes[0][h*4]);
+        py[h] = _mm_loadu_ps(&lanes[1][h*4]);
+        pz[h] = _mm_loadu_ps(&lanes[2][h*4]);
+        dx[h] = _mm_loadu_ps(&dir_lanes[0][h*4]);
+        dy[h] = _mm_loadu_ps(&dir_lanes[1][h*4]);
+        dz[h] = _mm_loadu_ps(&dir_lanes[2][h*4]);
+        dist_total[h] = _mm_setzero_ps();
+        // Padding lanes start out inactive.
+        Uint32 valid = SDL_min(4, count > h*4 ? count - h*4 : 0);
+        __m128i lane_index = _mm_set_epi32(3, 2, 1, 0);
+        active[h] = _mm_castsi128_ps(_mm_cmplt_epi32(lane_index, _mm_set1_epi32((int) valid)));
+    }
+    for (Uint32 i=0; i<count; i++)
+        hits[i] = build_vec3(0.0f, 0.0f, 0.0f);
+    stats->rays += count;
+    __m128 min_dist = _mm_set1_ps((float) MINIMUM_DIST_RAYMARCH);
+    __m128 max_dist = _mm_set1_ps((float) MAXIMUM_DIST_RAYMARCH);
+    for (Uint32 step=0; step<MAXIMUM_STEPS_RAYMARCH; step++) {
+        SDL_bool any_active = SDL_FALSE;
+        for (Uint32 h=0; h<2; h++) {
+            int active_mask = _mm_movemask_ps(active[h]);
+            if (active_mask == 0)
+                continue;
+            any_active = SDL_TRUE;
+            stats->iterations += _count_bits(active_mask);
+            __m128 dist = _distance_field4(px[h], py[h], pz[h], branch);
+            dist = _mm_and_ps(dist, active[h]);
+            px[h] = _mm_add_ps(px[h], _mm_mul_ps(dx[h], dist));
+            py[h] = _mm_add_ps(py[h], _mm_mul_ps(dy[h], dist));
+            pz[h] = _mm_add_ps(pz[h], _mm_mul_ps(dz[h], dist));
+            dist_total[h] = _mm_add_ps(dist_total[h], dist);
+            __m128 hit = _mm_and_ps(active[h], _mm_cmplt_ps(dist, min_dist));
+            __m128 fail = _mm_andnot_ps(hit, _mm_and_ps(active[h], _mm_cmpgt_ps(dist_total[h], max_dist)));
+            int hit_mask = _mm_movemask_ps(hit);
+            if (hit_mask) {
+                float x[4], y[4], z[4];
+                _mm_storeu_ps(x, px[h]);
+                _mm_storeu_ps(y, py[h]);
+                _mm_storeu_ps(z, pz[h]);
+                for (Uint32 l=0; l<4; l++) {
+                    if (hit_mask & (1 << l))
+                        hits[h*4 + l] = build_vec3(x[l], y[l], z[l]);
+                }
+            }
+            stats->failures += _count_bits(_mm_movemask_ps(fail));
+            active[h] = _mm_andnot_ps(_mm_or_ps(hit, fail), active[h]);
+        }
+        if (!any_active)
+            return;
+    }
+    stats->failures += _count_bits(_mm_movemask_ps(active[0])) + _count_bits(_mm_movemask_ps(active[1]));
+    return;
+}
+#endif
+
+void _raymarch_batch(EsRaymarchStats* stats, EsBranchSDF* branch, vec3* starts, vec3* dirs, vec3* hits, Uint32 count) {
+    // Rays that don't find the surface get a zero position, and are skipped while meshing.
+#ifdef ES_SSE2
+    for (Uint32 i=0; i<count; i+=TREES_RAY_BATCH)
+        _raymarch_lanes(stats, branch, &starts[i], &dirs[i], &hits[i], SDL_min(TREES_RAY_BATCH, count-i));
+#else
+    for (Uint32 i=0; i<count; i++)
+        hits[i] = _raymarch(stats, starts[i], dirs[i], branch);
+#endif
+    return;
 }
 
 EsCrossSection _trees_build_cs(float radius, vec3 position, vec3 axis, Uint32 depth, Uint32 num_children, Uint32 child1) {
@@ -86,11 +209,12 @@ EsCrossSection _trees_build_cs(float radius, vec3 position, vec3 axis, Uint32 de
     cs.num_children = num_children;
     cs.children[0] = child1;
     cs.depth = depth;
+    cs.arc_length = 0.0f;
     return cs;
 }
 
-float _get_var(EsVarFloat var) {
-    return var.val + rand_negpos() * var.val_v;
+float _get_var(EsRng* rng, EsVarFloat var) {
+    return var.val + rng_negpos(rng) * var.val_v;
 }
 
 float _shape_ratio(Uint32 shape, float ratio) {
@@ -118,15 +242,15 @@ Uint32 _get_num_branches(Uint32 max_branches, float offset, float parent_length,
         return (Uint32) (max_branches * (1.0f - (0.5 * (offset/parent_length))));
 }
 
-float _get_branch_length(EsTree* tree, Uint32 depth, float parent_length, float offset) {
+float _get_branch_length(EsTree* tree, EsRng* rng, Uint32 depth, float parent_length, float offset) {
     if (depth == 0)
-        return _get_var(tree->params.scale) * _get_var(tree->params.lengths[depth]);
+        return _get_var(rng, tree->params.scale) * _get_var(rng, tree->params.lengths[depth]);
     else if (depth == 1) {
         float base_length = tree->params.base_size * parent_length;
         float ratio = (parent_length-offset) / (parent_length-base_length);
-        return parent_length * _get_var(tree->params.lengths[depth]) * _shape_ratio(tree->params.shape, ratio);
+        return parent_length * _get_var(rng, tree->params.lengths[depth]) * _shape_ratio(tree->params.shape, ratio);
     } else
-        return _get_var(tree->params.lengths[depth]) * (parent_length - (0.6f*offset));
+        return _get_var(rng, tree->params.lengths[depth]) * (parent_length - (0.6f*offset));
 }
 
 float _get_branch_start_length(EsTree* tree, float length, Uint32 depth) {
@@ -136,11 +260,11 @@ float _get_branch_start_length(EsTree* tree, float length, Uint32 depth) {
         return 0.0f;
 }
 
-vec3 _branch_axis_rotation(EsTree* tree, vec3 current_axis, vec3 rotation_axis, Uint32 num_seg, Uint32 depth) {
+vec3 _branch_axis_rotation(EsTree* tree, EsRng* rng, vec3 current_axis, vec3 rotation_axis, Uint32 num_seg, Uint32 depth) {
     num_seg;
-    float angle = _get_var(tree->params.curves[depth]) / tree->params.curves_res[depth];
+    float angle = _get_var(rng, tree->params.curves[depth]) / tree->params.curves_res[depth];
     angle = deg_to_rad(angle);
-    return rotate_about_origin_axis(current_axis, angle, rotation_axis);
+    return quat_rotate(quat_from_axis_angle(rotation_axis, angle), current_axis);
 }
 
 vec3 _get_current_branch_axis(EsTree* tree, EsCrossSection cs) {
@@ -149,52 +273,53 @@ vec3 _get_current_branch_axis(EsTree* tree, EsCrossSection cs) {
     return axis;
 }
 
+SDL_bool _get_segment_index(EsTree* tree, Uint32 root, float length, Uint32* segment) {
+    // Binary search over the arc lengths of the branch, for the segment that contains length.
+    EsBranch branch = tree->roots[root];
+    EsCrossSection* cs = &tree->cross_sections[branch.root_cs];
+    if (length < 0.0f || branch.num_segments == 0 || length >= cs[branch.num_segments].arc_length)
+        return SDL_FALSE;
+    Uint32 low = 0;
+    Uint32 high = branch.num_segments;
+    while (high - low > 1) {
+        Uint32 mid = (low + high) / 2;
+        if (cs[mid].arc_length <= length)
+            low = mid;
+        else
+            high = mid;
+    }
+    *segment = low;
+    return SDL_TRUE;
+}
+
 vec3 _lerp_branch(EsTree* tree, Uint32 root, float length) {
-    EsCrossSection cs = tree->cross_sections[root];
-    float rem = length;
-    while (cs.num_children > 0) {
-        // TODO (24 Nov 2020 sam): BranchSplitRefactor
-        EsCrossSection child = tree->cross_sections[cs.children[0]];
-        vec3 axis = _get_current_branch_axis(tree, cs);
-        float dist = vec3_distance(cs.position, child.position);
-        if (rem < dist) {
-            float offset = rem / dist;
-            return vec3_add(cs.position, vec3_scale(axis, offset));
-        }
-        cs = child;
-        rem -= dist;
+    Uint32 segment;
+    if (!_get_segment_index(tree, root, length, &segment)) {
+        SDL_Log("ERROR: Could not lerp branch: root=%i, length=%f\n", root, length);
+        return build_vec3(10.0f, 10.0f, 10.0f);
     }
-    SDL_Log("ERROR: Could not lerp branch: root=%i, length=%f\n", root, length);
-    return build_vec3(10.0f, 10.0f, 10.0f);
+    EsCrossSection base = tree->cross_sections[tree->roots[root].root_cs + segment];
+    EsCrossSection tip = tree->cross_sections[tree->roots[root].root_cs + segment + 1];
+    float offset = (length - base.arc_length) / (tip.arc_length - base.arc_length);
+    return vec3_add(base.position, vec3_scale(vec3_sub(tip.position, base.position), offset));
 }
 
 Uint32 _get_segment_root(EsTree* tree, Uint32 root, float length) {
-    EsCrossSection cs = tree->cross_sections[root];
-    float rem = length;
-    Uint32 current_index = root;
-    while (cs.num_children > 0) {
-        // TODO (24 Nov 2020 sam): BranchSplitRefactor
-        EsCrossSection child = tree->cross_sections[cs.children[0]];
-        vec3 axis = _get_current_branch_axis(tree, cs);
-        float dist = vec3_magnitude(axis);
-        if (rem < dist) {
-            return current_index;
-        }
-        current_index = cs.children[0];
-        cs = child;
-        rem -= dist;
+    Uint32 segment;
+    if (!_get_segment_index(tree, root, length, &segment)) {
+        SDL_Log("ERROR: Could not get segement branch: root=%i, length=%f\n", root, length);
+        return 0;
     }
-    SDL_Log("ERROR: Could not get segement branch: root=%i, length=%f\n", root, length);
-    return 0;
+    return tree->roots[root].root_cs + segment;
 }
 
-float _get_down_angle(EsTree* tree, Uint32 depth, float parent_length, float offset) {
+float _get_down_angle(EsTree* tree, EsRng* rng, Uint32 depth, float parent_length, float offset) {
     float down_angle;
     EsVarFloat var = tree->params.down_angles[depth];
     if (var.val_v > 0)
-        down_angle = -deg_to_rad(_get_var(tree->params.down_angles[depth]));
+        down_angle = -deg_to_rad(_get_var(rng, tree->params.down_angles[depth]));
     else {
-        float valv = rand_negpos() * var.val_v;
+        float valv = rng_negpos(rng) * var.val_v;
         float base_length = tree->params.base_size * parent_length;
         float ratio = (parent_length-offset) / (parent_length-base_length);
         down_angle = var.val + (valv * (1.0f - (2.0f * _shape_ratio(0, ratio))));
@@ -202,327 +327,767 @@ float _get_down_angle(EsTree* tree, Uint32 depth, float parent_length, float off
     return deg_to_rad(down_angle);
 }
 
-// TODO (22 Nov 2020 sam): Implement get_next_cs_id or something. Function that gives the current cs_id
-// and incrments num. Also checks size and reallocs if required.
-Uint32 _get_next_cs_id(EsTree* tree) {
-    Uint32 cs_id = tree->num_cross_sections;
-    tree->num_cross_sections++;
-    if (tree->num_cross_sections == tree->cross_sections_size) {
-        Uint32 new_size = tree->cross_sections_size * 2;
-        EsCrossSection* new_cs = (EsCrossSection*) SDL_realloc(tree->cross_sections, new_size*sizeof(EsCrossSection));
-        if (new_cs == NULL) {
-            SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not realloc crossections\n");
-            exit(-2);
-        }
-        tree->cross_sections = new_cs;
-        tree->cross_sections_size = new_size;
-    }
-    return cs_id;
-}
-
-Uint32 _get_next_root(EsTree* tree) {
-    Uint32 root_id = tree->num_roots;
-    tree->num_roots++;
-    // SDL_Log("rootid = %i\n", root_id);
-    if (tree->num_roots == tree->roots_size) {
-        Uint32 new_size = tree->roots_size * 2;
-        Uint32* new_r = (Uint32*) SDL_realloc(tree->roots, new_size*sizeof(Uint32));
-        if (new_r == NULL) {
-            SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not realloc roots\n");
-            exit(-1);
-        }
-        tree->roots = new_r;
-        tree->roots_size = new_size;
-    }
-    return root_id;
-}
-
-Uint32 _get_next_leaf(EsTree* tree) {
-    Uint32 leaf_id = tree->num_leaves;
-    tree->num_leaves++;
-    // SDL_Log("rootid = %i\n", root_id);
-    if (tree->num_leaves == tree->leaves_size) {
-        Uint32 new_size = tree->leaves_size * 2;
-        EsLeaf* new_r = (EsLeaf*) SDL_realloc(tree->leaves, new_size*sizeof(EsLeaf));
-        if (new_r == NULL) {
-            SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not realloc leaves\n");
-            exit(-1);
+void _trees_plan_branch(EsTree* tree, Uint32 index) {
+    // Makes the draws that decide how many children and leaves the branch has. The rest of
+    // its draws are made from the same stream when it's built.
+    EsPendingBranch* branch = &tree->workspace->branches[index];
+    EsRng* rng = &branch->rng;
+    Uint32 depth = branch->depth;
+    rng_seed(rng, _trees_hash_seed(tree->seed, index));
+    branch->length = _get_branch_length(tree, rng, depth, branch->parent_length, branch->offset);
+    if (depth == 0)
+        branch->base_radius = branch->length * tree->params.ratio * _get_var(rng, tree->params.trunk_scale);
+    else
+        branch->base_radius = branch->parent_radius * SDL_powf(branch->length / branch->parent_length, tree->params.ratio_power);
+    branch->num_children = 0;
+    Uint32 param_ref_depth = SDL_min(depth, 3);
+    if (param_ref_depth < SDL_min(tree->params.levels-1, 3)) {
+        Uint32 max_branches = tree->params.branches[param_ref_depth+1];
+        // TODO (23 Nov 2020 sam): We should probably not be sending offset here. Need to check.
+        float child_length = _get_branch_length(tree, rng, param_ref_depth+1, branch->length, 0.0f);
+        float max_length = _get_var(rng, tree->params.lengths[param_ref_depth+1]);
+        branch->num_children = _get_num_branches(max_branches, branch->offset, branch->parent_length, max_length, child_length, param_ref_depth);
+    }
+    branch->num_leaves = 0;
+    if (depth == tree->params.levels-1) {
+        // Never more than params.leaves, which is what the leaf scratch space is sized for.
+        Uint32 num_leaves = (Uint32) (tree->params.leaves * _shape_ratio(4, (branch->offset/branch->parent_length)));
+        branch->num_leaves = SDL_min(num_leaves, tree->params.leaves);
+    }
+    branch->stats.rays = 0;
+    branch->stats.iterations = 0;
+    branch->stats.failures = 0;
+    return;
+}
+
+float _trees_child_offset(EsTree* tree, EsPendingBranch* branch, Uint32 child) {
+    float branch_start = _get_branch_start_length(tree, branch->length, SDL_min(branch->depth, 3));
+    float branch_end = branch->length;
+    float child_offset_ratio = ((float) child + 0.5f) / (float) branch->num_children;
+    return lerp(branch_start, branch_end, child_offset_ratio);
+}
+
+SDL_bool _trees_reserve_branches(EsTreeWorkspace* workspace, Uint32 count) {
+    // Unlike the tree arrays, the worklist grows while it's being filled, so it keeps its contents.
+    if (count <= workspace->branches_size)
+        return SDL_TRUE;
+    Uint32 size = SDL_max(count, workspace->branches_size*2);
+    EsPendingBranch* branches = (EsPendingBranch*) SDL_realloc(workspace->branches, size * sizeof(EsPendingBranch));
+    if (branches == NULL) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not allocate tree worklist\n");
+        return SDL_FALSE;
+    }
+    workspace->branches = branches;
+    workspace->branches_size = size;
+    return SDL_TRUE;
+}
+
+SDL_bool _trees_plan(EsTree* tree, EsTreeCounts* counts) {
+    // Fills the worklist one level at a time. Once a level is planned, every branch in it knows
+    // where its cross sections, children and leaves go, so the level can be built in any order.
+    EsTreeWorkspace* workspace = tree->workspace;
+    SDL_memset(counts, 0, sizeof(EsTreeCounts));
+    if (!_trees_reserve_branches(workspace, 1))
+        return SDL_FALSE;
+    EsPendingBranch* trunk = &workspace->branches[0];
+    trunk->depth = 0;
+    trunk->parent_length = 0.0f;
+    trunk->parent_radius = 0.0f;
+    trunk->offset = 0.0f;
+    trunk->position = build_vec3(0.0f, 0.0f, 0.0f);
+    trunk->axis = build_vec3(0.0f, 1.0f, 0.0f);
+    trunk->rotation_axis = build_vec3(0.0f, 0.0f, 1.0f);
+    Uint32 level_start = 0;
+    Uint32 level_end = 1;
+    while (level_start < level_end) {
+        Uint32 num_children = 0;
+        for (Uint32 i=level_start; i<level_end; i++) {
+            _trees_plan_branch(tree, i);
+            EsPendingBranch* branch = &workspace->branches[i];
+            branch->first_cs = counts->num_cross_sections;
+            counts->num_cross_sections += tree->params.curves_res[branch->depth] + 1;
+            branch->first_child = level_end + num_children;
+            num_children += branch->num_children;
+            branch->first_leaf = counts->num_leaves;
+            branch->sdf_id = counts->num_sdfs;
+            if (branch->depth == tree->params.levels-1) {
+                counts->num_leaves += branch->num_leaves;
+                counts->num_sdfs++;
+            }
         }
-        tree->leaves = new_r;
-        tree->leaves_size = new_size;
-    }
-    return leaf_id;
-}
-
-Uint32 _get_next_branch(EsTree* tree) {
-    Uint32 sdf_id = tree->num_sdfs;
-    tree->num_sdfs++;
-    // SDL_Log("rootid = %i\n", root_id);
-    if (tree->num_sdfs == tree->sdfs_size) {
-        Uint32 new_size = tree->sdfs_size * 2;
-        EsBranchSDF* new_r = (EsBranchSDF*) SDL_realloc(tree->sdfs, new_size*sizeof(EsBranchSDF));
-        if (new_r == NULL) {
-            SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not realloc sdfs\n");
-            exit(-1);
+        if (!_trees_reserve_branches(workspace, level_end + num_children))
+            return SDL_FALSE;
+        for (Uint32 i=level_start; i<level_end; i++) {
+            EsPendingBranch* branch = &workspace->branches[i];
+            for (Uint32 j=0; j<branch->num_children; j++) {
+                EsPendingBranch* child = &workspace->branches[branch->first_child + j];
+                child->depth = branch->depth+1;
+                child->parent_length = branch->length;
+                child->parent_radius = branch->base_radius;
+                child->offset = _trees_child_offset(tree, branch, j);
+            }
         }
-        tree->sdfs = new_r;
-        tree->sdfs_size = new_size;
+        level_start = level_end;
+        level_end += num_children;
     }
-    return sdf_id;
+    counts->num_roots = level_end;
+    return SDL_TRUE;
 }
 
-SDL_bool _trees_generate_branch(EsTree* tree, vec3 position, vec3 axis, vec3 rotation_axis, Uint32 depth, float parent_length, float parent_radius, float offset) {
-    Uint32 branch_root = _get_next_cs_id(tree);
-    Uint32 root_index = _get_next_root(tree);
-    if (depth == 0)
-        tree->tree_root = root_index;
+void _trees_build_branch(EsTree* tree, Uint32 index, vec3* leaf_dirs) {
+    // Only writes to the ranges that planning gave this branch, and to its children in the
+    // worklist, and only reads branches from earlier levels.
+    EsPendingBranch* branch = &tree->workspace->branches[index];
+    EsRng branch_rng = branch->rng;
+    EsRng* rng = &branch_rng;
+    Uint32 depth = branch->depth;
     Uint32 num_segments = tree->params.curves_res[depth];
-    tree->roots[root_index] = branch_root;
-    Uint32 index = branch_root;
-    float length = _get_branch_length(tree, depth, parent_length, offset);
-    if (depth == 0)
-        tree->tree_height = length;
-    float base_radius;
-    if (depth == 0)
-        base_radius = length * tree->params.ratio * _get_var(tree->params.trunk_scale);
-    else
-        base_radius = parent_radius * SDL_powf(length / parent_length, tree->params.ratio_power);
-    float tip_radius = base_radius * (1.0f-tree->params.tapers[depth]);
-    vec3 current_pos = position;
-    vec3 current_axis = axis;
+    float length = branch->length;
+    float tip_radius = branch->base_radius * (1.0f-tree->params.tapers[depth]);
+    vec3 current_pos = branch->position;
+    vec3 current_axis = branch->axis;
+    float current_arc_length = 0.0f;
+    float branch_length = 0.0f;
     // create the branch
     for (Uint32 i=0; i<num_segments+1; i++) {
-        float current_radius = lerp(base_radius, tip_radius, ((float)i/(float)num_segments));
-        Uint32 num_children;
-        Uint32 child_index;
-        if (i+1 == num_segments+1) {
-            num_children = 0;
-            child_index = 0;
-        } else { 
-            num_children = 1;
-            child_index = _get_next_cs_id(tree);
-        }
-        tree->cross_sections[index] = _trees_build_cs(current_radius, current_pos, current_axis, depth, num_children, child_index);
-        current_pos = vec3_add(current_pos, vec3_scale(current_axis, length/tree->params.curves_res[depth]));
-        current_axis = _branch_axis_rotation(tree, current_axis, rotation_axis, i, depth);
-        index = child_index;
+        float current_radius = lerp(branch->base_radius, tip_radius, ((float)i/(float)num_segments));
+        Uint32 cs_index = branch->first_cs + i;
+        if (i == num_segments)
+            tree->cross_sections[cs_index] = _trees_build_cs(current_radius, current_pos, current_axis, depth, 0, 0);
+        else
+            tree->cross_sections[cs_index] = _trees_build_cs(current_radius, current_pos, current_axis, depth, 1, cs_index+1);
+        tree->cross_sections[cs_index].arc_length = current_arc_length;
+        branch_length = current_arc_length;
+        vec3 next_pos = vec3_add(current_pos, vec3_scale(current_axis, length/tree->params.curves_res[depth]));
+        current_arc_length += vec3_distance(current_pos, next_pos);
+        current_pos = next_pos;
+        current_axis = _branch_axis_rotation(tree, rng, current_axis, branch->rotation_axis, i, depth);
     }
-    // create the child branches
+    EsBranch branch_info;
+    branch_info.root_cs = branch->first_cs;
+    branch_info.num_segments = num_segments;
+    branch_info.length = branch_length;
+    tree->roots[index] = branch_info;
+    // place the child branches, which are built with the next level
     Uint32 param_ref_depth = SDL_min(depth, 3);
-    if (param_ref_depth < SDL_min(tree->params.levels-1, 3)) {
-        Uint32 max_branches = tree->params.branches[param_ref_depth+1];
-        // TODO (23 Nov 2020 sam): We should probably not be sending offset here. Need to check.
-        float child_length = _get_branch_length(tree, param_ref_depth+1, length, 0.0f);
-        float max_length = _get_var(tree->params.lengths[param_ref_depth+1]);
-        Uint32 num_branches = _get_num_branches(max_branches, offset, parent_length, max_length, child_length, param_ref_depth);
-        float branch_start = _get_branch_start_length(tree, length, param_ref_depth);
-        float branch_end = length;
-        vec3 current_rotation = build_vec3(0.0f, 0.0f, 1.0f);
-        for (Uint32 i=0; i<num_branches; i++) {
-            float child_offset_ratio = ((float) i + 0.5f) / (float) num_branches;
-            float child_offset = lerp(branch_start, branch_end, child_offset_ratio);
-            vec3 child_pos = _lerp_branch(tree, branch_root, child_offset);
-            vec3 current_branch_axis = _get_current_branch_axis(tree, tree->cross_sections[branch_root]);
-            float angle = deg_to_rad(_get_var(tree->params.rotates[param_ref_depth+1]));
-            current_rotation = rotate_about_origin_axis(current_rotation, angle, current_branch_axis);
-            vec3 child_rotation_axis = vec3_cross(current_rotation, current_branch_axis);
-            float down_angle = _get_down_angle(tree, param_ref_depth+1, length, child_offset);
-            vec3 child_axis = rotate_about_origin_axis(current_rotation, down_angle, child_rotation_axis);
-            _trees_generate_branch(tree, child_pos, child_axis, child_rotation_axis, depth+1, length, base_radius, child_offset);
-        }
+    vec3 current_rotation = build_vec3(0.0f, 0.0f, 1.0f);
+    vec3 current_branch_axis = _get_current_branch_axis(tree, tree->cross_sections[branch->first_cs]);
+    for (Uint32 i=0; i<branch->num_children; i++) {
+        EsPendingBranch* child = &tree->workspace->branches[branch->first_child + i];
+        float angle = deg_to_rad(_get_var(rng, tree->params.rotates[param_ref_depth+1]));
+        current_rotation = quat_rotate(quat_from_axis_angle(current_branch_axis, angle), current_rotation);
+        child->position = _lerp_branch(tree, index, child->offset);
+        child->rotation_axis = vec3_cross(current_rotation, current_branch_axis);
+        float down_angle = _get_down_angle(tree, rng, param_ref_depth+1, length, child->offset);
+        child->axis = quat_rotate(quat_from_axis_angle(child->rotation_axis, down_angle), current_rotation);
     }
     if (depth == tree->params.levels-1) {
         // generate leaves
-        Uint32 num_leaves = (Uint32) (tree->params.leaves * _shape_ratio(4, (offset/parent_length)));
         float tree_length = tree->tree_height;
-        EsBranchSDF branch;
-        branch.main_pos = _lerp_branch(tree, branch_root, 0.5f * length);
-        branch.main_radius = length*0.5f + rand_negpos() * 0.1f;
-        branch.add1_pos = vec3_add(branch.main_pos, vec3_scale(rand_vec3(), branch.main_radius+rand_pos()));
-        branch.add1_radius = rand_pos() * branch.main_radius * 0.5f;
-        branch.sub_pos = _lerp_branch(tree, tree->tree_root, 0.5f * tree_length);
-        branch.sub_radius = vec3_distance(branch.sub_pos, branch.main_pos) - (branch.main_radius*2.0f);
-        branch.sub_radius -= 0.2f * branch.sub_radius * rand_pos();
-        Uint32 branch_id = _get_next_branch(tree);
-        tree->sdfs[branch_id] = branch;
-        float leaf_length = tree->params.leaf_scale / SDL_sqrtf(tree->params.quality);
-        float leaf_width = tree->params.leaf_scale * tree->params.leaf_scale_x / SDL_sqrtf(tree->params.quality);
-        for (Uint32 i=0; i<num_leaves; i++) {
-            Uint32 leaf_id = _get_next_leaf(tree);
-            _add_leaf_on_branch(tree, &branch, leaf_id, leaf_width, leaf_length);
-            tree->leaves[leaf_id].branch_root = root_index;
-            tree->leaves[leaf_id].sdf_id = branch_id;
+        EsBranchSDF sdf;
+        sdf.main_pos = _lerp_branch(tree, index, 0.5f * length);
+        sdf.main_radius = length*0.5f + rng_negpos(rng) * 0.1f;
+        vec3 add1_dir = rng_vec3(rng);
+        sdf.add1_pos = vec3_add(sdf.main_pos, vec3_scale(add1_dir, sdf.main_radius+rng_pos(rng)));
+        sdf.add1_radius = rng_pos(rng) * sdf.main_radius * 0.5f;
+        sdf.sub_pos = _lerp_branch(tree, tree->tree_root, 0.5f * tree_length);
+        sdf.sub_radius = vec3_distance(sdf.sub_pos, sdf.main_pos) - (sdf.main_radius*2.0f);
+        sdf.sub_radius -= 0.2f * sdf.sub_radius * rng_pos(rng);
+        tree->sdfs[branch->sdf_id] = sdf;
+        branch->leaf_rng = *rng;
+        _trees_build_leaves(tree, index, leaf_dirs);
+    }
+    return;
+}
+
+void _trees_build_leaves(EsTree* tree, Uint32 index, vec3* leaf_dirs) {
+    // Places the leaves around the leaf cluster of the branch, which has to be built already.
+    EsPendingBranch* branch = &tree->workspace->branches[index];
+    EsRng rng = branch->leaf_rng;
+    EsBranchSDF sdf = tree->sdfs[branch->sdf_id];
+    Uint32 num_leaves = branch->num_leaves;
+    float leaf_length = tree->params.leaf_scale / SDL_sqrtf(tree->params.quality);
+    float leaf_width = tree->params.leaf_scale * tree->params.leaf_scale_x / SDL_sqrtf(tree->params.quality);
+    // Start direction and axis for each leaf, drawn in one go. Then the rays towards the
+    // branch are all marched together.
+    vec3* ray_starts = &leaf_dirs[num_leaves*2];
+    vec3* ray_dirs = &leaf_dirs[num_leaves*3];
+    vec3* ray_hits = &leaf_dirs[num_leaves*4];
+    rng_fill_vec3(&rng, leaf_dirs, num_leaves*2);
+    for (Uint32 i=0; i<num_leaves; i++) {
+        ray_starts[i] = vec3_add(sdf.main_pos, vec3_scale(leaf_dirs[i*2 + 0], sdf.main_radius*5.0f));
+        ray_dirs[i] = vec3_sub(sdf.main_pos, ray_starts[i]);
+    }
+    vec3_normalize_array(ray_dirs, num_leaves);
+    branch->stats.rays = 0;
+    branch->stats.iterations = 0;
+    branch->stats.failures = 0;
+    _raymarch_batch(&branch->stats, &sdf, ray_starts, ray_dirs, ray_hits, num_leaves);
+    for (Uint32 i=0; i<num_leaves; i++) {
+        EsLeaf* leaf = &tree->leaves[branch->first_leaf + i];
+        leaf->position = ray_hits[i];
+        leaf->axis = leaf_dirs[i*2 + 1];
+        leaf->length = leaf_length;
+        leaf->width = leaf_width;
+        leaf->branch_root = index;
+        leaf->sdf_id = branch->sdf_id;
+    }
+    return;
+}
+
+typedef struct {
+    EsTree* tree;
+    Uint32 first;
+    SDL_bool leaves_only;
+} _EsLevelJob;
+
+void _trees_level_job(void* data, Uint32 index, Uint32 worker) {
+    _EsLevelJob* level = (_EsLevelJob*) data;
+    EsTree* tree = level->tree;
+    vec3* leaf_dirs = &tree->workspace->leaf_dirs[worker * tree->params.leaves * 5];
+    if (level->leaves_only)
+        _trees_build_leaves(tree, level->first + index, leaf_dirs);
+    else
+        _trees_build_branch(tree, level->first + index, leaf_dirs);
+    return;
+}
+
+SDL_bool _trees_build_levels(EsTree* tree, Uint32 first_root, SDL_bool leaves_only) {
+    // Builds the levels from the one starting at first_root on. Each level only depends on the
+    // levels before it.
+    EsPendingBranch* branches = tree->workspace->branches;
+    Uint32 level_start = first_root;
+    while (level_start < tree->num_roots) {
+        Uint32 level_end = level_start+1;
+        while (level_end < tree->num_roots && branches[level_end].depth == branches[level_start].depth)
+            level_end++;
+        _EsLevelJob level;
+        level.tree = tree;
+        level.first = level_start;
+        level.leaves_only = leaves_only;
+        Uint32 num_branches = level_end - level_start;
+        if (tree->parallel && num_branches >= TREES_MIN_PARALLEL_BRANCHES) {
+            if (!warehouse_parallel_for(num_branches, _trees_level_job, &level)) {
+                SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not build tree level %u\n", branches[level_start].depth);
+                return SDL_FALSE;
+            }
+        } else {
+            for (Uint32 i=0; i<num_branches; i++)
+                _trees_level_job(&level, i, 0);
         }
+        level_start = level_end;
     }
     return SDL_TRUE;
 }
 
-extern EsTree trees_gen_test() {
-    EsTree tree;
+Uint32 _trees_level_start(EsTree* tree, Uint32 depth) {
+    // The first branch at depth, or num_roots if the tree doesn't go that deep.
+    for (Uint32 i=0; i<tree->num_roots; i++) {
+        if (tree->workspace->branches[i].depth == depth)
+            return i;
+    }
+    return tree->num_roots;
+}
+
+void _trees_sum_stats(EsTree* tree) {
+    tree->raymarch_rays = 0;
+    tree->raymarch_iterations = 0;
+    tree->raymarch_failures = 0;
+    for (Uint32 i=0; i<tree->num_roots; i++) {
+        tree->raymarch_rays += tree->workspace->branches[i].stats.rays;
+        tree->raymarch_iterations += tree->workspace->branches[i].stats.iterations;
+        tree->raymarch_failures += tree->workspace->branches[i].stats.failures;
+    }
+    return;
+}
+
+void trees_default_params(EsTreeParams* params) {
     // Quaking Aspen params
-    tree.params.quality = 1.0f;
-    tree.params.shape = 7;
-    tree.params.base_size = 0.4f;
-    tree.params.scale.val = 13;
-    tree.params.scale.val_v = 3;
-    tree.params.levels = 2;
-    tree.params.ratio = 0.015f;
-    tree.params.ratio_power = 1.0f;
-    tree.params.lobes = 5;
-    tree.params.lobes_depth = 0.07f;
-    tree.params.flare = 0.6f;
-    tree.params.trunk_scale.val = 1.0f;
-    tree.params.trunk_scale.val_v = 0.0f;
-    tree.params.base_splits = 0;
+    params->quality = 1.0f;
+    params->shape = 7;
+    params->base_size = 0.4f;
+    params->scale.val = 13;
+    params->scale.val_v = 3;
+    params->levels = 2;
+    params->ratio = 0.015f;
+    params->ratio_power = 1.0f;
+    params->lobes = 5;
+    params->lobes_depth = 0.07f;
+    params->flare = 0.6f;
+    params->trunk_scale.val = 1.0f;
+    params->trunk_scale.val_v = 0.0f;
+    params->base_splits = 0;
     // level 0
-    tree.params.lengths[0].val = 1;
-    tree.params.lengths[0].val_v = 0;
-    tree.params.tapers[0] = 1.0f;
-    tree.params.curves_res[0] = 3;
-    tree.params.curves[0].val = 0;
-    tree.params.curves[0].val_v = 20;
-    tree.params.curves_back[0] = 0;
-    tree.params.down_angles[0].val = 0;
-    tree.params.down_angles[0].val_v = 0;
-    tree.params.rotates[0].val = 0;
-    tree.params.rotates[0].val_v = 0;
-    tree.params.branches[0] = 0;
-    tree.params.seg_splits[0] = 0;
-    tree.params.split_angles[0].val = 0;
-    tree.params.split_angles[0].val_v = 0;
+    params->lengths[0].val = 1;
+    params->lengths[0].val_v = 0;
+    params->tapers[0] = 1.0f;
+    params->curves_res[0] = 3;
+    params->curves[0].val = 0;
+    params->curves[0].val_v = 20;
+    params->curves_back[0] = 0;
+    params->down_angles[0].val = 0;
+    params->down_angles[0].val_v = 0;
+    params->rotates[0].val = 0;
+    params->rotates[0].val_v = 0;
+    params->branches[0] = 0;
+    params->seg_splits[0] = 0;
+    params->split_angles[0].val = 0;
+    params->split_angles[0].val_v = 0;
     // level 1
-    tree.params.lengths[1].val = 0.3f;
-    tree.params.lengths[1].val_v = 0;
-    tree.params.tapers[1] = 1.0f;
-    tree.params.curves_res[1] = 5;
-    tree.params.curves[1].val = -40;
-    tree.params.curves[1].val_v = 50;
-    tree.params.curves_back[1] = 0;
-    tree.params.down_angles[1].val = 60;
-    tree.params.down_angles[1].val_v = -50;
-    tree.params.rotates[1].val = 140;
-    tree.params.rotates[1].val_v = 0;
-    tree.params.branches[1] = 50;
-    tree.params.seg_splits[1] = 0;
-    tree.params.split_angles[1].val = 0;
-    tree.params.split_angles[1].val_v = 0;
+    params->lengths[1].val = 0.3f;
+    params->lengths[1].val_v = 0;
+    params->tapers[1] = 1.0f;
+    params->curves_res[1] = 5;
+    params->curves[1].val = -40;
+    params->curves[1].val_v = 50;
+    params->curves_back[1] = 0;
+    params->down_angles[1].val = 60;
+    params->down_angles[1].val_v = -50;
+    params->rotates[1].val = 140;
+    params->rotates[1].val_v = 0;
+    params->branches[1] = 50;
+    params->seg_splits[1] = 0;
+    params->split_angles[1].val = 0;
+    params->split_angles[1].val_v = 0;
     // level 2
-    tree.params.lengths[2].val = 0.6f;
-    tree.params.lengths[2].val_v = 0;
-    tree.params.tapers[2] = 1.0f;
-    tree.params.curves_res[2] = 3;
-    tree.params.curves[2].val = -40;
-    tree.params.curves[2].val_v = 75;
-    tree.params.curves_back[2] = 0;
-    tree.params.down_angles[2].val = 45;
-    tree.params.down_angles[2].val_v = 10;
-    tree.params.rotates[2].val = 140;
-    tree.params.rotates[2].val_v = 0;
-    tree.params.branches[2] = 30;
-    tree.params.seg_splits[2] = 0;
-    tree.params.split_angles[2].val = 0;
-    tree.params.split_angles[2].val_v = 0;
+    params->lengths[2].val = 0.6f;
+    params->lengths[2].val_v = 0;
+    params->tapers[2] = 1.0f;
+    params->curves_res[2] = 3;
+    params->curves[2].val = -40;
+    params->curves[2].val_v = 75;
+    params->curves_back[2] = 0;
+    params->down_angles[2].val = 45;
+    params->down_angles[2].val_v = 10;
+    params->rotates[2].val = 140;
+    params->rotates[2].val_v = 0;
+    params->branches[2] = 30;
+    params->seg_splits[2] = 0;
+    params->split_angles[2].val = 0;
+    params->split_angles[2].val_v = 0;
     // level 3
-    tree.params.lengths[3].val = 0;
-    tree.params.lengths[3].val_v = 0;
-    tree.params.tapers[3] = 1.0f;
-    tree.params.curves_res[3] = 1;
-    tree.params.curves[3].val = 0;
-    tree.params.curves[3].val_v = 0;
-    tree.params.curves_back[3] = 0;
-    tree.params.down_angles[3].val = 45;
-    tree.params.down_angles[3].val_v = 10;
-    tree.params.rotates[3].val = 77;
-    tree.params.rotates[3].val_v = 0;
-    tree.params.branches[3] = 1;
-    tree.params.seg_splits[3] = 0;
-    tree.params.split_angles[3].val = 0.3f;
-    tree.params.split_angles[3].val_v = 0;
-    tree.params.leaves = 35;
-    tree.params.leaf_shape = 0;
-    tree.params.leaf_scale = 0.57f;
-    tree.params.leaf_scale_x = 1.0f;
-    tree.params.attraction_up = 0.5;
-    tree.params.prune_ratio = 0;
-    tree.params.prune_width = 0.5;
-    tree.params.prune_width_peak = 0.5;
-    tree.params.prune_power_low = 0.5;
-    tree.params.prune_power_high = 0.5;
-    tree.num_cross_sections = 0;
-    tree.cross_sections_size = TREES_DEFAULT_CS;
-    tree.cross_sections = (EsCrossSection*) SDL_malloc(tree.cross_sections_size * sizeof(EsCrossSection));
-    tree.num_roots = 0;
-    tree.roots_size = TREES_DEFAULT_ROOTS;
-    tree.roots = (Uint32*) SDL_malloc(tree.roots_size * sizeof(Uint32));
-    tree.num_leaves = 0;
-    tree.leaves_size = TREES_DEFAULT_LEAVES;
-    tree.leaves = (EsLeaf*) SDL_malloc(tree.leaves_size * sizeof(EsLeaf));
-    tree.num_sdfs = 0;
-    tree.sdfs_size = TREES_DEFAULT_ROOTS;
-    tree.sdfs = (EsBranchSDF*) SDL_malloc(tree.sdfs_size * sizeof(EsBranchSDF));
-    
+    params->lengths[3].val = 0;
+    params->lengths[3].val_v = 0;
+    params->tapers[3] = 1.0f;
+    params->curves_res[3] = 1;
+    params->curves[3].val = 0;
+    params->curves[3].val_v = 0;
+    params->curves_back[3] = 0;
+    params->down_angles[3].val = 45;
+    params->down_angles[3].val_v = 10;
+    params->rotates[3].val = 77;
+    params->rotates[3].val_v = 0;
+    params->branches[3] = 1;
+    params->seg_splits[3] = 0;
+    params->split_angles[3].val = 0.3f;
+    params->split_angles[3].val_v = 0;
+    params->leaves = 35;
+    params->leaf_shape = 0;
+    params->leaf_scale = 0.57f;
+    params->leaf_scale_x = 1.0f;
+    params->attraction_up = 0.5;
+    params->prune_ratio = 0;
+    params->prune_width = 0.5;
+    params->prune_width_peak = 0.5;
+    params->prune_power_low = 0.5;
+    params->prune_power_high = 0.5;
+}
+
+void trees_init_workspace(EsTreeWorkspace* workspace) {
+    SDL_memset(workspace, 0, sizeof(EsTreeWorkspace));
+    return;
+}
+
+SDL_bool _trees_reserve(void** array, Uint32* size, Uint32 count, size_t element_size) {
+    // The contents don't need to survive, since every tree starts from empty arrays.
+    if (count <= *size)
+        return SDL_TRUE;
+    SDL_free(*array);
+    *array = SDL_malloc(count * element_size);
+    if (*array == NULL) {
+        *size = 0;
+        return SDL_FALSE;
+    }
+    *size = count;
+    return SDL_TRUE;
+}
+
+SDL_bool trees_reserve_workspace(EsTreeWorkspace* workspace, EsTreeCounts* counts) {
+    SDL_bool result = SDL_TRUE;
+    result = result && _trees_reserve((void**) &workspace->cross_sections, &workspace->cross_sections_size, counts->num_cross_sections, sizeof(EsCrossSection));
+    result = result && _trees_reserve((void**) &workspace->roots, &workspace->roots_size, counts->num_roots, sizeof(EsBranch));
+    result = result && _trees_reserve((void**) &workspace->leaves, &workspace->leaves_size, counts->num_leaves, sizeof(EsLeaf));
+    result = result && _trees_reserve((void**) &workspace->sdfs, &workspace->sdfs_size, counts->num_sdfs, sizeof(EsBranchSDF));
+    if (!result)
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not allocate tree workspace\n");
+    return result;
+}
+
+void trees_destroy_workspace(EsTreeWorkspace* workspace) {
+    SDL_free(workspace->cross_sections);
+    SDL_free(workspace->roots);
+    SDL_free(workspace->leaves);
+    SDL_free(workspace->sdfs);
+    SDL_free(workspace->leaf_dirs);
+    SDL_free(workspace->branches);
+    trees_init_workspace(workspace);
+    return;
+}
+
+SDL_bool trees_init_tree(EsTree* tree, EsTreeWorkspace* workspace, Uint32 seed) {
+    // Nothing is allocated here. The tree borrows the arrays of the workspace in trees_generate.
+    if (workspace == NULL)
+        return SDL_FALSE;
+    trees_default_params(&tree->params);
+    tree->seed = seed;
+    tree->workspace = workspace;
+    tree->parallel = SDL_TRUE;
+    tree->raymarch_rays = 0;
+    tree->raymarch_iterations = 0;
+    tree->raymarch_failures = 0;
+    tree->num_cross_sections = 0;
+    tree->cross_sections_size = 0;
+    tree->cross_sections = NULL;
+    tree->num_roots = 0;
+    tree->roots_size = 0;
+    tree->roots = NULL;
+    tree->num_leaves = 0;
+    tree->leaves_size = 0;
+    tree->leaves = NULL;
+    tree->num_sdfs = 0;
+    tree->sdfs_size = 0;
+    tree->sdfs = NULL;
+    return SDL_TRUE;
+}
+
+void trees_destroy_tree(EsTree* tree) {
+    // The arrays belong to the workspace, which can go on to the next tree.
+    tree->cross_sections = NULL;
+    tree->roots = NULL;
+    tree->leaves = NULL;
+    tree->sdfs = NULL;
+    tree->num_cross_sections = 0;
+    tree->num_roots = 0;
+    tree->num_leaves = 0;
+    tree->num_sdfs = 0;
+    return;
+}
+
+EsTree trees_gen_test(EsTreeWorkspace* workspace) {
+    EsTree tree;
+    trees_init_tree(&tree, workspace, TREES_TEST_SEED);
     trees_generate(&tree);
     return tree;
 }
 
-EsTree trees_test(const char* objname) {
-    EsTree tree = trees_gen_test();
-    trees_to_obj(&tree, objname);
-    return tree;
+SDL_bool trees_test(const char* objname) {
+    EsTreeWorkspace workspace;
+    trees_init_workspace(&workspace);
+    EsTree tree = trees_gen_test(&workspace);
+    SDL_Log("leaf raymarch: %u rays, %u iterations, %u failed\n", tree.raymarch_rays, tree.raymarch_iterations, tree.raymarch_failures);
+    SDL_bool result = trees_to_obj(&tree, objname);
+    trees_destroy_tree(&tree);
+    trees_destroy_workspace(&workspace);
+    return result;
+}
+
+SDL_bool trees_count(EsTree* tree, EsTreeCounts* counts) {
+    // Planning makes the draws that decide the size of every branch, so the counts are exact
+    // for the next trees_generate with the same params and seed.
+    return _trees_plan(tree, counts);
+}
+
+SDL_bool _trees_bind_workspace(EsTree* tree, EsTreeCounts* counts) {
+    if (!trees_reserve_workspace(tree->workspace, counts))
+        return SDL_FALSE;
+    Uint32 num_scratch = tree->parallel ? warehouse_num_workers() : 1;
+    if (!_trees_reserve((void**) &tree->workspace->leaf_dirs, &tree->workspace->leaf_dirs_size, tree->params.leaves * 5 * num_scratch, sizeof(vec3))) {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not allocate leaf directions\n");
+        return SDL_FALSE;
+    }
+    tree->num_cross_sections = counts->num_cross_sections;
+    tree->cross_sections = tree->workspace->cross_sections;
+    tree->cross_sections_size = tree->workspace->cross_sections_size;
+    tree->num_roots = counts->num_roots;
+    tree->roots = tree->workspace->roots;
+    tree->roots_size = tree->workspace->roots_size;
+    tree->num_leaves = counts->num_leaves;
+    tree->leaves = tree->workspace->leaves;
+    tree->leaves_size = tree->workspace->leaves_size;
+    tree->num_sdfs = counts->num_sdfs;
+    tree->sdfs = tree->workspace->sdfs;
+    tree->sdfs_size = tree->workspace->sdfs_size;
+    return SDL_TRUE;
 }
 
 SDL_bool trees_generate(EsTree* tree) {
-    _trees_generate_branch(tree, build_vec3(0.0f, 0.0f, 0.0f), build_vec3(0.0f, 1.0f, 0.0f), build_vec3(0.0f, 0.0f, 1.0f), 0, 0.0, 0.0, 0.0);
+    EsTreeCounts counts;
+    trees_destroy_tree(tree);
+    if (!trees_count(tree, &counts))
+        return SDL_FALSE;
+    if (!_trees_bind_workspace(tree, &counts))
+        return SDL_FALSE;
+    tree->tree_root = 0;
+    tree->tree_height = tree->workspace->branches[0].length;
+    tree->dirty_root = 0;
+    tree->dirty_leaves = SDL_TRUE;
+    if (!_trees_build_levels(tree, 0, SDL_FALSE))
+        return SDL_FALSE;
+    _trees_sum_stats(tree);
     return SDL_TRUE;
 }
 
-SDL_bool trees_add_to_geom_at_pos(EsTree* tree, EsGeometry* geom, vec3 pos) {
-    float* branch_lengths = SDL_malloc(tree->num_roots * sizeof(float));
-    for (Uint32 i=0; i<tree->num_roots; i++) {
-        Uint32 current_cs = tree->roots[i];
-        float branch_length;
-        float branch_offset_start;
-        float branch_offset_end;
-        branch_offset_start = 0.0f;
-        branch_offset_end = 0.0f;
-        if (i != tree->tree_root) {
-            branch_length = 0.0f;
-            SDL_bool run_loop = SDL_TRUE;
-            while (run_loop) {
-                if (tree->cross_sections[current_cs].num_children == 0)
-                    break;
-                EsCrossSection base = tree->cross_sections[current_cs];
-                EsCrossSection tip = tree->cross_sections[base.children[0]];
-                branch_length += vec3_distance(base.position, tip.position);
-                current_cs = base.children[0];
-            }
-            branch_lengths[i] = branch_length;
-            current_cs = tree->roots[i];
-        } else {
-            branch_length = tree->tree_height;
-            branch_lengths[i] = branch_length;
+SDL_bool _trees_same_var(EsVarFloat a, EsVarFloat b) {
+    return a.val == b.val && a.val_v == b.val_v;
+}
+
+SDL_bool _trees_params_need_plan(EsTreeParams* old, EsTreeParams* params) {
+    // These change the lengths or the number of branches, so the whole tree has to be
+    // generated again.
+    if (old->shape != params->shape || old->base_size != params->base_size || !_trees_same_var(old->scale, params->scale))
+        return SDL_TRUE;
+    if (old->levels != params->levels || old->ratio != params->ratio || old->ratio_power != params->ratio_power || !_trees_same_var(old->trunk_scale, params->trunk_scale))
+        return SDL_TRUE;
+    for (Uint32 i=0; i<4; i++) {
+        if (!_trees_same_var(old->lengths[i], params->lengths[i]) || old->branches[i] != params->branches[i] || old->curves_res[i] != params->curves_res[i])
+            return SDL_TRUE;
+    }
+    return SDL_FALSE;
+}
+
+Uint32 _trees_params_first_level(EsTreeParams* old, EsTreeParams* params) {
+    // The first level whose branches have to be built again, or 4 if none.
+    for (Uint32 i=0; i<4; i++) {
+        if (!_trees_same_var(old->curves[i], params->curves[i]) || old->tapers[i] != params->tapers[i])
+            return i;
+        // Branches place their children, so these are used by the level above.
+        if (i+1 < 4 && (!_trees_same_var(old->rotates[i+1], params->rotates[i+1]) || !_trees_same_var(old->down_angles[i+1], params->down_angles[i+1])))
+            return i;
+    }
+    return 4;
+}
+
+SDL_bool trees_regenerate(EsTree* tree, EsTreeParams* params) {
+    // Compares params with the ones the tree was generated with, and only builds the parts of
+    // the tree that they affect. Since every branch has its own rng stream, the result is the
+    // same as generating the tree again from scratch.
+    EsTreeParams old = tree->params;
+    tree->params = *params;
+    if (tree->num_roots == 0 || _trees_params_need_plan(&old, params))
+        return trees_generate(tree);
+    Uint32 first_level = _trees_params_first_level(&old, params);
+    SDL_bool leaves_changed = old.leaves != params->leaves;
+    SDL_bool leaf_size_changed = old.leaf_scale != params->leaf_scale || old.leaf_scale_x != params->leaf_scale_x || old.quality != params->quality;
+    tree->dirty_root = tree->num_roots;
+    tree->dirty_leaves = leaves_changed || leaf_size_changed || first_level < params->levels;
+    if (leaves_changed) {
+        // Only the leaf ranges move, the rest of the plan comes out the same.
+        EsTreeCounts counts;
+        if (!trees_count(tree, &counts))
+            return SDL_FALSE;
+        if (!_trees_bind_workspace(tree, &counts))
+            return SDL_FALSE;
+    }
+    if (first_level < params->levels) {
+        tree->dirty_root = _trees_level_start(tree, first_level);
+        if (!_trees_build_levels(tree, tree->dirty_root, SDL_FALSE))
+            return SDL_FALSE;
+        _trees_sum_stats(tree);
+    } else if (leaves_changed) {
+        if (!_trees_build_levels(tree, _trees_level_start(tree, params->levels-1), SDL_TRUE))
+            return SDL_FALSE;
+        _trees_sum_stats(tree);
+    } else if (leaf_size_changed) {
+        float leaf_length = params->leaf_scale / SDL_sqrtf(params->quality);
+        float leaf_width = params->leaf_scale * params->leaf_scale_x / SDL_sqrtf(params->quality);
+        for (Uint32 i=0; i<tree->num_leaves; i++) {
+            tree->leaves[i].length = leaf_length;
+            tree->leaves[i].width = leaf_width;
         }
-        SDL_bool run_loop = SDL_TRUE;
-        while (run_loop) {
-            if (tree->cross_sections[current_cs].num_children == 0)
+    }
+    return SDL_TRUE;
+}
+
+// Each lod steps over more cross sections per segment, drops branches that are thin compared
+// to the trunk, keeps fewer but larger leaves, and from TREES_LOD_LEAF_CARDS on, replaces the
+// leaves of each leaf cluster with a single card.
+static const Uint32 TREES_LOD_SEGMENT_STEP[TREES_NUM_LODS] = {1, 2, 2, 4};
+static const Uint32 TREES_LOD_LEAF_STEP[TREES_NUM_LODS] = {1, 2, 1, 1};
+static const float TREES_LOD_MIN_BRANCH_RADIUS[TREES_NUM_LODS] = {0.0f, 0.0f, 0.1f, 0.25f};
+#define TREES_LOD_LEAF_CARDS 2
+#define TREES_SWEEP_SECTIONS 64
+
+SDL_bool _trees_segment_is_straight(EsTree* tree, Uint32 base_cs, Uint32 tip_cs, float error) {
+    // Checks whether the cross sections between base_cs and tip_cs all lie within error of the
+    // surface that joins base_cs straight to tip_cs, in position, radius and tilt.
+    EsCrossSection base = tree->cross_sections[base_cs];
+    EsCrossSection tip = tree->cross_sections[tip_cs];
+    vec3 direction = vec3_sub(tip.position, base.position);
+    float length_squared = vec3_length_squared(direction);
+    if (length_squared == 0.0f)
+        return SDL_FALSE;
+    vec3 unit_direction = vec3_scale(direction, 1.0f / SDL_sqrtf(length_squared));
+    for (Uint32 i=base_cs+1; i<tip_cs; i++) {
+        EsCrossSection cs = tree->cross_sections[i];
+        vec3 offset = vec3_sub(cs.position, base.position);
+        float t = vec3_dot(offset, direction) / length_squared;
+        if (t < 0.0f || t > 1.0f)
+            return SDL_FALSE;
+        if (vec3_distance(cs.position, vec3_add(base.position, vec3_scale(direction, t))) > error)
+            return SDL_FALSE;
+        if (SDL_fabs(cs.radius - (base.radius + (tip.radius - base.radius) * t)) > error)
+            return SDL_FALSE;
+        float cos_tilt = vec3_dot(vec3_normalize(cs.axis), unit_direction);
+        if (cs.radius * SDL_sqrtf(SDL_max(0.0f, 1.0f - cos_tilt*cos_tilt)) > error)
+            return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+SDL_bool _trees_mesh(EsTree* tree, EsGeometry* geom, vec3 pos, Uint32 lod, Uint32 first_root, EsTreeMesh* mesh) {
+    // Meshes the branches from first_root on, and then all the leaves, keeping where each
+    // level starts in mesh.
+    Uint32 step = TREES_LOD_SEGMENT_STEP[lod];
+    float error = geom_error_from_lod(lod) * tree->tree_height;
+    float trunk_radius = tree->cross_sections[tree->roots[tree->tree_root].root_cs].radius;
+    float min_radius = TREES_LOD_MIN_BRANCH_RADIUS[lod] * trunk_radius;
+    Uint32 next_level = first_root < tree->num_roots ? tree->cross_sections[tree->roots[first_root].root_cs].depth : 4;
+    for (Uint32 i=first_root; i<tree->num_roots; i++) {
+        EsBranch branch = tree->roots[i];
+        Uint32 depth = tree->cross_sections[branch.root_cs].depth;
+        for (; next_level<=depth; next_level++)
+            mesh->levels[next_level] = geom_get_mark(geom);
+        if (i != tree->tree_root && tree->cross_sections[branch.root_cs].radius < min_radius)
+            continue;
+        // The branch is swept in parts of up to TREES_SWEEP_SECTIONS cross sections, and each
+        // part starts from the last cross section of the one before.
+        EsSweepSection sections[TREES_SWEEP_SECTIONS];
+        Uint32 num_sections = 0;
+        vec3 frame = build_vec3(0.0f, 0.0f, 0.0f);
+        for (Uint32 j=0; j<=branch.num_segments;) {
+            EsCrossSection cs = tree->cross_sections[branch.root_cs + j];
+            sections[num_sections].position = vec3_add(pos, cs.position);
+            sections[num_sections].axis = cs.axis;
+            sections[num_sections].radius = cs.radius;
+            sections[num_sections].offset = i != tree->tree_root ? cs.arc_length / branch.length : 0.0f;
+            num_sections++;
+            if (j == branch.num_segments)
                 break;
-            EsCrossSection base = tree->cross_sections[current_cs];
-            EsCrossSection tip = tree->cross_sections[base.children[0]];
-            if (i != tree->tree_root)
-                branch_offset_end = branch_offset_start + vec3_distance(base.position, tip.position)/branch_length; 
-            geom_add_cs_surface(geom, base.radius, vec3_add(pos, base.position), base.axis, tip.radius, vec3_add(pos, tip.position), tip.axis, build_vec2(0.0, 0.0), 0, tree->tree_height, branch_offset_start, branch_offset_end);
-            current_cs = base.children[0];
-            if (i != tree->tree_root)
-                branch_offset_start = branch_offset_end;
+            if (num_sections == TREES_SWEEP_SECTIONS) {
+                if (!geom_add_sweep(geom, sections, num_sections, &frame, build_vec2(0.0, 0.0), lod, tree->tree_height))
+                    return SDL_FALSE;
+                sections[0] = sections[num_sections-1];
+                num_sections = 1;
+            }
+            // Segments that carry on in a straight enough line are merged into one.
+            Uint32 tip_index = SDL_min(j+step, branch.num_segments);
+            while (tip_index < branch.num_segments && _trees_segment_is_straight(tree, branch.root_cs + j, branch.root_cs + SDL_min(tip_index+step, branch.num_segments), error))
+                tip_index = SDL_min(tip_index+step, branch.num_segments);
+            j = tip_index;
         }
+        if (!geom_add_sweep(geom, sections, num_sections, &frame, build_vec2(0.0, 0.0), lod, tree->tree_height))
+            return SDL_FALSE;
     }
-    for (Uint32 i=0; i<tree->num_leaves; i++) {
+    mesh->leaves = geom_get_mark(geom);
+    for (; next_level<4; next_level++)
+        mesh->levels[next_level] = mesh->leaves;
+    if (lod >= TREES_LOD_LEAF_CARDS) {
+        // The leaves of a cluster are contiguous, so we emit one card whenever the cluster changes.
+        Uint32 last_sdf = tree->num_sdfs;
+        for (Uint32 i=0; i<tree->num_leaves; i++) {
+            EsLeaf leaf = tree->leaves[i];
+            if (vec3_is_zero(leaf.position) || leaf.sdf_id == last_sdf)
+                continue;
+            last_sdf = leaf.sdf_id;
+            EsBranchSDF sdf = tree->sdfs[leaf.sdf_id];
+            vec3 branch_root_pos = tree->cross_sections[tree->roots[leaf.branch_root].root_cs].position;
+            vec3 axis = vec3_normalize(vec3_sub(sdf.main_pos, branch_root_pos));
+            vec3 card_pos = vec3_sub(sdf.main_pos, vec3_scale(axis, sdf.main_radius));
+            if (!geom_add_triple_quad_mesh(geom, vec3_add(pos, card_pos), axis, 2.0f*sdf.main_radius, 2.0f*sdf.main_radius, build_vec2(0.03f, 0.03f), build_vec2(1.0f, 1.0f), lod, tree->tree_height, vec3_distance(branch_root_pos, sdf.main_pos), vec3_add(pos, branch_root_pos)))
+                return SDL_FALSE;
+        }
+        mesh->end = geom_get_mark(geom);
+        return SDL_TRUE;
+    }
+    // Scale the leaves we keep so that the foliage covers about the same area.
+    Uint32 leaf_step = TREES_LOD_LEAF_STEP[lod];
+    float leaf_scale = SDL_sqrtf((float) leaf_step);
+    for (Uint32 i=0; i<tree->num_leaves; i+=leaf_step) {
         EsLeaf leaf = tree->leaves[i];
         if (vec3_is_zero(leaf.position))
             continue;
-        geom_add_triple_quad_mesh(geom, vec3_add(pos, leaf.position), leaf.axis, leaf.length, leaf.width, build_vec2(0.03f, 0.03f), build_vec2(1.0f, 1.0f), 0, tree->tree_height, vec3_distance(tree->cross_sections[leaf.branch_root].position, tree->sdfs[leaf.sdf_id].main_pos), vec3_add(pos, tree->cross_sections[leaf.branch_root].position));
+        vec3 branch_root_pos = tree->cross_sections[tree->roots[leaf.branch_root].root_cs].position;
+        if (!geom_add_triple_quad_mesh(geom, vec3_add(pos, leaf.position), leaf.axis, leaf.length*leaf_scale, leaf.width*leaf_scale, build_vec2(0.03f, 0.03f), build_vec2(1.0f, 1.0f), lod, tree->tree_height, vec3_distance(branch_root_pos, tree->sdfs[leaf.sdf_id].main_pos), vec3_add(pos, branch_root_pos)))
+            return SDL_FALSE;
     }
-    return SDL_TRUE;    
+    mesh->end = geom_get_mark(geom);
+    return SDL_TRUE;
+}
+
+SDL_bool trees_add_to_geom_mesh(EsTree* tree, EsGeometry* geom, vec3 pos, Uint32 lod, EsTreeMesh* mesh) {
+    // Same as trees_add_to_geom_at_pos_lod, but keeps where everything went in mesh, for
+    // trees_patch_geom.
+    if (lod >= TREES_NUM_LODS)
+        lod = TREES_NUM_LODS-1;
+    mesh->pos = pos;
+    mesh->lod = lod;
+    if (!_trees_mesh(tree, geom, pos, lod, 0, mesh))
+        return SDL_FALSE;
+    tree->dirty_root = tree->num_roots;
+    tree->dirty_leaves = SDL_FALSE;
+    return SDL_TRUE;
+}
+
+SDL_bool trees_add_to_geom_at_pos_lod(EsTree* tree, EsGeometry* geom, vec3 pos, Uint32 lod) {
+    EsTreeMesh mesh;
+    if (lod >= TREES_NUM_LODS)
+        lod = TREES_NUM_LODS-1;
+    return _trees_mesh(tree, geom, pos, lod, 0, &mesh);
+}
+
+EsGeometryMark _trees_offset_mark(EsGeometryMark mark, EsGeometryMark* offset) {
+    mark.num_vertices += offset->num_vertices;
+    mark.num_faces += offset->num_faces;
+    mark.num_textures += offset->num_textures;
+    mark.num_normals += offset->num_normals;
+    mark.num_colors += offset->num_colors;
+    return mark;
+}
+
+SDL_bool trees_patch_geom(EsTree* tree, EsGeometry* geom, EsTreeMesh* mesh) {
+    // Meshes again only what trees_regenerate changed, and puts it in place of the old mesh.
+    // If the size of the tree mesh changes, everything after it in geom moves along, so any
+    // other marks or face offsets past the tree need to be taken again.
+    if (tree->dirty_root >= tree->num_roots && !tree->dirty_leaves)
+        return SDL_TRUE;
+    Uint32 first_level = 4;
+    EsGeometryMark start = mesh->leaves;
+    if (tree->dirty_root < tree->num_roots) {
+        first_level = tree->cross_sections[tree->roots[tree->dirty_root].root_cs].depth;
+        start = mesh->levels[first_level];
+    }
+    // Usually the patch is the same size as what it replaces.
+    EsGeometry patch = geom_init_geometry_size(mesh->end.num_vertices - start.num_vertices + 1, mesh->end.num_faces - start.num_faces + 1, mesh->end.num_textures - start.num_textures + 1, mesh->end.num_normals - start.num_normals + 1, mesh->end.num_colors - start.num_colors + 1);
+    EsTreeMesh patch_mesh;
+    SDL_bool result = _trees_mesh(tree, &patch, mesh->pos, mesh->lod, tree->dirty_root, &patch_mesh);
+    if (result)
+        result = geom_replace_range(geom, &start, &mesh->end, &patch);
+    if (result) {
+        for (Uint32 i=first_level; i<4; i++)
+            mesh->levels[i] = _trees_offset_mark(patch_mesh.levels[i], &start);
+        mesh->leaves = _trees_offset_mark(patch_mesh.leaves, &start);
+        mesh->end = _trees_offset_mark(patch_mesh.end, &start);
+        tree->dirty_root = tree->num_roots;
+        tree->dirty_leaves = SDL_FALSE;
+    } else {
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not patch tree mesh\n");
+    }
+    geom_destroy_geometry(&patch);
+    return result;
+}
+
+SDL_bool trees_add_to_geom_at_pos(EsTree* tree, EsGeometry* geom, vec3 pos) {
+    return trees_add_to_geom_at_pos_lod(tree, geom, pos, 0);
 }
 
 SDL_bool trees_add_to_geom(EsTree* tree, EsGeometry* geom) {
@@ -532,6 +1097,7 @@ SDL_bool trees_add_to_geom(EsTree* tree, EsGeometry* geom) {
 EsGeometry trees_to_geom(EsTree* tree) {
     EsGeometry geom = geom_init_geometry();
     trees_add_to_geom(tree, &geom);
+    geom_compact_geometry(&geom);
     return geom;
 }
 
@@ -545,3 +1111,116 @@ SDL_bool trees_to_obj(EsTree* tree, const char* filename) {
     SDL_Log("filesave took %f seconds\n", _get_time_in_seconds()-time);
     return SDL_TRUE;
 }
+
+typedef struct {
+    vec3* positions;
+    Uint32 seed;
+    Uint32 num_lods;
+    EsGeometry* geoms;
+    // Only when the forest is emitted into an indexed mesh, one for each tree.
+    EsIndexedMesh* meshes;
+    SDL_bool* results;
+    Uint32* lod_faces;
+    // One workspace per worker. Each grows to the largest tree its worker has generated, so
+    // every tree is planned once, in trees_generate, and only a tree larger than any before it
+    // on the same worker allocates.
+    EsTreeWorkspace* workspaces;
+} _EsForestJob;
+
+void _trees_forest_job(void* data, Uint32 index, Uint32 worker) {
+    _EsForestJob* forest = (_EsForestJob*) data;
+    EsTree tree;
+    forest->geoms[index] = geom_init_geometry();
+    if (forest->meshes) {
+        forest->meshes[index] = geom_init_indexed_mesh();
+        forest->geoms[index].emit = &forest->meshes[index];
+    }
+    forest->results[index] = trees_init_tree(&tree, &forest->workspaces[worker], _trees_hash_seed(forest->seed, index+1));
+    if (!forest->results[index])
+        return;
+    tree.parallel = SDL_FALSE;
+    forest->results[index] = trees_generate(&tree);
+    // The lods of a tree are meshed one after the other, and we keep where each of them starts.
+    for (Uint32 lod=0; lod<forest->num_lods && forest->results[index]; lod++) {
+        forest->lod_faces[index*forest->num_lods + lod] = geom_num_triangles(&forest->geoms[index]);
+        forest->results[index] = trees_add_to_geom_at_pos_lod(&tree, &forest->geoms[index], forest->positions[index], lod);
+    }
+    trees_destroy_tree(&tree);
+    return;
+}
+
+void _trees_free_forest(_EsForestJob* forest, Uint32 num_workers) {
+    if (forest->workspaces) {
+        for (Uint32 i=0; i<num_workers; i++)
+            trees_destroy_workspace(&forest->workspaces[i]);
+    }
+    SDL_free(forest->geoms);
+    SDL_free(forest->meshes);
+    SDL_free(forest->results);
+    SDL_free(forest->lod_faces);
+    SDL_free(forest->workspaces);
+    return;
+}
+
+SDL_bool trees_generate_forest(EsGeometry* geom, vec3* positions, Uint32 num_trees, Uint32 num_lods, Uint32 seed, Uint32* face_offsets) {
+    // Every tree is generated and meshed into its own geometry across all the cores, and then
+    // appended in order, so the final geometry only depends on the seed and not on scheduling.
+    // If geom is in emission mode, each tree is emitted into its own mesh instead, and those are
+    // appended to the mesh of geom, with face_offsets counting its triangles.
+    // Each tree is meshed at lods 0 to num_lods-1. If face_offsets is not NULL, it gets
+    // num_trees*num_lods+1 entries, with the faces of lod l of tree i being
+    // face_offsets[i*num_lods+l] to face_offsets[i*num_lods+l+1].
+    SDL_bool result = SDL_TRUE;
+    _EsForestJob forest;
+    Uint32 num_workers = warehouse_num_workers();
+    if (num_lods == 0)
+        num_lods = 1;
+    forest.positions = positions;
+    forest.seed = seed;
+    forest.num_lods = num_lods;
+    // Zeroed, so that the geometries can be destroyed even if the trees never got generated.
+    forest.geoms = (EsGeometry*) SDL_calloc(num_trees, sizeof(EsGeometry));
+    forest.meshes = NULL;
+    if (geom->emit)
+        forest.meshes = (EsIndexedMesh*) SDL_calloc(num_trees, sizeof(EsIndexedMesh));
+    forest.results = (SDL_bool*) SDL_malloc(num_trees * sizeof(SDL_bool));
+    forest.lod_faces = (Uint32*) SDL_calloc(num_trees * num_lods, sizeof(Uint32));
+    forest.workspaces = (EsTreeWorkspace*) SDL_malloc(num_workers * sizeof(EsTreeWorkspace));
+    if (forest.geoms == NULL || (geom->emit && forest.meshes == NULL) || forest.results == NULL || forest.lod_faces == NULL || forest.workspaces == NULL) {
+        SDL_free(forest.workspaces);
+        forest.workspaces = NULL;
+        _trees_free_forest(&forest, num_workers);
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not alloc forest\n");
+        return SDL_FALSE;
+    }
+    for (Uint32 i=0; i<num_workers; i++)
+        trees_init_workspace(&forest.workspaces[i]);
+    result = warehouse_parallel_for(num_trees, _trees_forest_job, &forest);
+    for (Uint32 i=0; i<num_trees; i++) {
+        if (face_offsets) {
+            for (Uint32 lod=0; lod<num_lods; lod++)
+                face_offsets[i*num_lods + lod] = geom_num_triangles(geom) + forest.lod_faces[i*num_lods + lod];
+        }
+        if (!result || !forest.results[i])
+            result = SDL_FALSE;
+        else if (geom->emit)
+            result = geom_append_indexed_mesh(geom->emit, &forest.meshes[i]);
+        else
+            result = geom_append_geometry(geom, &forest.geoms[i]);
+        geom_destroy_geometry(&forest.geoms[i]);
+        if (forest.meshes)
+            geom_destroy_indexed_mesh(&forest.meshes[i]);
+    }
+    if (face_offsets)
+        face_offsets[num_trees*num_lods] = geom_num_triangles(geom);
+    // A forest is usually built once and then kept, so give back what growing left unused.
+    if (result) {
+        geom_compact_geometry(geom);
+        if (geom->emit)
+            geom_compact_indexed_mesh(geom->emit);
+    }
+    if (!result)
+        SDL_LogError(SDL_LOG_CATEGORY_ERROR, "Could not generate forest\n");
+    _trees_free_forest(&forest, num_workers);
+    return result;
+}
@@ -10,6 +10,9 @@
 #include "es_warehouse.h"
 #include "es_geometrygen.h"
 
+// Number of detail levels a tree can be meshed at. Lod 0 is the full tree.
+#define TREES_NUM_LODS 4
+
 typedef struct {
     float val;
     float val_v;
@@ -57,14 +60,24 @@ typedef struct {
     Uint32 num_children;
     Uint32 children[3];
     Uint32 depth;
+    // Distance along the branch from the branch root to this cross section.
+    float arc_length;
 } EsCrossSection;
 
+// The cross sections of a branch are contiguous, from root_cs to root_cs+num_segments.
+typedef struct {
+    Uint32 root_cs;
+    Uint32 num_segments;
+    float length;
+} EsBranch;
+
 typedef struct {
     vec3 position;
     vec3 axis;
     vec3 normal;
     float length;
     float width;
+    // Index of the leaf's branch in roots.
     Uint32 branch_root;
     Uint32 sdf_id;
 } EsLeaf;
@@ -80,30 +93,126 @@ typedef struct {
     float sub_radius;
 } EsBranchSDF;
 
+// Leaf placement stats, kept per branch while a level is built and summed into the tree after.
+typedef struct {
+    Uint32 rays;
+    Uint32 iterations;
+    Uint32 failures;
+} EsRaymarchStats;
+
+// An entry of the breadth first worklist that trees are generated from. The index of an entry
+// is also the index of the branch in roots, and the branches of each level are contiguous.
+typedef struct {
+    // Set by the parent, position and axes only once the parent is built.
+    Uint32 depth;
+    float parent_length;
+    float parent_radius;
+    float offset;
+    vec3 position;
+    vec3 axis;
+    vec3 rotation_axis;
+    // Set when the level is planned. Every branch draws from its own rng stream, so branches
+    // can be built in any order and on any core. The stream is kept as it was after planning,
+    // and before the leaves, so either can be built again on their own.
+    EsRng rng;
+    EsRng leaf_rng;
+    float length;
+    float base_radius;
+    Uint32 num_children;
+    Uint32 num_leaves;
+    Uint32 first_cs;
+    Uint32 first_child;
+    Uint32 first_leaf;
+    Uint32 sdf_id;
+    EsRaymarchStats stats;
+} EsPendingBranch;
+
+// The number of each element in a tree, from the planning pass in trees_count.
+typedef struct {
+    Uint32 num_cross_sections;
+    Uint32 num_roots;
+    Uint32 num_leaves;
+    Uint32 num_sdfs;
+} EsTreeCounts;
+
+// Owns the arrays that trees are generated into, so they can be reused from one tree to the
+// next. Generating a tree resets it, and only grows the arrays if the tree has more elements
+// than any tree before it. A workspace can only be used by one tree at a time.
+typedef struct {
+    Uint32 cross_sections_size;
+    EsCrossSection* cross_sections;
+    Uint32 roots_size;
+    EsBranch* roots;
+    Uint32 leaves_size;
+    EsLeaf* leaves;
+    Uint32 sdfs_size;
+    EsBranchSDF* sdfs;
+    // Scratch space for the leaves of one branch, for each worker building a level.
+    Uint32 leaf_dirs_size;
+    vec3* leaf_dirs;
+    Uint32 branches_size;
+    EsPendingBranch* branches;
+} EsTreeWorkspace;
+
 typedef struct {
     Uint32 num_cross_sections;
     Uint32 cross_sections_size;
     EsCrossSection* cross_sections;
     Uint32 num_roots;
     Uint32 roots_size;
-    Uint32* roots;
+    EsBranch* roots;
     Uint32 num_leaves;
     Uint32 leaves_size;
     EsLeaf* leaves;
     Uint32 num_sdfs;
     Uint32 sdfs_size;
     EsBranchSDF* sdfs;
+    EsTreeWorkspace* workspace;
+    // Build the branches of large levels across all the cores. Forests turn this off, since
+    // they already generate one tree per core.
+    SDL_bool parallel;
     EsTreeParams params;
     float tree_height;
     Uint32 tree_root;
+    Uint32 seed;
+    // What the last trees_generate or trees_regenerate changed, for trees_patch_geom. Every
+    // branch from dirty_root on, which is always the first branch of a level.
+    Uint32 dirty_root;
+    SDL_bool dirty_leaves;
+    // Leaf placement stats
+    Uint32 raymarch_rays;
+    Uint32 raymarch_iterations;
+    Uint32 raymarch_failures;
 } EsTree;
 
-extern EsTree trees_test(const char* objname);
-extern EsTree trees_gen_test();
+// Where each part of a tree mesh starts in the geometry it was added to. The branches are
+// meshed level by level, and then the leaves.
+typedef struct {
+    vec3 pos;
+    Uint32 lod;
+    EsGeometryMark levels[4];
+    EsGeometryMark leaves;
+    EsGeometryMark end;
+} EsTreeMesh;
+
+extern SDL_bool trees_test(const char* objname);
+extern EsTree trees_gen_test(EsTreeWorkspace* workspace);
+extern void trees_default_params(EsTreeParams* params);
+extern void trees_init_workspace(EsTreeWorkspace* workspace);
+extern SDL_bool trees_reserve_workspace(EsTreeWorkspace* workspace, EsTreeCounts* counts);
+extern void trees_destroy_workspace(EsTreeWorkspace* workspace);
+extern SDL_bool trees_init_tree(EsTree* tree, EsTreeWorkspace* workspace, Uint32 seed);
+extern void trees_destroy_tree(EsTree* tree);
+extern SDL_bool trees_count(EsTree* tree, EsTreeCounts* counts);
 extern SDL_bool trees_generate(EsTree* tree);
+extern SDL_bool trees_regenerate(EsTree* tree, EsTreeParams* params);
 extern EsGeometry trees_to_geom(EsTree* tree);
 extern SDL_bool trees_add_to_geom_at_pos(EsTree* tree, EsGeometry* geom, vec3 pos);
+extern SDL_bool trees_add_to_geom_at_pos_lod(EsTree* tree, EsGeometry* geom, vec3 pos, Uint32 lod);
+extern SDL_bool trees_add_to_geom_mesh(EsTree* tree, EsGeometry* geom, vec3 pos, Uint32 lod, EsTreeMesh* mesh);
+extern SDL_bool trees_patch_geom(EsTree* tree, EsGeometry* geom, EsTreeMesh* mesh);
 extern SDL_bool trees_add_to_geom(EsTree* tree, EsGeometry* geom);
 extern SDL_bool trees_to_obj(EsTree* tree, const char* filename);
+extern SDL_bool trees_generate_forest(EsGeometry* geom, vec3* positions, Uint32 num_trees, Uint32 num_lods, Uint32 seed, Uint32* face_offsets);
 
 #endif
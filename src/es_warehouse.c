@@ -1,8 +1,20 @@
-#include <stdlib.h>
 #include "es_warehouse.h"
 
+#ifdef ES_SSE2
+#include <emmintrin.h>
+#endif
+
+#define RNG_DEFAULT_SEED 0x853C49E6748FEA9Bull
+// Below this many values, setting up the wide generator costs more than it saves.
+#define RNG_MIN_WIDE_FILL 32
+
+EsRng _warehouse_rng = { { 0u, 0u, 0u, 0u } };
+
 float rand_pos() {
-    return (float) rand() / (float) RAND_MAX;
+    // Not thread safe. Only meant for one off things on the main thread.
+    if ((_warehouse_rng.s[0] | _warehouse_rng.s[1] | _warehouse_rng.s[2] | _warehouse_rng.s[3]) == 0)
+        rng_seed(&_warehouse_rng, RNG_DEFAULT_SEED);
+    return rng_pos(&_warehouse_rng);
 }
 
 float rand_negpos() {
@@ -13,6 +25,137 @@ vec3 rand_vec3() {
     return vec3_normalize(build_vec3(rand_negpos(), rand_negpos(), rand_negpos()));
 }
 
+Uint64 _rng_splitmix64(Uint64* state) {
+    Uint64 z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+Uint32 _rng_rotl(Uint32 x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+void rng_seed(EsRng* rng, Uint64 seed) {
+    // splitmix64 spreads the seed over the whole state, and never leaves it all zero
+    // for any seed.
+    Uint64 a = _rng_splitmix64(&seed);
+    Uint64 b = _rng_splitmix64(&seed);
+    rng->s[0] = (Uint32) a;
+    rng->s[1] = (Uint32) (a >> 32);
+    rng->s[2] = (Uint32) b;
+    rng->s[3] = (Uint32) (b >> 32);
+    return;
+}
+
+Uint32 rng_next(EsRng* rng) {
+    Uint32* s = rng->s;
+    Uint32 result = s[0] + s[3];
+    Uint32 t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = _rng_rotl(s[3], 11);
+    return result;
+}
+
+float rng_pos(EsRng* rng) {
+    // The top 24 bits are the good ones in xoshiro128+, and they fit exactly in a float.
+    return (float) (rng_next(rng) >> 8) * (1.0f / 16777215.0f);
+}
+
+float rng_negpos(EsRng* rng) {
+    return (rng_pos(rng) - 0.5f) * 2.0f;
+}
+
+vec3 rng_vec3(EsRng* rng) {
+    float x = rng_negpos(rng);
+    float y = rng_negpos(rng);
+    float z = rng_negpos(rng);
+    return vec3_normalize(build_vec3(x, y, z));
+}
+
+void _rng_fill_wide(EsRng* rng, float* out, Uint32 count, float scale, float offset) {
+    // Runs four xoshiro128+ streams side by side, one per lane, each seeded from rng.
+    // The output is still fully determined by rng, but it is not the same sequence as
+    // calling rng_pos count times.
+    Uint32 lanes[4][4];
+    for (Uint32 i=0; i<4; i++) {
+        Uint64 seed = ((Uint64) rng_next(rng) << 32) | rng_next(rng);
+        EsRng lane;
+        rng_seed(&lane, seed);
+        for (Uint32 j=0; j<4; j++)
+            lanes[j][i] = lane.s[j];
+    }
+    Uint32 i = 0;
+#ifdef ES_SSE2
+    __m128i s0 = _mm_loadu_si128((__m128i*) lanes[0]);
+    __m128i s1 = _mm_loadu_si128((__m128i*) lanes[1]);
+    __m128i s2 = _mm_loadu_si128((__m128i*) lanes[2]);
+    __m128i s3 = _mm_loadu_si128((__m128i*) lanes[3]);
+    __m128 mul = _mm_set1_ps(scale / 16777215.0f);
+    __m128 add = _mm_set1_ps(offset);
+    for (; i+4<=count; i+=4) {
+        __m128i result = _mm_add_epi32(s0, s3);
+        __m128i t = _mm_slli_epi32(s1, 9);
+        s2 = _mm_xor_si128(s2, s0);
+        s3 = _mm_xor_si128(s3, s1);
+        s1 = _mm_xor_si128(s1, s2);
+        s0 = _mm_xor_si128(s0, s3);
+        s2 = _mm_xor_si128(s2, t);
+        s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+        __m128 values = _mm_cvtepi32_ps(_mm_srli_epi32(result, 8));
+        _mm_storeu_ps(&out[i], _mm_add_ps(_mm_mul_ps(values, mul), add));
+    }
+    _mm_storeu_si128((__m128i*) lanes[0], s0);
+    _mm_storeu_si128((__m128i*) lanes[1], s1);
+    _mm_storeu_si128((__m128i*) lanes[2], s2);
+    _mm_storeu_si128((__m128i*) lanes[3], s3);
+#endif
+    // Scalar version of the same four lanes. Also picks up the tail.
+    for (; i<count; i++) {
+        Uint32 l = i % 4;
+        EsRng lane;
+        for (Uint32 j=0; j<4; j++)
+            lane.s[j] = lanes[j][l];
+        out[i] = (float) (rng_next(&lane) >> 8) * (scale / 16777215.0f) + offset;
+        for (Uint32 j=0; j<4; j++)
+            lanes[j][l] = lane.s[j];
+    }
+    return;
+}
+
+void rng_fill_pos(EsRng* rng, float* out, Uint32 count) {
+    if (count < RNG_MIN_WIDE_FILL) {
+        for (Uint32 i=0; i<count; i++)
+            out[i] = rng_pos(rng);
+        return;
+    }
+    _rng_fill_wide(rng, out, count, 1.0f, 0.0f);
+    return;
+}
+
+void rng_fill_negpos(EsRng* rng, float* out, Uint32 count) {
+    if (count < RNG_MIN_WIDE_FILL) {
+        for (Uint32 i=0; i<count; i++)
+            out[i] = rng_negpos(rng);
+        return;
+    }
+    _rng_fill_wide(rng, out, count, 2.0f, -1.0f);
+    return;
+}
+
+void rng_fill_vec3(EsRng* rng, vec3* out, Uint32 count) {
+    // vec3 is three tightly packed floats, so we can fill the components in one go
+    // and normalize after.
+    rng_fill_negpos(rng, (float*) out, count*3);
+    for (Uint32 i=0; i<count; i++)
+        out[i] = vec3_normalize(out[i]);
+    return;
+}
+
 float warehouse_log_2(float num) {
     return (float) SDL_log(num) / (float) SDL_log(2);
 }
@@ -47,7 +190,7 @@ mat4 mat4_mat4_multiply(mat4 a, mat4 b) {
     return result;
 }
 
-vec4 mat4_vec4_multiply(mat4 a, vec4 b) {
+vec4 mat4_vec4_multiply_scalar(mat4 a, vec4 b) {
     vec4 result;
     result.x = a.a.x*b.x + a.a.y*b.y + a.a.z*b.z + a.a.w*b.w;    
     result.y = a.b.x*b.x + a.b.y*b.y + a.b.z*b.z + a.b.w*b.w;    
@@ -56,6 +199,113 @@ vec4 mat4_vec4_multiply(mat4 a, vec4 b) {
     return result;
 }
 
+vec4 mat4_vec4_multiply(mat4 a, vec4 b) {
+#ifdef ES_SSE2
+    // The rows are transposed into columns, which are weighted by b and summed in the same order
+    // as the scalar version, so both give the same bits. b is built from its components rather
+    // than loaded, since some ABIs pass it in two registers and the load would stall on the
+    // halves being spilled.
+    vec4 result;
+    __m128 c0 = _mm_load_ps(&a.a.x);
+    __m128 c1 = _mm_load_ps(&a.b.x);
+    __m128 c2 = _mm_load_ps(&a.c.x);
+    __m128 c3 = _mm_load_ps(&a.d.x);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    __m128 v = _mm_setr_ps(b.x, b.y, b.z, b.w);
+    __m128 r = _mm_mul_ps(c0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)));
+    r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))));
+    r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+    r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))));
+    _mm_store_ps(&result.x, r);
+    return result;
+#else
+    return mat4_vec4_multiply_scalar(a, b);
+#endif
+}
+
+void mat4_transform_points_scalar(mat4 a, const vec3* points, Uint32 count, vec3* out, Uint32 out_stride) {
+    for (Uint32 i=0; i<count; i++) {
+        vec4 point = mat4_vec4_multiply_scalar(a, build_vec4(points[i].x, points[i].y, points[i].z, 1.0f));
+        vec3* result = (vec3*) ((Uint8*) out + (size_t) i*out_stride);
+        *result = vec3_from_vec4(point);
+    }
+}
+
+void mat4_transform_points(mat4 a, const vec3* points, Uint32 count, vec3* out, Uint32 out_stride) {
+    // Transforms points as if their w were 1, and writes each result out_stride bytes after the
+    // one before, so that out can be the position in an array of vertices. points and out can
+    // be the same array.
+#ifdef ES_SSE2
+    __m128 c0 = _mm_setr_ps(a.a.x, a.b.x, a.c.x, a.d.x);
+    __m128 c1 = _mm_setr_ps(a.a.y, a.b.y, a.c.y, a.d.y);
+    __m128 c2 = _mm_setr_ps(a.a.z, a.b.z, a.c.z, a.d.z);
+    __m128 c3 = _mm_setr_ps(a.a.w, a.b.w, a.c.w, a.d.w);
+    ES_ALIGN(16) float lanes[4];
+    for (Uint32 i=0; i<count; i++) {
+        __m128 point = _mm_mul_ps(c0, _mm_set1_ps(points[i].x));
+        point = _mm_add_ps(point, _mm_mul_ps(c1, _mm_set1_ps(points[i].y)));
+        point = _mm_add_ps(point, _mm_mul_ps(c2, _mm_set1_ps(points[i].z)));
+        point = _mm_add_ps(point, c3);
+        _mm_store_ps(lanes, point);
+        vec3* result = (vec3*) ((Uint8*) out + (size_t) i*out_stride);
+        result->x = lanes[0];
+        result->y = lanes[1];
+        result->z = lanes[2];
+    }
+#else
+    mat4_transform_points_scalar(a, points, count, out, out_stride);
+#endif
+}
+
+void vec3_normalize_array_scalar(vec3* vectors, Uint32 count) {
+    for (Uint32 i=0; i<count; i++)
+        vectors[i] = vec3_normalize(vectors[i]);
+}
+
+void vec3_normalize_array(vec3* vectors, Uint32 count) {
+    Uint32 i = 0;
+#ifdef ES_SSE2
+    // Four vectors at a time, one in each lane.
+    ES_ALIGN(16) float lanes[3][4];
+    for (; i+4<=count; i+=4) {
+        vec3* v = &vectors[i];
+        __m128 x = _mm_setr_ps(v[0].x, v[1].x, v[2].x, v[3].x);
+        __m128 y = _mm_setr_ps(v[0].y, v[1].y, v[2].y, v[3].y);
+        __m128 z = _mm_setr_ps(v[0].z, v[1].z, v[2].z, v[3].z);
+        __m128 length = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+        length = _mm_sqrt_ps(length);
+        _mm_store_ps(lanes[0], _mm_div_ps(x, length));
+        _mm_store_ps(lanes[1], _mm_div_ps(y, length));
+        _mm_store_ps(lanes[2], _mm_div_ps(z, length));
+        for (Uint32 j=0; j<4; j++)
+            v[j] = build_vec3(lanes[0][j], lanes[1][j], lanes[2][j]);
+    }
+#endif
+    vec3_normalize_array_scalar(&vectors[i], count-i);
+}
+
+void vec3_offset_array_scalar(vec3* points, vec3 offset, Uint32 count) {
+    for (Uint32 i=0; i<count; i++)
+        points[i] = vec3_add(points[i], offset);
+}
+
+void vec3_offset_array(vec3* points, vec3 offset, Uint32 count) {
+    Uint32 i = 0;
+#ifdef ES_SSE2
+    // Four points are twelve floats, which is three registers with the offset rotated through.
+    __m128 o0 = _mm_setr_ps(offset.x, offset.y, offset.z, offset.x);
+    __m128 o1 = _mm_setr_ps(offset.y, offset.z, offset.x, offset.y);
+    __m128 o2 = _mm_setr_ps(offset.z, offset.x, offset.y, offset.z);
+    for (; i+4<=count; i+=4) {
+        float* p = &points[i].x;
+        _mm_storeu_ps(p + 0, _mm_add_ps(_mm_loadu_ps(p + 0), o0));
+        _mm_storeu_ps(p + 4, _mm_add_ps(_mm_loadu_ps(p + 4), o1));
+        _mm_storeu_ps(p + 8, _mm_add_ps(_mm_loadu_ps(p + 8), o2));
+    }
+#endif
+    vec3_offset_array_scalar(&points[i], offset, count-i);
+}
+
 void print_mat4(mat4 a) {
     SDL_Log("\n%f %f %f %f\n%f %f %f %f\n%f %f %f %f\n%f %f %f %f\n",
             a.a.x, a.a.y, a.a.z, a.a.w,
@@ -305,13 +555,93 @@ SDL_bool vec3_is_zero(vec3 a) {
     return (a.x == 0.0f && a.y == 0.0f && a.z == 0.0f);
 }
 
-vec3 rotate_about_origin_axis(vec3 point, float angle, vec3 axis) {
+quat quat_identity() {
+    quat result;
+    result.x = 0.0f;
+    result.y = 0.0f;
+    result.z = 0.0f;
+    result.w = 1.0f;
+    return result;
+}
+
+quat quat_from_axis_angle(vec3 axis, float angle) {
+    // Turns the same way as rotation_matrix_axis. A zero axis gives no rotation.
     if (vec3_is_zero(axis) || angle == 0.0f)
-        return point;
-    mat4 rotation = rotation_matrix_axis(angle, axis);
-    vec4 point4 = build_vec4(point.x, point.y, point.z, 0.0f);
-    vec4 rotated = mat4_vec4_multiply(rotation, point4);
-    return build_vec3(rotated.x, rotated.y, rotated.z);
+        return quat_identity();
+    vec3 n = vec3_scale(vec3_normalize(axis), SDL_sinf(angle*0.5f));
+    quat result;
+    result.x = n.x;
+    result.y = n.y;
+    result.z = n.z;
+    result.w = SDL_cosf(angle*0.5f);
+    return result;
+}
+
+quat quat_multiply(quat a, quat b) {
+    // The rotation of b followed by the rotation of a.
+    quat result;
+    result.x = a.w*b.x + a.x*b.w + a.y*b.z - a.z*b.y;
+    result.y = a.w*b.y - a.x*b.z + a.y*b.w + a.z*b.x;
+    result.z = a.w*b.z + a.x*b.y - a.y*b.x + a.z*b.w;
+    result.w = a.w*b.w - a.x*b.x - a.y*b.y - a.z*b.z;
+    return result;
+}
+
+quat quat_normalize(quat a) {
+    float magnitude = SDL_sqrtf(a.x*a.x + a.y*a.y + a.z*a.z + a.w*a.w);
+    quat result;
+    result.x = a.x/magnitude;
+    result.y = a.y/magnitude;
+    result.z = a.z/magnitude;
+    result.w = a.w/magnitude;
+    return result;
+}
+
+quat quat_slerp(quat a, quat b, float t) {
+    // Takes the shorter way round, and falls back to a normalized lerp when the two are close
+    // enough that the angle between them can't be worked out well.
+    float cos_angle = a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w;
+    if (cos_angle < 0.0f) {
+        b.x = -b.x;
+        b.y = -b.y;
+        b.z = -b.z;
+        b.w = -b.w;
+        cos_angle = -cos_angle;
+    }
+    float wa = 1.0f - t;
+    float wb = t;
+    if (cos_angle < 0.9995f) {
+        float angle = SDL_acosf(cos_angle);
+        float sin_angle = SDL_sinf(angle);
+        wa = SDL_sinf(wa*angle) / sin_angle;
+        wb = SDL_sinf(wb*angle) / sin_angle;
+    }
+    quat result;
+    result.x = wa*a.x + wb*b.x;
+    result.y = wa*a.y + wb*b.y;
+    result.z = wa*a.z + wb*b.z;
+    result.w = wa*a.w + wb*b.w;
+    return quat_normalize(result);
+}
+
+vec3 quat_rotate(quat q, vec3 point) {
+    // point + w*t + u x t, with u the vector part of q and t = 2 u x point.
+    vec3 u = build_vec3(q.x, q.y, q.z);
+    vec3 t = vec3_scale(vec3_cross(u, point), 2.0f);
+    return vec3_add(vec3_add(point, vec3_scale(t, q.w)), vec3_cross(u, t));
+}
+
+void quat_rotate_points(quat q, vec3* points, Uint32 count) {
+    for (Uint32 i=0; i<count; i++)
+        points[i] = quat_rotate(q, points[i]);
+}
+
+vec3 rotate_about_origin_axis(vec3 point, float angle, vec3 axis) {
+    return quat_rotate(quat_from_axis_angle(axis, angle), point);
+}
+
+void rotate_points_about_origin_axis(vec3* points, Uint32 count, float angle, vec3 axis) {
+    quat_rotate_points(quat_from_axis_angle(axis, angle), points, count);
 }
 
 vec3 rotate_about_anchor_axis(vec3 point, vec3 anchor, float angle, vec3 axis) {
@@ -376,3 +706,67 @@ vec3 vec3_from_vec4(vec4 a) {
     result.z = a.z;
     return result;
 }
+
+typedef struct {
+    EsJobFunction job;
+    void* data;
+    Uint32 count;
+    Uint32 worker;
+    SDL_atomic_t* next;
+} _EsJobWorker;
+
+int _warehouse_job_worker(void* ptr) {
+    _EsJobWorker* worker = (_EsJobWorker*) ptr;
+    while (SDL_TRUE) {
+        Uint32 index = (Uint32) SDL_AtomicAdd(worker->next, 1);
+        if (index >= worker->count)
+            break;
+        worker->job(worker->data, index, worker->worker);
+    }
+    return 0;
+}
+
+Uint32 warehouse_num_workers() {
+    int cpus = SDL_GetCPUCount();
+    if (cpus < 1)
+        return 1;
+    return (Uint32) cpus;
+}
+
+SDL_bool warehouse_parallel_for(Uint32 count, EsJobFunction job, void* data) {
+    // The calling thread works as worker 0, so when we can't create threads, we still
+    // get through all the jobs, just slower.
+    Uint32 num_workers = SDL_min(warehouse_num_workers(), count);
+    if (num_workers <= 1) {
+        for (Uint32 i=0; i<count; i++)
+            job(data, i, 0);
+        return SDL_TRUE;
+    }
+    SDL_atomic_t next;
+    SDL_AtomicSet(&next, 0);
+    _EsJobWorker* workers = (_EsJobWorker*) SDL_malloc(num_workers * sizeof(_EsJobWorker));
+    SDL_Thread** threads = (SDL_Thread**) SDL_malloc(num_workers * sizeof(SDL_Thread*));
+    if (workers == NULL || threads == NULL) {
+        SDL_free(workers);
+        SDL_free(threads);
+        return SDL_FALSE;
+    }
+    for (Uint32 i=0; i<num_workers; i++) {
+        workers[i].job = job;
+        workers[i].data = data;
+        workers[i].count = count;
+        workers[i].worker = i;
+        workers[i].next = &next;
+        threads[i] = NULL;
+        if (i > 0)
+            threads[i] = SDL_CreateThread(_warehouse_job_worker, "es_worker", &workers[i]);
+    }
+    _warehouse_job_worker(&workers[0]);
+    for (Uint32 i=1; i<num_workers; i++) {
+        if (threads[i] != NULL)
+            SDL_WaitThread(threads[i], NULL);
+    }
+    SDL_free(workers);
+    SDL_free(threads);
+    return SDL_TRUE;
+}
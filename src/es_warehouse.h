@@ -10,6 +10,16 @@
 #define DEBUG_BUILD SDL_TRUE
 #define MAX_FRAMES_IN_FLIGHT 2
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ES_SSE2 1
+#endif
+
+#ifdef _MSC_VER
+#define ES_ALIGN(n) __declspec(align(n))
+#else
+#define ES_ALIGN(n) __attribute__((aligned(n)))
+#endif
+
 typedef struct {
     float x;
     float y;
@@ -32,7 +42,8 @@ typedef struct {
     Uint32 z;
 } vec3ui;
 
-typedef struct {
+// Aligned for SSE, like mat4.
+typedef ES_ALIGN(16) struct {
     float x;
     float y;
     float z;
@@ -46,7 +57,17 @@ typedef struct {
     Uint32 w;
 } vec4ui;
 
+// A unit quaternion, for rotations. x, y and z are the axis times the sine of half the angle,
+// and w is the cosine of half the angle.
 typedef struct {
+    float x;
+    float y;
+    float z;
+    float w;
+} quat;
+
+// Each row of a matrix is one vec4.
+typedef ES_ALIGN(16) struct {
     vec4 a;
     vec4 b;
     vec4 c;
@@ -61,12 +82,53 @@ typedef struct {
     vec4 assorted;
 } EsVertex;
 
+// The color of a packed vertex is stored as unorm over [0, PACKED_VERTEX_COLOR_RANGE].
+#define PACKED_VERTEX_COLOR_RANGE 4.0f
+
+// EsVertex in 20 bytes instead of 64. Position and texture coordinates are half floats, and
+// the normal is octahedral encoded into two snorms. There is no assorted. See
+// geom_pack_vertices.
+typedef struct {
+    Uint16 pos[4];
+    Uint8 color[4];
+    Uint16 tex[2];
+    Sint16 normal[2];
+} EsPackedVertex;
+// The painter's vertex attributes and the packed vertex buffers rely on this layout.
+SDL_COMPILE_TIME_ASSERT(es_packed_vertex_size, sizeof(EsPackedVertex) == 20);
+
+// Per instance data for instanced meshes. Rotation is about the y axis, in radians.
+typedef struct {
+    vec3 position;
+    float rotation;
+    float scale;
+    float wind_phase;
+} EsInstance;
+
+// xoshiro128+ state. Every generator that needs to be reproducible or run on its own
+// thread should keep one of these rather than using the rand_* functions.
+typedef struct {
+    Uint32 s[4];
+} EsRng;
+
+// Jobs are called with the item index and the id of the worker running them, so that
+// callers can keep per worker scratch data in an array of warehouse_num_workers() size.
+typedef void (*EsJobFunction)(void* data, Uint32 index, Uint32 worker);
+
 extern void warehouse_error_popup(const char* error_header, const char* error_text);
 extern float warehouse_log_2(float num);
 extern vec2 build_vec2(float x, float y);
 extern vec2ui build_vec2ui(Uint32 x, Uint32 y);
 extern mat4 mat4_mat4_multiply(mat4 a, mat4 b);
 extern vec4 mat4_vec4_multiply(mat4 a, vec4 b);
+extern void mat4_transform_points(mat4 a, const vec3* points, Uint32 count, vec3* out, Uint32 out_stride);
+extern void vec3_normalize_array(vec3* vectors, Uint32 count);
+extern void vec3_offset_array(vec3* points, vec3 offset, Uint32 count);
+// Plain versions of the SIMD functions above, to check them against.
+extern vec4 mat4_vec4_multiply_scalar(mat4 a, vec4 b);
+extern void mat4_transform_points_scalar(mat4 a, const vec3* points, Uint32 count, vec3* out, Uint32 out_stride);
+extern void vec3_normalize_array_scalar(vec3* vectors, Uint32 count);
+extern void vec3_offset_array_scalar(vec3* points, vec3 offset, Uint32 count);
 extern void print_mat4(mat4 a);
 extern void print_vec4(vec4 a);
 extern void print_vec3ui(vec3ui a);
@@ -100,7 +162,15 @@ extern mat4 rotation_matrix_axis(float angle, vec3 axis);
 extern mat4 rotation_matrix_xaxis(float angle);
 extern mat4 rotation_matrix_yaxis(float angle);
 extern mat4 rotation_matrix_zaxis(float angle);
+extern quat quat_identity();
+extern quat quat_from_axis_angle(vec3 axis, float angle);
+extern quat quat_multiply(quat a, quat b);
+extern quat quat_normalize(quat a);
+extern quat quat_slerp(quat a, quat b, float t);
+extern vec3 quat_rotate(quat q, vec3 point);
+extern void quat_rotate_points(quat q, vec3* points, Uint32 count);
 extern vec3 rotate_about_origin_axis(vec3 point, float angle, vec3 axis);
+extern void rotate_points_about_origin_axis(vec3* points, Uint32 count, float angle, vec3 axis);
 extern vec3 rotate_about_anchor_axis(vec3 point, vec3 anchor, float angle, vec3 axis);
 extern vec3 rotate_about_origin_xaxis(vec3 point, float angle);
 extern vec3 rotate_about_origin_yaxis(vec3 point, float angle);
@@ -112,6 +182,16 @@ extern float lerp(float start, float end, float val);
 extern float rand_pos();
 extern float rand_negpos();
 extern vec3 rand_vec3();
+extern void rng_seed(EsRng* rng, Uint64 seed);
+extern Uint32 rng_next(EsRng* rng);
+extern float rng_pos(EsRng* rng);
+extern float rng_negpos(EsRng* rng);
+extern vec3 rng_vec3(EsRng* rng);
+extern void rng_fill_pos(EsRng* rng, float* out, Uint32 count);
+extern void rng_fill_negpos(EsRng* rng, float* out, Uint32 count);
+extern void rng_fill_vec3(EsRng* rng, vec3* out, Uint32 count);
 extern vec3 vec3_from_vec4(vec4 a);
+extern Uint32 warehouse_num_workers();
+extern SDL_bool warehouse_parallel_for(Uint32 count, EsJobFunction job, void* data);
 
 #endif
@@ -32,7 +32,8 @@ SDL_bool world_init(EsWorld* w) {
     w->controls.right_down = SDL_FALSE;
     w->controls.q_down = SDL_FALSE;
     w->controls.e_down = SDL_FALSE;
-    w->tree_geom = geom_init_geometry_size(300000, 700000, 2, 300000, 0);
+    w->tree_mesh = geom_init_indexed_mesh();
+    w->tree_seed = TREE_SEED;
     w->refresh_tree = SDL_FALSE;
     w->refresh_shaders = SDL_FALSE;
     w->mouse.l_down = SDL_FALSE;
@@ -77,8 +78,11 @@ SDL_bool _world_aim_update(EsWorld* w, Uint32 timestep) {
     // w->player_transform.position = vec3_add(w->player_transform.position, movement);
     float x_angle = -w->mouse.moved_x / 768.0f;
     float y_angle = w->mouse.moved_y / 1024.0f;
-    w->player_transform.facing = rotate_about_origin_axis(w->player_transform.facing, x_angle, w->player_transform.up);
-    w->player_transform.facing = rotate_about_origin_axis(w->player_transform.facing, y_angle, vec3_cross(w->player_transform.up, w->player_transform.facing));
+    // Turning about up and then pitching about the new right is the same as pitching about the
+    // current right and then turning, so both go into one rotation.
+    quat yaw = quat_from_axis_angle(w->player_transform.up, x_angle);
+    quat pitch = quat_from_axis_angle(vec3_cross(w->player_transform.up, w->player_transform.facing), y_angle);
+    w->player_transform.facing = quat_rotate(quat_multiply(yaw, pitch), w->player_transform.facing);
     return SDL_TRUE;
 }
 
@@ -92,14 +96,19 @@ SDL_bool _world_fly_update(EsWorld* w, Uint32 timestep) {
     w->player_forces.velocity = vec3_add(w->player_forces.velocity, vec3_scale(w->player_forces.lift, timestep/1000.0f));
     float bias = 0.5f;
     w->player_forces.velocity = vec3_add(vec3_scale(w->player_forces.velocity, bias), vec3_scale(w->player_transform.facing, (1.0f-bias)*vec3_magnitude(w->player_forces.velocity)));
+    float pitch = 0.0f;
+    float roll = 0.0f;
     if (w->controls.up_down)
-        w->player_transform.facing = rotate_about_origin_axis(w->player_transform.facing, PITCH_SPEED/timestep/1000.0f, vec3_cross(w->player_transform.up, w->player_transform.facing));
+        pitch += PITCH_SPEED/timestep/1000.0f;
     if (w->controls.down_down)
-        w->player_transform.facing = rotate_about_origin_axis(w->player_transform.facing, -PITCH_SPEED/timestep/1000.0f, vec3_cross(w->player_transform.up, w->player_transform.facing));
+        pitch -= PITCH_SPEED/timestep/1000.0f;
     if (w->controls.right_down)
-        w->player_transform.up = rotate_about_origin_axis(w->player_transform.up, ROLL_SPEED/timestep/1000.0f, w->player_transform.facing);
+        roll += ROLL_SPEED/timestep/1000.0f;
     if (w->controls.left_down)
-        w->player_transform.up = rotate_about_origin_axis(w->player_transform.up, -ROLL_SPEED/timestep/1000.0f, w->player_transform.facing);
+        roll -= ROLL_SPEED/timestep/1000.0f;
+    // With nothing held both angles are zero, and quat_from_axis_angle skips the trig.
+    w->player_transform.facing = quat_rotate(quat_from_axis_angle(vec3_cross(w->player_transform.up, w->player_transform.facing), pitch), w->player_transform.facing);
+    w->player_transform.up = quat_rotate(quat_from_axis_angle(w->player_transform.facing, roll), w->player_transform.up);
     // float x_angle = (w->mouse.moved_x / 768.0f) * M_PI;
     // float y_angle = (-w->mouse.moved_y / 1024.0f) * M_PI;
     // w->player_transform.up = rotate_about_origin_axis(w->up_axis, x_angle, w->player_transform.facing);
@@ -189,6 +198,10 @@ SDL_bool world_process_input_event(EsWorld* w, SDL_Event e) {
             w->controls.e_down = SDL_FALSE;
         if (key == SDLK_r)
             w->refresh_shaders = SDL_TRUE;
+        if (key == SDLK_t) {
+            w->tree_seed++;
+            w->refresh_tree = SDL_TRUE;
+        }
     }
     return SDL_TRUE;
 }
@@ -12,6 +12,14 @@
 #include "es_geometrygen.h"
 #include "es_trees.h"
 
+// The tree archetypes that get drawn instanced. The impostor baker generates the same ones.
+#define TREE_ARCHETYPES 4
+#define TREE_LODS TREES_NUM_LODS
+#define TREE_SEED 1
+// Bump when the tree generator changes, so that meshes and impostors cached by the old one are
+// made again.
+#define TREE_CACHE_VERSION 5
+
 typedef enum {
     MODE_AIM,
     MODE_FLY,
@@ -69,7 +77,9 @@ typedef struct {
     PlayerForces player_forces;
     MouseData mouse;
     ControlsData controls;
-    EsGeometry tree_geom;
+    EsIndexedMesh tree_mesh;
+    // The seed of the tree archetypes. Setting refresh_tree rebuilds them in the background.
+    Uint32 tree_seed;
     SDL_bool refresh_tree;
     SDL_bool refresh_shaders;
 } EsWorld;
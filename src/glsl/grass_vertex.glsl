@@ -52,3 +52,15 @@ vec4 getPos() {
     pos += obj_pos-base_obj_pos;
     return pos;
 }
+
+vec3 getNormal() {
+    return inNormal;
+}
+
+vec2 getTexCoord() {
+    return inTexCoord;
+}
+
+vec3 getColor() {
+    return inColor;
+}
@@ -0,0 +1,29 @@
+#version 450
+#pragma shader_stage(fragment)
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(binding = 0) uniform sampler2D texSampler;
+
+layout(location = 0) in vec2 fragTexCoord;
+layout(location = 1) in vec3 fragColor;
+layout(location = 2) in vec3 fragNormal;
+
+layout(location = 0) out vec4 outAlbedo;
+layout(location = 1) out vec4 outNormalDepth;
+
+// Same as the tree fragment shader, once it has fully grown and without the wind or the light.
+void main() {
+    vec4 col = texture(texSampler, fragTexCoord);
+    if (col.a < 0.1)
+        discard;
+    float leaf_tint = 1.0;
+    if (fragTexCoord.x > 0)
+        leaf_tint = fragColor.z;
+    col = mix(col, vec4(col.xyz*0.7, 1.0), 1.0-leaf_tint);
+    if (col.a < 0.3)
+        discard;
+    outAlbedo = vec4(col.xyz, 1.0);
+    // The depth is only kept in 8 bits, so it is good for ordering or offsetting the impostor,
+    // not for reconstructing the surface.
+    outNormalDepth = vec4(normalize(fragNormal)*0.5 + 0.5, gl_FragCoord.z);
+}
@@ -0,0 +1,26 @@
+#version 450
+#pragma shader_stage(vertex)
+#extension GL_ARB_separate_shader_objects : enable
+
+// Used by es_impostor to bake the tree archetypes. Each view of the atlas is drawn with its
+// own camera, so the matrices come in as push constants.
+layout(push_constant) uniform BakeConstants {
+    mat4 view;
+    mat4 proj;
+} bake;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inColor;
+layout(location = 2) in vec2 inTexCoord;
+layout(location = 3) in vec3 inNormal;
+
+layout(location = 0) out vec2 fragTexCoord;
+layout(location = 1) out vec3 fragColor;
+layout(location = 2) out vec3 fragNormal;
+
+void main() {
+    gl_Position = bake.proj * bake.view * vec4(inPosition, 1.0);
+    fragTexCoord = inTexCoord;
+    fragColor = inColor;
+    fragNormal = (bake.view * vec4(inNormal, 0.0)).xyz;
+}
@@ -0,0 +1,23 @@
+// The atlas is loaded as unorm, so that the normals on the right half come back unchanged. The
+// color on the left half is still srgb encoded, so it is decoded here instead of by the sampler.
+vec3 srgbToLinear(vec3 col) {
+    return mix(col / 12.92, pow((col + 0.055) / 1.055, vec3(2.4)), step(vec3(0.04045), col));
+}
+
+// The right half of the atlas has the view space normal of the same texel. inNormal is the
+// direction to the camera, which was the z axis of the view when it was baked.
+vec4 getCol() {
+    vec4 col = texture(texSampler, fragTexCoord);
+    if (col.a < 0.3)
+        discard;
+    col.xyz = srgbToLinear(col.xyz);
+    vec3 baked_normal = texture(texSampler, fragTexCoord + vec2(0.5, 0.0)).xyz * 2.0 - 1.0;
+    vec3 up = vec3(0.0, 1.0, 0.0);
+    vec3 right = normalize(cross(up, inNormal));
+    vec3 normal = right*baked_normal.x + up*baked_normal.y + inNormal*baked_normal.z;
+    vec4 shadow = vec4(col.xyz * 0.2, 1.0);
+    float light = dot(inLightDirection, normalize(normal));
+    light = (light+1.0) / 2.0;
+    col = mix(shadow, col, light);
+    return col;
+}
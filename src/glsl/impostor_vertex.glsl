@@ -0,0 +1,67 @@
+// Per instance data. See EsInstance.
+layout(location = 5) in vec4 inInstancePosition;
+layout(location = 6) in vec2 inInstanceScale;
+
+// Each archetype is a quad at the centre of its bounding sphere. inColor has the offset of the
+// corner from the centre, and inOthers has the atlas row, the number of rows and the number
+// of views. See es_impostor.h for the atlas layout.
+
+mat4 rotation_matrix_axis(float angle, vec3 axis) {
+    float cosa = cos(angle);
+    float sina = sin(angle);
+    vec3 n = normalize(axis);
+    mat4 rotation = mat4(
+        n.x*n.x*(1.0-cosa) + cosa,
+        n.x*n.y*(1.0-cosa) - n.z*sina,
+        n.x*n.z*(1.0-cosa) + n.y*sina,
+        0.0,
+        n.x*n.y*(1.0-cosa) + n.z*sina,
+        n.y*n.y*(1.0-cosa) + cosa,
+        n.y*n.z*(1.0-cosa) - n.x*sina,
+        0.0,
+        n.x*n.z*(1.0-cosa) - n.y*sina,
+        n.y*n.z*(1.0-cosa) + n.x*sina,
+        n.z*n.z*(1.0-cosa) + cosa,
+        0.0,
+        0.0, 0.0, 0.0, 1.0
+    );
+    return rotation;
+}
+
+vec3 getCentre() {
+    mat4 rotation = rotation_matrix_axis(inInstancePosition.w, vec3(0.0, 1.0, 0.0));
+    vec3 centre = (rotation * vec4(inPosition * inInstanceScale.x, 1.0)).xyz;
+    return centre + inInstancePosition.xyz;
+}
+
+// Like the grass, the quad only turns about the y axis to face the camera.
+vec3 getToCamera() {
+    vec3 to_cam = ubo.camera_position - getCentre();
+    to_cam.y = 0.0;
+    return normalize(to_cam);
+}
+
+vec4 getPos() {
+    vec3 up = vec3(0.0, 1.0, 0.0);
+    vec3 to_cam = getToCamera();
+    vec3 right = normalize(cross(up, to_cam));
+    vec2 corner = inColor.xy * inInstanceScale.x;
+    return vec4(getCentre() + right*corner.x + up*corner.y, 1.0);
+}
+
+vec3 getNormal() {
+    return getToCamera();
+}
+
+// Pick the baked view closest to the direction of the camera in the archetype's own space.
+vec2 getTexCoord() {
+    mat4 rotation = rotation_matrix_axis(-inInstancePosition.w, vec3(0.0, 1.0, 0.0));
+    vec3 local = (rotation * vec4(getToCamera(), 0.0)).xyz;
+    float num_views = inOthers.z;
+    float view = mod(round(atan(local.x, local.z) / (2.0*3.1415926) * num_views) + num_views, num_views);
+    return vec2((view + inTexCoord.x) / (2.0*num_views), (inOthers.x + inTexCoord.y) / inOthers.y);
+}
+
+vec3 getColor() {
+    return inColor;
+}
@@ -95,3 +95,15 @@ vec4 getPosLookAt() {
 vec4 getPos() {
     return vec4(inPosition, 1.0);
 }
+
+vec3 getNormal() {
+    return inNormal;
+}
+
+vec2 getTexCoord() {
+    return inTexCoord;
+}
+
+vec3 getColor() {
+    return inColor;
+}
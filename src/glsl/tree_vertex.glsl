@@ -1,3 +1,7 @@
+// Per instance data. See EsInstance.
+layout(location = 5) in vec4 inInstancePosition;
+layout(location = 6) in vec2 inInstanceScale;
+
 float rand(float n) { return fract(sin(n) * 43758.5453123); }
 float rand(vec2 n) { return fract(sin(dot(n, vec2(12.9898, 4.1414))) * 43758.5453); }
 
@@ -13,6 +17,20 @@ float noise(vec2 n) {
 	return mix(mix(rand(b), rand(b + d.yx), f.x), mix(rand(b + d.xy), rand(b + d.yy), f.x), f.y);
 }
 
+// Tree vertices are packed, see EsPackedVertex. The color is stored over [0, 4], and the normal
+// is octahedral encoded.
+vec3 getColor() {
+    return inColor * 4.0;
+}
+
+vec3 decodeNormal(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
 mat4 rotation_matrix_axis(float angle, vec3 axis) {
     float cosa = cos(angle);
     float sina = sin(angle);
@@ -49,9 +67,22 @@ vec4 getPos() {
     // mat4 rotation_mat = rotation_matrix_axis(-angle_to_camera, vec3(0,1.0,0));
     // obj_pos = rotation_mat * obj_pos;
     // pos += obj_pos-base_obj_pos;
-    pos += vec3(0.3, 0.0, 0.3) * inColor.x * sin(ubo.time/1.4); 
-    pos += vec3(0.3, 0.1, 0.0) * inColor.y * sin(ubo.time/2.2); 
-    pos += vec3(0.2, 0.1, 0.3) * inColor.z * sin(ubo.time/3.7); 
-    return vec4(pos, 1.0);
+    float phase = inInstanceScale.y;
+    vec3 color = getColor();
+    pos += vec3(0.3, 0.0, 0.3) * color.x * sin(ubo.time/1.4 + phase); 
+    pos += vec3(0.3, 0.1, 0.0) * color.y * sin(ubo.time/2.2 + phase); 
+    pos += vec3(0.2, 0.1, 0.3) * color.z * sin(ubo.time/3.7 + phase); 
+    mat4 rotation = rotation_matrix_axis(inInstancePosition.w, vec3(0.0, 1.0, 0.0));
+    pos = (rotation * vec4(pos * inInstanceScale.x, 1.0)).xyz;
+    return vec4(pos + inInstancePosition.xyz, 1.0);
+}
+
+vec3 getNormal() {
+    mat4 rotation = rotation_matrix_axis(inInstancePosition.w, vec3(0.0, 1.0, 0.0));
+    return (rotation * vec4(decodeNormal(inNormal.xy), 0.0)).xyz;
+}
+
+vec2 getTexCoord() {
+    return inTexCoord;
 }
 
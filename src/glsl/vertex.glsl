@@ -3,3 +3,14 @@ vec4 getPos() {
     return pos;
 }
 
+vec3 getNormal() {
+    return inNormal;
+}
+
+vec2 getTexCoord() {
+    return inTexCoord;
+}
+
+vec3 getColor() {
+    return inColor;
+}
@@ -6,11 +6,11 @@ void main() {
         gl_Position = shadowPos;
     else if (ubo.state == 1)
         gl_Position = ubo.proj * ubo.view * ubo.model * pos;
-    fragColor = inColor;
-    fragTexCoord = inTexCoord;
+    fragColor = getColor();
+    fragTexCoord = getTexCoord();
     time = ubo.time;
     outPos = pos.xyz;
-    outColor = inColor;
-    outNormal = inNormal;
+    outColor = getColor();
+    outNormal = getNormal();
     lightDirection = ubo.light_direction;
 
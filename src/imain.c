@@ -0,0 +1,26 @@
+#include "SDL.h"
+#include "es_warehouse.h"
+#include "es_world.h"
+#include "es_painter.h"
+#include "es_impostor.h"
+
+// Bakes the impostor atlas for the tree archetypes that the painter draws, on a headless
+// painter. Pass --cpu to prefer a software vulkan device, for machines without a gpu. The
+// painter also bakes it on startup if it isn't on disk, so this is only needed to bake ahead.
+int main(int argc, char** argv) {
+    SDL_LogSetAllPriority(SDL_LOG_PRIORITY_VERBOSE);
+    SDL_bool prefer_cpu = SDL_FALSE;
+    for (int i=1; i<argc; i++) {
+        if (SDL_strcmp(argv[i], "--cpu") == 0)
+            prefer_cpu = SDL_TRUE;
+    }
+    EsPainter painter;
+    if (!painter_initialise_headless(&painter, prefer_cpu))
+        return 1;
+    Uint32 timer_start = SDL_GetTicks();
+    if (!painter_bake_impostors(&painter, TREE_SEED))
+        return 1;
+    SDL_Log("baked impostor atlas %s in %i ticks", painter.impostor_atlas_path, SDL_GetTicks()-timer_start);
+    painter_cleanup(&painter);
+    return 0;
+}